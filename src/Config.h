@@ -8,6 +8,73 @@
 // Unrolling loops by chacha block size.
 #define Y_SORT_BLOCK_MODE 1
 
+// Scatter fx outputs into their top-most y bits buckets while computing them,
+// so that the y sort only has to perform the bucket-local passes.
+#define FX_FUSED_BUCKET_MODE 1
+
+// How tables 2-5 have their metadata ordered after their y sort:
+//  0: Permute it with the sort key (MapFxWithSortKey).
+//  1: Leave it unsorted and read it through the sort key on the next table's fx.
+//  2: Measure both on the first two plots, then pick the cheapest per table.
+#define FX_LAZY_META_MODE 2
+
+// Store 96-bit metadata (table 5's output) as separate 64-bit and 32-bit planes
+// instead of 16-byte entries. Streams 25% fewer bytes, but random gathers touch both planes.
+#define FX_META3_PLANAR 1
+
+// How metadata and pairs are gathered with the sort key after the y sort:
+//  0: Direct gather.
+//  1: Blocked gather: Partition blocks of keys by source region first.
+//  2: Time both on the first plot, then pick the fastest per table.
+#define FX_BLOCKED_GATHER_MODE 2
+
+// When the y sort is bucketed, map each sorted bucket's pairs and mark the next table's
+// kBC groups on it while the following buckets are still being sorted.
+// The next table's scan then only needs to decode the group bitmap.
+// Only the pair mapping and the group marking overlap the sort: The next table's
+// pairing and fx still start once the whole sort is done, as they need the buffers
+// the sort tail is still using. (See FpComputeSingleTable.)
+#define FX_SORT_MAP_AND_MARK_GROUPS 1
+
+// Mark Phase 2's used entries by first distributing the referenced left table indices
+// into ranges of 2^P2_MARK_RANGE_BITS entries, so that each thread marks its own ranges
+// instead of all threads writing to random locations across the whole table.
+#define P2_PARTITIONED_MARKING 1
+#define P2_MARK_RANGE_BITS     20
+
+// While marking partitioned ranges, also count how many entries survive in each range.
+// Phase 3 then knows where each range's pruned entries go without scanning the marks first.
+// Requires P2_PARTITIONED_MARKING.
+#define P2_COUNT_MARKED_ENTRIES 1
+
+// Convert pairs to line points as they are pruned in Phase 3, 
+// instead of copying the surviving pairs and converting them in a second pass.
+#define P3_FUSED_PRUNE_LP 1
+
+// How Phase 3 gathers the line points' x values from the left table,
+// and scatters the new indices to the lookup table:
+//  0: Direct, random accesses across the whole table.
+//  1: Partitioned: Partition blocks of entries by the table region they access first.
+//  2: Direct on the first plot, partitioned on the second one, then pick the fastest per table.
+#define P3_PARTITIONED_LOOKUP_MODE 2
+
+// Sort line points in buckets chosen from their histogram, writing each park 
+// as soon as the buckets it spans are sorted, instead of a full radix sort followed by WriteParks.
+// Line points are converted to park deltas in place, so this is disabled when writing them out for debugging.
+// (See DBG_WRITE_LINE_POINTS below.)
+#define P3_BUCKETED_LP_SORT 1
+
+// Write Phase 4's P7, C1, C2 and C3 tables in a single pass, where each thread
+// writes all the tables for its range of C1 intervals, instead of a pass per table.
+#define P4_FUSED_TABLES 1
+
+// Compute every table's size once Phase 2 has marked the used entries, so that the plot writer
+// lays out the file up front: The header is written first, and each table goes straight to its offset.
+// Requires P2_COUNT_MARKED_ENTRIES, otherwise the tables' sizes are only known as they're written.
+#if P2_PARTITIONED_MARKING && P2_COUNT_MARKED_ENTRIES
+    #define PLOT_WRITER_PRECOMPUTED_LAYOUT 1
+#endif
+
 ///
 /// Debug Stuff
 ///
@@ -36,6 +103,11 @@
 #endif
 
 // #define DBG_WRITE_LINE_POINTS 1
+#if DBG_WRITE_LINE_POINTS
+    // The bucketed sort overwrites the line points with park deltas
+    #undef  P3_BUCKETED_LP_SORT
+    #define P3_BUCKETED_LP_SORT 0
+#endif
 // #define DBG_WRITE_SORTED_F7_TABLE 1
 
 // Enable to test plotting times without writing to disk
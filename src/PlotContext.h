@@ -2,17 +2,33 @@
 #include "Config.h"
 #include "ChiaConsts.h"
 #include "threading/ThreadPool.h"
+#include "threading/PressureGovernor.h"
 #include "PlotWriter.h"
 
 struct PlotRequest
 {
     const byte* plotId;       // Id of the plot we want to create       
-    const char* outPath;      // Output plot path
+    const char* plotFileName; // Plot file name, written to one of the plotter's output directories
     const byte* memo;         // Plot memo
     uint16      memoSize;
     bool        IsFinalPlot;  
+    const char* outDir;       // If set, the one of the plotter's output directories to write the plot to
+    void*       userData;     // Given back with the plot's result
 };
 
+// How a plot went, reported once it has finished writing
+struct PlotResult
+{
+    const char*           plotPath;         // Final path of the plot file, or where it was streamed to
+    double                phaseSeconds[4];
+    double                plotSeconds;      // Phases 1 to 4
+    size_t                plotSize;
+    const PlotWriteStats* writeStats;
+    void*                 userData;         // From the plot's request
+};
+
+typedef void (*PlotFinishedCallback)( const PlotResult& result, void* data );
+
 struct Pair
 {
     uint32 left;
@@ -39,6 +55,10 @@ struct MemPlotContext
     // Thread pool to use when running jobs
     ThreadPool* threadPool;
 
+    // If set, it may switch threadPool and threadCount to fewer threads when updated,
+    // which must only be done between tables
+    PressureGovernor* governor;
+
     ///
     /// Buffers
     ///
@@ -66,11 +86,30 @@ struct MemPlotContext
     // Number of entries per-table
     uint64 entryCount[7];
 
+    // Added by Phase 1:
+    // Measured cost in seconds of permuting each table's metadata after its sort [0],
+    // or of leaving it unsorted and reading it through the sort key on the next table [1].
+    // These are kept across plots to pick the cheapest.
+    double metaMapCost[2][7];
+
+    // Sort key gather method (MapFxGather) picked for each table on the first plot.
+    byte   mapFxGather[7];
+
     // Added by Phase 2:
     byte* usedEntries[6];   // Used entries per each table.
                             // These are only used for tables 2-6 (inclusive).
                             // These buffers map to regions in yBuffer0.
 
+    uint32* usedEntryCounts[6]; // Used entries in each range of 2^P2_MARK_RANGE_BITS entries, per table.
+                                // Null if they were not counted (see P2_COUNT_MARKED_ENTRIES).
+                                // These also map to yBuffer0, after the used entries.
+
+    // Added by Phase 3:
+    // Measured time in seconds of each table's line point gather and lookup table scatter,
+    // done directly [0] or partitioned by table region [1]. Kept across plots to pick the fastest.
+    double lpGatherCost     [2][7];
+    double lookupScatterCost[2][7];
+
     DiskPlotWriter* plotWriter;
 
     // The buffer used to write to disk the Phase 4 data.
@@ -82,5 +121,10 @@ struct MemPlotContext
 
     // How many plots we've made so far
     uint64 plotCount;
+
+    // The plot being written, reported to onPlotFinished, if set, once it has been written
+    PlotResult           plotResult;
+    PlotFinishedCallback onPlotFinished;
+    void*                onPlotFinishedData;
 };
 
@@ -0,0 +1,194 @@
+#include "PlotId.h"
+#include "Util.h"
+#include "SysHost.h"
+
+#include <ctime>
+#include <vector>
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wreturn-type"
+
+#pragma warning( push )
+
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#pragma warning( disable : 6287  )
+#pragma warning( disable : 4267  )
+#pragma warning( disable : 26495 )
+#include "bls.hpp"
+#include "elements.hpp"
+#include "schemes.hpp"
+#include "util.hpp"
+#pragma GCC diagnostic pop
+#pragma warning( pop )
+
+static bool            BytesToG1Element( const byte bytes[48], bls::G1Element& element );
+static bls::PrivateKey MasterSkToLocalSK( bls::PrivateKey& sk );
+static bls::G1Element  GeneratePlotPublicKey( const bls::G1Element& localPk, bls::G1Element& farmerPk, const bool includeTaproot );
+
+static std::vector<uint8_t> BytesConcat( std::vector<uint8_t> a, std::vector<uint8_t> b, std::vector<uint8_t> c );
+
+//-----------------------------------------------------------
+bool GeneratePlotIdAndMemo( const byte farmerPublicKey[48], const byte* poolPublicKey, const byte* poolContractPuzzleHash,
+                            byte plotId[32], byte plotMemo[48+48+32], uint16& outMemoSize )
+{
+    ASSERT( farmerPublicKey );
+    ASSERT( poolPublicKey || poolContractPuzzleHash );
+
+    bls::G1Element farmerPK;
+    bls::G1Element poolPK;
+
+    if( !BytesToG1Element( farmerPublicKey, farmerPK ) )
+        return false;
+
+    if( poolPublicKey && !BytesToG1Element( poolPublicKey, poolPK ) )
+        return false;
+
+    // Generate random master secret key
+    byte seed[32];
+    SysHost::Random( seed, sizeof( seed ) );
+
+    bls::PrivateKey sk      = bls::AugSchemeMPL().KeyGen( bls::Bytes( seed, sizeof( seed ) ) );
+    bls::G1Element  localPk = std::move( MasterSkToLocalSK( sk ) ).GetG1Element();
+
+    // #See: chia-blockchain create_plots.py
+    //       The plot public key is the combination of the harvester and farmer keys
+    //       New plots will also include a taproot of the keys, for extensibility
+    const bool includeTaproot = poolPublicKey == nullptr;
+
+    bls::G1Element plotPublicKey = std::move( GeneratePlotPublicKey( localPk, farmerPK, includeTaproot ) );
+
+    std::vector<uint8_t> farmerPkBytes = farmerPK.Serialize();
+    std::vector<uint8_t> localSkBytes  = sk.Serialize();
+
+    // The plot id is based on the harvester, farmer, and pool keys
+    if( !includeTaproot )
+    {
+        std::vector<uint8_t> bytes = poolPK.Serialize();
+
+        // Gen plot id
+        auto plotPkBytes = plotPublicKey.Serialize();
+        bytes.insert( bytes.end(), plotPkBytes.begin(), plotPkBytes.end() );
+
+        bls::Util::Hash256( plotId, bytes.data(), bytes.size() );
+
+        // Gen memo
+        auto memoBytes = BytesConcat( poolPK.Serialize(), farmerPkBytes, localSkBytes );
+
+        const size_t poolMemoSize = 48 + 48 + 32;
+        ASSERT( memoBytes.size() == poolMemoSize );
+
+        memcpy( plotMemo, memoBytes.data(), poolMemoSize );
+        outMemoSize = (uint16)poolMemoSize;
+    }
+    else
+    {
+        // Create a pool plot with a contract puzzle hash
+        std::vector<uint8_t> phBytes( poolContractPuzzleHash, poolContractPuzzleHash + 32 );
+
+        // Gen plot id
+        std::vector<uint8_t> plotIdBytes = phBytes;
+        auto plotPkBytes = plotPublicKey.Serialize();
+
+        plotIdBytes.insert( plotIdBytes.end(), plotPkBytes.begin(), plotPkBytes.end() );
+        bls::Util::Hash256( plotId, plotIdBytes.data(), plotIdBytes.size() );
+
+        // Gen memo
+        auto memoBytes = BytesConcat( phBytes, farmerPkBytes, localSkBytes );
+
+        const size_t phMemoSize = 32 + 48 + 32;
+        ASSERT( memoBytes.size() == phMemoSize );
+
+        memcpy( plotMemo, memoBytes.data(), phMemoSize );
+        outMemoSize = (uint16)phMemoSize;
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------
+void GetPlotFileName( const byte plotId[32], char fileName[PLOT_FILE_FMT_LEN] )
+{
+    time_t     now = time( nullptr  );
+    struct tm* t   = localtime( &now ); ASSERT( t );
+
+    const size_t r = strftime( fileName, PLOT_FILE_FMT_LEN, "plot-k32-%Y-%m-%d-%H-%M-", t );
+    if( r != PLOT_FILE_PREFIX_LEN )
+        Fatal( "Failed to generate plot file." );
+
+    size_t numEncoded = 0;
+    BytesToHexStr( plotId, 32, fileName + PLOT_FILE_PREFIX_LEN, 64, numEncoded );
+    ASSERT( numEncoded == 32 );
+
+    memcpy( fileName + PLOT_FILE_PREFIX_LEN + 64, ".plot.tmp", sizeof( ".plot.tmp" ) );
+}
+
+//-----------------------------------------------------------
+bool BytesToG1Element( const byte bytes[48], bls::G1Element& element )
+{
+    // Points that are not on the curve throw
+    try
+    {
+        element = bls::G1Element::FromBytes( bls::Bytes( bytes, bls::G1Element::SIZE ) );
+    }
+    catch( ... )
+    {
+        return false;
+    }
+
+    return element.IsValid();
+}
+
+//-----------------------------------------------------------
+bls::PrivateKey MasterSkToLocalSK( bls::PrivateKey& sk )
+{
+    // #SEE: chia-blockchain: derive-keys.py
+    // EIP 2334 bls key derivation
+    // https://eips.ethereum.org/EIPS/eip-2334
+    // 12381 = bls spec number
+    // 8444  = Chia blockchain number and port number
+    // 0, 1, 2, 3, 4, 5, 6 farmer, pool, wallet, local, backup key, singleton, pooling authentication key numbers
+
+    const uint32 blsSpecNum         = 12381;
+    const uint32 chiaBlockchainPort = 8444;
+    const uint32 localIdx           = 3;
+
+    bls::PrivateKey ssk = bls::AugSchemeMPL().DeriveChildSk( sk, blsSpecNum );
+    ssk = bls::AugSchemeMPL().DeriveChildSk( ssk, chiaBlockchainPort );
+    ssk = bls::AugSchemeMPL().DeriveChildSk( ssk, localIdx );
+    ssk = bls::AugSchemeMPL().DeriveChildSk( ssk, 0        );
+
+    return ssk;
+}
+
+//-----------------------------------------------------------
+bls::G1Element GeneratePlotPublicKey( const bls::G1Element& localPk, bls::G1Element& farmerPk, const bool includeTaproot )
+{
+    bls::G1Element plotPublicKey;
+
+    if( includeTaproot )
+    {
+        std::vector<uint8_t> taprootMsg = (localPk + farmerPk).Serialize();
+        taprootMsg = BytesConcat( taprootMsg, localPk.Serialize(), farmerPk.Serialize() );
+
+        byte tapRootHash[32];
+        bls::Util::Hash256( tapRootHash, taprootMsg.data(), taprootMsg.size() );
+
+        bls::PrivateKey taprootSk = bls::AugSchemeMPL().KeyGen( bls::Bytes( tapRootHash, sizeof( tapRootHash ) ) );
+
+        plotPublicKey = localPk + farmerPk + taprootSk.GetG1Element();
+    }
+    else
+    {
+        plotPublicKey = localPk + farmerPk;
+    }
+
+    return plotPublicKey;
+}
+
+//-----------------------------------------------------------
+inline std::vector<uint8_t> BytesConcat( std::vector<uint8_t> a, std::vector<uint8_t> b, std::vector<uint8_t> c )
+{
+    a.insert( a.end(), b.begin(), b.end() );
+    a.insert( a.end(), c.begin(), c.end() );
+    return a;
+}
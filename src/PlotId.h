@@ -0,0 +1,13 @@
+#pragma once
+
+#define PLOT_FILE_PREFIX_LEN (sizeof("plot-k32-2021-08-05-18-55-")-1)
+#define PLOT_FILE_FMT_LEN (sizeof( "plot-k32-2021-08-05-18-55-77a011fc20f0003c3adcc739b615041ae56351a22b690fd854ccb6726e5f43b7.plot.tmp" ))
+
+// Generates a new plot id and memo, with a random local key, for a farmer public key (48 bytes)
+// and either a pool public key (48 bytes), or the puzzle hash of a pool contract (32 bytes).
+// Returns false if a key is not valid.
+bool GeneratePlotIdAndMemo( const byte farmerPublicKey[48], const byte* poolPublicKey, const byte* poolContractPuzzleHash,
+                            byte plotId[32], byte plotMemo[48+48+32], uint16& outMemoSize );
+
+// Names a plot file after the current time and the plot id, with a .tmp suffix
+void GetPlotFileName( const byte plotId[32], char fileName[PLOT_FILE_FMT_LEN] );
@@ -2,11 +2,57 @@
 #include "ChiaConsts.h"
 #include "SysHost.h"
 #include "Config.h"
+#include "threading/ThreadPool.h"
+#include "util/Log.h"
+
+#include <thread>
+
+#if PLATFORM_IS_UNIX
+    #include <sys/mman.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+struct StageCopyJob
+{
+    const byte* src;
+    byte*       dst;
+    size_t      size;
+};
+
+static void StageCopyThread( StageCopyJob* job );
+
+static const char ChecksumManifestExt[] = ".b3.json";
+
+static const char* TableNames[10] = {
+    "Table1", "Table2", "Table3", "Table4", "Table5", "Table6", "Table7", "C1", "C2", "C3"
+};
+
+//-----------------------------------------------------------
+size_t DiskPlotWriter::EstimatePlotSize( size_t headerSize, size_t blockSize )
+{
+    const uint64 entryCount = 1ull << _K;
+    const uint64 parkCount  = CDiv( entryCount, kEntriesPerPark );
+    const uint64 c1Count    = entryCount / kCheckpoint1Interval + 1;
+
+    size_t size = headerSize;
+
+    for( uint table = (uint)TableId::Table1; table <= (uint)TableId::Table6; table++ )
+        size += parkCount * CalculateParkSize( (TableId)table );
+
+    size += parkCount * CDiv( ( _K + 1 ) * kEntriesPerPark, 8 );    // P7
+    size += c1Count * sizeof( uint32 ) * 2;                         // C1 and C2
+    size += c1Count * CalculateC3Size();                            // C3
+
+    // Tables are block-aligned
+    return RoundUpToNextBoundary( size, (int)blockSize ) + blockSize * 10;
+}
 
 //-----------------------------------------------------------
 DiskPlotWriter::DiskPlotWriter()
     : _writeSignal       ( 0 )
     , _plotFinishedSignal( 0 )
+    , _tableWrittenSignal( 0 )
 {
     #if BB_BENCHMARK_MODE
         return;
@@ -32,12 +78,26 @@ DiskPlotWriter::~DiskPlotWriter()
     if( _headerBuffer )
         SysHost::VirtualFree( _headerBuffer );
 
+    if( _checksumPool )
+        delete _checksumPool;
+
     if( _file )
         delete _file;
 }
 
 //-----------------------------------------------------------
-bool DiskPlotWriter::BeginPlot( const char* plotFilePath, FileStream& file, const byte plotId[32], const byte* plotMemo, const uint16 plotMemoSize )
+void DiskPlotWriter::EnableChecksum( uint threadCount )
+{
+    ASSERT( !_file && !_checksumPool );
+    ASSERT( threadCount );
+
+    // These threads float, as they run alongside the plotter's
+    _checksumPool = new ThreadPool( threadCount, ThreadPool::Mode::Fixed, true );
+}
+
+//-----------------------------------------------------------
+bool DiskPlotWriter::BeginPlot( const char* plotFilePath, PlotSink& file, const byte plotId[32], const byte* plotMemo, const uint16 plotMemoSize,
+                                const size_t tableSizes[10] )
 {
     #if BB_BENCHMARK_MODE
         _filePath = plotFilePath;
@@ -51,6 +111,9 @@ bool DiskPlotWriter::BeginPlot( const char* plotFilePath, FileStream& file, cons
     if( _file || _error || !file.IsOpen() )
         return false;
 
+    ReleaseStagedTables();
+    _stagedTableStart = 0;
+
     const size_t headerSize =
         ( sizeof( kPOSMagic ) - 1 ) +
         32 +            // plot id
@@ -63,7 +126,8 @@ bool DiskPlotWriter::BeginPlot( const char* plotFilePath, FileStream& file, cons
     ;
 
     ASSERT( plotFilePath );
-    _filePath = plotFilePath;
+    _filePath  = plotFilePath;
+    _streaming = file.IsStream();
 
 
     const size_t paddedHeaderSize = RoundUpToNextBoundary( headerSize, (int)file.BlockSize() );
@@ -123,13 +187,6 @@ bool DiskPlotWriter::BeginPlot( const char* plotFilePath, FileStream& file, cons
         // Tables will be copied at the end.
     }
 
-    // Seek to the aligned position after the header
-    if( !file.Seek( (int64)paddedHeaderSize, SeekOrigin::Begin ) )
-    {
-        _error = file.GetError();
-        return false;
-    }
-    
     // Save header so that we can actually write it to the end of the file
     _headerBuffer = header;
     _headerSize   = headerSize;
@@ -137,6 +194,34 @@ bool DiskPlotWriter::BeginPlot( const char* plotFilePath, FileStream& file, cons
     // Store initial table offset
     _tablePointers[0] = paddedHeaderSize;
     _position         = paddedHeaderSize;
+    _layoutKnown      = tableSizes != nullptr;
+    _tablesSubmitted  = 0;
+
+    // Lay out the tables one after another, and fill in the header's table pointers now,
+    // so that it can be written first
+    if( _layoutKnown )
+    {
+        memcpy( _tableSizes, tableSizes, sizeof( _tableSizes ) );
+
+        for( uint i = 1; i < 10; i++ )
+            _tablePointers[i] = _tablePointers[i-1] + RoundUpToNextBoundary( _tableSizes[i-1], (int)file.BlockSize() );
+
+        _layoutSize = _tablePointers[9] + RoundUpToNextBoundary( _tableSizes[9], (int)file.BlockSize() );
+
+        uint64* headerPointers = (uint64*)( header + headerSize - 80 );
+        for( uint i = 0; i < 10; i++ )
+            headerPointers[i] = Swap64( _tablePointers[i] );
+    }
+    else
+        memset( _tableSizes, 0, sizeof( _tableSizes ) );
+
+    ZeroMem( &_stats );
+    _plotBeginTime = TimerBegin();
+
+    // No table of this plot is written yet. This must be reset before the file is handed over,
+    // otherwise the previous plot's count would report this plot's buffers as free
+    // until the writer thread picks up the file.
+    _lastTableIndexWritten.store( 0, std::memory_order_release );
 
     // Give ownership of the file to the writer thread and signal it
     _tableIndex = 0;
@@ -148,12 +233,40 @@ bool DiskPlotWriter::BeginPlot( const char* plotFilePath, FileStream& file, cons
 
 //-----------------------------------------------------------
 bool DiskPlotWriter::WriteTable( const void* buffer, size_t size )
+{
+    return WriteTableAt( _tableIndex.load( std::memory_order_relaxed ), buffer, size );
+}
+
+//-----------------------------------------------------------
+bool DiskPlotWriter::SubmitTable( const void* buffer, size_t size )
+{
+    return SubmitTableAt( _tableIndex.load( std::memory_order_relaxed ), buffer, size );
+}
+
+//-----------------------------------------------------------
+bool DiskPlotWriter::BeginTable( const void* buffer )
+{
+    return BeginTableAt( _tableIndex.load( std::memory_order_relaxed ), buffer );
+}
+
+//-----------------------------------------------------------
+bool DiskPlotWriter::CanSubmitTable( uint table )
+{
+    if( table >= 10 || ( _tablesSubmitted & ( 1u << table ) ) )
+        return false;
+
+    // Without a known layout, a table's offset is only known once the ones before it are written
+    return _layoutKnown || table == _tableIndex.load( std::memory_order_relaxed );
+}
+
+//-----------------------------------------------------------
+bool DiskPlotWriter::WriteTableAt( uint table, const void* buffer, size_t size )
 {
     #if BB_BENCHMARK_MODE
         return true;
     #endif
 
-    if( !SubmitTable( buffer, size ) )
+    if( !SubmitTableAt( table, buffer, size ) )
         return false;
 
     // Signal the writer thread that there is a new table to write
@@ -163,7 +276,7 @@ bool DiskPlotWriter::WriteTable( const void* buffer, size_t size )
 }
 
 //-----------------------------------------------------------
-bool DiskPlotWriter::SubmitTable( const void* buffer, size_t size )
+bool DiskPlotWriter::SubmitTableAt( uint tableId, const void* buffer, size_t size )
 {
     #if BB_BENCHMARK_MODE
         return true;
@@ -174,18 +287,33 @@ bool DiskPlotWriter::SubmitTable( const void* buffer, size_t size )
     if( !_file || _error )
         return false;
 
-    const uint tableIndex = _tableIndex.load( std::memory_order_relaxed );
-    ASSERT( tableIndex < 10 );
+    std::lock_guard<std::mutex> lock( _submitLock );
 
-    // Can't overflow tables
-    if( tableIndex >= 10 )
+    // Can't overflow tables, or write them out of order without knowing their offsets
+    if( !CanSubmitTable( tableId ) )
         return false;
 
+    // The table would not fit its place in the layout
+    if( _layoutKnown && size != _tableSizes[tableId] )
+    {
+        Log::Error( "Error: %s is %llu bytes instead of the %llu bytes expected.", TableNames[tableId], size, _tableSizes[tableId] );
+        return false;
+    }
+
     ASSERT( buffer );
     ASSERT( size   );
 
-    _tablebuffers[tableIndex].buffer = (byte*)buffer;
-    _tablebuffers[tableIndex].size   = size;
+    const uint tableIndex = _tableIndex.load( std::memory_order_relaxed );
+    _tablesSubmitted |= 1u << tableId;
+
+    TableBuffer& table = _tablebuffers[tableIndex];
+    table.table  = tableId;
+    table.buffer = (byte*)buffer;
+    table.size   = size;
+    table.staged = nullptr;
+    table.readySize.store( size, std::memory_order_relaxed );
+    table.complete .store( true, std::memory_order_relaxed );
+    table.state    .store( TableState::Pending, std::memory_order_relaxed );
 
     // Store the value
     _tableIndex.store( tableIndex + 1, std::memory_order_release );
@@ -193,6 +321,103 @@ bool DiskPlotWriter::SubmitTable( const void* buffer, size_t size )
     return true;
 }
 
+//-----------------------------------------------------------
+bool DiskPlotWriter::BeginTableAt( uint tableId, const void* buffer )
+{
+    #if BB_BENCHMARK_MODE
+        return true;
+    #endif
+
+    if( !_file || _error )
+        return false;
+
+    std::lock_guard<std::mutex> lock( _submitLock );
+
+    if( !CanSubmitTable( tableId ) )
+        return false;
+
+    ASSERT( buffer );
+
+    const uint tableIndex = _tableIndex.load( std::memory_order_relaxed );
+    _tablesSubmitted |= 1u << tableId;
+
+    TableBuffer& table = _tablebuffers[tableIndex];
+    table.table  = tableId;
+    table.buffer = (byte*)buffer;
+    table.size   = 0;
+    table.staged = nullptr;
+    table.readySize.store( 0    , std::memory_order_relaxed );
+    table.complete .store( false, std::memory_order_relaxed );
+    table.state    .store( TableState::Pending, std::memory_order_relaxed );
+
+    _chunkSignalSize = 0;
+
+    // The writer thread can now see the table, but it won't write anything until chunks are submitted
+    _tableIndex.store( tableIndex + 1, std::memory_order_release );
+
+    return true;
+}
+
+//-----------------------------------------------------------
+bool DiskPlotWriter::SubmitTableChunk( size_t size )
+{
+    #if BB_BENCHMARK_MODE
+        return true;
+    #endif
+
+    if( !_file || _error )
+        return false;
+
+    const uint tableIndex = _tableIndex.load( std::memory_order_relaxed );
+    ASSERT( tableIndex > 0 && tableIndex <= 10 );
+
+    TableBuffer& table = _tablebuffers[tableIndex-1];
+    ASSERT( !table.complete.load( std::memory_order_relaxed ) );
+
+    const size_t readySize = table.readySize.load( std::memory_order_relaxed ) + size;
+    table.readySize.store( readySize, std::memory_order_release );
+
+    // Only wake the writer thread once there's a good amount of data for it
+    if( readySize - _chunkSignalSize >= MinChunkSignalSize )
+    {
+        _chunkSignalSize = readySize;
+        _writeSignal.Release();
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------
+bool DiskPlotWriter::EndTable( size_t size )
+{
+    #if BB_BENCHMARK_MODE
+        return true;
+    #endif
+
+    if( !_file || _error )
+        return false;
+
+    const uint tableIndex = _tableIndex.load( std::memory_order_relaxed );
+    ASSERT( tableIndex > 0 && tableIndex <= 10 );
+
+    TableBuffer& table = _tablebuffers[tableIndex-1];
+    ASSERT( size >= table.readySize.load( std::memory_order_relaxed ) );
+
+    if( _layoutKnown && size != _tableSizes[table.table] )
+    {
+        Log::Error( "Error: %s is %llu bytes instead of the %llu bytes expected.", TableNames[table.table], size, _tableSizes[table.table] );
+        return false;
+    }
+
+    table.size = size;
+    table.readySize.store( size, std::memory_order_relaxed );
+    table.complete .store( true, std::memory_order_release );
+
+    _writeSignal.Release();
+
+    return true;
+}
+
 // //-----------------------------------------------------------
 // bool DiskPlotWriter::FlushTables()
 // {
@@ -224,16 +449,168 @@ bool DiskPlotWriter::WaitUntilFinishedWriting()
     if( !_file && _plotFinishedSignal.GetCount() == 0 )
         return true;
 
+    auto timer = TimerBegin();
+
     do {
         _plotFinishedSignal.Wait();
     } while( _file );
 
+    _stats.finishWaitSeconds += TimerEnd( timer );
+
     ASSERT( _file == nullptr );
 
+    ReleaseStagedTables();
+
     return _error == 0;
 #endif
 }
 
+//-----------------------------------------------------------
+bool DiskPlotWriter::IsBufferRangePending( const void* buffer, size_t size )
+{
+    #if BB_BENCHMARK_MODE
+        return false;
+    #endif
+
+    // The writer thread nullifies the file once it has written all the tables, or stopped on an error
+    if( !_file )
+        return false;
+
+    const byte* start = (const byte*)buffer;
+    const byte* end   = start + size;
+
+    const uint tableCount    = _tableIndex.load( std::memory_order_acquire );
+    const uint tablesWritten = _lastTableIndexWritten.load( std::memory_order_acquire );
+
+    for( uint i = tablesWritten; i < tableCount; i++ )
+    {
+        const TableBuffer& table = _tablebuffers[i];
+
+        // Tables submitted in chunks don't have a known size until they end
+        const byte* tableStart = table.buffer;
+        const byte* tableEnd   = table.complete.load( std::memory_order_acquire ) ? tableStart + table.size : (const byte*)UINTPTR_MAX;
+
+        if( tableStart < end && start < tableEnd )
+            return true;
+    }
+
+    return false;
+}
+
+//-----------------------------------------------------------
+bool DiskPlotWriter::WaitForBufferRange( const void* buffer, size_t size )
+{
+    if( !IsBufferRangePending( buffer, size ) )
+        return _error == 0;
+
+    auto timer = TimerBegin();
+
+    while( IsBufferRangePending( buffer, size ) )
+        _tableWrittenSignal.Wait();
+
+    _stats.bufferWaitSeconds += TimerEnd( timer );
+
+    return _error == 0;
+}
+//-----------------------------------------------------------
+size_t DiskPlotWriter::StageBufferRange( ThreadPool& pool, const void* buffer, size_t size )
+{
+    #if BB_BENCHMARK_MODE
+        return 0;
+    #endif
+
+    if( !_staging || !_file )
+        return 0;
+
+    ReleaseStagedTables();
+
+    const byte* start = (const byte*)buffer;
+    const byte* end   = start + size;
+
+    const uint tableCount    = _tableIndex.load( std::memory_order_acquire );
+    const uint tablesWritten = _lastTableIndexWritten.load( std::memory_order_acquire );
+
+    size_t stagedSize = 0;
+    auto   timer      = TimerBegin();
+
+    for( uint i = tablesWritten; i < tableCount; i++ )
+    {
+        TableBuffer& table = _tablebuffers[i];
+
+        if( table.staged || !table.complete.load( std::memory_order_acquire ) )
+            continue;
+
+        if( table.buffer >= end || start >= table.buffer + table.size )
+            continue;
+
+        // The writer thread can't start the table while we stage it. If it already did, it keeps its buffer.
+        TableState state = TableState::Pending;
+        if( !table.state.compare_exchange_strong( state, TableState::Staging, std::memory_order_acq_rel ) )
+            continue;
+
+        byte* staged = _staging->Alloc( AlignToBlockSize( table.size ) );
+
+        if( staged )
+        {
+            const uint threadCount = pool.ThreadCount();
+
+            StageCopyJob jobs[MAX_THREADS];
+
+            const size_t sizePerThread = table.size / threadCount / 4096 * 4096;
+
+            for( uint j = 0; j < threadCount; j++ )
+            {
+                const size_t offset = sizePerThread * j;
+
+                StageCopyJob& job = jobs[j];
+                job.src  = table.buffer + offset;
+                job.dst  = staged + offset;
+                job.size = j == threadCount-1 ? table.size - offset : sizePerThread;
+            }
+
+            pool.RunJob( StageCopyThread, jobs, threadCount );
+
+            table.buffer = staged;
+            table.staged = staged;
+            stagedSize  += table.size;
+        }
+
+        table.state.store( TableState::Pending, std::memory_order_release );
+    }
+
+    if( stagedSize )
+        _stats.stageSeconds += TimerEnd( timer );
+
+    return stagedSize;
+}
+
+//-----------------------------------------------------------
+void DiskPlotWriter::ReleaseStagedTables()
+{
+    if( !_staging )
+        return;
+
+    const uint tablesWritten = _file ? _lastTableIndexWritten.load( std::memory_order_acquire ) : 10;
+
+    for( uint i = _stagedTableStart; i < tablesWritten; i++ )
+    {
+        TableBuffer& table = _tablebuffers[i];
+
+        if( table.staged )
+        {
+            _staging->Release( table.staged );
+            table.staged = nullptr;
+        }
+    }
+
+    _stagedTableStart = std::max( _stagedTableStart, tablesWritten );
+}
+
+//-----------------------------------------------------------
+void StageCopyThread( StageCopyJob* job )
+{
+    memcpy( job->dst, job->src, job->size );
+}
 
 ///
 /// Writer thread
@@ -255,15 +632,24 @@ void DiskPlotWriter::WriterThread()
     if( _terminateSignal.load( std::memory_order_relaxed ) )
         return;
 
-    FileStream* file = nullptr;
+    PlotSink* file = nullptr;
 
-    uint tableIndex = 0;    // Local table index
+    uint   tableIndex       = 0;    // Local table index
+    size_t tableSizeWritten = 0;    // Bytes of the current table written so far
+    bool   tableClaimed     = false;
 
     // Buffer for writing 
     size_t blockBufferSize = 0;
     byte*  blockBuffer     = nullptr;
     size_t blockSize       = 0;
 
+    bool   registerBuffers = false;     // Stop trying to register table buffers once it fails
+    bool   hashing         = false;
+
+    auto   tableTimer      = TimerBegin();
+    auto   waitTimer       = TimerBegin();  // Started when we ran out of a table's chunks to write
+    bool   tableWaiting    = false;
+
     for( ;; )
     {
         // Wait to be signalled by the main thread
@@ -284,8 +670,10 @@ void DiskPlotWriter::WriterThread()
                 continue;
 
             // Reset table index
-            tableIndex = 0;
-            _lastTableIndexWritten.store( 0, std::memory_order_release );
+            tableIndex       = 0;
+            tableSizeWritten = 0;
+            tableClaimed     = false;
+            tableWaiting     = false;
 
             // Allocate a new block buffer, if we need to
             blockSize = file->BlockSize();
@@ -300,6 +688,38 @@ void DiskPlotWriter::WriterThread()
                 if( !blockBuffer )
                     Fatal( "Failed to allocate buffer for writing to disk." );
             }
+
+            // Keep several writes in flight if we can, otherwise they're written synchronously.
+            // (Async writes are only queued on Linux.)
+        #if PLATFORM_IS_LINUX
+            file->InitAsyncWrites( WriteQueueDepth );
+        #endif
+            registerBuffers = file->HasAsyncQueue();
+
+            // Reserve the whole file up front so that it's laid out contiguously.
+            // This is only a hint, so we carry on if the file system can't do it.
+            const size_t reserveSize = _layoutKnown ? _layoutSize : EstimatePlotSize( _tablePointers[0], blockSize );
+
+            if( !file->Reserve( (ssize_t)reserveSize ) )
+                file->GetError();
+
+            // The file's regions are hashed as BLAKE3 subtrees, which must start at a chunk boundary
+            hashing = _checksumPool != nullptr;
+            _checksum.Reset();
+
+            if( hashing && blockSize % Blake3Tree::ChunkSize != 0 )
+            {
+                Log::Error( "Warning: Not computing the checksum of %s, as its block size of %llu bytes is not supported.",
+                            _filePath.c_str(), blockSize );
+                hashing = false;
+            }
+
+            // The header already has the table pointers, so there's no need to come back to it
+            if( _layoutKnown && !WriteBlocks( *file, _headerBuffer, _tablePointers[0], 0, hashing ) )
+            {
+                _error = file->GetError();
+                break;
+            }
         }
 
         // See if we have a new table to write (should always be the case when we're signaled)
@@ -308,34 +728,70 @@ void DiskPlotWriter::WriterThread()
         while( tableIndex < newIndex )
         {
             TableBuffer& table       = _tablebuffers[tableIndex];
+            PlotWriteStats::Table& tableStats = _stats.tables[table.table];
+
+            // Without a known layout, tables are written one after another
+            const size_t tableOffset = _layoutKnown ? _tablePointers[table.table] : _position;
+
+            // Claim the table so that the plotting thread doesn't move it to the staging buffer while we write it.
+            // If it's being staged right now, wait for the copy to finish, then write it from there.
+            if( !tableClaimed )
+            {
+                TableState state = TableState::Pending;
+                while( !table.state.compare_exchange_weak( state, TableState::Writing, std::memory_order_acq_rel ) )
+                {
+                    state = TableState::Pending;
+                    std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+                }
+
+                tableClaimed = true;
+                tableTimer   = TimerBegin();
+                SampleWriteQueue();
+            }
+
+            if( tableWaiting )
+            {
+                tableStats.waitSeconds += TimerEnd( waitTimer );
+                tableWaiting = false;
+            }
+
+            // Tables submitted in chunks may only be partially ready
+            const bool   complete    = table.complete.load( std::memory_order_acquire );
+            const size_t readySize   = complete ? table.size : table.readySize.load( std::memory_order_acquire );
 
-            const byte*  writeBuffer = table.buffer;
+            const byte*  writeBuffer = table.buffer + tableSizeWritten;
 
-            // Write as many blocks as we can, 
+            // Register the table's buffer if we have all of it before we start writing it.
+            // There's no writes in flight here, as we wait for them at the end of every table.
+        #if PLATFORM_IS_LINUX
+            if( registerBuffers && complete && tableSizeWritten == 0 && readySize >= blockSize )
+                registerBuffers = file->RegisterAsyncBuffer( table.buffer, readySize / blockSize * blockSize );
+        #endif
+
+            // Queue as many blocks as we can, 
             // then write the remainder by copying it to our own block-aligned buffer
-            const size_t blockCount  = table.size / blockSize;
-            size_t       sizeToWrite = blockCount * blockSize;
+            const size_t blockCount  = readySize / blockSize;
+            const size_t sizeToWrite = blockCount * blockSize - tableSizeWritten;
 
-            const size_t remainder   = table.size - sizeToWrite;
+            const size_t remainder   = readySize - blockCount * blockSize;
 
-            while( sizeToWrite )
+            if( sizeToWrite && !WriteBlocks( *file, writeBuffer, sizeToWrite, tableOffset + tableSizeWritten, hashing ) )
             {
-                ssize_t sizeWritten = file->Write( writeBuffer, sizeToWrite );
-                if( sizeWritten < 1 )
-                {
-                    // Error occurred, stop writing.
-                    _error = file->GetError();
-                    break;
-                }
-                ASSERT( (size_t)sizeWritten <= sizeToWrite );
+                // Error occurred, stop writing.
+                _error = file->GetError();
+                break;
+            }
 
-                sizeToWrite -= (size_t)sizeWritten;
-                writeBuffer += sizeWritten;
-            };
+            tableSizeWritten += sizeToWrite;
+            writeBuffer      += sizeToWrite;
 
-            // Break out if we got a write error
-            if( _error )
+            // Wait for the rest of the table
+            if( !complete )
+            {
+                waitTimer    = TimerBegin();
+                tableWaiting = true;
                 break;
+            }
 
             // Write remainder, if we have any
             if( remainder )
@@ -343,30 +799,43 @@ void DiskPlotWriter::WriterThread()
                 memset( blockBuffer, 0, blockSize );
                 memcpy( blockBuffer, writeBuffer, remainder );
 
-                ssize_t sizeWritten = file->Write( blockBuffer, blockSize );
-                if( sizeWritten < 1 )
+                if( !WriteBlocks( *file, blockBuffer, blockSize, tableOffset + tableSizeWritten, hashing ) )
                 {
                     _error = file->GetError();
                     break;   
                 }
-
-                ASSERT( (size_t)sizeWritten == blockSize );
             }
 
-            if( !file->Flush() )
+            // The table's buffer may be reused once we report it as written
+            if( !file->WaitForAsyncWrites() )
             {
                 _error = file->GetError();
                 break;
             }
 
+            tableStats.size    = table.size;
+            tableStats.seconds = TimerEnd( tableTimer );
+
             // Go to the next table
+            tableSizeWritten = 0;
+            tableClaimed     = false;
             tableIndex ++;
             _lastTableIndexWritten.store( tableIndex, std::memory_order_release );
+            _tableWrittenSignal.Release();
+
+            SampleWriteQueue();
 
-            _position += RoundUpToNextBoundary( table.size, (int)blockSize );
+            if( !_layoutKnown )
+            {
+                _tableSizes[table.table] = table.size;
+                _position += RoundUpToNextBoundary( table.size, (int)blockSize );
 
-            // Save the table pointer
-            _tablePointers[tableIndex] = _position;
+                // Save the table pointer
+                if( tableIndex < 10 )
+                    _tablePointers[tableIndex] = _position;
+            }
+            else if( tableIndex == 10 )
+                _position = _layoutSize;
         }
         
         if( _error )
@@ -377,27 +846,40 @@ void DiskPlotWriter::WriterThread()
         {
             ASSERT( tableIndex == 10 );
 
-            // We now need to seek to the beginning so that we can write the header
-            // with the table pointers set
-            if( file->Seek( 0, SeekOrigin::Begin ) )
-            {
-                const size_t alignedHeaderSize = _tablePointers[0];
+            // Write the header at the beginning of the file, now that the table pointers are set.
+            // (It was written first if they were known up front.)
+            const size_t alignedHeaderSize = _tablePointers[0];
+            auto         finishTimer       = TimerBegin();
+
+            // Convert to BE
+            for( uint i = 0; i < 10; i++ )
+                _tablePointers[i] = Swap64( _tablePointers[i] );
 
-                // Convert to BE
-                for( uint i = 0; i < 10; i++ )
-                    _tablePointers[i] = Swap64( _tablePointers[i] );
+            memcpy( _headerBuffer + (_headerSize-80), _tablePointers, 80 );
+
+            if( ( !_layoutKnown && !WriteBlocks( *file, _headerBuffer, alignedHeaderSize, 0, hashing ) ) || !file->WaitForAsyncWrites() )
+                _error = file->GetError();
+            else
+            {
+                // Now we have hashed the whole file. The manifest is written with it, even if it's streamed.
+                if( hashing )
+                {
+                    byte hash[Blake3Tree::HashSize];
 
-                memcpy( _headerBuffer + (_headerSize-80), _tablePointers, 80 );
+                    if( !_checksum.Finalize( _position, hash ) )
+                        Log::Error( "Error: Failed to compute the checksum of %s.", _filePath.c_str() );
+                    else
+                        AddChecksumManifest( *file, hash );
+                }
 
-                if( file->Write( _headerBuffer, alignedHeaderSize ) != (ssize_t)alignedHeaderSize )
+                // Drop the reserved space we didn't use, and sync the file data only once, at the end.
+                // (The receiver does this for streamed plots.)
+                if( !file->Finish( _position ) )
                     _error = file->GetError();
             }
-            else
-                _error = file->GetError();
 
-            // Plot data cleanup
-            if( !file->Flush() )
-                _error = file->GetError();
+            _stats.finishSeconds = TimerEnd( finishTimer );
+            _stats.elapsed       = TimerEnd( _plotBeginTime );
             
             file->Close();
             delete file;
@@ -428,9 +910,198 @@ void DiskPlotWriter::WriterThread()
     _file = nullptr;
 
     // Signal that this thread is finished
+    _tableWrittenSignal.Release();
     _plotFinishedSignal.Release();
 }
 
+//-----------------------------------------------------------
+bool DiskPlotWriter::WriteBlocks( PlotSink& file, const byte* buffer, size_t size, size_t offset, bool hashing )
+{
+    if( !hashing )
+        return file.WriteAsync( buffer, size, offset );
+
+    // Hash each segment after queueing it, so that we hash while the previous writes complete
+    for( size_t done = 0; done < size; )
+    {
+        const size_t segmentSize = std::min( size - done, ChecksumSegmentSize );
+
+        if( !file.WriteAsync( buffer + done, segmentSize, offset + done ) )
+            return false;
+
+        _checksum.AddRegion( *_checksumPool, buffer + done, segmentSize, offset + done );
+        done += segmentSize;
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------
+void DiskPlotWriter::AddChecksumManifest( PlotSink& file, const byte hash[Blake3Tree::HashSize] )
+{
+    const std::string plotName = PlotFileName();
+
+    char hashHex[Blake3Tree::HashSize*2 + 1];
+    for( uint i = 0; i < Blake3Tree::HashSize; i++ )
+        sprintf( hashHex + i*2, "%02x", hash[i] );
+
+    std::string manifest;
+    char        line[512];
+
+    snprintf( line, sizeof( line ), "{\n" );
+    manifest += line;
+    snprintf( line, sizeof( line ), "  \"plot\"   : \"%s\",\n", plotName.c_str() );
+    manifest += line;
+    snprintf( line, sizeof( line ), "  \"size\"   : %llu,\n", (uint64)_position );
+    manifest += line;
+    snprintf( line, sizeof( line ), "  \"blake3\" : \"%s\",\n", hashHex );
+    manifest += line;
+    snprintf( line, sizeof( line ), "  \"tables\" : [\n" );
+    manifest += line;
+
+    // The table pointers are big-endian by now
+    for( uint i = 0; i < 10; i++ )
+    {
+        snprintf( line, sizeof( line ), "    { \"name\": \"%s\", \"pointer\": %llu, \"size\": %llu }%s\n",
+                  TableNames[i], (uint64)Swap64( _tablePointers[i] ), (uint64)_tableSizes[i], i < 9 ? "," : "" );
+        manifest += line;
+    }
+
+    manifest += "  ]\n";
+    manifest += "}\n";
+
+    file.AddSidecar( ChecksumManifestExt, manifest.c_str(), manifest.size() );
+}
+
+//-----------------------------------------------------------
+std::string DiskPlotWriter::PlotFileName()
+{
+    std::string plotName = _filePath;
+
+    if( plotName.size() > 4 && plotName.compare( plotName.size() - 4, 4, ".tmp" ) == 0 )
+        plotName.resize( plotName.size() - 4 );
+
+    const size_t slash = plotName.find_last_of( "/\\" );
+    if( slash != std::string::npos )
+        plotName.erase( 0, slash + 1 );
+
+    return plotName;
+}
+
+//-----------------------------------------------------------
+void DiskPlotWriter::SampleWriteQueue()
+{
+    if( _stats.queueSampleCount >= sizeof( _stats.queue ) / sizeof( _stats.queue[0] ) )
+        return;
+
+    const uint tableCount    = _tableIndex.load( std::memory_order_acquire );
+    const uint tablesWritten = _lastTableIndexWritten.load( std::memory_order_acquire );
+
+    PlotWriteStats::QueueSample& sample = _stats.queue[_stats.queueSampleCount++];
+    sample.time   = TimerEnd( _plotBeginTime );
+    sample.tables = tableCount > tablesWritten ? tableCount - tablesWritten : 0;
+    sample.bytes  = 0;
+
+    for( uint i = tablesWritten; i < tableCount; i++ )
+        sample.bytes += _tablebuffers[i].readySize.load( std::memory_order_acquire );
+}
+
+//-----------------------------------------------------------
+void DiskPlotWriter::ReportWriteStats()
+{
+    #if BB_BENCHMARK_MODE
+        return;
+    #endif
+
+    const PlotWriteStats& stats = _stats;
+
+    // Rates are of the time spent writing, not waiting for the plotter
+    auto rate = []( size_t size, double seconds ) {
+        return seconds > 0 ? (double)size / (1ull MB) / seconds : 0.0;
+    };
+
+    Log::Line( "Plot write stats:" );
+
+    double tablesWaitSeconds = 0;
+
+    for( uint i = 0; i < 10; i++ )
+    {
+        const PlotWriteStats::Table& table = stats.tables[i];
+        tablesWaitSeconds += table.waitSeconds;
+
+        Log::Line( "  %-6s : %8.2lf GiB in %7.2lf seconds ( %8.2lf MiB/s ), waited %7.2lf seconds for the plotter.",
+            TableNames[i], (double)table.size / (1ull GB), table.seconds,
+            rate( table.size, table.seconds - table.waitSeconds ), table.waitSeconds );
+    }
+
+    Log::Line( "  Header and finish : %.2lf seconds.", stats.finishSeconds );
+    Log::Line( "  Wrote %.2lf GiB in %.2lf seconds ( %.2lf MiB/s ).",
+        (double)_position / (1ull GB), stats.elapsed, rate( _position, stats.elapsed - tablesWaitSeconds ) );
+
+    uint   maxQueueTables = 0;
+    size_t maxQueueBytes  = 0;
+
+    for( uint i = 0; i < stats.queueSampleCount; i++ )
+    {
+        maxQueueTables = std::max( maxQueueTables, stats.queue[i].tables );
+        maxQueueBytes  = std::max( maxQueueBytes , stats.queue[i].bytes  );
+    }
+
+    Log::Line( "  Max queue depth   : %u tables, %.2lf GiB.", maxQueueTables, (double)maxQueueBytes / (1ull GB) );
+    Log::Line( "  Plotting waited on the writer for %.2lf seconds: staging %.2lf, table buffers %.2lf, plot finish %.2lf.",
+        stats.stageSeconds + stats.bufferWaitSeconds + stats.finishWaitSeconds,
+        stats.stageSeconds, stats.bufferWaitSeconds, stats.finishWaitSeconds );
+
+    if( _statsPath )
+        SaveWriteStats();
+}
+
+//-----------------------------------------------------------
+void DiskPlotWriter::SaveWriteStats()
+{
+    const PlotWriteStats& stats = _stats;
+
+    std::string json;
+    char        field[512];
+
+    snprintf( field, sizeof( field ), "{\"plot\":\"%s\",\"size\":%llu,\"elapsed\":%.3lf,\"finish_seconds\":%.3lf,"
+              "\"stage_seconds\":%.3lf,\"buffer_wait_seconds\":%.3lf,\"finish_wait_seconds\":%.3lf,\"tables\":[",
+              PlotFileName().c_str(), (uint64)_position, stats.elapsed, stats.finishSeconds,
+              stats.stageSeconds, stats.bufferWaitSeconds, stats.finishWaitSeconds );
+    json += field;
+
+    for( uint i = 0; i < 10; i++ )
+    {
+        const PlotWriteStats::Table& table = stats.tables[i];
+
+        snprintf( field, sizeof( field ), "%s{\"name\":\"%s\",\"size\":%llu,\"seconds\":%.3lf,\"wait_seconds\":%.3lf}",
+                  i ? "," : "", TableNames[i], (uint64)table.size, table.seconds, table.waitSeconds );
+        json += field;
+    }
+
+    json += "],\"queue\":[";
+
+    for( uint i = 0; i < stats.queueSampleCount; i++ )
+    {
+        const PlotWriteStats::QueueSample& sample = stats.queue[i];
+
+        snprintf( field, sizeof( field ), "%s{\"time\":%.3lf,\"tables\":%u,\"bytes\":%llu}",
+                  i ? "," : "", sample.time, sample.tables, (uint64)sample.bytes );
+        json += field;
+    }
+
+    json += "]}\n";
+
+    // One plot per line, so that the file can be appended to by every run
+    FILE* f = fopen( _statsPath, "ab" );
+
+    bool written = f && fwrite( json.c_str(), 1, json.size(), f ) == json.size();
+    if( f && fclose( f ) != 0 )
+        written = false;
+
+    if( !written )
+        Log::Error( "Error: Failed to write plot write stats to %s.", _statsPath );
+}
+
 //-----------------------------------------------------------
 size_t DiskPlotWriter::AlignToBlockSize( size_t size )
 {
@@ -448,3 +1119,165 @@ size_t DiskPlotWriter::AlignToBlockSize( size_t size )
 }
 
 
+
+///
+/// Staging buffer
+///
+//-----------------------------------------------------------
+PlotStagingBuffer::PlotStagingBuffer()
+{}
+
+//-----------------------------------------------------------
+PlotStagingBuffer::~PlotStagingBuffer()
+{
+    if( !_buffer )
+        return;
+
+    #if PLATFORM_IS_UNIX
+        if( _mapped )
+        {
+            munmap( _buffer, _size );
+            return;
+        }
+    #endif
+
+    SysHost::VirtualFree( _buffer );
+}
+
+//-----------------------------------------------------------
+bool PlotStagingBuffer::Init( size_t size, const char* directory )
+{
+    ASSERT( !_buffer );
+
+    size = RoundUpToNextBoundary( size, (int)SysHost::GetPageSize() );
+
+    if( directory && *directory )
+    {
+    #if PLATFORM_IS_UNIX
+        std::string path = directory;
+        if( path.back() != '/' )
+            path += '/';
+        path += "bladebit-staging-XXXXXX";
+
+        int fd = mkstemp( &path[0] );
+        if( fd < 0 )
+        {
+            Log::Error( "Error: Failed to create staging file in %s with error: %d.", directory, errno );
+            return false;
+        }
+
+        // The mapping keeps the file alive, and we don't leave it behind if we exit
+        unlink( path.c_str() );
+
+        // Make sure we have the space, so that we don't fault when writing to it
+        #if PLATFORM_IS_LINUX
+            int r = fallocate( fd, 0, 0, (off_t)size );
+        #else
+            int r = ftruncate( fd, (off_t)size );
+        #endif
+
+        void* buffer = MAP_FAILED;
+        if( r == 0 )
+            buffer = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+
+        const int err = errno;
+        close( fd );
+
+        if( buffer == MAP_FAILED )
+        {
+            Log::Error( "Error: Failed to allocate staging file in %s with error: %d.", directory, err );
+            return false;
+        }
+
+        _buffer = (byte*)buffer;
+        _mapped = true;
+    #else
+        Log::Error( "Error: Staging to a file is not supported on this platform." );
+        return false;
+    #endif
+    }
+    else
+    {
+        _buffer = (byte*)SysHost::VirtualAlloc( size );
+
+        if( !_buffer )
+        {
+            Log::Error( "Error: Failed to allocate staging buffer." );
+            return false;
+        }
+    }
+
+    _size = size;
+    return true;
+}
+
+//-----------------------------------------------------------
+byte* PlotStagingBuffer::Alloc( size_t size )
+{
+    if( !_buffer || size > _size || _allocCount >= MAX_ALLOCS )
+        return nullptr;
+
+    size_t offset = 0;
+
+    if( _allocCount > 0 )
+    {
+        const Allocation& first = _allocs[_allocStart];
+        const Allocation& last  = _allocs[( _allocStart + _allocCount - 1 ) % MAX_ALLOCS];
+
+        const size_t head = last.offset + last.size;
+
+        if( head > first.offset )
+        {
+            // Not wrapped: Try after the last allocation, then wrap around to the start
+            if( _size - head >= size )
+                offset = head;
+            else if( first.offset >= size )
+                offset = 0;
+            else
+                return nullptr;
+        }
+        else
+        {
+            // Wrapped: Only the gap up to the first allocation is free
+            if( first.offset - head >= size )
+                offset = head;
+            else
+                return nullptr;
+        }
+    }
+
+    Allocation& alloc = _allocs[( _allocStart + _allocCount ) % MAX_ALLOCS];
+    alloc.offset = offset;
+    alloc.size   = size;
+    alloc.freed  = false;
+
+    _allocCount++;
+
+    return _buffer + offset;
+}
+
+//-----------------------------------------------------------
+void PlotStagingBuffer::Release( const byte* buffer )
+{
+    ASSERT( buffer >= _buffer && buffer < _buffer + _size );
+
+    const size_t offset = (size_t)( buffer - _buffer );
+
+    // Allocations may be released out of order, but their space is only reclaimed in order
+    for( uint i = 0; i < _allocCount; i++ )
+    {
+        Allocation& alloc = _allocs[( _allocStart + i ) % MAX_ALLOCS];
+
+        if( alloc.offset == offset && !alloc.freed )
+        {
+            alloc.freed = true;
+            break;
+        }
+    }
+
+    while( _allocCount > 0 && _allocs[_allocStart].freed )
+    {
+        _allocStart = ( _allocStart + 1 ) % MAX_ALLOCS;
+        _allocCount--;
+    }
+}
@@ -1,7 +1,88 @@
 #pragma once
-#include "io/FileStream.h"
+#include "io/PlotSink.h"
 #include "threading/Thread.h"
 #include "threading/Semaphore.h"
+#include "util/Blake3Tree.h"
+#include <mutex>
+
+class ThreadPool;
+
+/**
+ * Memory to which DiskPlotWriter copies tables that are still pending to be written,
+ * so that their buffers can be reused by the next plot right away.
+ * It is either RAM or, if a directory is given, a temporary file in it mapped into memory,
+ * which is meant to be on a fast local drive.
+ * 
+ * Allocations are made from a ring, and their space is reclaimed in the order they were made.
+ * Only used from the plotting thread.
+ */
+class PlotStagingBuffer
+{
+public:
+    PlotStagingBuffer();
+    ~PlotStagingBuffer();
+
+    bool Init( size_t size, const char* directory = nullptr );
+
+    // Returns nullptr if there is not enough contiguous room
+    byte* Alloc( size_t size );
+
+    // Allocations may be released in any order
+    void Release( const byte* buffer );
+
+    inline size_t Size() const { return _size; }
+
+private:
+    static constexpr uint MAX_ALLOCS = 32;
+
+    struct Allocation
+    {
+        size_t offset;
+        size_t size;
+        bool   freed;
+    };
+
+    byte*      _buffer     = nullptr;
+    size_t     _size       = 0;
+    bool       _mapped     = false;     // Backed by a file
+    Allocation _allocs[MAX_ALLOCS];
+    uint       _allocStart = 0;         // Index of the oldest allocation
+    uint       _allocCount = 0;
+};
+
+/**
+ * How a plot was written by DiskPlotWriter, and how long plotting waited on it,
+ * to tell whether the disk is what limits plotting.
+ */
+struct PlotWriteStats
+{
+    struct Table
+    {
+        size_t size;
+        double seconds;             // From the writer starting the table until it was fully written
+        double waitSeconds;         // Part of it spent waiting for the plotter to submit more of the table
+    };
+
+    // Tables submitted but not yet written, sampled as the writer starts and finishes each table
+    struct QueueSample
+    {
+        double time;                // Seconds since the plot began
+        uint   tables;
+        size_t bytes;               // Bytes of those tables that are ready to be written
+    };
+
+    Table       tables[10];
+    double      finishSeconds;      // Writing the header and finishing the file
+    double      elapsed;            // From the plot beginning until it was finished
+
+    // Time the plotting thread spent on the writer
+    double      stageSeconds;       // Copying pending tables to the staging buffer
+    double      bufferWaitSeconds;  // Waiting for pending tables to be written, so that their buffers can be reused
+    double      finishWaitSeconds;  // Waiting for the plot to finish writing
+
+    QueueSample queue[20];
+    uint        queueSampleCount;
+};
 
 /**
  * Handles writing the final plot to disk
@@ -34,9 +115,14 @@ public:
     DiskPlotWriter();
     ~DiskPlotWriter();
 
-    // Begins writing a new plot. Any previous plot must have finished before calling this
-    bool BeginPlot( const char* plotFilePath, FileStream& file, const byte plotId[32],
-                    const byte* plotMemo, const uint16 plotMemoSize );
+    // Begins writing a new plot to a file or a stream. We take ownership of the sink.
+    // Any previous plot must have finished before calling this
+    // If the size of every table is given, in file order, the tables are laid out up front:
+    // The header is written first, and tables may be submitted in any order with the *At() variants.
+    // Tables must then be exactly the size given.
+    bool BeginPlot( const char* plotFilePath, PlotSink& file, const byte plotId[32],
+                    const byte* plotMemo, const uint16 plotMemoSize,
+                    const size_t tableSizes[10] = nullptr );
 
     // Submits and signals the writing thread to write a table
     bool WriteTable( const void* buffer, size_t size );
@@ -44,6 +130,26 @@ public:
     // Submits the table for writing, but does not actually write it to disk yet
     bool SubmitTable( const void* buffer, size_t size );
 
+    // Begins a table which will be submitted in chunks, as its parks are written to buffer.
+    // Chunks are contiguous in buffer and are written in the order they are submitted.
+    // Only whole blocks are written until the table is ended.
+    bool BeginTable( const void* buffer );
+
+    // Same as above, for the table at index table in the file (0-9: Table1-7, C1, C2, C3).
+    // Tables are written at their offset in the order they are submitted, so with a known layout,
+    // each one can be submitted as soon as it's ready. Without one, that must be the file order.
+    // Whole tables may be submitted from several threads at once, but not while a table
+    // is being submitted in chunks.
+    bool WriteTableAt ( uint table, const void* buffer, size_t size );
+    bool SubmitTableAt( uint table, const void* buffer, size_t size );
+    bool BeginTableAt ( uint table, const void* buffer );
+
+    // Appends the next size bytes of the current table's buffer for writing
+    bool SubmitTableChunk( size_t size );
+
+    // Ends the current table. size is the total size of the table.
+    bool EndTable( size_t size );
+
     // Flush pending tables to write
     // bool FlushTables();
 
@@ -51,6 +157,38 @@ public:
     // If there are any errors, call GetError() to obtain the file write error.
     bool WaitUntilFinishedWriting();
 
+    // Returns true if a table still pending to be written to disk lies in [buffer, buffer+size).
+    // Tables are released in the order they were submitted, as soon as each is fully written.
+    bool IsBufferRangePending( const void* buffer, size_t size );
+
+    // Blocks until none of the tables pending to be written lie in [buffer, buffer+size),
+    // so that the range may be overwritten before the whole plot has been written.
+    // Returns false if there was an error writing the plot.
+    bool WaitForBufferRange( const void* buffer, size_t size );
+
+    // Copies the pending tables in [buffer, buffer+size) that the writer has not started yet
+    // to the staging buffer, if there's room, so that they no longer hold the range.
+    // Returns the number of bytes staged.
+    size_t StageBufferRange( ThreadPool& pool, const void* buffer, size_t size );
+
+    // Optional buffer to copy pending tables to. May be shared between writers,
+    // as long as only one of them has tables pending at any time.
+    inline void SetStagingBuffer( PlotStagingBuffer* staging ) { _staging = staging; }
+
+    // Computes the BLAKE3 hash of every plot from its tables in memory as they are written,
+    // using threadCount threads of its own, and writes it to a manifest next to the plot,
+    // with the table pointers and sizes. Must be called before the first plot begins.
+    void EnableChecksum( uint threadCount );
+
+    // Appends the write stats of each plot to this file as a line of JSON, when it's reported
+    inline void SetStatsPath( const char* path ) { _statsPath = path; }
+
+    // Logs how the last plot was written, and saves it to the stats file, if set.
+    // Call once the plot has finished writing.
+    void ReportWriteStats();
+
+    inline const PlotWriteStats& WriteStats() { return _stats; }
+
     // Returns true if the plotter has finished writing the last queued plot.
     // (We nullify our reference when the file has been closed and finished.)
     inline bool HasFinishedWriting() { return _file == nullptr; }
@@ -68,31 +206,99 @@ public:
 
     inline const std::string& FilePath() { return _filePath; }
 
+    // Streamed plots are given their final name by the receiver, rather than renamed by us
+    inline bool IsStreaming() { return _streaming; }
+
+    // True if the table pointers were known when the plot began
+    inline bool IsLayoutKnown() { return _layoutKnown; }
+
     // Number of tables written
     inline uint TablesWritten() { return _lastTableIndexWritten.load( std::memory_order_acquire ); }
 
+    // Size of the plot file, once it has finished writing
+    inline size_t PlotSize() { return _position; }
+
+    // Upper estimate of a plot file's size, assuming every table has 2^k entries.
+    // Used to reserve the file up front. It is truncated to its actual size once written.
+    static size_t EstimatePlotSize( size_t headerSize, size_t blockSize );
+
 private:
     static void WriterMain( void* data );
     void WriterThread();
     size_t AlignToBlockSize( size_t size );
 
+    // Whether the table may be submitted next
+    bool CanSubmitTable( uint table );
+
+    // Releases staged tables that have been written
+    void ReleaseStagedTables();
+
+    // Queues writes of size bytes at offset, then hashes them while they're in flight, if hashing
+    bool WriteBlocks( PlotSink& file, const byte* buffer, size_t size, size_t offset, bool hashing );
+
+    // Called by the writer thread as it starts and finishes each table
+    void SampleWriteQueue();
+
+    void SaveWriteStats();
+
+    // File name of the plot once it's finished, without its directory
+    std::string PlotFileName();
+
+    // Has the sink write the manifest next to the plot once it's finished
+    void AddChecksumManifest( PlotSink& file, const byte hash[Blake3Tree::HashSize] );
+
+    enum class TableState : uint32
+    {
+        Pending = 0,    // Not started by the writer
+        Writing,        // Claimed by the writer thread, its buffer must not change
+        Staging         // Being copied to the staging buffer by the plotting thread
+    };
+
     struct TableBuffer
     {
+        uint         table;             // Index of the table in the file
         const byte*  buffer;
         size_t size;
+        const byte*  staged;            // Staging allocation holding the table, if any
+
+        std::atomic<size_t>     readySize;  // Bytes that can be written so far
+        std::atomic<bool>       complete;   // Set once size is known and the whole table can be written
+        std::atomic<TableState> state;
     };
 
+    // Don't wake the writer thread for chunks smaller than this
+    static constexpr size_t MinChunkSignalSize = 64ull << 20;   // 64MiB
+
+    // Writes in flight, of up to FileStream::AsyncWriteChunkSize each
+    static constexpr uint   WriteQueueDepth    = 16;
+
+    // Tables are hashed this much at a time, so that the hashing overlaps the writes
+    static constexpr size_t ChecksumSegmentSize = 256ull << 20; // 256MiB
+
 private:
-    FileStream* _file              = nullptr;
+    PlotSink*   _file              = nullptr;
     std::string _filePath;
+    bool        _streaming         = false;
     size_t      _headerSize        = 0;
     byte*       _headerBuffer      = nullptr;
     size_t      _position          = 0;             // Current write position
     uint64      _tablePointers[10] = { 0 };         // Pointers to the table begin position
-    TableBuffer _tablebuffers [10];                 // Table buffers passed to us for writing.
+    size_t      _tableSizes   [10] = { 0 };         // By table index in the file. Set as they're written, if the layout is not known.
+    bool        _layoutKnown       = false;         // Table sizes were given up front
+    size_t      _layoutSize        = 0;             // Size of the plot file, if the layout is known
+    uint        _tablesSubmitted   = 0;             // Bit per table index in the file
+    TableBuffer _tablebuffers [10];                 // Table buffers passed to us for writing, in the order they were submitted.
+    size_t      _chunkSignalSize   = 0;             // Ready size of the current table when the writer was last signalled
+    PlotStagingBuffer* _staging    = nullptr;
+    uint        _stagedTableStart  = 0;             // Index of the first table that may still hold a staging allocation
+    ThreadPool* _checksumPool      = nullptr;       // Set if plots are hashed. Only used by the writer thread.
+    Blake3Tree  _checksum;
+    PlotWriteStats _stats;
+    std::chrono::steady_clock::time_point _plotBeginTime;
+    const char* _statsPath         = nullptr;
 
     std::atomic<uint> _tableIndex             = 0;  // Next table index to write
-    std::atomic<uint> _lastTableIndexWritten  = 10; // Index of the latest table that was fully written to disk. (Owned by writer thread.)
+    std::atomic<uint> _lastTableIndexWritten  = 10; // Index of the latest table that was fully written to disk. (Written by the writer thread, and reset by BeginPlot.)
                                                     //  That is, index-1 is the index of the last table written.
                                                     //  We start it at 10 (all tables written), to denote that we have
                                                     //  no tables pending to write.
@@ -100,8 +306,10 @@ private:
     int               _error              = 0;      // Set if there was an error writing the plot file
 
     Thread            _writerThread;
+    std::mutex        _submitLock;                  // Held while a table is queued, as tables may be submitted from several threads
     Semaphore         _writeSignal;                 // Main thread signals writer thread to write a new table
     Semaphore         _plotFinishedSignal;          // Writer thread signals that it's finished writing a plot
+    Semaphore         _tableWrittenSignal;          // Writer thread signals that it's finished writing a table, or stopped
     std::atomic<bool> _terminateSignal    = false;  // Main thread signals us to exit
 };
 
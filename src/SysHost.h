@@ -36,6 +36,10 @@ public:
     /// Gets the currently available (unused) system ram in bytes
     static size_t GetAvailableSystemMemory();
 
+    /// Gets the disk space available to us in the file system containing path, in bytes.
+    /// Returns 0 if it could not be queried.
+    static size_t GetAvailableDiskSpace( const char* path );
+
     /// Get the total number of logical CPUs in the system
     static uint GetLogicalCPUCount();
 
@@ -15,6 +15,23 @@
     #error Byte swapping intrinsics not configured for this compiler.
 #endif
 
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+// Count trailing zero bits. x must not be 0.
+//-----------------------------------------------------------
+inline uint32 Ctz64( uint64 x )
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward64( &idx, x );
+    return (uint32)idx;
+#else
+    return (uint32)__builtin_ctzll( x );
+#endif
+}
+
 
 /// Byte size conversions
 #define KB *(1<<10)
@@ -5,6 +5,7 @@
 #include "util/Log.h"
 #include "Config.h"
 #include "ChiaConsts.h"
+#include <vector>
 
 
 template<typename JobT>
@@ -43,17 +44,23 @@ struct SortYJob : SortYBaseJob<SortYJob>
 
     uint32* sortKey;
     uint32* sortKeyTmp;
+
+    const YBucketSlots* slots;  // Set when sorting pre-bucketed entries
+    uint32*             slotsPfxSum;    // This thread's prefix sums when sorting pre-bucketed entries. Owned by the caller.
+    YBucketDoneFunc     onBucketDone;
+    void*               onBucketDoneData;
     
     template<bool HasSortKey>
     static void SortYThread( SortYJob* job );
 
+    static void SortBucketsThread( SortYJob* job );
+
 private:
     template<bool HasSortKey, uint shift, typename YT>
-    void SortBucket( const uint64 bucket, const uint offset, 
-                     const uint bucketOffset, const uint32 length, 
+    void SortBucket( const uint64 bucket, const uint bucketOffset, const uint32 length, 
                      uint32* counts, uint32* pfxSum,
-                     uint32* input, YT* tmp,
-                     uint32* sortKey, uint32* sortKeyTmp );
+                     const uint32* input, YT* tmp,
+                     const uint32* sortKey, uint32* sortKeyTmp );
 };
 
 struct NumaSortJob
@@ -149,6 +156,9 @@ void YSorter::DoSort( bool useSortKey, uint64 length,
         
         job.sortKey       = sortKey;
         job.sortKeyTmp    = sortKeyTmp;
+        job.slots         = nullptr;
+        job.slotsPfxSum   = nullptr;
+        job.onBucketDone  = nullptr;
     }
 
     if( useSortKey )
@@ -157,6 +167,86 @@ void YSorter::DoSort( bool useSortKey, uint64 length,
         pool.RunJob( SortYJob::SortYThread<false>, jobs, threadCount );
 }
 
+//-----------------------------------------------------------
+void YSorter::SortBuckets( 
+        uint64 length, const YBucketSlots& slots,
+        uint64* yBuffer, uint64* yTmp,
+        uint32* sortKey, uint32* sortKeyTmp,
+        YBucketDoneFunc onBucketDone, void* onBucketDoneData )
+{
+    ASSERT( length );
+    ASSERT( yBuffer && yTmp && sortKey && sortKeyTmp );
+
+    ThreadPool& pool        = _pool;
+    const uint  threadCount = pool.ThreadCount();
+
+    constexpr uint Radix = 256;
+
+    SortYJob jobs[MAX_THREADS];
+
+    // Each thread publishes its prefix sums through its job, so they must outlive the thread function
+    std::vector<uint32> pfxSums( (size_t)threadCount * Radix );
+
+    std::atomic<uint> finishedCount = 0;
+    std::atomic<uint> releaseLock   = 0;
+
+    for( uint i = 0; i < threadCount; i++ )
+    {
+        SortYJob& job = jobs[i];
+
+        job.jobs          = jobs;
+        job.finishedCount = &finishedCount;
+        job.releaseLock   = &releaseLock;
+        job.counts        = nullptr;
+        job.pfxSum        = nullptr;
+        job.id            = i;
+        job.threadCount   = threadCount;
+        job.length        = length;
+        job.input         = yBuffer;
+        job.tmp           = yTmp;
+        job.sortKey       = sortKey;
+        job.sortKeyTmp    = sortKeyTmp;
+        job.slots         = &slots;
+        job.slotsPfxSum   = pfxSums.data() + (size_t)i * Radix;
+
+        job.onBucketDone     = onBucketDone;
+        job.onBucketDoneData = onBucketDoneData;
+    }
+
+    pool.RunJob( SortYJob::SortBucketsThread, jobs, threadCount );
+}
+
+//-----------------------------------------------------------
+bool YBucketSlots::Init( uint threadCount, uint64 entryCount,
+                         uint32* buffer0, uint64 capacity0,
+                         uint32* buffer1, uint64 capacity1 )
+{
+    ASSERT( threadCount && threadCount <= MAX_THREADS );
+
+    // Split the slots between both buffers proportionally to their capacity
+    const uint64 slotCount = (uint64)threadCount * Buckets;
+    const uint64 slots1    = (uint64)( slotCount * ( capacity1 / (double)( capacity0 + capacity1 ) ) );
+    const uint64 slots0    = slotCount - slots1;
+
+    // Each slot holds both the y values and the sort key
+    uint64 capacity = capacity0 / 2 / slots0;
+    
+    if( slots1 )
+        capacity = std::min( capacity, capacity1 / 2 / slots1 );
+
+    buffers[0]     = buffer0;
+    buffers[1]     = buffer1;
+    slotsInBuffer0 = slots0;
+    slotCapacity   = capacity;
+
+    memset( counts, 0, sizeof( counts ) );
+
+    // Require at least 25% headroom over the expected entries per slot,
+    // otherwise we are likely to overflow and have to fall back.
+    const uint64 expectedPerSlot = CDiv( entryCount, slotCount );
+    return capacity > 0 && capacity >= expectedPerSlot + expectedPerSlot / 4;
+}
+
 //-----------------------------------------------------------
 template<bool HasSortKey>
 void SortYJob::SortYThread( SortYJob* job )
@@ -204,7 +294,7 @@ void SortYJob::SortYThread( SortYJob* job )
     #else
         const uint64  numBlocks = length / 8;
         const uint64* blockEnd  = src + numBlocks * 8;
-        do
+        while( src < blockEnd )
         {
             counts[src[0] >> 32]++;
             counts[src[1] >> 32]++;
@@ -217,7 +307,7 @@ void SortYJob::SortYThread( SortYJob* job )
             counts[src[7] >> 32]++;
             
             src += 8;
-        } while( src < blockEnd );
+        }
         
         while( src < end )
             counts[*src++ >> 32]++;
@@ -283,9 +373,9 @@ void SortYJob::SortYThread( SortYJob* job )
             if( id == threadCount-1 )
                 length += bucketLengths[bucket] - (threadCount * length);
 
-            job->SortBucket<HasSortKey, 0 >( bucket, offset, bucketOffset, length, counts, pfxSum, (uint32*)input, (uint32*)tmp  , sortKey,    sortKeyTmp );
-            job->SortBucket<HasSortKey, 8 >( bucket, offset, bucketOffset, length, counts, pfxSum, (uint32*)tmp  , (uint32*)input, sortKeyTmp, sortKey    );
-            job->SortBucket<HasSortKey, 16>( bucket, offset, bucketOffset, length, counts, pfxSum, (uint32*)input, (uint32*)tmp  , sortKey,    sortKeyTmp );
+            job->SortBucket<HasSortKey, 0 >( bucket, bucketOffset, length, counts, pfxSum, (uint32*)input + offset, (uint32*)tmp  , sortKey    + offset, sortKeyTmp );
+            job->SortBucket<HasSortKey, 8 >( bucket, bucketOffset, length, counts, pfxSum, (uint32*)tmp   + offset, (uint32*)input, sortKeyTmp + offset, sortKey    );
+            job->SortBucket<HasSortKey, 16>( bucket, bucketOffset, length, counts, pfxSum, (uint32*)input + offset, (uint32*)tmp  , sortKey    + offset, sortKeyTmp );
 
             bucketOffset += bucketLengths[bucket];
         }
@@ -305,47 +395,122 @@ void SortYJob::SortYThread( SortYJob* job )
             if( id == threadCount-1 )
                 length += bucketLengths[bucket] - (threadCount * length);
 
-            job->SortBucket<HasSortKey, 24>( ((uint64)bucket) << 32, offset, bucketOffset, length, counts, pfxSum, (uint32*)tmp, input, sortKeyTmp, sortKey );
+            job->SortBucket<HasSortKey, 24>( ((uint64)bucket) << 32, bucketOffset, length, counts, pfxSum, (uint32*)tmp + offset, input, sortKeyTmp + offset, sortKey );
 
             bucketOffset += bucketLengths[bucket];
         }
     }
 }
 
+//-----------------------------------------------------------
+void SortYJob::SortBucketsThread( SortYJob* job )
+{
+    constexpr uint Radix   = 256;
+    constexpr uint Buckets = YBucketSlots::Buckets;
+
+    const uint id          = job->id;
+    const uint threadCount = job->threadCount;
+
+    const YBucketSlots& slots = *job->slots;
+
+    // The temporary buffers are split into 2 planes of 32-bit entries each
+    uint32* yTmp0   = (uint32*)job->tmp;
+    uint32* yTmp1   = yTmp0 + job->length;
+    uint32* keyTmp0 = job->sortKeyTmp;
+    uint32* keyTmp1 = keyTmp0 + job->length;
+
+    uint32 counts[Radix];
+    job->counts = counts;
+
+    // Get lengths for each bucket from what the producers wrote to their slots
+    uint bucketLengths[Buckets];
+    memset( bucketLengths, 0, sizeof( bucketLengths ) );
+
+    for( uint i = 0; i < threadCount; i++ )
+    {
+        for( uint j = 0; j < Buckets; j++ )
+            bucketLengths[j] += slots.counts[i][j];
+    }
+
+    uint32* pfxSum = job->slotsPfxSum;
+    job->pfxSum = pfxSum;
+
+    uint bucketOffset = 0;
+    for( uint bucket = 0; bucket < Buckets; bucket++ )
+    {
+        // The first pass reads directly from the slot our producer thread wrote to.
+        // The thread order is preserved, so the result is the same as a full y sort.
+        job->SortBucket<true, 0>( bucket, bucketOffset, slots.counts[id][bucket], counts, pfxSum, 
+                                  slots.YSlot( id, bucket ), yTmp0, slots.KeySlot( id, bucket ), keyTmp0 );
+
+        uint       length = bucketLengths[bucket] / threadCount;
+        const uint offset = bucketOffset + length * id;
+
+        // Add the remainder if we're the last thread
+        if( id == threadCount-1 )
+            length += bucketLengths[bucket] - (threadCount * length);
+
+        job->SortBucket<true, 8 >( bucket, bucketOffset, length, counts, pfxSum, yTmp0 + offset, yTmp1, keyTmp0 + offset, keyTmp1 );
+        job->SortBucket<true, 16>( bucket, bucketOffset, length, counts, pfxSum, yTmp1 + offset, yTmp0, keyTmp1 + offset, keyTmp0 );
+
+        bucketOffset += bucketLengths[bucket];
+    }
+
+    // Final expansion pass, done last as it may overwrite the slots
+    bucketOffset = 0;
+
+    for( uint bucket = 0; bucket < Buckets; bucket++ )
+    {
+        uint       length = bucketLengths[bucket] / threadCount;
+        const uint offset = bucketOffset + length * id;
+
+        if( id == threadCount-1 )
+            length += bucketLengths[bucket] - (threadCount * length);
+
+        job->SortBucket<true, 24>( ((uint64)bucket) << 32, bucketOffset, length, counts, pfxSum, yTmp0 + offset, job->input, keyTmp0 + offset, job->sortKey );
+
+        // The bucket is final once all threads are past the pass' sync point.
+        // Consumers can start working on it while the next bucket is being expanded.
+        if( job->onBucketDone )
+            job->onBucketDone( job->onBucketDoneData, id, threadCount, bucketOffset, bucketLengths[bucket] );
+
+        bucketOffset += bucketLengths[bucket];
+    }
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wattributes"
 
 //-----------------------------------------------------------
 template<bool HasSortKey, uint shift, typename YT>
-FORCE_INLINE void SortYJob::SortBucket( const uint64 bucket, const uint offset,
-                                        const uint bucketOffset, const uint32 length, 
+FORCE_INLINE void SortYJob::SortBucket( const uint64 bucket, const uint bucketOffset, const uint32 length, 
                                         uint32* counts, uint32* pfxSum,
-                                        uint32* input, YT* tmp,
-                                        uint32* sortKey, uint32* sortKeyTmp )
+                                        const uint32* input, YT* tmp,
+                                        const uint32* sortKey, uint32* sortKeyTmp )
 {
     const uint Radix = 256;
 
-    const uint32* start = input + offset;
+    const uint32* start = input;
     const uint32* end   = start + length;
 
-    uint32* src = (uint32*)start;
-    uint32* keySrc;
+    const uint32* src = start;
+    const uint32* keySrc;
 
     if constexpr ( HasSortKey )
-        keySrc = sortKey + offset;
+        keySrc = sortKey;
     
 
     // Get counts
     memset( counts, 0, sizeof( uint32 ) * Radix );
 
 #if !Y_SORT_BLOCK_MODE
-    do { counts[(*src >> shift) & 0xFF]++; }
-    while( ++src < end );
+    while( src < end )
+        counts[(*src++ >> shift) & 0xFF]++;
 #else
     // Assume block size = 64 bytes
     const uint64  numBlocks = length / 16;
     const uint32* blockEnd  = src + numBlocks * 16;
-    do
+    while( src < blockEnd )
     {
         counts[(src[0] >> shift) & 0xFF]++;
         counts[(src[1] >> shift) & 0xFF]++;
@@ -366,7 +531,7 @@ FORCE_INLINE void SortYJob::SortBucket( const uint64 bucket, const uint offset,
         counts[(src[15] >> shift) & 0xFF]++;
         
         src += 16;
-    } while( src < blockEnd );
+    }
     
     while( src < end )
         counts[(*src++ >> shift) & 0xFF]++;
@@ -376,7 +541,7 @@ FORCE_INLINE void SortYJob::SortBucket( const uint64 bucket, const uint offset,
     CalculatePrefixSum<Radix>( id, counts, pfxSum );
 
     // Store in new location, iterating backwards
-    src = (uint32*)start;
+    src = start;
     YT* dst = tmp + bucketOffset;
     
     uint32* keyDst;
@@ -1,8 +1,51 @@
 #pragma once
+#include "Config.h"
+#include "ChiaConsts.h"
 
 
 class ThreadPool;
 
+///
+/// Describes y values that were already distributed into their top-most
+/// kExtraBits buckets by their producer (see FX_FUSED_BUCKET_MODE).
+/// Each (thread, bucket) pair owns a fixed-capacity slot which holds the
+/// bucket-stripped 32-bit y values followed by their 32-bit sort keys.
+///
+struct YBucketSlots
+{
+    static constexpr uint Buckets = 1u << kExtraBits;
+
+    uint32* buffers[2];                     // Slots are carved out of these buffers, in order
+    uint64  slotsInBuffer0;                 // How many slots live in the first buffer
+    uint64  slotCapacity;                   // Max entries per slot
+    uint32  counts[MAX_THREADS][Buckets];   // Entries written to each slot by its producer
+
+    // Returns false if the buffers can't hold a slot per (thread, bucket) pair
+    // with enough headroom for entryCount uniformly distributed entries.
+    // Capacities are given in 32-bit elements.
+    bool Init( uint threadCount, uint64 entryCount,
+               uint32* buffer0, uint64 capacity0,
+               uint32* buffer1, uint64 capacity1 );
+
+    inline uint32* YSlot( uint thread, uint bucket ) const
+    {
+        const uint64 slot = (uint64)thread * Buckets + bucket;
+        
+        if( slot < slotsInBuffer0 )
+            return buffers[0] + slot * slotCapacity * 2;
+
+        return buffers[1] + ( slot - slotsInBuffer0 ) * slotCapacity * 2;
+    }
+
+    inline uint32* KeySlot( uint thread, uint bucket ) const
+    {
+        return YSlot( thread, bucket ) + slotCapacity;
+    }
+};
+
+// Invoked by every sorting thread once a bucket's sorted y values and sort keys are final.
+// The bucket spans entries [offset, offset+length) of the output buffers.
+typedef void (*YBucketDoneFunc)( void* data, uint threadId, uint threadCount, uint64 offset, uint64 length );
 
 class YSorter
 {
@@ -20,6 +63,19 @@ public:
         uint64* yBuffer, uint64* yTmp,
         uint32* sortKey, uint32* sortKeyTmp );
 
+    // Sorts y values which have already been distributed into buckets on their 
+    // top-most bits, so only the bucket-local passes are performed.
+    // The sorted y values and keys are written to yBuffer and sortKey, which may alias the slot buffers.
+    // yTmp and sortKeyTmp must each have space for length * 2 32-bit entries.
+    // If onBucketDone is given, the sorting threads call it as soon as each bucket is sorted,
+    // while the remaining buckets are still being expanded. The second half of yTmp
+    // (starting at length 32-bit entries) is not used by then and may be written to by it.
+    void SortBuckets( 
+        uint64 length, const YBucketSlots& slots,
+        uint64* yBuffer, uint64* yTmp,
+        uint32* sortKey, uint32* sortKeyTmp,
+        YBucketDoneFunc onBucketDone = nullptr, void* onBucketDoneData = nullptr );
+
 private:
     void DoSort( bool useSortKey, uint64 length, 
                 uint64* yBuffer, uint64* yTmp,
@@ -31,4 +87,3 @@ private:
 
 
 
-
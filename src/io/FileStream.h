@@ -45,8 +45,6 @@ public:
     // Duplicate a file
     // FileStream( const FileStream& src );
 
-    // void WriteAsync( byte* buffer, size_t size );
-
     static bool Open( const char* path, FileStream& file, FileMode mode, FileAccess access, FileFlags flags = FileFlags::None );
     bool Open( const char* path, FileMode mode, FileAccess access, FileFlags flags = FileFlags::None );
 
@@ -59,6 +57,36 @@ public:
 
     bool Flush();
 
+    // Flushes the file's data, and only the metadata needed to read it back
+    bool DataSync();
+
+    bool Truncate( int64 size );
+
+    // Asynchronous writes at explicit offsets, which do not move the write position.
+    // Buffers must not be modified or freed until WaitForAsyncWrites() returns.
+    // They are only queued on Linux, to an io_uring with up to queueDepth writes in flight.
+    // Elsewhere, or if io_uring is not available, they are written synchronously.
+#if PLATFORM_IS_LINUX
+    bool InitAsyncWrites( uint queueDepth );
+
+    // Registers a buffer with the kernel, so that async writes from it
+    // don't need to map its pages each time. Any previous buffer is unregistered.
+    // Must not be called while there are writes in flight.
+    // Writes still work if this fails (ie. for exceeding RLIMIT_MEMLOCK).
+    bool RegisterAsyncBuffer( const void* buffer, size_t size );
+#endif
+
+    // Queues a write. Large writes are split into AsyncWriteChunkSize requests.
+    // Returns false if this or a previously queued write failed.
+    bool WriteAsync( const void* buffer, size_t size, uint64 offset );
+
+    // Waits until all queued writes have completed
+    bool WaitForAsyncWrites();
+
+    inline bool HasAsyncQueue() const { return _asyncQueue != nullptr; }
+
+    static constexpr size_t AsyncWriteChunkSize = 16ull << 20;  // 16MiB
+
     inline size_t BlockSize()
     {
         return _blockSize;
@@ -94,6 +122,8 @@ private:
     int        _error         = 0;
     size_t     _blockSize     = 0;        // for O_DIRECT/FILE_FLAG_NO_BUFFERING
 
+    struct AsyncWriteQueue* _asyncQueue = nullptr;  // io_uring, if async writes are enabled
+
     #if PLATFORM_IS_UNIX
         int    _fd            = -1;
     #elif PLATFORM_IS_WINDOWS
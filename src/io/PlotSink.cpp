@@ -0,0 +1,875 @@
+#include "PlotSink.h"
+#include "SysHost.h"
+#include "Util.h"
+#include "util/Log.h"
+#include "threading/Thread.h"
+
+#include <vector>
+
+#if PLATFORM_IS_UNIX
+    #include <sys/types.h>
+    #include <sys/socket.h>
+    #include <netdb.h>
+    #include <unistd.h>
+    #include <signal.h>
+#endif
+
+enum class PlotRecord : uint32
+{
+    Begin = 0,
+    Reserve,
+    Data,
+    Sidecar,
+    End,
+    Abort
+};
+
+struct PlotStreamRecord
+{
+    uint32 magic;
+    uint32 type;
+    uint64 offset;
+    uint64 size;
+};
+static_assert( sizeof( PlotStreamRecord ) == 24, "Invalid plot stream record size." );
+
+static constexpr uint32 PlotStreamMagic   = 0x53504242;       // "BBPS"
+static constexpr size_t MaxPlotNameSize   = 1024;
+static constexpr size_t MaxSidecarSize    = 1ull << 20;       // 1MiB
+static constexpr size_t ReceiveBufferSize = 16ull << 20;      // 16MiB
+
+// Upper bound of the size of a plot up to k50: (2k+1) bits for each of the 2^k entries,
+// which is more than the ~0.762 * (2k+1) * 2^(k-1) bytes a plot actually takes.
+// Offsets and sizes read from a stream are checked against it before they reach the file system.
+static constexpr uint   MaxPlotK          = 50;
+static constexpr uint64 MaxPlotSize       = ( 2ull * MaxPlotK + 1 ) << ( MaxPlotK - 1 );
+
+#if PLATFORM_IS_UNIX
+    static int     WriteAll( int fd, const void* data, size_t size );
+    static ssize_t ReadAll ( int fd, void* data, size_t size );
+#endif
+
+//-----------------------------------------------------------
+PlotSink::PlotSink()
+{}
+
+//-----------------------------------------------------------
+PlotSink::~PlotSink()
+{
+    Close();
+}
+
+//-----------------------------------------------------------
+PlotSinkType PlotSink::TargetType( const char* target )
+{
+    ASSERT( target );
+
+    if( strcmp( target, "-" ) == 0 )
+        return PlotSinkType::Pipe;
+
+    if( strncmp( target, "tcp://", sizeof( "tcp://" ) - 1 ) == 0 )
+        return PlotSinkType::Socket;
+
+    return PlotSinkType::File;
+}
+
+//-----------------------------------------------------------
+bool PlotSink::OpenFile( const char* path, FileFlags flags )
+{
+    ASSERT( path );
+    ASSERT( !IsOpen() );
+
+    _type     = PlotSinkType::File;
+    _finished = false;
+    _error    = 0;
+
+    if( !_file.Open( path, FileMode::Create, FileAccess::Write, flags ) )
+        return false;
+
+    _path = path;
+    return true;
+}
+
+//-----------------------------------------------------------
+bool PlotSink::OpenPipe( int fd, const char* plotName )
+{
+    ASSERT( plotName );
+    ASSERT( !IsOpen() );
+
+#if PLATFORM_IS_UNIX
+    // A closed pipe is reported by the failed write instead
+    signal( SIGPIPE, SIG_IGN );
+
+    _type     = PlotSinkType::Pipe;
+    _fd       = fd;
+    _ownsFd   = false;
+    _finished = false;
+    _error    = 0;
+
+    const size_t nameSize = strlen( plotName );
+    return SendRecord( (uint32)PlotRecord::Begin, 0, nameSize ) && SendAll( plotName, nameSize );
+#else
+    Log::Error( "Error: Streaming plots is not supported on this platform." );
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------
+bool PlotSink::Connect( const char* address, const char* plotName )
+{
+    ASSERT( address  );
+    ASSERT( plotName );
+    ASSERT( !IsOpen() );
+
+#if PLATFORM_IS_UNIX
+    std::string host = address;
+
+    const size_t colon = host.rfind( ':' );
+    if( colon == std::string::npos )
+    {
+        Log::Error( "Error: Invalid plot receiver address '%s'. Expected host:port.", address );
+        return false;
+    }
+
+    const std::string port = host.substr( colon + 1 );
+    host.resize( colon );
+
+    // IPv6 addresses are given in brackets
+    if( host.size() > 1 && host.front() == '[' && host.back() == ']' )
+        host = host.substr( 1, host.size() - 2 );
+
+    addrinfo hints = {};
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* addresses = nullptr;
+
+    int r = getaddrinfo( host.c_str(), port.c_str(), &hints, &addresses );
+    if( r != 0 )
+    {
+        Log::Error( "Error: Failed to resolve plot receiver address '%s': %s", address, gai_strerror( r ) );
+        return false;
+    }
+
+    int fd = -1;
+
+    for( addrinfo* a = addresses; a; a = a->ai_next )
+    {
+        fd = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+        if( fd < 0 )
+        {
+            _error = errno;
+            continue;
+        }
+
+        if( connect( fd, a->ai_addr, a->ai_addrlen ) == 0 )
+            break;
+
+        _error = errno;
+        close( fd );
+        fd = -1;
+    }
+
+    freeaddrinfo( addresses );
+
+    if( fd < 0 )
+        return false;
+
+    signal( SIGPIPE, SIG_IGN );
+
+    _type     = PlotSinkType::Socket;
+    _fd       = fd;
+    _ownsFd   = true;
+    _finished = false;
+    _error    = 0;
+
+    const size_t nameSize = strlen( plotName );
+    return SendRecord( (uint32)PlotRecord::Begin, 0, nameSize ) && SendAll( plotName, nameSize );
+#else
+    Log::Error( "Error: Streaming plots is not supported on this platform." );
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------
+bool PlotSink::IsOpen() const
+{
+    if( _type == PlotSinkType::File )
+        return _file.IsOpen();
+
+    return _fd >= 0;
+}
+
+//-----------------------------------------------------------
+size_t PlotSink::BlockSize()
+{
+    if( _type == PlotSinkType::File )
+        return _file.BlockSize();
+
+    return StreamBlockSize;
+}
+
+#if PLATFORM_IS_LINUX
+//-----------------------------------------------------------
+bool PlotSink::InitAsyncWrites( uint queueDepth )
+{
+    if( _type == PlotSinkType::File )
+        return _file.InitAsyncWrites( queueDepth );
+
+    return true;
+}
+
+//-----------------------------------------------------------
+bool PlotSink::RegisterAsyncBuffer( const void* buffer, size_t size )
+{
+    if( _type == PlotSinkType::File )
+        return _file.RegisterAsyncBuffer( buffer, size );
+
+    return false;
+}
+
+#endif
+
+//-----------------------------------------------------------
+bool PlotSink::HasAsyncQueue() const
+{
+    if( _type == PlotSinkType::File )
+        return _file.HasAsyncQueue();
+
+    return false;
+}
+
+//-----------------------------------------------------------
+bool PlotSink::WriteAsync( const void* buffer, size_t size, uint64 offset )
+{
+    if( _type == PlotSinkType::File )
+        return _file.WriteAsync( buffer, size, offset );
+
+    return SendRecord( (uint32)PlotRecord::Data, offset, size ) && SendAll( buffer, size );
+}
+
+//-----------------------------------------------------------
+bool PlotSink::WaitForAsyncWrites()
+{
+    if( _type == PlotSinkType::File )
+        return _file.WaitForAsyncWrites();
+
+    return _error == 0;
+}
+
+//-----------------------------------------------------------
+bool PlotSink::Reserve( ssize_t size )
+{
+    if( _type == PlotSinkType::File )
+        return _file.Reserve( size );
+
+    return SendRecord( (uint32)PlotRecord::Reserve, (uint64)size, 0 );
+}
+
+//-----------------------------------------------------------
+void PlotSink::AddSidecar( const char* extension, const void* data, size_t size )
+{
+    ASSERT( extension );
+    ASSERT( data || !size );
+
+    Sidecar sidecar;
+    sidecar.extension = extension;
+    sidecar.data.assign( (const char*)data, size );
+
+    _sidecars.push_back( std::move( sidecar ) );
+}
+
+//-----------------------------------------------------------
+bool PlotSink::Finish( uint64 size )
+{
+    if( _type == PlotSinkType::File )
+    {
+        // Only once the space reserved for the plot has been released
+        if( !_file.Truncate( (int64)size ) || !_file.DataSync() )
+            return false;
+
+        // Named after the final plot file
+        std::string plotPath = _path;
+        if( plotPath.size() > 4 && plotPath.compare( plotPath.size() - 4, 4, ".tmp" ) == 0 )
+            plotPath.resize( plotPath.size() - 4 );
+
+        for( const Sidecar& sidecar : _sidecars )
+        {
+            const std::string path = plotPath + sidecar.extension;
+
+            FILE* f = fopen( path.c_str(), "wb" );
+            if( !f )
+            {
+                _error = errno;
+                return false;
+            }
+
+            const bool written = fwrite( sidecar.data.data(), 1, sidecar.data.size(), f ) == sidecar.data.size();
+
+            if( fclose( f ) != 0 || !written )
+            {
+                _error = errno ? errno : EIO;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+#if PLATFORM_IS_UNIX
+    // The receiver holds on to the sidecars until the plot has been synced
+    for( const Sidecar& sidecar : _sidecars )
+    {
+        const size_t extensionSize = sidecar.extension.size() + 1;
+
+        if( !SendRecord( (uint32)PlotRecord::Sidecar, 0, extensionSize + sidecar.data.size() ) ||
+            !SendAll( sidecar.extension.c_str(), extensionSize ) ||
+            !SendAll( sidecar.data.data(), sidecar.data.size() ) )
+            return false;
+    }
+
+    if( !SendRecord( (uint32)PlotRecord::End, size, 0 ) )
+        return false;
+
+    // There's no going back once the receiver has the whole plot
+    _finished = true;
+
+    // The plot is only durable once the receiver has synced it
+    if( _type == PlotSinkType::Socket )
+    {
+        PlotStreamRecord ack;
+
+        if( ReadAll( _fd, &ack, sizeof( ack ) ) != (ssize_t)sizeof( ack ) ||
+            ack.magic != PlotStreamMagic || ack.type != (uint32)PlotRecord::End )
+        {
+            _error = EIO;
+            return false;
+        }
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------
+void PlotSink::Close()
+{
+    if( _type == PlotSinkType::File )
+    {
+        _file.Close();
+        return;
+    }
+
+#if PLATFORM_IS_UNIX
+    if( _fd < 0 )
+        return;
+
+    // Let the receiver discard what it got
+    if( !_finished )
+        SendRecord( (uint32)PlotRecord::Abort, 0, 0 );
+
+    if( _ownsFd )
+        close( _fd );
+
+    _fd = -1;
+#endif
+}
+
+//-----------------------------------------------------------
+int PlotSink::GetError()
+{
+    int err = _error;
+    _error = 0;
+
+    if( !err && _type == PlotSinkType::File )
+        err = _file.GetError();
+
+    return err;
+}
+
+//-----------------------------------------------------------
+bool PlotSink::SendRecord( uint32 type, uint64 offset, uint64 size )
+{
+    PlotStreamRecord record;
+    record.magic  = PlotStreamMagic;
+    record.type   = type;
+    record.offset = offset;
+    record.size   = size;
+
+    return SendAll( &record, sizeof( record ) );
+}
+
+//-----------------------------------------------------------
+bool PlotSink::SendAll( const void* data, size_t size )
+{
+#if PLATFORM_IS_UNIX
+    if( _error || _fd < 0 )
+        return false;
+
+    _error = WriteAll( _fd, data, size );
+    return _error == 0;
+#else
+    return false;
+#endif
+}
+
+
+///
+/// Receiver
+///
+#if PLATFORM_IS_UNIX
+
+struct ReceiveJob
+{
+    int                fd;
+    const std::string* directory;
+    Thread*            thread;
+};
+
+static void DiscardPlotFile( FileStream*& file, const std::string& tmpPath );
+
+#endif
+
+//-----------------------------------------------------------
+bool PlotStreamReceiver::Run( const char* source, const char* directory )
+{
+    ASSERT( source );
+
+#if PLATFORM_IS_UNIX
+    std::string dir = directory ? directory : "";
+
+    if( !dir.empty() && dir.back() != '/' )
+        dir += '/';
+
+    if( strcmp( source, "-" ) == 0 )
+        return ReceiveStream( STDIN_FILENO, false, dir );
+
+    addrinfo hints = {};
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+
+    addrinfo* addresses = nullptr;
+
+    int r = getaddrinfo( nullptr, source, &hints, &addresses );
+    if( r != 0 )
+    {
+        Log::Error( "Error: Invalid port '%s': %s", source, gai_strerror( r ) );
+        return false;
+    }
+
+    int listener = -1;
+    int err      = 0;
+
+    for( addrinfo* a = addresses; a; a = a->ai_next )
+    {
+        listener = socket( a->ai_family, a->ai_socktype, a->ai_protocol );
+        if( listener < 0 )
+        {
+            err = errno;
+            continue;
+        }
+
+        const int reuse = 1;
+        setsockopt( listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+
+        if( bind( listener, a->ai_addr, a->ai_addrlen ) == 0 && listen( listener, 16 ) == 0 )
+            break;
+
+        err = errno;
+        close( listener );
+        listener = -1;
+    }
+
+    freeaddrinfo( addresses );
+
+    if( listener < 0 )
+    {
+        Log::Error( "Error: Failed to listen on port %s with error: %d.", source, err );
+        return false;
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+
+    Log::Line( "Receiving plots on port %s into %s", source, dir.empty() ? "the current directory" : dir.c_str() );
+
+    // Each plotter connection is received on its own thread
+    std::vector<ReceiveJob*> jobs;
+
+    for( ;; )
+    {
+        const int fd = accept( listener, nullptr, nullptr );
+
+        if( fd < 0 )
+        {
+            if( errno == EINTR || errno == ECONNABORTED )
+                continue;
+
+            Log::Error( "Error: Failed to accept plot stream with error: %d.", errno );
+            break;
+        }
+
+        // Reap the threads of the streams that have finished
+        for( size_t i = 0; i < jobs.size(); )
+        {
+            if( jobs[i]->thread->HasExited() )
+            {
+                jobs[i]->thread->WaitForExit();
+                delete jobs[i]->thread;
+                delete jobs[i];
+
+                jobs[i] = jobs.back();
+                jobs.pop_back();
+            }
+            else
+                i++;
+        }
+
+        ReceiveJob* job = new ReceiveJob();
+        job->fd        = fd;
+        job->directory = &dir;
+        job->thread    = new Thread();
+        jobs.push_back( job );
+
+        job->thread->Run( ReceiveThread, job );
+    }
+
+    for( ReceiveJob* job : jobs )
+    {
+        job->thread->WaitForExit();
+        delete job->thread;
+        delete job;
+    }
+
+    close( listener );
+    return false;
+#else
+    Log::Error( "Error: Receiving plot streams is not supported on this platform." );
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------
+bool PlotStreamReceiver::ReceiveStream( int fd, bool acknowledge, const std::string& directory )
+{
+#if PLATFORM_IS_UNIX
+    byte* buffer = (byte*)SysHost::VirtualAlloc( ReceiveBufferSize );
+    if( !buffer )
+        Fatal( "Failed to allocate buffer for receiving plots." );
+
+    FileStream* file = nullptr;
+    std::string plotName;
+    std::string tmpPath;
+    bool        ok   = true;
+
+    // Sidecar files are written once their plot is
+    std::vector<std::pair<std::string, std::string>> sidecars;
+
+    auto timer = TimerBegin();
+
+    for( ;; )
+    {
+        PlotStreamRecord record;
+        const ssize_t r = ReadAll( fd, &record, sizeof( record ) );
+
+        // A stream may only end between plots
+        if( r == 0 && !file )
+            break;
+
+        if( r != (ssize_t)sizeof( record ) || record.magic != PlotStreamMagic )
+        {
+            Log::Error( "Error: Plot stream was interrupted or is invalid." );
+            ok = false;
+            break;
+        }
+
+        const PlotRecord type = (PlotRecord)record.type;
+
+        if( ( type == PlotRecord::Begin ) == ( file != nullptr ) )
+        {
+            Log::Error( "Error: Unexpected record in plot stream." );
+            ok = false;
+            break;
+        }
+
+        switch( type )
+        {
+            case PlotRecord::Begin:
+            {
+                if( record.size == 0 || record.size > MaxPlotNameSize ||
+                    ReadAll( fd, buffer, record.size ) != (ssize_t)record.size )
+                {
+                    ok = false;
+                    break;
+                }
+
+                plotName.assign( (const char*)buffer, record.size );
+
+                // Plots may only be written to our directory
+                if( plotName.find_first_of( std::string( "/\\\0", 3 ) ) != std::string::npos ||
+                    plotName == "." || plotName == ".." )
+                {
+                    Log::Error( "Error: Invalid plot name in plot stream." );
+                    ok = false;
+                    break;
+                }
+
+                tmpPath = directory + plotName + ".tmp";
+
+                file = new FileStream();
+                if( !file->Open( tmpPath.c_str(), FileMode::Create, FileAccess::Write, FileFlags::LargeFile ) )
+                {
+                    Log::Error( "Error: Failed to open plot file %s for writing with error: %d.", tmpPath.c_str(), file->GetError() );
+                    delete file;
+                    file = nullptr;
+                    ok   = false;
+                    break;
+                }
+
+                Log::Line( "Receiving plot %s", plotName.c_str() );
+                timer = TimerBegin();
+            }
+            break;
+
+            case PlotRecord::Reserve:
+                if( record.offset > MaxPlotSize )
+                {
+                    Log::Error( "Error: Invalid plot size of %llu bytes in plot stream.", record.offset );
+                    ok = false;
+                    break;
+                }
+
+                // Only a hint
+                if( !file->Reserve( (ssize_t)record.offset ) )
+                    file->GetError();
+            break;
+
+            case PlotRecord::Data:
+            {
+                if( record.offset > MaxPlotSize || record.size > MaxPlotSize - record.offset )
+                {
+                    Log::Error( "Error: Invalid data record in plot stream." );
+                    ok = false;
+                    break;
+                }
+
+                for( uint64 received = 0; received < record.size; )
+                {
+                    const size_t size = (size_t)std::min( record.size - received, (uint64)ReceiveBufferSize );
+
+                    if( ReadAll( fd, buffer, size ) != (ssize_t)size )
+                    {
+                        Log::Error( "Error: Plot stream was interrupted." );
+                        ok = false;
+                        break;
+                    }
+
+                    if( !file->WriteAsync( buffer, size, record.offset + received ) )
+                    {
+                        Log::Error( "Error: Failed to write to plot file %s with error: %d.", tmpPath.c_str(), file->GetError() );
+                        ok = false;
+                        break;
+                    }
+
+                    received += size;
+                }
+            }
+            break;
+
+            case PlotRecord::Sidecar:
+            {
+                if( record.size > MaxSidecarSize || ReadAll( fd, buffer, record.size ) != (ssize_t)record.size )
+                {
+                    ok = false;
+                    break;
+                }
+
+                // Extension, then contents
+                const char*  extension     = (const char*)buffer;
+                const size_t extensionSize = strnlen( extension, record.size );
+
+                if( extensionSize == record.size || memchr( extension, '/', extensionSize ) )
+                {
+                    Log::Error( "Error: Invalid sidecar file in plot stream." );
+                    ok = false;
+                    break;
+                }
+
+                sidecars.emplace_back( std::string( extension, extensionSize ),
+                                       std::string( extension + extensionSize + 1, record.size - extensionSize - 1 ) );
+            }
+            break;
+
+            case PlotRecord::End:
+            {
+                if( record.offset > MaxPlotSize )
+                {
+                    Log::Error( "Error: Invalid plot size of %llu bytes in plot stream.", record.offset );
+                    ok = false;
+                    break;
+                }
+
+                const std::string plotPath = directory + plotName;
+
+                bool finished = file->WaitForAsyncWrites() &&
+                                file->Truncate( (int64)record.offset ) &&
+                                file->DataSync();
+
+                if( !finished )
+                    Log::Error( "Error: Failed to finish plot file %s with error: %d.", tmpPath.c_str(), file->GetError() );
+
+                file->Close();
+                delete file;
+                file = nullptr;
+
+                if( finished && rename( tmpPath.c_str(), plotPath.c_str() ) != 0 )
+                {
+                    Log::Error( "Error: Failed to rename plot file %s with error: %d.", tmpPath.c_str(), errno );
+                    finished = false;
+                }
+
+                for( size_t i = 0; finished && i < sidecars.size(); i++ )
+                {
+                    const std::string  path = plotPath + sidecars[i].first;
+                    const std::string& data = sidecars[i].second;
+
+                    FILE* f = fopen( path.c_str(), "wb" );
+
+                    bool written = f && fwrite( data.data(), 1, data.size(), f ) == data.size();
+                    if( f && fclose( f ) != 0 )
+                        written = false;
+
+                    if( !written )
+                        Log::Error( "Error: Failed to write %s.", path.c_str() );
+                }
+
+                sidecars.clear();
+
+                if( finished )
+                {
+                    const double elapsed = TimerEnd( timer );
+                    Log::Line( "Received plot %s (%.2lf GiB) in %.2lf seconds.",
+                               plotPath.c_str(), (double)record.offset / ( 1ull << 30 ), elapsed );
+                }
+                else
+                    remove( tmpPath.c_str() );
+
+                if( acknowledge )
+                {
+                    PlotStreamRecord ack;
+                    ack.magic  = PlotStreamMagic;
+                    ack.type   = (uint32)( finished ? PlotRecord::End : PlotRecord::Abort );
+                    ack.offset = record.offset;
+                    ack.size   = 0;
+
+                    if( WriteAll( fd, &ack, sizeof( ack ) ) != 0 )
+                        ok = false;
+                }
+            }
+            break;
+
+            case PlotRecord::Abort:
+                Log::Line( "Plot %s was aborted by the plotter.", plotName.c_str() );
+                DiscardPlotFile( file, tmpPath );
+                sidecars.clear();
+            break;
+
+            default:
+                Log::Error( "Error: Unknown record in plot stream." );
+                ok = false;
+            break;
+        }
+
+        if( !ok )
+            break;
+    }
+
+    if( file )
+    {
+        Log::Error( "Error: Discarding incomplete plot %s.", plotName.c_str() );
+        DiscardPlotFile( file, tmpPath );
+    }
+
+    SysHost::VirtualFree( buffer );
+    return ok;
+#else
+    return false;
+#endif
+}
+
+#if PLATFORM_IS_UNIX
+
+//-----------------------------------------------------------
+void PlotStreamReceiver::ReceiveThread( void* data )
+{
+    ReceiveJob* job = (ReceiveJob*)data;
+
+    ReceiveStream( job->fd, true, *job->directory );
+    close( job->fd );
+}
+
+//-----------------------------------------------------------
+void DiscardPlotFile( FileStream*& file, const std::string& tmpPath )
+{
+    file->Close();
+    delete file;
+    file = nullptr;
+
+    remove( tmpPath.c_str() );
+}
+
+//-----------------------------------------------------------
+int WriteAll( int fd, const void* data, size_t size )
+{
+    const byte* writer = (const byte*)data;
+
+    while( size )
+    {
+        const ssize_t r = write( fd, writer, size );
+
+        if( r < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+
+            return errno;
+        }
+
+        writer += r;
+        size   -= (size_t)r;
+    }
+
+    return 0;
+}
+
+//-----------------------------------------------------------
+ssize_t ReadAll( int fd, void* data, size_t size )
+{
+    byte*  reader = (byte*)data;
+    size_t total  = 0;
+
+    while( total < size )
+    {
+        const ssize_t r = read( fd, reader + total, size - total );
+
+        if( r < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+
+            return -1;
+        }
+
+        // End of stream
+        if( r == 0 )
+            break;
+
+        total += (size_t)r;
+    }
+
+    return (ssize_t)total;
+}
+
+#endif
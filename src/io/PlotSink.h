@@ -0,0 +1,129 @@
+#pragma once
+#include "io/FileStream.h"
+#include <string>
+#include <vector>
+
+enum class PlotSinkType : uint32
+{
+    File = 0,   // A plot file in a local directory
+    Pipe,       // A plot stream to stdout
+    Socket      // A plot stream to a receiver over TCP
+};
+
+/**
+ * Where DiskPlotWriter writes a plot to.
+ *
+ * Files are written with positioned writes. The header is written last, once the table pointers are known,
+ * or first, if the writer was given the tables' sizes up front.
+ * Streams can't seek, so the same writes are sent as records,
+ * which PlotStreamReceiver writes to its own file at their offset.
+ *
+ * Stream format (little-endian):
+ * [Record]
+ *   - magic "BBPS"                  : 4 bytes
+ *   - record type                   : 4 bytes
+ *   - offset                        : 8 bytes
+ *   - data size                     : 8 bytes
+ *   - data                          : * bytes
+ *
+ * Records of a plot:
+ *   - Begin   : data is the final name of the plot file
+ *   - Reserve : offset is the expected size of the plot file
+ *   - Data    : data is written at offset. The plot header is at offset 0, first or last.
+ *   - Sidecar : data is an extension, a null terminator, then the contents of a file
+ *               written next to the plot once it's finished (ie. its checksum manifest)
+ *   - End     : offset is the final size of the plot file
+ *   - Abort   : The plot failed, and is discarded by the receiver
+ *
+ * A pipe may carry any number of plots, one after another. A socket carries one.
+ * Over a socket, the receiver acknowledges End with an End record once the plot
+ * is synced and renamed, or with an Abort record if that failed.
+ */
+class PlotSink
+{
+public:
+    PlotSink();
+    ~PlotSink();
+
+    static PlotSinkType TargetType( const char* target );
+
+    // path is the temporary plot file, whose .tmp suffix is removed once finished
+    bool OpenFile( const char* path, FileFlags flags );
+
+    // Streams plotName to a pipe we don't own, such as stdout
+    bool OpenPipe( int fd, const char* plotName );
+
+    // Streams plotName to a receiver at address, given as host:port
+    bool Connect( const char* address, const char* plotName );
+
+    inline PlotSinkType Type()     const { return _type; }
+    inline bool         IsStream() const { return _type != PlotSinkType::File; }
+
+    bool IsOpen() const;
+
+    size_t BlockSize();
+
+    // See FileStream. Streams write synchronously, in the order they are given.
+#if PLATFORM_IS_LINUX
+    bool InitAsyncWrites( uint queueDepth );
+    bool RegisterAsyncBuffer( const void* buffer, size_t size );
+#endif
+    bool HasAsyncQueue() const;
+    bool WriteAsync( const void* buffer, size_t size, uint64 offset );
+    bool WaitForAsyncWrites();
+
+    // Hint of the final size of the plot
+    bool Reserve( ssize_t size );
+
+    // Adds a small file to write next to the plot once it's finished,
+    // named after the plot with extension appended.
+    void AddSidecar( const char* extension, const void* data, size_t size );
+
+    // Makes the plot durable at its final size, then writes its sidecar files.
+    // A file is truncated to size and synced. The receiver of a stream does the same,
+    // and renames it to its final name.
+    bool Finish( uint64 size );
+
+    // Streams that were not finished abort the plot
+    void Close();
+
+    int GetError();
+
+    // Streams are block-aligned like files, so that the plot is laid out the same
+    static constexpr size_t StreamBlockSize = 4096;
+
+private:
+    bool SendRecord( uint32 type, uint64 offset, uint64 size );
+    bool SendAll( const void* data, size_t size );
+
+    struct Sidecar
+    {
+        std::string extension;
+        std::string data;
+    };
+
+private:
+    PlotSinkType _type     = PlotSinkType::File;
+    FileStream   _file;
+    std::string  _path;                 // File sinks only
+    int          _fd       = -1;        // Stream sinks only
+    bool         _ownsFd   = false;
+    bool         _finished = false;
+    int          _error    = 0;
+    std::vector<Sidecar> _sidecars;
+};
+
+/**
+ * Receives plot streams sent by PlotSink, and writes them to plot files in a directory.
+ */
+class PlotStreamReceiver
+{
+public:
+    // source is "-" for stdin, or a TCP port to listen on, which is served until the process exits.
+    // Returns false if receiving stopped on an error.
+    static bool Run( const char* source, const char* directory );
+
+private:
+    static bool ReceiveStream( int fd, bool acknowledge, const std::string& directory );
+    static void ReceiveThread( void* data );
+};
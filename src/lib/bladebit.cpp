@@ -0,0 +1,276 @@
+#include "bladebit.h"
+#include "PlotId.h"
+#include "memplot/MemPlotter.h"
+#include "io/PlotSink.h"
+#include "threading/Thread.h"
+#include "SysHost.h"
+#include "Util.h"
+#include "util/Log.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct bb_plotter
+{
+    struct Request
+    {
+        byte        plotId[32];
+        byte        memo[48+48+32];
+        uint16      memoSize;
+        char        fileName[PLOT_FILE_FMT_LEN];
+        std::string outDir;             // Empty to let the plotter pick one
+        void*       userData;
+    };
+
+    MemPlotter*              plotter      = nullptr;
+    bb_plot_callback         callback     = nullptr;
+    void*                    callbackData = nullptr;
+
+    // The plotter keeps pointers to these
+    std::vector<std::string> outDirs;
+    std::vector<const char*> outDirPtrs;
+    std::string              stagingDir;
+    std::string              writeStatsPath;
+
+    std::mutex               lock;
+    std::condition_variable  signal;    // Signalled when plots are queued or reported, and on exit
+    std::deque<Request*>     queue;
+    uint64                   pending      = 0;      // Plots submitted that have not been reported yet
+    bool                     exit         = false;
+
+    Thread                   thread;
+};
+
+static void PlotterThread( void* data );
+static void OnPlotFinished( const PlotResult& result, void* data );
+static void ReportPlot( bb_plotter& p, bb_plotter::Request* req, const bb_plot_result& result );
+
+//-----------------------------------------------------------
+bb_plotter* bb_plotter_create( const bb_plotter_config* config, bb_plot_callback callback, void* callbackData )
+{
+    if( !config || !config->out_dirs || config->out_dir_count < 1 )
+        return nullptr;
+
+    bb_plotter* p = new bb_plotter();
+    p->callback     = callback;
+    p->callbackData = callbackData;
+
+    for( uint32_t i = 0; i < config->out_dir_count; i++ )
+    {
+        if( !config->out_dirs[i] )
+        {
+            delete p;
+            return nullptr;
+        }
+
+        p->outDirs.push_back( config->out_dirs[i] );
+
+        // Keep stdout for plots that are streamed to it
+        if( PlotSink::TargetType( config->out_dirs[i] ) == PlotSinkType::Pipe )
+            Log::SetOutStream( stderr );
+    }
+
+    for( const std::string& dir : p->outDirs )
+        p->outDirPtrs.push_back( dir.c_str() );
+
+    if( config->staging_dir )
+        p->stagingDir = config->staging_dir;
+
+    if( config->write_stats_path )
+        p->writeStatsPath = config->write_stats_path;
+
+    const uint threadCount = SysHost::GetLogicalCPUCount();
+
+    MemPlotConfig plotCfg;
+    ZeroMem( &plotCfg );
+    plotCfg.threadCount        = config->thread_count ? std::min( (uint)config->thread_count, threadCount ) : threadCount;
+    plotCfg.warmStart          = config->warm_start != 0;
+    plotCfg.noNUMA             = config->no_numa != 0;
+    plotCfg.noCPUAffinity      = config->no_cpu_affinity != 0;
+    plotCfg.outDirs            = p->outDirPtrs.data();
+    plotCfg.outDirCount        = (uint)p->outDirPtrs.size();
+    plotCfg.stagingSize        = (size_t)config->staging_size;
+    plotCfg.stagingDir         = config->staging_dir      ? p->stagingDir.c_str()     : nullptr;
+    plotCfg.checksumThreads    = config->checksum_threads;
+    plotCfg.writeStatsPath     = config->write_stats_path ? p->writeStatsPath.c_str() : nullptr;
+    plotCfg.pressureCeiling    = config->pressure_ceiling;
+    plotCfg.pressureMinThreads = std::max( (uint)config->pressure_min_threads, 1u );
+    plotCfg.onPlotFinished     = OnPlotFinished;
+    plotCfg.onPlotFinishedData = p;
+
+    p->plotter = new MemPlotter( plotCfg );
+    p->thread.Run( PlotterThread, p );
+
+    return p;
+}
+
+//-----------------------------------------------------------
+bb_status bb_plotter_submit( bb_plotter* p, const bb_plot_request* request )
+{
+    if( !p || !request || !request->farmer_public_key ||
+        ( !request->pool_public_key && !request->pool_contract_puzzle_hash ) )
+        return BB_ERROR_INVALID_ARGUMENT;
+
+    bb_plotter::Request* req = new bb_plotter::Request();
+
+    // A pool public key takes precedence over a pool contract, as with the bladebit command
+    const uint8_t* puzzleHash = request->pool_public_key ? nullptr : request->pool_contract_puzzle_hash;
+
+    if( !GeneratePlotIdAndMemo( request->farmer_public_key, request->pool_public_key, puzzleHash,
+                                req->plotId, req->memo, req->memoSize ) )
+    {
+        delete req;
+        return BB_ERROR_INVALID_ARGUMENT;
+    }
+
+    if( request->out_dir )
+        req->outDir = request->out_dir;
+
+    req->userData = request->user_data;
+
+    {
+        std::lock_guard<std::mutex> lock( p->lock );
+
+        if( p->exit )
+        {
+            delete req;
+            return BB_ERROR_CLOSED;
+        }
+
+        p->queue.push_back( req );
+        p->pending++;
+    }
+
+    p->signal.notify_all();
+    return BB_OK;
+}
+
+//-----------------------------------------------------------
+void bb_plotter_wait( bb_plotter* p )
+{
+    if( !p )
+        return;
+
+    std::unique_lock<std::mutex> lock( p->lock );
+    p->signal.wait( lock, [p]() { return p->pending == 0; } );
+}
+
+//-----------------------------------------------------------
+void bb_plotter_destroy( bb_plotter* p )
+{
+    if( !p )
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock( p->lock );
+        p->exit = true;
+    }
+
+    // The thread exits once it has plotted everything queued
+    p->signal.notify_all();
+    p->thread.WaitForExit();
+
+    delete p->plotter;
+    delete p;
+}
+
+//-----------------------------------------------------------
+void PlotterThread( void* data )
+{
+    bb_plotter& p = *(bb_plotter*)data;
+
+    for( ;; )
+    {
+        bb_plotter::Request* req;
+
+        {
+            std::unique_lock<std::mutex> lock( p.lock );
+            p.signal.wait( lock, [&p]() { return p.exit || !p.queue.empty(); } );
+
+            if( p.queue.empty() )
+                return;
+
+            req = p.queue.front();
+            p.queue.pop_front();
+        }
+
+        GetPlotFileName( req->plotId, req->fileName );
+        Log::Line( "Generating plot %s", req->fileName );
+
+        // Plots are not final, so that the next plot overlaps with this one's write
+        PlotRequest request;
+        ZeroMem( &request );
+        request.plotId       = req->plotId;
+        request.plotFileName = req->fileName;
+        request.memo         = req->memo;
+        request.memoSize     = req->memoSize;
+        request.IsFinalPlot  = false;
+        request.outDir       = req->outDir.empty() ? nullptr : req->outDir.c_str();
+        request.userData     = req;
+
+        if( !p.plotter->Run( request ) )
+        {
+            bb_plot_result result;
+            ZeroMem( &result );
+            result.status = BB_ERROR_OUTPUT;
+
+            ReportPlot( p, req, result );
+        }
+
+        // Nothing else to plot yet: Finish writing this plot, instead of keeping it until the next one
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock( p.lock );
+            idle = p.queue.empty();
+        }
+
+        if( idle )
+            p.plotter->Flush();
+    }
+}
+
+//-----------------------------------------------------------
+void OnPlotFinished( const PlotResult& plotResult, void* data )
+{
+    const PlotWriteStats& stats = *plotResult.writeStats;
+
+    bb_plot_result result;
+    ZeroMem( &result );
+    result.status             = BB_OK;
+    result.plot_path          = plotResult.plotPath;
+    result.plot_seconds       = plotResult.plotSeconds;
+    result.write_seconds      = stats.elapsed;
+    result.write_wait_seconds = stats.stageSeconds + stats.bufferWaitSeconds + stats.finishWaitSeconds;
+    result.plot_size          = plotResult.plotSize;
+
+    for( uint i = 0; i < 4; i++ )
+        result.phase_seconds[i] = plotResult.phaseSeconds[i];
+
+    ReportPlot( *(bb_plotter*)data, (bb_plotter::Request*)plotResult.userData, result );
+}
+
+//-----------------------------------------------------------
+void ReportPlot( bb_plotter& p, bb_plotter::Request* req, const bb_plot_result& result )
+{
+    ASSERT( req );
+
+    bb_plot_result r = result;
+    memcpy( r.plot_id, req->plotId, sizeof( r.plot_id ) );
+    r.user_data = req->userData;
+
+    if( p.callback )
+        p.callback( &r, p.callbackData );
+
+    delete req;
+
+    {
+        std::lock_guard<std::mutex> lock( p.lock );
+        p.pending--;
+    }
+
+    p.signal.notify_all();
+}
@@ -0,0 +1,98 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * libbladebit: Plots from within another process.
+ *
+ * A plotter allocates its buffers once, when it's created, and plots the requests submitted to it
+ * one after another on its own thread, overlapping each plot's write with the next plot,
+ * as the bladebit command does when it makes several plots.
+ * The result of each plot is given to a callback once it has been written.
+ *
+ * Errors that the bladebit command treats as fatal, such as failing to allocate the plotter's
+ * buffers or to write a plot, still end the process.
+ */
+
+#if defined( _WIN32 ) && defined( BB_SHARED_LIB )
+    #if defined( BB_EXPORTS )
+        #define BB_API __declspec( dllexport )
+    #else
+        #define BB_API __declspec( dllimport )
+    #endif
+#else
+    #define BB_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct bb_plotter bb_plotter;
+
+typedef enum bb_status
+{
+    BB_OK = 0,
+    BB_ERROR_INVALID_ARGUMENT,      // A required field is missing, or a key is not valid
+    BB_ERROR_OUTPUT,                // The plot could not be opened in any of the output directories
+    BB_ERROR_CLOSED                 // The plotter is being destroyed
+} bb_status;
+
+// The same options as the bladebit command's. Zero-initialize it, then set what's needed.
+typedef struct bb_plotter_config
+{
+    uint32_t           thread_count;        // 0 for all the system's threads
+    int                warm_start;
+    int                no_numa;
+    int                no_cpu_affinity;
+    const char* const* out_dirs;            // Directories to write plots to, or stream targets. At least one.
+    uint32_t           out_dir_count;
+    uint64_t           staging_size;        // In bytes
+    const char*        staging_dir;
+    uint32_t           checksum_threads;
+    const char*        write_stats_path;
+    uint32_t           pressure_ceiling;
+    uint32_t           pressure_min_threads;
+} bb_plotter_config;
+
+typedef struct bb_plot_request
+{
+    const uint8_t* farmer_public_key;           // 48 bytes
+    const uint8_t* pool_public_key;             // 48 bytes. Either this or a pool contract puzzle hash.
+    const uint8_t* pool_contract_puzzle_hash;   // 32 bytes
+    const char*    out_dir;                     // One of the plotter's out_dirs, or NULL to let the plotter pick one
+    void*          user_data;                   // Given back with the result
+} bb_plot_request;
+
+typedef struct bb_plot_result
+{
+    bb_status   status;
+    const char* plot_path;              // Final path of the plot, or where it was streamed to
+    uint8_t     plot_id[32];
+    double      phase_seconds[4];
+    double      plot_seconds;           // Phases 1 to 4
+    double      write_seconds;          // From the plot starting to be written until it was finished
+    double      write_wait_seconds;     // Time that plotting waited on the plot's write
+    uint64_t    plot_size;
+    void*       user_data;
+} bb_plot_result;
+
+// Called on the plotter's thread. result is only valid during the call.
+// It must not call bb_plotter_wait or bb_plotter_destroy.
+typedef void (*bb_plot_callback)( const bb_plot_result* result, void* callback_data );
+
+// Allocates a plotter's buffers and starts its thread. Returns NULL if the config is not valid.
+BB_API bb_plotter* bb_plotter_create( const bb_plotter_config* config, bb_plot_callback callback, void* callback_data );
+
+// Queues a plot. Requests are copied, so they may be freed once this returns.
+BB_API bb_status bb_plotter_submit( bb_plotter* plotter, const bb_plot_request* request );
+
+// Blocks until all the plots submitted so far have been written
+BB_API void bb_plotter_wait( bb_plotter* plotter );
+
+// Finishes the plots submitted, then frees the plotter
+BB_API void bb_plotter_destroy( bb_plotter* plotter );
+
+#ifdef __cplusplus
+}
+#endif
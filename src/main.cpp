@@ -2,12 +2,15 @@
 #include <cstdlib>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "Version.h"
 #include "Util.h"
 #include "util/Log.h"
 #include "SysHost.h"
 #include "memplot/MemPlotter.h"
+#include "io/PlotSink.h"
+#include "PlotId.h"
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wreturn-type"
@@ -29,9 +32,6 @@ extern "C" {
 #pragma GCC diagnostic pop
 #pragma warning( pop )
 
-#define PLOT_FILE_PREFIX_LEN (sizeof("plot-k32-2021-08-05-18-55-")-1)
-#define PLOT_FILE_FMT_LEN (sizeof( "/plot-k32-2021-08-05-18-55-77a011fc20f0003c3adcc739b615041ae56351a22b690fd854ccb6726e5f43b7.plot.tmp" ))
-
 /// Internal Data Structures
 struct Config
 {
@@ -45,7 +45,15 @@ struct Config
     bls::G1Element* poolPublicKey      = nullptr;
     
     ByteSpan*       contractPuzzleHash = nullptr;
-    const char*     outputFolder       = nullptr;
+    std::vector<const char*> outputFolders;
+
+    size_t          stagingSize        = 0;
+    const char*     stagingDir         = nullptr;
+    uint            checksumThreads    = 0;
+    const char*     writeStatsPath     = nullptr;
+    uint            pressureCeiling    = 0;
+    uint            pressureMinThreads = 1;
+    const char*     receiveSource      = nullptr;
 
     int             maxFailCount       = 100;
 
@@ -60,11 +68,6 @@ bool            HexPKeyToG1Element( const char* hexKey, bls::G1Element& pkey );
 
 ByteSpan        DecodePuzzleHash( const char* poolContractAddress );
 void            GeneratePlotIdAndMemo( Config& cfg, byte plotId[32], byte plotMemo[48+48+32], uint16& outMemoSize );
-bls::PrivateKey MasterSkToLocalSK( bls::PrivateKey& sk );
-bls::G1Element  GeneratePlotPublicKey( const bls::G1Element& localPk, bls::G1Element& farmerPk, const bool includeTaproot );
-
-std::vector<uint8_t> BytesConcat( std::vector<uint8_t> a, std::vector<uint8_t> b, std::vector<uint8_t> c );
-
 void PrintSysInfo();
 void GetPlotIdBytes( const std::string& plotId, byte outBytes[32] );
 void PrintUsage();
@@ -78,10 +81,16 @@ void PrintUsage();
 #endif
 
 //-----------------------------------------------------------
-const char* USAGE = "bladebit [<OPTIONS>] [<out_dir>]\n"
+const char* USAGE = "bladebit [<OPTIONS>] [<out_dir> ...]\n"
 R"(
 <out_dir>: Output directory in which to output the plots.
            This directory must exist.
+           If more than one is specified, each plot is written to the
+           directory with room for it that has received the fewest plots.
+           Each directory is written to by its own thread.
+           Instead of a directory, plots may be streamed to:
+             -               : stdout. The log is written to stderr instead.
+             tcp://host:port : A plot receiver (see --receive).
 
 OPTIONS:
 
@@ -105,6 +114,40 @@ OPTIONS:
 
  -w, --warm-start     : Touch all pages of buffer allocations before starting to plot.
 
+ --staging            : Size in GiB of a staging buffer for plot writes.
+                        If the previous plot is still being written to disk when the
+                        next plot needs its buffers, the tables not yet written are
+                        copied here instead of waiting for the disk. Off by default.
+
+ --staging-dir        : Put the staging buffer in a temporary file in this directory,
+                        ideally on a fast local drive, instead of in RAM.
+                        Requires --staging.
+
+ --checksum           : Number of threads with which to compute the BLAKE3 hash
+                        of each plot while it is written, so that it doesn't have
+                        to be read back to be checked. The hash and the table
+                        pointers are written to a <plot>.b3.json file next to it.
+                        Off by default.
+
+ --write-stats        : Append how each plot was written to this file, as a line
+                        of JSON: per-table write times and rates, time spent
+                        waiting on the writer, and the writer's queue depth.
+
+ --pressure-ceiling   : Co-location mode, for machines that also run a harvester.
+                        Plot as fast as possible while keeping the share of time
+                        that tasks are stalled on memory or CPU, as reported by
+                        Linux in /proc/pressure, under this percentage. Above it,
+                        jobs are paced right away, and fewer threads are used
+                        from the next table on. Off by default.
+
+ --min-threads        : Never use fewer threads than this in co-location mode.
+                        Default: 1.
+
+ --receive            : Receive plot streams on this TCP port, or from stdin if '-',
+                        and write them to <out_dir>, then exit. No other options are needed.
+                        Plots are written to a .tmp file, which is synced
+                        and renamed once the whole plot has been received.
+
  -i, --plot-id        : Specify a plot id for debugging.
 
  --memo               : Specify a plot memo for debugging.
@@ -141,19 +184,7 @@ int main( int argc, const char* argv[] )
     Config cfg;
     ParseCommandLine( argc-1, argv+1, cfg );
 
-    // Create the plot output path
-    size_t outputFolderLen = strlen( cfg.outputFolder );
-    
-    char* plotOutPath = new char[outputFolderLen + PLOT_FILE_FMT_LEN];
-
-    if( outputFolderLen )
-    {
-        memcpy( plotOutPath, cfg.outputFolder, outputFolderLen );
-
-        // Add a trailing slash, if we need one.
-        if( plotOutPath[outputFolderLen-1] != '/' )
-            plotOutPath[outputFolderLen++] = '/';
-    }
+    char plotFileName[PLOT_FILE_FMT_LEN];
 
     // Begin plotting
     PlotRequest req;
@@ -161,10 +192,20 @@ int main( int argc, const char* argv[] )
 
     // #TODO: Don't let this config to permanently remain on the stack
     MemPlotConfig plotCfg;
-    plotCfg.threadCount   = cfg.threads;
-    plotCfg.noNUMA        = cfg.disableNuma;
-    plotCfg.noCPUAffinity = cfg.disableCpuAffinity;
-    plotCfg.warmStart     = cfg.warmStart;
+    plotCfg.threadCount        = cfg.threads;
+    plotCfg.noNUMA             = cfg.disableNuma;
+    plotCfg.noCPUAffinity      = cfg.disableCpuAffinity;
+    plotCfg.warmStart          = cfg.warmStart;
+    plotCfg.outDirs            = cfg.outputFolders.data();
+    plotCfg.outDirCount        = (uint)cfg.outputFolders.size();
+    plotCfg.stagingSize        = cfg.stagingSize;
+    plotCfg.stagingDir         = cfg.stagingDir;
+    plotCfg.checksumThreads    = cfg.checksumThreads;
+    plotCfg.writeStatsPath     = cfg.writeStatsPath;
+    plotCfg.pressureCeiling    = cfg.pressureCeiling;
+    plotCfg.pressureMinThreads = cfg.pressureMinThreads;
+    plotCfg.onPlotFinished     = nullptr;
+    plotCfg.onPlotFinishedData = nullptr;
 
     MemPlotter plotter( plotCfg );
 
@@ -198,18 +239,8 @@ int main( int argc, const char* argv[] )
             plotIdStr[64] = 0;
         }
 
-        // Set the output path
-        {
-            time_t     now = time( nullptr  );
-            struct tm* t   = localtime( &now ); ASSERT( t );
-            
-            const size_t r = strftime( plotOutPath + outputFolderLen, PLOT_FILE_FMT_LEN, "plot-k32-%Y-%m-%d-%H-%M-", t );
-            if( r != PLOT_FILE_PREFIX_LEN )
-                Fatal( "Failed to generate plot file." );
-
-            memcpy( plotOutPath + outputFolderLen + PLOT_FILE_PREFIX_LEN     , plotIdStr, 64 );
-            memcpy( plotOutPath + outputFolderLen + PLOT_FILE_PREFIX_LEN + 64, ".plot.tmp", sizeof( ".plot.tmp" ) );
-        }
+        // Set the output file name. The plotter picks the directory.
+        GetPlotFileName( plotId, plotFileName );
 
         Log::Line( "Generating plot %d / %d: %s", i+1, cfg.plotCount, plotIdStr );
         if( cfg.showMemo )
@@ -225,11 +256,11 @@ int main( int argc, const char* argv[] )
         Log::Line( "" );
 
         // Prepare the request
-        req.outPath     = plotOutPath;
-        req.plotId      = plotId;
-        req.memo        = memo;
-        req.memoSize    = memoSize;
-        req.IsFinalPlot = i+1 == cfg.plotCount;
+        req.plotFileName = plotFileName;
+        req.plotId       = plotId;
+        req.memo         = memo;
+        req.memoSize     = memoSize;
+        req.IsFinalPlot  = i+1 == cfg.plotCount;
 
         // Plot it
         if( !plotter.Run( req ) )
@@ -330,6 +361,37 @@ void ParseCommandLine( int argc, const char* argv[], Config& cfg )
         {
             cfg.warmStart = true;
         }
+        else if( check( "--staging" ) )
+        {
+            cfg.stagingSize = (size_t)uvalue() GB;
+        }
+        else if( check( "--staging-dir" ) )
+        {
+            cfg.stagingDir = value();
+        }
+        else if( check( "--checksum" ) )
+        {
+            cfg.checksumThreads = uvalue();
+        }
+        else if( check( "--write-stats" ) )
+        {
+            cfg.writeStatsPath = value();
+        }
+        else if( check( "--pressure-ceiling" ) )
+        {
+            cfg.pressureCeiling = uvalue();
+
+            if( cfg.pressureCeiling > 100 )
+                Fatal( "The pressure ceiling must be a percentage between 1 and 100." );
+        }
+        else if( check( "--min-threads" ) )
+        {
+            cfg.pressureMinThreads = uvalue();
+        }
+        else if( check( "--receive" ) )
+        {
+            cfg.receiveSource = value();
+        }
         else if( check( "-i" ) || check( "--plot-id" ) )
         {
             cfg.plotId = value();
@@ -408,17 +470,38 @@ void ParseCommandLine( int argc, const char* argv[], Config& cfg )
         }
         else
         {
-            if( i+1 < argc )
+            // The remaining arguments are output directories
+            for( ; i < argc; i++ )
             {
-                Fatal( "Unexpected argument '%s'.", arg );
-                exit( 1 );
-            }
+                arg = argv[i];
+
+                // A lone '-' is stdout
+                if( arg[0] == '-' && arg[1] != 0 )
+                {
+                    Fatal( "Unexpected argument '%s'.", arg );
+                    exit( 1 );
+                }
 
-            cfg.outputFolder = arg;
+                cfg.outputFolders.push_back( arg );
+            }
         }
     }
     #undef check
 
+    // Receive plots from other plotters instead
+    if( cfg.receiveSource )
+    {
+        const char* outDir = cfg.outputFolders.empty() ? "" : cfg.outputFolders[0];
+        exit( PlotStreamReceiver::Run( cfg.receiveSource, outDir ) ? 0 : 1 );
+    }
+
+    // Keep stdout for plots that are streamed to it
+    for( const char* outputFolder : cfg.outputFolders )
+    {
+        if( PlotSink::TargetType( outputFolder ) == PlotSinkType::Pipe )
+            Log::SetOutStream( stderr );
+    }
+
 
     if( farmerPublicKey )
     {
@@ -471,22 +554,40 @@ void ParseCommandLine( int argc, const char* argv[], Config& cfg )
     if( cfg.plotCount < 1 )
         cfg.plotCount = 1;
 
-    if( cfg.outputFolder == nullptr )
+    if( cfg.outputFolders.empty() )
     {
         Log::Line( "Warning: No output folder specified. Using current directory." );
-        cfg.outputFolder = "";
+        cfg.outputFolders.push_back( "" );
     }
 
     Log::Line( "Creating %d plots:", cfg.plotCount );
     
-    if( cfg.outputFolder )
-        Log::Line( " Output path           : %s", cfg.outputFolder );
-    else
-        Log::Line( " Output path           : Current directory." );
+    for( const char* outputFolder : cfg.outputFolders )
+    {
+        if( *outputFolder )
+            Log::Line( " Output path           : %s", outputFolder );
+        else
+            Log::Line( " Output path           : Current directory." );
+    }
 
     Log::Line( " Thread count          : %d", cfg.threads );
     Log::Line( " Warm start enabled    : %s", cfg.warmStart ? "true" : "false" );
 
+    if( cfg.stagingDir && !cfg.stagingSize )
+        Fatal( "A staging size must be specified with --staging-dir." );
+
+    if( cfg.stagingSize )
+        Log::Line( " Staging               : %llu GiB in %s", cfg.stagingSize BtoGB, cfg.stagingDir ? cfg.stagingDir : "RAM" );
+
+    if( cfg.checksumThreads )
+        Log::Line( " Checksum threads      : %u", cfg.checksumThreads );
+
+    if( cfg.writeStatsPath )
+        Log::Line( " Write stats file      : %s", cfg.writeStatsPath );
+
+    if( cfg.pressureCeiling )
+        Log::Line( " Pressure ceiling      : %u%%, down to %u threads", cfg.pressureCeiling, cfg.pressureMinThreads );
+
 
     Log::Line( " Farmer public key     : %s", farmerPublicKey );
 
@@ -501,117 +602,22 @@ void ParseCommandLine( int argc, const char* argv[], Config& cfg )
 //-----------------------------------------------------------
 void GeneratePlotIdAndMemo( Config& cfg, byte plotId[32], byte plotMemo[48+48+32], uint16& outMemoSize )
 {
-    bls::G1Element& farmerPK = cfg.farmerPublicKey;
-    bls::G1Element* poolPK   = cfg.poolPublicKey;
-
-    // Generate random master secret key
-    byte seed[32];
-    SysHost::Random( seed, sizeof( seed ) );
-
-    bls::PrivateKey sk      = bls::AugSchemeMPL().KeyGen( bls::Bytes( seed, sizeof( seed ) ) );
-    bls::G1Element  localPk = std::move( MasterSkToLocalSK( sk ) ).GetG1Element();
-
-    // #See: chia-blockchain create_plots.py
-    //       The plot public key is the combination of the harvester and farmer keys
-    //       New plots will also include a taproot of the keys, for extensibility
-    const bool includeTaproot = cfg.contractPuzzleHash != nullptr;
-    
-    bls::G1Element plotPublicKey = std::move( GeneratePlotPublicKey( localPk, farmerPK, includeTaproot ) );
-    
-    std::vector<uint8_t> farmerPkBytes = farmerPK.Serialize();
-    std::vector<uint8_t> localSkBytes  = sk.Serialize();
+    const std::vector<uint8_t> farmerPkBytes = cfg.farmerPublicKey.Serialize();
+    std::vector<uint8_t>       poolPkBytes;
 
-    // The plot id is based on the harvester, farmer, and pool keys
-    if( !includeTaproot )
-    {
-        std::vector<uint8_t> bytes = poolPK->Serialize();
-        
-        // Gen plot id
-        auto plotPkBytes = plotPublicKey.Serialize();
-        bytes.insert( bytes.end(), plotPkBytes.begin(), plotPkBytes.end() );
-
-        bls::Util::Hash256( plotId, bytes.data(), bytes.size() );
-
-        // Gen memo
-        auto memoBytes = BytesConcat( poolPK->Serialize(), farmerPkBytes, localSkBytes );
-
-        const size_t poolMemoSize = 48 + 48 + 32;
-        ASSERT( memoBytes.size() == poolMemoSize );
-
-        memcpy( plotMemo, memoBytes.data(), poolMemoSize );
-        outMemoSize = (uint16)poolMemoSize;
-    }
+    if( cfg.poolPublicKey )
+        poolPkBytes = cfg.poolPublicKey->Serialize();
     else
     {
-        // Create a pool plot with a contract puzzle hash
         ASSERT( cfg.contractPuzzleHash );
-
-        const auto& ph = *cfg.contractPuzzleHash;
-        std::vector<uint8_t> phBytes( (uint8_t*)ph.values, (uint8_t*)ph.values + ph.length );
-        
-        // Gen plot id
-        std::vector<uint8_t> plotIdBytes = phBytes;
-        auto plotPkBytes = plotPublicKey.Serialize();
-
-        plotIdBytes.insert( plotIdBytes.end(), plotPkBytes.begin(), plotPkBytes.end() );
-        bls::Util::Hash256( plotId, plotIdBytes.data(), plotIdBytes.size() );
-
-        // Gen memo
-        auto memoBytes = BytesConcat( phBytes, farmerPkBytes, localSkBytes );
-
-        const size_t phMemoSize = 32 + 48 + 32;
-        ASSERT( memoBytes.size() == phMemoSize );
-
-        memcpy( plotMemo, memoBytes.data(), phMemoSize );
-        outMemoSize = (uint16)phMemoSize;
+        ASSERT( cfg.contractPuzzleHash->length == 32 );
     }
-}
-
-//-----------------------------------------------------------
-bls::PrivateKey MasterSkToLocalSK( bls::PrivateKey& sk )
-{
-    // #SEE: chia-blockchain: derive-keys.py
-    // EIP 2334 bls key derivation
-    // https://eips.ethereum.org/EIPS/eip-2334
-    // 12381 = bls spec number
-    // 8444  = Chia blockchain number and port number
-    // 0, 1, 2, 3, 4, 5, 6 farmer, pool, wallet, local, backup key, singleton, pooling authentication key numbers
-
-    const uint32 blsSpecNum         = 12381;
-    const uint32 chiaBlockchainPort = 8444; 
-    const uint32 localIdx           = 3;
-
-    bls::PrivateKey ssk = bls::AugSchemeMPL().DeriveChildSk( sk, blsSpecNum );
-    ssk = bls::AugSchemeMPL().DeriveChildSk( ssk, chiaBlockchainPort );
-    ssk = bls::AugSchemeMPL().DeriveChildSk( ssk, localIdx );
-    ssk = bls::AugSchemeMPL().DeriveChildSk( ssk, 0        );
-
-    return ssk;
-}
-
-//-----------------------------------------------------------
-bls::G1Element GeneratePlotPublicKey( const bls::G1Element& localPk, bls::G1Element& farmerPk, const bool includeTaproot )
-{
-    bls::G1Element plotPublicKey;
-
-    if( includeTaproot )
-    {
-        std::vector<uint8_t> taprootMsg = (localPk + farmerPk).Serialize();
-        taprootMsg = BytesConcat( taprootMsg, localPk.Serialize(), farmerPk.Serialize() );
-        
-        byte tapRootHash[32];
-        bls::Util::Hash256( tapRootHash, taprootMsg.data(), taprootMsg.size() );
 
-        bls::PrivateKey taprootSk = bls::AugSchemeMPL().KeyGen( bls::Bytes( tapRootHash, sizeof( tapRootHash ) ) );
-        
-        plotPublicKey = localPk + farmerPk + taprootSk.GetG1Element();
-    }
-    else
-    {
-        plotPublicKey = localPk + farmerPk;
-    }
+    const byte* poolPk     = cfg.poolPublicKey ? poolPkBytes.data() : nullptr;
+    const byte* puzzleHash = cfg.poolPublicKey ? nullptr : cfg.contractPuzzleHash->values;
 
-    return plotPublicKey;
+    if( !GeneratePlotIdAndMemo( farmerPkBytes.data(), poolPk, puzzleHash, plotId, plotMemo, outMemoSize ) )
+        Fatal( "Failed to generate a plot id from the given keys." );
 }
 
 //-----------------------------------------------------------
@@ -717,14 +723,6 @@ void GetPlotIdBytes( const std::string& plotId, byte outBytes[32] )
 }
 
 
-//-----------------------------------------------------------
-inline std::vector<uint8_t> BytesConcat( std::vector<uint8_t> a, std::vector<uint8_t> b, std::vector<uint8_t> c )
-{
-    a.insert( a.end(), b.begin(), b.end() );
-    a.insert( a.end(), c.begin(), c.end() );
-    return a;
-}
-
 //-----------------------------------------------------------
 void PrintUsage()
 {
@@ -5,6 +5,36 @@
 #include "threading/ThreadPool.h"
 #include "ChiaConsts.h"
 #include "PlotContext.h"
+#include "MemPhase1.h"
+#include "util/Log.h"
+
+// Blocked gather settings. Each thread partitions blocks of sort keys by the source region
+// they point to before gathering them, so that consecutive reads stay within the same region.
+// A region spans MAP_FX_TLB_REACH bytes of the source buffer being read, so that the page table
+// entries for its pages stay cached while it's gathered from, instead of every read walking them.
+// The default is the reach of a typical 1536-entry L2 TLB with 4KiB pages.
+#define MAP_FX_TLB_REACH           ( 1536ull * 4096 )
+
+// Blocks are sized to give each region at least this many keys, so that partitioning pays off.
+// They're bound by the scratch space, which is at least MAP_FX_BLOCK_SIZE keys per thread.
+// If the scratch space can't hold enough keys, regions are made larger instead.
+#define MAP_FX_KEYS_PER_REGION     256
+#define MAP_FX_BLOCK_SIZE          ( 1ull << 20 )
+#define MAP_FX_MAX_REGIONS         ( MAP_FX_BLOCK_SIZE / MAP_FX_KEYS_PER_REGION * 16 )
+
+// Bytes of scratch space per key of a block: Its key and its destination
+#define MAP_FX_SCRATCH_PER_KEY     ( sizeof( uint32 ) * 2 )
+
+// Minimum scratch space required by the blocked gather per thread, in bytes.
+// It holds a block and the region counts.
+#define MAP_FX_SCRATCH_PER_THREAD  ( MAP_FX_BLOCK_SIZE * MAP_FX_SCRATCH_PER_KEY + MAP_FX_MAX_REGIONS * sizeof( uint32 ) )
+
+enum class MapFxGather : byte
+{
+    Unknown = 0,    // Not measured yet: Sample both and pick the fastest one
+    Direct,         // Gather straight from the sort key
+    Blocked         // Partition the sort keys by source region first
+};
 
 template<typename TMeta>
 struct MapFxJob
@@ -16,6 +46,12 @@ struct MapFxJob
     TMeta*        metaDst;
     const Pair*   pairSrc;
     Pair*         pairDst;
+    
+    // Blocked gather only
+    uint32*       scratch;
+    uint64        blockSize;
+    uint32        regionShift;
+    uint32        regionCount;
 };
 
 struct GenSortKeyJob
@@ -30,6 +66,10 @@ void GenSortKey( ThreadPool& pool, uint64 length, uint32* keyBuffer );
 
 template<typename TMeta>
 void MapFxThread( MapFxJob<TMeta>* job );
+
+template<typename TMeta>
+void MapFxBlockedThread( MapFxJob<TMeta>* job );
+
 void GenSortKeyThread( GenSortKeyJob* job );
 
 //-----------------------------------------------------------
@@ -49,35 +89,145 @@ inline void SortFx(
 
 //-----------------------------------------------------------
 template<typename TMeta, size_t MAX_JOBS>
-inline void MapFxWithSortKey(
-    ThreadPool&   pool,    uint64  length,  
+inline void MapFxRange(
+    ThreadPool&   pool,    uint64  offset, uint64 length,
     const uint32* sortKey,
     const TMeta*  metaSrc, TMeta*  metaDst,
-    const Pair*   pairSrc, Pair*   pairDst )
+    const Pair*   pairSrc, Pair*   pairDst,
+    const uint64  srcLength, MapFxGather gather, uint32* scratch, size_t scratchSize )
 {
-    // Sort metadata and pairs on y via the sort key
     const uint32 threadCount      = pool.ThreadCount();
     const uint64 entriesPerThread = length / threadCount;
     const uint64 trailingEntries  = length - ( entriesPerThread * threadCount );
 
+    // Blocked gather: Size the regions to the TLB's reach over the largest source entries that are read
+    // (metadata and pairs are gathered one after the other), then size the blocks to give each region
+    // enough keys, making the regions larger if the blocks can't get that large.
+    const size_t scratchPerThread = scratchSize / threadCount / 64 * 64;
+
+    uint64 blockSize   = 0;
+    uint32 regionShift = 0;
+    uint64 regionCount = 0;
+
+    if( gather == MapFxGather::Blocked )
+    {
+        ASSERT( scratchPerThread >= MAP_FX_SCRATCH_PER_THREAD - 64 );
+
+        const size_t metaSize     = metaSrc ? sizeof( TMeta ) : 1;
+        const size_t pairSize     = pairSrc ? sizeof( Pair  ) : 1;
+        const size_t entrySize    = std::max( metaSize, pairSize );
+        const uint64 maxBlockSize = ( scratchPerThread - MAP_FX_MAX_REGIONS * sizeof( uint32 ) ) / MAP_FX_SCRATCH_PER_KEY;
+
+        while( ( (uint64)entrySize << ( regionShift + 1 ) ) <= MAP_FX_TLB_REACH )
+            regionShift++;
+
+        regionCount = ( ( srcLength - 1 ) >> regionShift ) + 1;
+
+        while( regionCount > MAP_FX_MAX_REGIONS || regionCount * MAP_FX_KEYS_PER_REGION > maxBlockSize )
+        {
+            regionShift++;
+            regionCount = ( ( srcLength - 1 ) >> regionShift ) + 1;
+        }
+
+        blockSize = std::max( regionCount * MAP_FX_KEYS_PER_REGION, std::min( MAP_FX_BLOCK_SIZE, maxBlockSize ) );
+    }
+
     MapFxJob<TMeta> jobs[MAX_JOBS];
 
     for( uint32 i = 0; i < threadCount; i++ )
     {
         auto& job = jobs[i];
 
-        job.offset  = i * entriesPerThread;
-        job.length  = entriesPerThread;
-        job.sortKey = sortKey;
-        job.metaSrc = metaSrc;
-        job.metaDst = metaDst;
-        job.pairSrc = pairSrc;
-        job.pairDst = pairDst;
+        job.offset      = offset + i * entriesPerThread;
+        job.length      = entriesPerThread;
+        job.sortKey     = sortKey;
+        job.metaSrc     = metaSrc;
+        job.metaDst     = metaDst;
+        job.pairSrc     = pairSrc;
+        job.pairDst     = pairDst;
+        job.scratch     = scratch + i * ( scratchPerThread / sizeof( uint32 ) );
+        job.blockSize   = blockSize;
+        job.regionShift = regionShift;
+        job.regionCount = (uint32)regionCount;
     }
 
     jobs[threadCount-1].length += trailingEntries;
 
-    pool.RunJob( MapFxThread<TMeta>, jobs, threadCount );
+    if( gather == MapFxGather::Blocked )
+        pool.RunJob( MapFxBlockedThread<TMeta>, jobs, threadCount );
+    else
+        pool.RunJob( MapFxThread<TMeta>, jobs, threadCount );
+}
+
+// If metaSrc or pairSrc are null, the metadata or the pairs are not mapped, respectively.
+// If scratch is large enough, the gather method given by gather is used.
+// If it is Unknown, both methods are timed on a slice of the entries,
+// and gather is set to the fastest one.
+//-----------------------------------------------------------
+template<typename TMeta, size_t MAX_JOBS>
+inline void MapFxWithSortKey(
+    ThreadPool&   pool,    uint64  length,  
+    const uint32* sortKey,
+    const TMeta*  metaSrc, TMeta*  metaDst,
+    const Pair*   pairSrc, Pair*   pairDst,
+    MapFxGather&  gather,  uint32* scratch, size_t scratchSize )
+{
+    // Sort metadata and pairs on y via the sort key
+    const uint32 threadCount = pool.ThreadCount();
+
+    MapFxGather method = gather;
+
+    if( scratchSize < threadCount * MAP_FX_SCRATCH_PER_THREAD )
+        method = MapFxGather::Direct;
+
+    uint64 offset = 0;
+
+    if( method == MapFxGather::Unknown )
+    {
+        const uint64 sampleLength = threadCount * MAP_FX_BLOCK_SIZE * 4;
+
+        // Not enough entries to get a meaningful sample
+        if( length < sampleLength * 4 )
+            method = MapFxGather::Direct;
+        else
+        {
+            auto timer = TimerBegin();
+            MapFxRange<TMeta, MAX_JOBS>( pool, offset, sampleLength, sortKey, 
+                metaSrc, metaDst, pairSrc, pairDst, length, MapFxGather::Direct, scratch, scratchSize );
+            const double directElapsed = TimerEnd( timer );
+            offset += sampleLength;
+            
+            timer = TimerBegin();
+            MapFxRange<TMeta, MAX_JOBS>( pool, offset, sampleLength, sortKey, 
+                metaSrc, metaDst, pairSrc, pairDst, length, MapFxGather::Blocked, scratch, scratchSize );
+            const double blockedElapsed = TimerEnd( timer );
+            offset += sampleLength;
+
+            method = blockedElapsed < directElapsed ? MapFxGather::Blocked : MapFxGather::Direct;
+            gather = method;
+
+            Log::Line( "  Sort key gather sample: direct %.3lfs, blocked %.3lfs. Using %s gather.",
+                directElapsed, blockedElapsed, method == MapFxGather::Blocked ? "blocked" : "direct" );
+        }
+    }
+
+    MapFxRange<TMeta, MAX_JOBS>( pool, offset, length - offset, sortKey,
+        metaSrc, metaDst, pairSrc, pairDst, length, method, scratch, scratchSize );
+}
+
+//-----------------------------------------------------------
+template<typename TMeta>
+inline void MapMetaEntry( const TMeta* src, TMeta* dst, const uint64 srcIdx, const uint64 dstIdx )
+{
+    if constexpr ( MetaLayout<TMeta>::Planar )
+    {
+        using Layout = MetaLayout<TMeta>;
+
+        Layout::Plane0( dst )[dstIdx] = Layout::Plane0( src )[srcIdx];
+        Layout::Plane1( dst )[dstIdx] = Layout::Plane1( src )[srcIdx];
+    }
+    else
+        dst[dstIdx] = src[srcIdx];
 }
 
 //-----------------------------------------------------------
@@ -89,19 +239,91 @@ void MapFxThread( MapFxJob<TMeta>* job )
 
     const uint32* sortKey = job->sortKey + offset;
 
-    // Map metadata
+    // Map metadata, unless it is being left unsorted
     const TMeta* metaSrc  = job->metaSrc;
-    TMeta*       metaDst  = job->metaDst + offset;
+    TMeta*       metaDst  = job->metaDst;
 
-    for( uint64 i = 0; i < length; i++ )
-        metaDst[i] = metaSrc[sortKey[i]];
+    if( metaSrc )
+    {
+        for( uint64 i = 0; i < length; i++ )
+            MapMetaEntry( metaSrc, metaDst, sortKey[i], offset + i );
+    }
 
-    // Map pairs
+    // Map pairs, unless they were already mapped
     const Pair*  pairSrc  = job->pairSrc;
     Pair*        pairDst  = job->pairDst + offset;
 
-    for( uint64 i = 0; i < length; i++ )
-        pairDst[i] = pairSrc[sortKey[i]];
+    if( pairSrc )
+    {
+        for( uint64 i = 0; i < length; i++ )
+            pairDst[i] = pairSrc[sortKey[i]];
+    }
+}
+
+// Gathers a block of entries at a time. The block's keys are first partitioned
+// by the source region they point to, so that the gathers walk the source buffers
+// one region at a time, while the writes stay within the block's destination range.
+//-----------------------------------------------------------
+template<typename TMeta>
+void MapFxBlockedThread( MapFxJob<TMeta>* job )
+{
+    const uint64 length      = job->length;
+    const uint64 offset      = job->offset;
+    const uint64 blockSize   = job->blockSize;
+    const uint32 regionShift = job->regionShift;
+    const uint32 regionCount = job->regionCount;
+
+    const TMeta* metaSrc     = job->metaSrc;
+    TMeta*       metaDst     = job->metaDst;
+    const Pair*  pairSrc     = job->pairSrc;
+    Pair*        pairDst     = job->pairDst;
+
+    uint32* blockKeys = job->scratch;
+    uint32* blockDst  = blockKeys + blockSize;
+    uint32* counts    = blockDst  + blockSize;
+
+    for( uint64 blockStart = 0; blockStart < length; blockStart += blockSize )
+    {
+        const uint64  blockLength = std::min( blockSize, length - blockStart );
+        const uint64  dstOffset   = offset + blockStart;
+        const uint32* sortKey     = job->sortKey + dstOffset;
+
+        // Partition the keys by region
+        memset( counts, 0, regionCount * sizeof( uint32 ) );
+
+        for( uint64 i = 0; i < blockLength; i++ )
+            counts[sortKey[i] >> regionShift]++;
+
+        uint32 sum = 0;
+        for( uint32 r = 0; r < regionCount; r++ )
+        {
+            const uint32 count = counts[r];
+            counts[r] = sum;
+            sum += count;
+        }
+
+        for( uint64 i = 0; i < blockLength; i++ )
+        {
+            const uint32 key = sortKey[i];
+            const uint32 idx = counts[key >> regionShift]++;
+
+            blockKeys[idx] = key;
+            blockDst [idx] = (uint32)( dstOffset + i );
+        }
+
+        // Gather in region order
+        if( metaSrc )
+        {
+            for( uint64 i = 0; i < blockLength; i++ )
+                MapMetaEntry( metaSrc, metaDst, blockKeys[i], blockDst[i] );
+        }
+
+        if( pairSrc )
+        {
+            for( uint64 i = 0; i < blockLength; i++ )
+                pairDst[blockDst[i]] = pairSrc[blockKeys[i]];
+        }
+    }
 }
 
 
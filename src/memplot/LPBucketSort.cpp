@@ -0,0 +1,387 @@
+#include "LPBucketSort.h"
+#include "ParkWriter.h"
+#include "threading/ThreadPool.h"
+#include "Util.h"
+#include <mutex>
+#include <thread>
+
+// Line points are first distributed on their top LP_FINE_BITS bits.
+// Consecutive fine bins are then grouped into buckets of about LP_BUCKET_TARGET entries.
+#define LP_FINE_BITS     16
+#define LP_FINE_BINS     ( 1u << LP_FINE_BITS )
+#define LP_FINE_SHIFT    ( _K * 2 - 1 - LP_FINE_BITS )  // Line points are always < 2^(2k-1)
+#define LP_BUCKET_TARGET ( 1ull << 18 )                 // Small enough to be sorted in cache
+#define LP_PARK_CHUNK    16                             // Parks claimed by a thread at a time
+
+struct LPBucketSortState
+{
+    uint64   length;
+    uint64*  linePoints;
+    uint64*  lpTmp;
+    uint32*  map;
+    uint32*  mapTmp;
+
+    byte*    parkBuffer;
+    size_t   parkSize;
+    TableId  tableId;
+
+    uint64*  binStarts;         // Where each fine bin starts in the distributed buffers (LP_FINE_BINS+1 entries)
+    uint32*  bucketBins;        // First fine bin of each bucket (bucketCount+1 entries)
+    byte*    bucketSorted;      // Set once a bucket's entries are final
+    uint32   bucketCount;
+
+    std::atomic<uint32> nextBucket;
+
+    std::mutex          prefixLock;
+    uint32              prefixBucket;   // First bucket which has not been sorted yet
+
+    uint64              parkCount;
+    std::atomic<uint64> parksReady;     // Parks whose line points are all final
+    std::atomic<uint64> parksClaimed;   // Parks which are being written or have been written
+    std::atomic<uint64> parksReported;  // Parks handed over to onParksWritten
+
+    LPParksWrittenFunc  onParksWritten;
+    void*               onParksWrittenData;
+};
+
+struct LPBucketJob
+{
+    uint64             offset;
+    uint64             length;
+    uint64*            binCounts;   // This thread's count (and then offset) for each fine bin
+    LPBucketSortState* state;
+};
+
+void CountLPBinsThread( LPBucketJob* job );
+void DistributeLPBinsThread( LPBucketJob* job );
+void SortLPBucketsThread( LPBucketJob* job );
+
+//-----------------------------------------------------------
+size_t LPBucketSortScratchSize( uint threadCount )
+{
+    return sizeof( uint64 ) * LP_FINE_BINS * threadCount    // Bin counts
+         + sizeof( uint64 ) * ( LP_FINE_BINS + 1 )          // Bin starts
+         + sizeof( uint32 ) * ( LP_FINE_BINS + 1 )          // Bucket bins
+         + LP_FINE_BINS;                                    // Bucket sorted flags
+}
+
+//-----------------------------------------------------------
+size_t SortLinePointsAndWriteParks( ThreadPool& pool, const uint64 length,
+                                    uint64* linePoints, uint64* lpTmp,
+                                    uint32* map, uint32* mapTmp,
+                                    byte* parkBuffer, TableId tableId,
+                                    void* scratch,
+                                    LPParksWrittenFunc onParksWritten, void* onParksWrittenData )
+{
+    if( length == 0 )
+        return 0;
+
+    const uint   threadCount      = pool.ThreadCount();
+    const uint64 entriesPerThread = length / threadCount;
+
+    LPBucketSortState state;
+    state.length       = length;
+    state.linePoints   = linePoints;
+    state.lpTmp        = lpTmp;
+    state.map          = map;
+    state.mapTmp       = mapTmp;
+    state.parkBuffer   = parkBuffer;
+    state.parkSize     = CalculateParkSize( tableId );
+    state.tableId      = tableId;
+
+    state.onParksWritten     = onParksWritten;
+    state.onParksWrittenData = onParksWrittenData;
+
+    uint64* binCounts  = (uint64*)scratch;
+    state.binStarts    = binCounts + (size_t)LP_FINE_BINS * threadCount;
+    state.bucketBins   = (uint32*)( state.binStarts + LP_FINE_BINS + 1 );
+    state.bucketSorted = (byte*)( state.bucketBins + LP_FINE_BINS + 1 );
+
+    LPBucketJob jobs[MAX_THREADS];
+
+    for( uint i = 0; i < threadCount; i++ )
+    {
+        auto& job = jobs[i];
+
+        job.offset    = i * entriesPerThread;
+        job.length    = entriesPerThread;
+        job.binCounts = binCounts + (size_t)i * LP_FINE_BINS;
+        job.state     = &state;
+    }
+
+    jobs[threadCount-1].length += length - entriesPerThread * threadCount;
+
+    pool.RunJob( CountLPBinsThread, jobs, threadCount );
+
+    // Turn the counts into offsets, ordered by bin first, then by thread,
+    // and group the bins into buckets.
+    uint64 totalEntries = 0;
+    uint64 bucketSize   = 0;
+    uint32 bucketCount  = 0;
+
+    for( uint32 bin = 0; bin < LP_FINE_BINS; bin++ )
+    {
+        if( bin == 0 || bucketSize >= LP_BUCKET_TARGET )
+        {
+            state.bucketBins[bucketCount++] = bin;
+            bucketSize = 0;
+        }
+
+        state.binStarts[bin] = totalEntries;
+
+        for( uint i = 0; i < threadCount; i++ )
+        {
+            const uint64 count = jobs[i].binCounts[bin];
+            jobs[i].binCounts[bin] = totalEntries;
+
+            totalEntries += count;
+            bucketSize   += count;
+        }
+    }
+
+    ASSERT( totalEntries == length );
+    state.binStarts[LP_FINE_BINS]  = totalEntries;
+    state.bucketBins[bucketCount]  = LP_FINE_BINS;
+    state.bucketCount              = bucketCount;
+
+    pool.RunJob( DistributeLPBinsThread, jobs, threadCount );
+
+    // Sort the buckets and write parks as they become ready
+    memset( state.bucketSorted, 0, bucketCount );
+
+    state.nextBucket    = 0;
+    state.prefixBucket  = 0;
+    state.parkCount     = CDiv( length, kEntriesPerPark );
+    state.parksReady    = 0;
+    state.parksClaimed  = 0;
+    state.parksReported = 0;
+
+    pool.RunJob( SortLPBucketsThread, jobs, threadCount );
+
+    return state.parkSize * state.parkCount;
+}
+
+//-----------------------------------------------------------
+void CountLPBinsThread( LPBucketJob* job )
+{
+    const uint64* linePoints = job->state->linePoints + job->offset;
+    const uint64  length     = job->length;
+
+    uint64* counts = job->binCounts;
+    memset( counts, 0, sizeof( uint64 ) * LP_FINE_BINS );
+
+    for( uint64 i = 0; i < length; i++ )
+        counts[linePoints[i] >> LP_FINE_SHIFT]++;
+}
+
+//-----------------------------------------------------------
+void DistributeLPBinsThread( LPBucketJob* job )
+{
+    const LPBucketSortState& state = *job->state;
+
+    const uint64  offset     = job->offset;
+    const uint64  end        = offset + job->length;
+    const uint64* linePoints = state.linePoints;
+    const uint32* map        = state.map;
+    uint64*       lpTmp      = state.lpTmp;
+    uint32*       mapTmp     = state.mapTmp;
+
+    uint64* offsets = job->binCounts;
+
+    for( uint64 i = offset; i < end; i++ )
+    {
+        const uint64 lp  = linePoints[i];
+        const uint64 dst = offsets[lp >> LP_FINE_SHIFT]++;
+
+        lpTmp [dst] = lp;
+        mapTmp[dst] = map[i];
+    }
+}
+
+// LSD radix sort on the bits below the fine bin bits.
+// Sorts from the temporary buffers to the final ones.
+//-----------------------------------------------------------
+inline void SortLPBin( const uint64 length, uint64* lpTmp, uint64* linePoints, uint32* mapTmp, uint32* map )
+{
+    constexpr uint Radix  = 256;
+    constexpr uint Passes = CDiv( LP_FINE_SHIFT, 8 );
+
+    uint64* src    = lpTmp;
+    uint64* dst    = linePoints;
+    uint32* keySrc = mapTmp;
+    uint32* keyDst = map;
+
+    uint64 counts[Radix];
+
+    for( uint pass = 0; pass < Passes; pass++ )
+    {
+        const uint shift = pass * 8;
+
+        memset( counts, 0, sizeof( counts ) );
+
+        for( uint64 i = 0; i < length; i++ )
+            counts[(src[i] >> shift) & 0xFF]++;
+
+        // Skip the pass if all entries share this digit
+        if( counts[(src[0] >> shift) & 0xFF] == length )
+            continue;
+
+        uint64 sum = 0;
+        for( uint i = 0; i < Radix; i++ )
+        {
+            const uint64 count = counts[i];
+            counts[i] = sum;
+            sum += count;
+        }
+
+        for( uint64 i = 0; i < length; i++ )
+        {
+            const uint64 value = src[i];
+            const uint64 idx   = counts[(value >> shift) & 0xFF]++;
+
+            dst   [idx] = value;
+            keyDst[idx] = keySrc[i];
+        }
+
+        std::swap( src,    dst    );
+        std::swap( keySrc, keyDst );
+    }
+
+    if( src != linePoints )
+    {
+        memcpy( linePoints, src,    length * sizeof( uint64 ) );
+        memcpy( map,        keySrc, length * sizeof( uint32 ) );
+    }
+}
+
+// Advance the sorted prefix and let other threads know which parks can now be written
+//-----------------------------------------------------------
+inline void MarkLPBucketSorted( LPBucketSortState& state, const uint32 bucket )
+{
+    std::lock_guard<std::mutex> lock( state.prefixLock );
+
+    state.bucketSorted[bucket] = 1;
+
+    uint32 prefix = state.prefixBucket;
+    while( prefix < state.bucketCount && state.bucketSorted[prefix] )
+        prefix++;
+
+    if( prefix == state.prefixBucket )
+        return;
+
+    state.prefixBucket = prefix;
+
+    const uint64 sortedEnd = state.binStarts[state.bucketBins[prefix]];
+
+    // The last park may be a partial one
+    uint64 parksReady = sortedEnd == state.length ? state.parkCount : sortedEnd / kEntriesPerPark;
+
+    // Parks written in the temporary buffer must not overwrite the buckets still being sorted
+    const byte* tmpStart = (byte*)state.lpTmp;
+    const byte* tmpEnd   = (byte*)( state.lpTmp + state.length );
+
+    if( sortedEnd < state.length && state.parkBuffer >= tmpStart && state.parkBuffer < tmpEnd )
+    {
+        const byte* unsortedStart = (byte*)( state.lpTmp + sortedEnd );
+        const uint64 parksFit = unsortedStart > state.parkBuffer ?
+                                    (uint64)( unsortedStart - state.parkBuffer ) / state.parkSize : 0;
+
+        parksReady = std::min( parksReady, parksFit );
+    }
+
+    state.parksReady.store( parksReady, std::memory_order_release );
+}
+
+// Returns false if there were no parks ready to write
+//-----------------------------------------------------------
+inline bool WriteReadyLPParks( LPBucketSortState& state )
+{
+    bool wroteParks = false;
+
+    for( ;; )
+    {
+        uint64 claimed = state.parksClaimed.load( std::memory_order_relaxed );
+        uint64 count;
+
+        do
+        {
+            const uint64 ready = state.parksReady.load( std::memory_order_acquire );
+            if( claimed >= ready )
+                return wroteParks;
+
+            count = std::min<uint64>( ready - claimed, LP_PARK_CHUNK );
+        }
+        while( !state.parksClaimed.compare_exchange_weak( claimed, claimed + count, std::memory_order_relaxed ) );
+
+        const uint64 parkEnd = claimed + count;
+
+        for( uint64 park = claimed; park < parkEnd; )
+        {
+            const uint64 entryOffset = park * kEntriesPerPark;
+            uint64*      linePoints  = state.linePoints + entryOffset;
+            byte*        parkBuffer  = state.parkBuffer + park * state.parkSize;
+
+            // Full parks are written in pairs
+            if( park + 1 < parkEnd && entryOffset + kEntriesPerPark * 2 <= state.length )
+            {
+                WriteParkPair( state.parkSize, linePoints, parkBuffer, state.tableId );
+                park += 2;
+            }
+            else
+            {
+                const uint64 entryCount = std::min<uint64>( kEntriesPerPark, state.length - entryOffset );
+
+                WritePark( state.parkSize, entryCount, linePoints, parkBuffer, state.tableId );
+                park++;
+            }
+        }
+
+        // Report the parks in order: Wait for the threads that claimed the previous parks
+        if( state.onParksWritten )
+        {
+            while( state.parksReported.load( std::memory_order_acquire ) != claimed )
+                std::this_thread::yield();
+
+            state.onParksWritten( state.onParksWrittenData, state.parkBuffer + claimed * state.parkSize, count * state.parkSize );
+            state.parksReported.store( claimed + count, std::memory_order_release );
+        }
+
+        wroteParks = true;
+    }
+}
+
+//-----------------------------------------------------------
+void SortLPBucketsThread( LPBucketJob* job )
+{
+    LPBucketSortState& state = *job->state;
+
+    for( ;; )
+    {
+        // Parks take priority, they free up the writer sooner
+        WriteReadyLPParks( state );
+
+        const uint32 bucket = state.nextBucket++;
+        if( bucket >= state.bucketCount )
+            break;
+
+        const uint32 binEnd = state.bucketBins[bucket+1];
+
+        for( uint32 bin = state.bucketBins[bucket]; bin < binEnd; bin++ )
+        {
+            const uint64 start  = state.binStarts[bin];
+            const uint64 length = state.binStarts[bin+1] - start;
+
+            if( length )
+                SortLPBin( length, state.lpTmp + start, state.linePoints + start, state.mapTmp + start, state.map + start );
+        }
+
+        MarkLPBucketSorted( state, bucket );
+    }
+
+    // All buckets have been picked up. Keep writing parks as the remaining buckets are finished.
+    while( state.parksClaimed.load( std::memory_order_relaxed ) < state.parkCount )
+    {
+        if( !WriteReadyLPParks( state ) )
+            std::this_thread::yield();
+    }
+}
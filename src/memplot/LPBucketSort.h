@@ -0,0 +1,31 @@
+#pragma once
+#include "PlotContext.h"
+
+///
+/// Sorts line points (along with their map) by first distributing them into
+/// buckets on their top bits, then having each thread sort whole buckets on its own.
+/// Line points are not uniformly distributed, so bucket boundaries are chosen
+/// from a histogram so that the buckets are about the same size.
+///
+/// Parks are written as soon as all the buckets they span have been sorted,
+/// while the remaining buckets are still being sorted.
+///
+/// The park buffer may alias lpTmp: Parks that would overwrite
+/// buckets which are still being sorted are held back until those are done.
+///
+/// If onParksWritten is given, it is called with each run of parks once they've been
+/// written, in park order. Runs are contiguous in the park buffer and are never reported concurrently.
+///
+/// scratch must be able to hold LPBucketSortScratchSize( threadCount ) bytes.
+/// Returns the total size of the parks written.
+///
+typedef void (*LPParksWrittenFunc)( void* data, const byte* parks, size_t size );
+
+size_t SortLinePointsAndWriteParks( ThreadPool& pool, const uint64 length,
+                                    uint64* linePoints, uint64* lpTmp,
+                                    uint32* map, uint32* mapTmp,
+                                    byte* parkBuffer, TableId tableId,
+                                    void* scratch,
+                                    LPParksWrittenFunc onParksWritten = nullptr, void* onParksWrittenData = nullptr );
+
+size_t LPBucketSortScratchSize( uint threadCount );
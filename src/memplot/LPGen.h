@@ -2,6 +2,19 @@
 #include <atomic>
 #include "PlotContext.h"
 
+// Partitioned lookup settings. Each thread partitions blocks of up to P3_LOOKUP_MAX_BLOCK_SIZE
+// entries into P3_LOOKUP_REGION_COUNT regions of the table they read from or write to,
+// so that the random accesses walk that table one region at a time.
+// Blocks are as large as the free scratch space allows: The larger the block,
+// the more accesses land on the same pages of a region.
+#define P3_LOOKUP_MIN_BLOCK_SIZE ( 1ull << 16 )
+#define P3_LOOKUP_MAX_BLOCK_SIZE ( 1ull << 24 )
+#define P3_LOOKUP_REGION_BITS    11
+#define P3_LOOKUP_REGION_COUNT   ( 1u << P3_LOOKUP_REGION_BITS )
+
+// Scratch space required by the partitioned lookups per block entry, in bytes
+#define P3_LOOKUP_SCRATCH_PER_ENTRY ( sizeof( Pair ) + sizeof( uint32 ) )
+
 ///
 /// Job structs
 ///
@@ -31,14 +44,27 @@ struct LPJob : public SyncedJob
     const byte* markedEntries;  // Marked entries that will not be pruned
     
     uint32* map;
+
+    bool    prunedKnown;        // Where our entries go after pruning is already known,
+    uint64  prunedOffset;       // so we don't need to count them first
+    uint64  prunedLength;
+
+    bool    partitioned;        // Partition the lTable accesses by region (see P3_LOOKUP_MAX_BLOCK_SIZE)
+    uint32  regionShift;
+    uint64  blockSize;
+    byte*   scratch;            // blockSize * P3_LOOKUP_SCRATCH_PER_ENTRY bytes for this thread
 };
 
 template<bool PruneTable>
 void ProcessTableThread( LPJob* job );
 
+uint64 GetPrunedRange( LPJob* job );
 void PruneAndMapThread( LPJob* job );
+void PruneToLinePointThread( LPJob* job );
 void ConverToLinePointThread( LPJob* job );
 void WriteLookupTableThread( LPJob* job );
+void ConvertBlockToLinePoints( uint64* lps, const uint64 length, const uint32* lTable, 
+                               const uint32 regionShift, const uint64 blockSize, byte* scratch );
 
 // Calculates x * (x-1) / 2. Division is done before multiplication.
 inline uint64 GetXEnc( uint64 x );
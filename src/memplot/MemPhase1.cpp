@@ -53,7 +53,8 @@ struct kBCJob
     uint64        startIndex;
 
     // For scan job
-    uint64 endIndex;
+    uint64        endIndex;
+    const uint64* groupBitmap;      // If set, group starts are read from this bitmap instead of y
 
     // For scan job
     uint64 pairCount;        // Group count for scan job, pair count for pair job.
@@ -66,15 +67,31 @@ struct kBCJob
 };
 
 
+struct FpBucketPipeline
+{
+    const uint64* yBuffer;          // Sorted y values
+    const uint32* sortKey;
+    const Pair*   pairSrc;          // Unsorted pairs
+    Pair*         pairDst;
+    uint64*       groupBitmap;      // Set bits mark the first entry of each kBC group
+};
+
 template<typename TYOut, typename TMetaIn, typename TMetaOut>
 struct FpFxJob
 {
+    uint           id;
+    uint64         offset;
     uint64         entryCount;
     const TMetaIn* inMetaBuffer;
+    const uint32*  inMetaKey;       // If set, inMetaBuffer is unsorted and must be read through this key
     const uint64*  inYBuffer;
     const Pair*    lrPairs;
     TMetaOut*      outMetaBuffer;
     TYOut*         outYBuffer;
+
+    // For bucketed fx output
+    YBucketSlots*  bucketSlots;
+    bool           overflowed;      // Set if our entries did not fit in our bucket slots
 };
 
 /// Internal Funcs forwards-declares
@@ -82,9 +99,10 @@ void F1JobThread( F1GenJob* job );
 void F1NumaJobThread( F1GenJob* job );
 
 void FpScanThread( kBCJob* job );
+void FpBucketPipelineThread( void* data, uint id, uint threadCount, uint64 offset, uint64 length );
 void FpPairThread( kBCJob* job );
 
-template<typename TYOut, typename TMetaIn, typename TMetaOut>
+template<typename TYOut, typename TMetaIn, typename TMetaOut, bool Bucketed, bool KeyedMeta>
 void ComputeFxJob( FpFxJob<TYOut, TMetaIn, TMetaOut>* job );
 
 template<size_t metaKMultiplierIn, size_t metaKMultiplierOut, uint ShiftBits>
@@ -95,12 +113,52 @@ FORCE_INLINE uint64 ComputeFx( uint64 y, uint64* metaData, uint64* metaOut );
 //----------------------------------------------------------
 MemPhase1::MemPhase1( MemPlotContext& context )
     : _context( context )
+    , _metaInUnsorted( false )
+    , _metaMapElapsed( 0 )
+    , _groupBitmap   ( nullptr )
 {
     LoadLTargets();
 }
 
 //-----------------------------------------------------------
-void MemPhase1::WaitForPreviousPlotWriter()
+void MemPhase1::WaitForPreviousPlotWriter( const void* buffer, size_t size )
+{
+    // No plot being written
+    if( !_context.p4WriteBuffer )
+        return;
+
+    DiskPlotWriter& writer = *_context.plotWriter;
+
+    if( writer.IsBufferRangePending( buffer, size ) )
+    {
+        // Copy what we can to the staging buffer, if we have one, and wait only for the rest
+        auto stageTimer = TimerBegin();
+        const size_t stagedSize = writer.StageBufferRange( *_context.threadPool, buffer, size );
+
+        if( stagedSize )
+        {
+            const double elapsed = TimerEnd( stageTimer );
+            Log::Line( " Staged %.2lf GiB of the last plot in %.2lf seconds.", (double)stagedSize / (1ull GB), elapsed );
+        }
+    }
+
+    if( writer.IsBufferRangePending( buffer, size ) )
+    {
+        Log::Line( " Waiting for last plot to finish being written to disk..." );
+        auto timer = TimerBegin();
+
+        writer.WaitForBufferRange( buffer, size );
+
+        const double elapsed = TimerEnd( timer );
+        Log::Line( " Waited %.2lf seconds for the last plot.", elapsed );
+    }
+
+    if( writer.HasFinishedWriting() )
+        FinishPreviousPlot();
+}
+
+//-----------------------------------------------------------
+void MemPhase1::FinishPreviousPlot()
 {
     // Wait until the current plot has finished writing
     if( !_context.plotWriter->WaitUntilFinishedWriting() )
@@ -108,11 +166,20 @@ void MemPhase1::WaitForPreviousPlotWriter()
             _context.plotWriter->FilePath().c_str(),
             _context.plotWriter->GetError() );
 
-    const char* curname = _context.plotWriter->FilePath().c_str();
-    char* newname = new char[strlen(curname) - 3]();
-    memcpy(newname, curname, strlen(curname) - 4);
+    // The receiver of a streamed plot renames it itself
+    std::string plotPath = _context.plotWriter->FilePath();
+
+    if( !_context.plotWriter->IsStreaming() )
+    {
+        const char* curname = _context.plotWriter->FilePath().c_str();
+        char* newname = new char[strlen(curname) - 3]();
+        memcpy(newname, curname, strlen(curname) - 4);
 
-    rename(curname, newname);
+        if( rename(curname, newname) == 0 )
+            plotPath = newname;
+
+        delete[] newname;
+    }
 
     // Print final pointer offsets
     Log::Line( "" );
@@ -131,9 +198,53 @@ void MemPhase1::WaitForPreviousPlotWriter()
     }
     Log::Line( "" );
 
+    _context.plotWriter->ReportWriteStats();
+    Log::Line( "" );
+
+    if( _context.onPlotFinished )
+    {
+        _context.plotResult.plotPath   = plotPath.c_str();
+        _context.plotResult.plotSize   = _context.plotWriter->PlotSize();
+        _context.plotResult.writeStats = &_context.plotWriter->WriteStats();
+        _context.onPlotFinished( _context.plotResult, _context.onPlotFinishedData );
+    }
+
     _context.p4WriteBuffer = nullptr;
 }
 
+//-----------------------------------------------------------
+bool MemPhase1::DeferMetaMap( const TableId tableId )
+{
+    // Only tables 3 to 6 can read unsorted metadata:
+    // Table 7 writes its y values to the buffer holding the sort key.
+    if( tableId < TableId::Table2 || tableId > TableId::Table5 )
+        return false;
+
+#if FX_LAZY_META_MODE == 1
+    return true;
+#elif FX_LAZY_META_MODE == 2
+    // Permute eagerly on the first plot and defer it on the second one.
+    // After that, pick whichever ended up being cheapest for this table.
+    const double eagerCost = _context.metaMapCost[0][(int)tableId];
+    const double lazyCost  = _context.metaMapCost[1][(int)tableId];
+
+    if( eagerCost == 0 )
+        return false;
+    
+    if( lazyCost == 0 )
+        return true;
+
+    const bool defer = lazyCost < eagerCost;
+
+    Log::Line( "  Metadata mapping cost: permuted %.2lfs, deferred %.2lfs. %s metadata.", 
+        eagerCost, lazyCost, defer ? "Deferring" : "Permuting" );
+
+    return defer;
+#else
+    return false;
+#endif
+}
+
 //----------------------------------------------------------
 void MemPhase1::Run()
 {
@@ -325,6 +436,11 @@ void MemPhase1::ForwardPropagate( uint64 table1EntryCount )
     uint64 table6EntryCount = FpComputeTable<TableId::Table6>( table5EntryCount, yBuffer, metaBuffer );
     uint64 table7EntryCount = FpComputeTable<TableId::Table7>( table6EntryCount, yBuffer, metaBuffer );
 
+    // The previous plot has normally been released by now, but make sure it has been
+    // completely written before the next phases use the rest of our buffers.
+    if( cx.p4WriteBuffer )
+        FinishPreviousPlot();
+
     cx.entryCount[0] = table1EntryCount;
     cx.entryCount[1] = table2EntryCount;
     cx.entryCount[2] = table3EntryCount;
@@ -369,6 +485,10 @@ uint64 MemPhase1::FpComputeSingleTable(
     MemPlotContext& cx  = _context;
     Log::Line( "Forward propagating to table %d...", (int)tableId+1 );
 
+    // Nothing depends on the thread count across tables
+    if( cx.governor )
+        cx.governor->Update( cx.threadPool, cx.threadCount );
+
     // yBuffer.read amd metaBuffer.read should always point
     // to the y and meta values generated from the previous table, respectively
     // That is the values generated from the previous' tables fx(), but sorted.
@@ -393,11 +513,16 @@ uint64 MemPhase1::FpComputeSingleTable(
         kBCJob jobs[MAX_THREADS];
 
         // Scan for kBC groups
-        const uint64 groupCount = FpScan( entryCount, yBuffer.read, groupBoundaries, jobs );
+        const uint64 groupCount = FpScan( entryCount, yBuffer.read, groupBoundaries, jobs, _groupBitmap );
+        _groupBitmap = nullptr;
         
         // Generate L/R pairs from kBC groups (writes to unsorted pair buffer)
         Pair* tmpPairBuffer = (Pair*)metaBuffer.write;
 
+        // If the previous plot is still being written to disk, its last tables are in meta0.
+        // Our write meta buffer is meta1 unless the previous table's metadata was left unsorted.
+        WaitForPreviousPlotWriter( metaBuffer.write, cx.maxPairs * sizeof( Pair ) );
+
         pairCount = FpPair( yBuffer.read, jobs, groupCount, tmpPairBuffer, unsortedPairBuffer );
     }
 
@@ -411,21 +536,63 @@ uint64 MemPhase1::FpComputeSingleTable(
         ASSERT( metaBuffer.read == cx.metaBuffer0 );
     }
 
-    FpComputeFx<tableId, TMetaIn, TMetaOut>( 
-        pairCount, unsortedPairBuffer, 
-        (TMetaIn*)inMetaBuffer, yBuffer.read,
-        (TMetaOut*)metaBuffer.write, yBuffer.write );
+    // If the previous table's metadata was left unsorted, 
+    // we read it through the previous table's sort key.
+    const uint32* inMetaKey = _metaInUnsorted ? cx.t7YBuffer : nullptr;
 
-    // DbgVerifyPairsKBCGroups( pairCount, yBuffer.read, unsortedPairBuffer );
+    // When possible, have fx scatter y values straight into their top-bits 
+    // buckets so that the sort only needs to perform the bucket-local passes.
+    // The bucket slots use the y write buffer and either table 7's y buffer or,
+    // if it is holding the previous table's sort key, the space left in
+    // the metadata write buffer past this table's metadata.
+    YBucketSlots bucketSlots;
+    bool         fxBucketed = false;
 
-    // If a previous plot was being written to disk, we need to ensure
-    // it finished as we are about to use meta0 which is used to write the
-    // last buffers written to disk.
-    if( cx.p4WriteBuffer )
+    auto fxTimer = TimerBegin();
+
+    #if FX_FUSED_BUCKET_MODE
+    if constexpr ( tableId != TableId::Table7 )
     {
-        Log::Line( " Waiting for last plot to finish being written to disk..." );
-        WaitForPreviousPlotWriter();
-    }   
+        const size_t metaBufferSize = cx.maxPairs * sizeof( Pair );     // Meta buffers are sized to fit all pairs
+        const size_t metaOutSize    = ENTRIES_PER_TABLE * MetaLayout<TMetaOut>::Size;
+
+        uint32* slotBuffer1   = cx.t7YBuffer;
+        uint64  slotCapacity1 = ENTRIES_PER_TABLE;
+
+        if( inMetaKey )
+        {
+            slotBuffer1   = (uint32*)( (byte*)metaBuffer.write + metaOutSize );
+            slotCapacity1 = ( metaBufferSize - metaOutSize ) / sizeof( uint32 );
+        }
+
+        fxBucketed = bucketSlots.Init( cx.threadCount, pairCount,
+                                       (uint32*)yBuffer.write, ENTRIES_PER_TABLE * 2,
+                                       slotBuffer1, slotCapacity1 );
+        if( fxBucketed )
+        {
+            fxBucketed = FpComputeFx<tableId, TMetaIn, TMetaOut>( 
+                pairCount, unsortedPairBuffer, 
+                (TMetaIn*)inMetaBuffer, inMetaKey, yBuffer.read,
+                (TMetaOut*)metaBuffer.write, yBuffer.write,
+                &bucketSlots );
+
+            if( !fxBucketed )
+                Log::Line( "  Fx bucket slots overflowed. Re-computing fx linearly..." );
+        }
+    }
+    #endif
+
+    if( !fxBucketed )
+    {
+        FpComputeFx<tableId, TMetaIn, TMetaOut>( 
+            pairCount, unsortedPairBuffer, 
+            (TMetaIn*)inMetaBuffer, inMetaKey, yBuffer.read,
+            (TMetaOut*)metaBuffer.write, yBuffer.write );
+    }
+
+    const double fxElapsed = TimerEnd( fxTimer );
+
+    // DbgVerifyPairsKBCGroups( pairCount, yBuffer.read, unsortedPairBuffer );
 
     // Swap buffers here, ready for sort
     yBuffer   .Swap();
@@ -435,31 +602,124 @@ uint64 MemPhase1::FpComputeSingleTable(
     if constexpr ( tableId != TableId::Table7 )
     {
         Log::Line( "  Sorting entries..." );
-        auto timer = TimerBegin();
 
         // Use table 7's buffers as a temporary buffer
         uint32* sortKey    = cx.t7YBuffer;
-        uint32* sortKeyTmp = (uint32*)( metaBuffer.write + ENTRIES_PER_TABLE ); // Use the output metabuffer for now as 
-                                                                                // the temporary sortkey buffer.
-        SortFx<MAX_THREADS>(
-            *cx.threadPool,        pairCount,
-            (uint64*)yBuffer.read, yBuffer.write,
-            sortKeyTmp,            sortKey
-        );
-        yBuffer.Swap();
+
+        // The sort uses part of the write meta buffer (now meta0) as a temporary sort key buffer,
+        // and writes our final pairs, which overwrites any previous plot's parks in them.
+        if( fxBucketed )
+            WaitForPreviousPlotWriter( metaBuffer.write, pairCount * sizeof( uint32 ) );
+        else
+            WaitForPreviousPlotWriter( metaBuffer.write + ENTRIES_PER_TABLE, pairCount * sizeof( uint32 ) );
+
+        WaitForPreviousPlotWriter( pairBuffer, pairCount * sizeof( Pair ) );
+
+        // Start timing only after waiting on the previous plot's writer,
+        // so that the cost recorded for the meta mode is not skewed by it.
+        auto timer = TimerBegin();
+
+        FpBucketPipeline pipeline;
+        bool             pipelined = false;
+
+        if( fxBucketed )
+        {
+            // The bucketed y values live in our current read buffer (and the second slot buffer).
+            // The sorted y values are written back to the read buffer, so no need to swap.
+            // The output metabuffer is used as the temporary sort key buffer.
+            YSorter sorter( *cx.threadPool );
+
+            #if FX_SORT_MAP_AND_MARK_GROUPS
+                // Map the pairs and mark the next table's kBC groups on each bucket as soon as it is sorted.
+                // The group bitmap is kept in the second half of the sort's temporary y buffer,
+                // which is free by then and is not used by the next table until its fx.
+                // #NOTE: The next table's pairing is not pipelined here, as it would need buffers still in use:
+                //        Its pairs go to the unsorted pair buffer, which the pair mapping is reading from,
+                //        and its temporary pair buffer is either the meta write buffer holding the sort's
+                //        temporary keys, or the meta read buffer which the metadata mapping still reads.
+                //        Overlapping it would take another pair buffer, which we don't have room for.
+                pipeline.yBuffer     = yBuffer.read;
+                pipeline.sortKey     = sortKey;
+                pipeline.pairSrc     = unsortedPairBuffer;
+                pipeline.pairDst     = pairBuffer;
+                pipeline.groupBitmap = (uint64*)( (uint32*)yBuffer.write + ENTRIES_PER_TABLE );
+                pipelined            = true;
+
+                sorter.SortBuckets( pairCount, bucketSlots,
+                                    (uint64*)yBuffer.read, yBuffer.write,
+                                    sortKey, (uint32*)metaBuffer.write,
+                                    FpBucketPipelineThread, &pipeline );
+            #else
+                sorter.SortBuckets( pairCount, bucketSlots,
+                                    (uint64*)yBuffer.read, yBuffer.write,
+                                    sortKey, (uint32*)metaBuffer.write );
+            #endif
+        }
+        else
+        {
+            uint32* sortKeyTmp = (uint32*)( metaBuffer.write + ENTRIES_PER_TABLE ); // Use the output metabuffer for now as 
+                                                                                    // the temporary sortkey buffer.
+            SortFx<MAX_THREADS>(
+                *cx.threadPool,        pairCount,
+                (uint64*)yBuffer.read, yBuffer.write,
+                sortKeyTmp,            sortKey
+            );
+            yBuffer.Swap();
+        }
 
         // DbgVerifyPairsKBCGroups( pairCount, yBuffer.write, unsortedPairBuffer );
 
-        MapFxWithSortKey<TMetaOut, MAX_THREADS>(
-            *cx.threadPool, pairCount, sortKey,
-            (TMetaOut*)metaBuffer.read, (TMetaOut*)metaBuffer.write,
-            unsortedPairBuffer,         pairBuffer   // Write to the final pair buffer
-        );
+        // Record how long the previous table's metadata ordering cost us.
+        // Reading unsorted metadata may also prevent fx bucketing, so we account for the sort as well.
+        if constexpr ( tableId > TableId::Table2 )
+        {
+            const double sortElapsed = TimerEnd( timer );
+            cx.metaMapCost[_metaInUnsorted ? 1 : 0][(int)tableId-1] = _metaMapElapsed + fxElapsed + sortElapsed;
+        }
+
+        // Either permute the metadata now, or leave it unsorted and have the 
+        // next table's fx read it through the sort key, which stays in table 7's y buffer.
+        // Pairs are always mapped as they are stored permanently.
+        const bool deferMeta = DeferMetaMap( tableId );
+
+        if( !deferMeta )
+            WaitForPreviousPlotWriter( metaBuffer.write, pairCount * sizeof( TMetaOut ) );
+
+        auto mapTimer = TimerBegin();
+
+        // The first half of the y write buffer is no longer needed and serves as scratch for the blocked gather.
+        // (The second half may be holding the next table's group bitmap.)
+        #if FX_BLOCKED_GATHER_MODE == 0
+            MapFxGather gather = MapFxGather::Direct;
+        #elif FX_BLOCKED_GATHER_MODE == 1
+            MapFxGather gather = MapFxGather::Blocked;
+        #else
+            MapFxGather& gather = *(MapFxGather*)&cx.mapFxGather[(int)tableId];
+        #endif
+
+        // Pairs were already mapped if the sort was pipelined
+        if( !deferMeta || !pipelined )
+        {
+            MapFxWithSortKey<TMetaOut, MAX_THREADS>(
+                *cx.threadPool, pairCount, sortKey,
+                deferMeta ? nullptr : (TMetaOut*)metaBuffer.read, 
+                deferMeta ? nullptr : (TMetaOut*)metaBuffer.write,
+                pipelined ? nullptr : unsortedPairBuffer, pairBuffer,  // Write to the final pair buffer
+                gather, (uint32*)yBuffer.write, ENTRIES_PER_TABLE * sizeof( uint32 )
+            );
+        }
+
+        if( pipelined )
+            _groupBitmap = pipeline.groupBitmap;
+
+        _metaMapElapsed = TimerEnd( mapTimer );
+        _metaInUnsorted = deferMeta;
 
         // DbgVerifyPairsKBCGroups( pairCount, yBuffer.write, pairBuffer );
 
         // Use the sorted metabuffer as the read buffer for the next table
-        metaBuffer.Swap();
+        if( !deferMeta )
+            metaBuffer.Swap();
 
         double elapsed = TimerEnd( timer );
         Log::Line( "  Finished sorting in %.2lf seconds.", elapsed );
@@ -644,11 +904,21 @@ void F1JobThread( F1GenJob* job )
 ///
 
 //-----------------------------------------------------------
-uint64 MemPhase1::FpScan( const uint64 entryCount, const uint64* yBuffer, uint32* groupBoundaries, kBCJob jobs[MAX_THREADS] )
+uint64 MemPhase1::FpScan( const uint64 entryCount, const uint64* yBuffer, 
+                          uint32* groupBoundaries, kBCJob jobs[MAX_THREADS],
+                          const uint64* groupBitmap )
 {
     MemPlotContext& cx  = _context;
     const uint32 threadCount        = cx.threadCount;
-    const uint64 maxKBCGroups       = cx.maxKBCGroups;
+    uint64       maxKBCGroups       = cx.maxKBCGroups;
+
+    // Don't let the group boundaries overwrite the group bitmap, which lives past them in the same buffer
+    if( groupBitmap )
+    {
+        ASSERT( (const uint32*)groupBitmap > groupBoundaries );
+        maxKBCGroups = std::min( maxKBCGroups, (uint64)( (const uint32*)groupBitmap - groupBoundaries ) );
+    }
+
     const uint64 maxGroupsPerThread = maxKBCGroups / threadCount;
     
     uint64 groupCount = 0;
@@ -661,6 +931,7 @@ uint64 MemPhase1::FpScan( const uint64 entryCount, const uint64* yBuffer, uint32
     jobs[0].yBuffer         = yBuffer;
     jobs[0].startIndex      = 0;
     jobs[0].endIndex        = entryCount;
+    jobs[0].groupBitmap     = groupBitmap;
 
     #if DEBUG
         jobs[0].jobIdx = 0;
@@ -671,63 +942,83 @@ uint64 MemPhase1::FpScan( const uint64 entryCount, const uint64* yBuffer, uint32
     {
         auto& job = jobs[i];
 
-        job.yBuffer    = yBuffer;
-        job.groupCount = 0;
-        job.copyDst    = nullptr;
+        job.yBuffer     = yBuffer;
+        job.groupCount  = 0;
+        job.copyDst     = nullptr;
+        job.groupBitmap = groupBitmap;
 
         const uint64 idx      = entryCount / threadCount * i;
-        const uint64 y        = yBuffer[idx];
-        const uint64 curGroup = y / kBC;
 
-        const uint32 groupLocalIdx = (uint32)(y - curGroup * kBC);
+        // If the previous table's sort marked the group starts, just find the next marked entry
+        if( groupBitmap )
+        {
+            job.startIndex = std::max( idx, jobs[i-1].startIndex + 1 );
 
-        uint64 targetGroup;
+            uint64 bits = groupBitmap[job.startIndex >> 6] >> ( job.startIndex & 63 );
+            while( !bits )
+            {
+                job.startIndex = ( job.startIndex | 63 ) + 1;
+                bits = groupBitmap[job.startIndex >> 6];
+            }
+            job.startIndex += Ctz64( bits );
 
-        // If we are already at the start of a group, just use this index
-        if( groupLocalIdx == 0 )
-        {
-            job.startIndex = idx;
+            ASSERT( job.startIndex < entryCount );
         }
         else
         {
-            // Choose if we should find the upper boundary or the lower boundary
-            const uint32 remainder = kBC - groupLocalIdx;
-            
-            #if _DEBUG
-                bool foundBoundary = false;
-            #endif
-            if( remainder <= kBC / 2 )
+            const uint64 y        = yBuffer[idx];
+            const uint64 curGroup = y / kBC;
+
+            const uint32 groupLocalIdx = (uint32)(y - curGroup * kBC);
+
+            uint64 targetGroup;
+
+            // If we are already at the start of a group, just use this index
+            if( groupLocalIdx == 0 )
             {
-                // Look for the upper boundary
-                for( uint64 j = idx+1; j < entryCount; j++ )
-                {
-                    targetGroup = yBuffer[j] / kBC;
-                    if( targetGroup != curGroup )
-                    {
-                        #if _DEBUG
-                            foundBoundary = true;
-                        #endif
-                        job.startIndex = j; break;
-                    }   
-                }
+                job.startIndex = idx;
             }
             else
             {
-                // Look for the lower boundary
-                for( uint64 j = idx-1; j >= 0; j-- )
+                // Choose if we should find the upper boundary or the lower boundary
+                const uint32 remainder = kBC - groupLocalIdx;
+            
+                #if _DEBUG
+                    bool foundBoundary = false;
+                #endif
+                if( remainder <= kBC / 2 )
                 {
-                    targetGroup = yBuffer[j] / kBC;
-                    if( targetGroup != curGroup )
+                    // Look for the upper boundary
+                    for( uint64 j = idx+1; j < entryCount; j++ )
                     {
-                        #if _DEBUG
-                            foundBoundary = true;
-                        #endif
-                        job.startIndex = j+1; break;
-                    }  
+                        targetGroup = yBuffer[j] / kBC;
+                        if( targetGroup != curGroup )
+                        {
+                            #if _DEBUG
+                                foundBoundary = true;
+                            #endif
+                            job.startIndex = j; break;
+                        }   
+                    }
+                }
+                else
+                {
+                    // Look for the lower boundary
+                    for( uint64 j = idx-1; j >= 0; j-- )
+                    {
+                        targetGroup = yBuffer[j] / kBC;
+                        if( targetGroup != curGroup )
+                        {
+                            #if _DEBUG
+                                foundBoundary = true;
+                            #endif
+                            job.startIndex = j+1; break;
+                        }  
+                    }
                 }
-            }
 
-            ASSERT( foundBoundary );
+                ASSERT( foundBoundary );
+            }
         }
 
         auto& lastJob = jobs[i-1];
@@ -854,6 +1145,38 @@ void FpScanThread( kBCJob* job )
     const uint64  start   = job->startIndex;
     const uint64  end     = job->endIndex;
 
+    // Group starts already marked by the previous table's sort
+    if( job->groupBitmap )
+    {
+        const uint64* groupBitmap = job->groupBitmap;
+
+        for( uint64 i = start+1; i < end; )
+        {
+            const uint64 bits = groupBitmap[i >> 6] >> ( i & 63 );
+            
+            if( !bits )
+            {
+                i = ( i | 63 ) + 1;
+                continue;
+            }
+
+            i += Ctz64( bits );
+            if( i >= end )
+                break;
+
+            groupBoundaries[groupCount++] = (uint32)i++;
+
+            if( groupCount == maxGroups )
+            {
+                ASSERT( 0 );
+                break;
+            }
+        }
+
+        job->groupCount = groupCount;
+        return;
+    }
+
     uint64 lastGroup = yBuffer[start] / kBC;
 
     for( uint64 i = start+1; i < end; i++ )
@@ -878,6 +1201,66 @@ void FpScanThread( kBCJob* job )
     job->groupCount = groupCount;
 }
 
+// Runs on each bucket as soon as the y sort has finished it, while the next buckets are still being sorted.
+// Maps the bucket's pairs, and marks the kBC group starts for the next table's scan.
+//-----------------------------------------------------------
+void FpBucketPipelineThread( void* data, uint id, uint threadCount, uint64 offset, uint64 length )
+{
+    const FpBucketPipeline& pipeline = *(FpBucketPipeline*)data;
+
+    // Split the bucket in 64-entry aligned ranges, so that each bitmap word within it has a single writer
+    const uint64 end = offset + length;
+
+    auto rangeStart = [=]( uint i ) -> uint64 {
+        if( i == 0 )
+            return offset;
+        if( i == threadCount )
+            return end;
+
+        return std::min( end, std::max( offset, ( offset + length / threadCount * i ) & ~63ull ) );
+    };
+
+    const uint64 start    = rangeStart( id );
+    const uint64 rangeEnd = rangeStart( id + 1 );
+
+    if( start == rangeEnd )
+        return;
+
+    // Map pairs
+    const uint32* sortKey = pipeline.sortKey;
+    const Pair*   pairSrc = pipeline.pairSrc;
+    Pair*         pairDst = pipeline.pairDst;
+
+    for( uint64 i = start; i < rangeEnd; i++ )
+        pairDst[i] = pairSrc[sortKey[i]];
+
+    // Mark group starts. The previous bucket is already sorted, so we can compare against its last entry.
+    const uint64* yBuffer     = pipeline.yBuffer;
+    uint64*       groupBitmap = pipeline.groupBitmap;
+
+    uint64 lastGroup = start > 0 ? yBuffer[start-1] / kBC : ~0ull;
+
+    for( uint64 i = start; i < rangeEnd; )
+    {
+        const uint64 word    = i >> 6;
+        const uint64 wordEnd = std::min( ( word + 1 ) << 6, rangeEnd );
+
+        uint64 bits = 0;
+        for( ; i < wordEnd; i++ )
+        {
+            const uint64 group = yBuffer[i] / kBC;
+            bits |= (uint64)( group != lastGroup ) << ( i & 63 );
+            lastGroup = group;
+        }
+
+        // The first word may be shared with the previous bucket, which was already written
+        if( ( word << 6 ) < start )
+            groupBitmap[word] |= bits;
+        else
+            groupBitmap[word] = bits;
+    }
+}
+
 // Create pairs from y values
 //-----------------------------------------------------------
 uint64 MemPhase1::FpPair( const uint64* yBuffer, kBCJob jobs[MAX_THREADS],
@@ -1054,12 +1437,16 @@ RETURN:
 /// Fx Computation
 ///
 template<TableId tableId, typename TMetaIn, typename TMetaOut>
-void MemPhase1::FpComputeFx( const uint64 entryCount, const Pair* lrPairs,
-                             const TMetaIn* inMetaBuffer, const uint64* inYBuffer,
-                             TMetaOut* outMetaBuffer, uint64* outYBuffer )
+bool MemPhase1::FpComputeFx( const uint64 entryCount, const Pair* lrPairs,
+                             const TMetaIn* inMetaBuffer, const uint32* inMetaKey, const uint64* inYBuffer,
+                             TMetaOut* outMetaBuffer, uint64* outYBuffer,
+                             YBucketSlots* bucketSlots )
 {
     using TYOut = typename YOut<tableId>::Type;
 
+    ASSERT( !bucketSlots || tableId != TableId::Table7 );
+    ASSERT( !inMetaKey   || ( tableId > TableId::Table2 && tableId < TableId::Table7 ) );
+
 
     MemPlotContext& cx = _context;
 
@@ -1082,26 +1469,57 @@ void MemPhase1::FpComputeFx( const uint64 entryCount, const Pair* lrPairs,
 
         const size_t offset = entriesPerThred * i;
 
+        job.id            = i;
+        job.offset        = offset;
         job.entryCount    = entriesPerThred;
         job.inMetaBuffer  = inMetaBuffer;             // These should NOT be offseted as we 
-        job.inYBuffer     = inYBuffer;                // use them as lookup tables based on the lrPairs
+        job.inMetaKey     = inMetaKey;                // use them as lookup tables based on the lrPairs
+        job.inYBuffer     = inYBuffer;
         job.lrPairs       = lrPairs       + offset;
         job.outMetaBuffer = outMetaBuffer + offset;
+        
+        // Planar metadata is written to the planes at the job's offset
+        if constexpr ( MetaLayout<TMetaOut>::Planar )
+            job.outMetaBuffer = outMetaBuffer;
         job.outYBuffer    = tYOut         + offset;
+        job.bucketSlots   = bucketSlots;
+        job.overflowed    = false;
     }
 
     // Add trailing entries to the last job
     jobs[threadCount-1].entryCount += trailingEntries;
 
     // Calculate Fx
-    cx.threadPool->RunJob( ComputeFxJob<TYOut, TMetaIn, TMetaOut>, jobs, threadCount );
+    bool fitSlots = true;
+
+    if constexpr ( tableId != TableId::Table7 )
+    {
+        if( bucketSlots )
+        {
+            if( inMetaKey )
+                cx.threadPool->RunJob( ComputeFxJob<TYOut, TMetaIn, TMetaOut, true, true>, jobs, threadCount );
+            else
+                cx.threadPool->RunJob( ComputeFxJob<TYOut, TMetaIn, TMetaOut, true, false>, jobs, threadCount );
+
+            for( uint i = 0; i < threadCount; i++ )
+                fitSlots = fitSlots && !jobs[i].overflowed;
+        }
+        else if( inMetaKey )
+            cx.threadPool->RunJob( ComputeFxJob<TYOut, TMetaIn, TMetaOut, false, true>, jobs, threadCount );
+        else
+            cx.threadPool->RunJob( ComputeFxJob<TYOut, TMetaIn, TMetaOut, false, false>, jobs, threadCount );
+    }
+    else
+        cx.threadPool->RunJob( ComputeFxJob<TYOut, TMetaIn, TMetaOut, false, false>, jobs, threadCount );
 
     auto elapsed = TimerEnd( timer );
     Log::Line( "  Finished computing Fx in %.4lf seconds.", elapsed );
+
+    return fitSlots;
 }
 
 //-----------------------------------------------------------
-template<typename TYOut, typename TMetaIn, typename TMetaOut>
+template<typename TYOut, typename TMetaIn, typename TMetaOut, bool Bucketed, bool KeyedMeta>
 void ComputeFxJob( FpFxJob<TYOut, TMetaIn, TMetaOut>* job )
 {
     const size_t metaKMultiplierIn  = SizeForMeta<TMetaIn >::Value;
@@ -1114,6 +1532,7 @@ void ComputeFxJob( FpFxJob<TYOut, TMetaIn, TMetaOut>* job )
     const uint64   entryCount    = job->entryCount;
     const Pair*    lrPairs       = job->lrPairs;
     const TMetaIn* inMetaBuffer  = job->inMetaBuffer;
+    const uint32*  inMetaKey     = job->inMetaKey;
     const uint64*  inYBuffer     = job->inYBuffer;
     TMetaOut*      outMetaBuffer = job->outMetaBuffer;
     TYOut*         outYBuffer    = job->outYBuffer;
@@ -1125,6 +1544,29 @@ void ComputeFxJob( FpFxJob<TYOut, TMetaIn, TMetaOut>* job )
     // Intermediate metadata holder
     uint64 lrMetadata[4];
 
+    // When bucketing, y values are written to the slot for their top-most bits bucket,
+    // stripped of those bits, along with their index, which is used as the sort key.
+    constexpr uint Buckets = YBucketSlots::Buckets;
+
+    uint32* ySlots      [Buckets];
+    uint32* keySlots    [Buckets];
+    uint32  bucketCounts[Buckets];
+    uint64  slotCapacity = 0;
+
+    if constexpr ( Bucketed )
+    {
+        const YBucketSlots& slots = *job->bucketSlots;
+        slotCapacity = slots.slotCapacity;
+
+        for( uint b = 0; b < Buckets; b++ )
+        {
+            ySlots  [b] = slots.YSlot  ( job->id, b );
+            keySlots[b] = slots.KeySlot( job->id, b );
+        }
+
+        memset( bucketCounts, 0, sizeof( bucketCounts ) );
+    }
+
     for( uint64 i = 0; i < entryCount; i++ )
     {
         const Pair& pair = lrPairs[i];
@@ -1137,25 +1579,45 @@ void ComputeFxJob( FpFxJob<TYOut, TMetaIn, TMetaOut>* job )
         // Read y
         const uint64 y = inYBuffer[pair.left];
 
+        // Unsorted metadata is found through the previous table's sort key
+        uint64 metaL = pair.left;
+        uint64 metaR = pair.right;
+
+        if constexpr ( KeyedMeta )
+        {
+            metaL = inMetaKey[metaL];
+            metaR = inMetaKey[metaR];
+        }
+
         // Read metadata
         if constexpr( metaKMultiplierIn == 1 )
         {
             uint32* meta32 = (uint32*)lrMetadata;
 
-            meta32[0] = inMetaBuffer[pair.left ];    // Metadata( l and r x's)
-            meta32[1] = inMetaBuffer[pair.right];
+            meta32[0] = inMetaBuffer[metaL];    // Metadata( l and r x's)
+            meta32[1] = inMetaBuffer[metaR];
         }
         else if constexpr( metaKMultiplierIn == 2 )
         {
-            lrMetadata[0] = inMetaBuffer[pair.left ];
-            lrMetadata[1] = inMetaBuffer[pair.right];
+            lrMetadata[0] = inMetaBuffer[metaL];
+            lrMetadata[1] = inMetaBuffer[metaR];
+        }
+        else if constexpr( MetaLayout<TMetaIn>::Planar )
+        {
+            const uint64* inMeta0 = MetaLayout<TMetaIn>::Plane0( inMetaBuffer );
+            const uint32* inMeta1 = MetaLayout<TMetaIn>::Plane1( inMetaBuffer );
+
+            lrMetadata[0] = inMeta0[metaL];
+            lrMetadata[1] = inMeta1[metaL];
+            lrMetadata[2] = inMeta0[metaR];
+            lrMetadata[3] = inMeta1[metaR];
         }
         else
         {
             // For 3 and 4 we just use 16 bytes (2 64-bit entries)
             const Meta4* inMeta4 = static_cast<const Meta4*>( inMetaBuffer );
-            const Meta4& meta4L  = inMeta4[pair.left ];
-            const Meta4& meta4R  = inMeta4[pair.right];
+            const Meta4& meta4L  = inMeta4[metaL];
+            const Meta4& meta4R  = inMeta4[metaR];
 
             lrMetadata[0] = meta4L.m0;
             lrMetadata[1] = meta4L.m1;
@@ -1163,13 +1625,44 @@ void ComputeFxJob( FpFxJob<TYOut, TMetaIn, TMetaOut>* job )
             lrMetadata[3] = meta4R.m1;
         }
 
-        TYOut f = (TYOut)ComputeFx<metaKMultiplierIn, metaKMultiplierOut, extraBitsShift>( y, lrMetadata, (uint64*)outMetaBuffer );
+        TYOut f;
+        
+        if constexpr ( MetaLayout<TMetaOut>::Planar )
+        {
+            uint64 metaOut[2];
+            f = (TYOut)ComputeFx<metaKMultiplierIn, metaKMultiplierOut, extraBitsShift>( y, lrMetadata, metaOut );
 
-        outYBuffer[i] = f;
+            MetaLayout<TMetaOut>::Plane0( outMetaBuffer )[job->offset + i] = metaOut[0];
+            MetaLayout<TMetaOut>::Plane1( outMetaBuffer )[job->offset + i] = (uint32)metaOut[1];
+        }
+        else
+            f = (TYOut)ComputeFx<metaKMultiplierIn, metaKMultiplierOut, extraBitsShift>( y, lrMetadata, (uint64*)outMetaBuffer );
+
+        if constexpr ( Bucketed )
+        {
+            const uint32 bucket = (uint32)( f >> 32 );
+            const uint32 count  = bucketCounts[bucket];
+
+            // Our slot is full. Fx will have to be computed linearly instead.
+            if( count == slotCapacity )
+            {
+                job->overflowed = true;
+                break;
+            }
+
+            ySlots  [bucket][count] = (uint32)f;
+            keySlots[bucket][count] = (uint32)( job->offset + i );
+            bucketCounts[bucket]    = count + 1;
+        }
+        else
+            outYBuffer[i] = f;
 
-        if constexpr( metaKMultiplierOut != 0 )
+        if constexpr( metaKMultiplierOut != 0 && !MetaLayout<TMetaOut>::Planar )
             outMetaBuffer ++;
     }
+
+    if constexpr ( Bucketed )
+        memcpy( job->bucketSlots->counts[job->id], bucketCounts, sizeof( bucketCounts ) );
 }
 
 #pragma GCC diagnostic push
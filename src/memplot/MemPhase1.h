@@ -2,6 +2,7 @@
 #include "PlotContext.h"
 
 struct kBCJob;
+struct YBucketSlots;
 
 template<typename T>
 struct ReadWriteBuffer
@@ -41,6 +42,32 @@ template<> struct SizeForMeta<Meta3>  { static constexpr size_t Value = 3; };
 template<> struct SizeForMeta<Meta4>  { static constexpr size_t Value = 4; };
 template<> struct SizeForMeta<NoMeta> { static constexpr size_t Value = 0; };
 
+/// How metadata is laid out in the metadata buffers.
+/// By default entries are stored contiguously, with Meta3 using 16 bytes.
+/// With FX_META3_PLANAR, 96-bit metadata is stored as a plane of 64-bit values 
+/// followed by a plane of 32-bit values, each sized for ENTRIES_PER_TABLE.
+template<typename TMeta>
+struct MetaLayout
+{
+    static constexpr bool   Planar = false;
+    static constexpr size_t Size   = sizeof( TMeta );   // Bytes used per entry
+};
+
+#if FX_META3_PLANAR
+template<>
+struct MetaLayout<Meta3>
+{
+    static constexpr bool   Planar = true;
+    static constexpr size_t Size   = sizeof( uint64 ) + sizeof( uint32 );
+
+    inline static uint64*       Plane0( void* buffer )       { return (uint64*)buffer; }
+    inline static const uint64* Plane0( const void* buffer ) { return (const uint64*)buffer; }
+    inline static uint32*       Plane1( void* buffer )       { return (uint32*)( (uint64*)buffer + ENTRIES_PER_TABLE ); }
+    inline static const uint32* Plane1( const void* buffer ) { return (const uint32*)( (const uint64*)buffer + ENTRIES_PER_TABLE ); }
+};
+#endif
+
+/// Metadata types for each table. Their layout is given by MetaLayout.
 template<TableId Table>
 struct TableMetaType;
 
@@ -69,8 +96,10 @@ private:
     uint64 GenerateF1();
 
     void ForwardPropagate( uint64 entryCount );
+    // If groupBitmap is given, group starts are read from it instead of being searched for in yBuffer.
     uint64 FpScan( const uint64 entryCount, const uint64* yBuffer, 
-                   uint32* groupBoundaries, kBCJob jobs[MAX_THREADS] );
+                   uint32* groupBoundaries, kBCJob jobs[MAX_THREADS],
+                   const uint64* groupBitmap = nullptr );
 
     uint64 FpPair( const uint64* yBuffer, kBCJob jobs[MAX_THREADS],
                    const uint64 groupCount, Pair* tmpPairBuffer, Pair* outPairBuffer );
@@ -85,14 +114,31 @@ private:
                                ReadWriteBuffer<uint64>& yBuffer, 
                                ReadWriteBuffer<uint64>& metaBuffer );
 
+    // If inMetaKey is given, inMetaBuffer is unsorted and is read through it.
+    // If bucketSlots is given, y values are scattered to them instead of outYBuffer.
+    // Returns false if they did not fit in the bucket slots.
     template<TableId tableId, typename TMetaIn, typename TMetaOut>
-    void FpComputeFx( const uint64 entryCount, const Pair* lrPairs,
-                      const TMetaIn* inMetaBuffer, const uint64* inYBuffer,
-                      TMetaOut* outMetaBuffer, uint64* outYBuffer );
+    bool FpComputeFx( const uint64 entryCount, const Pair* lrPairs,
+                      const TMetaIn* inMetaBuffer, const uint32* inMetaKey, const uint64* inYBuffer,
+                      TMetaOut* outMetaBuffer, uint64* outYBuffer,
+                      YBucketSlots* bucketSlots = nullptr );
     
     
-    void WaitForPreviousPlotWriter();
+    // Should we leave this table's metadata unsorted after its y sort?
+    bool DeferMetaMap( TableId tableId );
+
+    // Waits until the previous plot, if it is still being written to disk,
+    // has released the tables it keeps in [buffer, buffer+size), so that we can overwrite them.
+    void WaitForPreviousPlotWriter( const void* buffer, size_t size );
+
+    // Waits until the previous plot has been completely written, then finalizes it
+    void FinishPreviousPlot();
 
 private:
     MemPlotContext& _context;
+
+    bool   _metaInUnsorted;   // Is the previous table's metadata still in fx order?
+    double _metaMapElapsed;   // Time spent mapping the previous table's metadata and pairs
+
+    const uint64* _groupBitmap;   // kBC group starts marked by the previous table's pipelined sort
 };
\ No newline at end of file
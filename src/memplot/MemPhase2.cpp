@@ -22,6 +22,25 @@ struct MarkJob
     uint64      fieldPerMarkingBuffer;
 };
 
+// For partitioned marking (P2_PARTITIONED_MARKING)
+struct PartitionMarkJob
+{
+    uint64      startIndex;
+    uint64      rightEntryCount;
+    const Pair* rightEntries;
+    const byte* rightMarkedEntries;  // Used in tables <= 5
+    
+    uint32      partitionShift;
+    uint64*     counts;              // This thread's count (and then offset) for each partition
+    uint32*     indices;             // Left table indices, in partition order
+
+    // For the marking pass: Range of indices to mark
+    uint64      indexStart;
+    uint64      indexEnd;
+    byte*       leftMarkingBuffer;
+    uint32*     leftMarkedCounts;    // If set, the number of marked entries per partition is counted here
+};
+
 ///
 /// Internal Functions
 ///
@@ -30,6 +49,14 @@ void ClearMarkedEntriesThread( ClearMarkingBufferJob* job );
 template<bool HasRightTableMarkingBuffer>
 void MarkEntriesThread( MarkJob* job );
 
+template<bool HasRightTableMarkingBuffer>
+void CountPartitionsThread( PartitionMarkJob* job );
+
+template<bool HasRightTableMarkingBuffer>
+void DistributePartitionsThread( PartitionMarkJob* job );
+
+void MarkPartitionsThread( PartitionMarkJob* job );
+
 
 void DbgReadPhase1TableFiles( MemPlotContext& cx );
 void DbgCountMarkedEntries( MemPlotContext& cx );
@@ -92,6 +119,16 @@ void MemPhase2::Run()
         Log::Line( "  Prunning table %d...", i );
         auto timer = TimerBegin();
 
+        #if P2_PARTITIONED_MARKING
+            const uint64 lTableCount = cx.entryCount[i-1];
+
+            uint32*      lTableCounts = cx.usedEntryCounts[i-1];
+
+            if( i == (int)TableId::Table7 )
+                MarkTablePartitioned<false>( rTable, rTableCount, nullptr, lTableMarkingBuffer, lTableCount, lTableCounts );
+            else
+                MarkTablePartitioned<true>( rTable, rTableCount, (byte*)cx.usedEntries[i], lTableMarkingBuffer, lTableCount, lTableCounts );
+        #else
         if( i == (int)TableId::Table7 )
         {
             // Table 6 which does not have a rightMarkedEntries buffer, as all of table 7's entries are valid
@@ -103,6 +140,7 @@ void MemPhase2::Run()
 
             MarkTable<true>( rTable, rTableCount, rTableMarkedEntries, lTableMarkingBuffer );
         }
+        #endif
 
         double elapsed = TimerEnd( timer );
         Log::Line( "  Finished prunning table %d in %.2lf seconds.", i, elapsed );
@@ -144,6 +182,19 @@ void MemPhase2::ClearMarkingBuffers()
 
     for( uint i = 0; i < 5; i++ )
         cx.usedEntries[i+1] = markingBuffer + i * maxEntries;
+
+    // Marked entry counts are stored right after the marking buffers
+    cx.usedEntryCounts[0] = nullptr;
+
+    for( uint i = 0; i < 5; i++ )
+    {
+        #if P2_PARTITIONED_MARKING && P2_COUNT_MARKED_ENTRIES
+            const uint64 countsPerTable = maxEntries >> P2_MARK_RANGE_BITS;
+            cx.usedEntryCounts[i+1] = (uint32*)( markingBuffer + totalSize ) + i * countsPerTable;
+        #else
+            cx.usedEntryCounts[i+1] = nullptr;
+        #endif
+    }
 }
 
 //-----------------------------------------------------------
@@ -174,6 +225,179 @@ void MemPhase2::MarkTable( const Pair* rightTable, uint64 rightEntryCount, const
     cx.threadPool->RunJob( MarkEntriesThread<HasRightTableMarkingBuffer>, jobs, threadCount );
 }
 
+// Marks the left table's entries in 3 passes, so that no two threads write to the same region:
+// The referenced left indices are first counted and distributed into partitions of P2_MARK_RANGE_BITS
+// entries each, then each thread marks a contiguous run of partitions on its own.
+// The distributed indices are stored in metaBuffer1, which is not in use during Phase 2.
+//-----------------------------------------------------------
+template<bool HasRightTableMarkingBuffer>
+void MemPhase2::MarkTablePartitioned( const Pair* rightTable, uint64 rightEntryCount, const byte* rMarkedEntries, 
+                                      byte* lMarkingBuffer, uint64 leftEntryCount, uint32* lMarkedCounts )
+{
+    MemPlotContext& cx = _context;
+
+    const uint   threadCount           = cx.threadCount;
+    const uint64 rightEntriesPerThread = rightEntryCount / threadCount;
+
+    const uint32 partitionShift = P2_MARK_RANGE_BITS;
+    const uint32 partitionCount = (uint32)CDiv( leftEntryCount, 1 << partitionShift );
+
+    // Counts for each thread and the start of each partition, followed by the distributed indices
+    uint64* counts          = cx.metaBuffer1;
+    uint64* partitionStarts = counts + (size_t)threadCount * partitionCount;
+    uint32* indices         = (uint32*)( partitionStarts + partitionCount );
+
+    ASSERT( ( (size_t)threadCount + 1 ) * partitionCount * sizeof( uint64 ) + rightEntryCount * 2 * sizeof( uint32 ) <= 64ull GB );
+
+    PartitionMarkJob jobs[MAX_THREADS];
+
+    for( uint i = 0; i < threadCount; i++ )
+    {
+        auto& job = jobs[i];
+
+        job.startIndex         = i * rightEntriesPerThread;
+        job.rightEntryCount    = rightEntriesPerThread;
+        job.rightEntries       = rightTable;
+        job.rightMarkedEntries = rMarkedEntries;
+        job.partitionShift     = partitionShift;
+        job.counts             = counts + (size_t)i * partitionCount;
+        job.indices            = indices;
+        job.leftMarkingBuffer  = lMarkingBuffer;
+        job.leftMarkedCounts   = lMarkedCounts;
+
+        memset( job.counts, 0, sizeof( uint64 ) * partitionCount );
+    }
+
+    if( lMarkedCounts )
+        memset( lMarkedCounts, 0, sizeof( uint32 ) * partitionCount );
+
+    jobs[threadCount-1].rightEntryCount += (rightEntryCount - ( rightEntriesPerThread  * threadCount ) );
+
+    cx.threadPool->RunJob( CountPartitionsThread<HasRightTableMarkingBuffer>, jobs, threadCount );
+
+    // Turn the counts into offsets, ordered by partition first, then by thread.
+    // Save where each partition starts, so that we can split the marking work.
+    uint64 totalIndices = 0;
+
+    for( uint32 p = 0; p < partitionCount; p++ )
+    {
+        partitionStarts[p] = totalIndices;
+
+        for( uint i = 0; i < threadCount; i++ )
+        {
+            const uint64 count = jobs[i].counts[p];
+            jobs[i].counts[p]  = totalIndices;
+            totalIndices += count;
+        }
+    }
+
+    // Give each thread a contiguous run of partitions with about the same amount of indices.
+    uint32 partition = 0;
+    for( uint i = 0; i < threadCount; i++ )
+    {
+        auto& job = jobs[i];
+
+        const uint64 target = totalIndices * (i+1) / threadCount;
+
+        job.indexStart = partition < partitionCount ? partitionStarts[partition] : totalIndices;
+
+        while( partition < partitionCount && partitionStarts[partition] < target )
+            partition++;
+
+        job.indexEnd = partition < partitionCount ? partitionStarts[partition] : totalIndices;
+    }
+
+    jobs[threadCount-1].indexEnd = totalIndices;
+    
+    cx.threadPool->RunJob( DistributePartitionsThread<HasRightTableMarkingBuffer>, jobs, threadCount );
+    cx.threadPool->RunJob( MarkPartitionsThread, jobs, threadCount );
+}
+
+//-----------------------------------------------------------
+template<bool HasRightTableMarkingBuffer>
+void CountPartitionsThread( PartitionMarkJob* job )
+{
+    const uint64 startIndex  = job->startIndex;
+    const uint64 endIndex    = startIndex + job->rightEntryCount;
+
+    const Pair*  rightEntries       = job->rightEntries;
+    const byte*  rightMarkedEntries = job->rightMarkedEntries;
+    const uint32 shift              = job->partitionShift;
+
+    uint64* counts = job->counts;
+
+    for( uint64 i = startIndex; i < endIndex; i++ )
+    {
+        if constexpr ( HasRightTableMarkingBuffer )
+        {
+            if( !rightMarkedEntries[i] )
+                continue;
+        }
+
+        const Pair& entry = rightEntries[i];
+
+        counts[entry.left  >> shift]++;
+        counts[entry.right >> shift]++;
+    }
+}
+
+//-----------------------------------------------------------
+template<bool HasRightTableMarkingBuffer>
+void DistributePartitionsThread( PartitionMarkJob* job )
+{
+    const uint64 startIndex  = job->startIndex;
+    const uint64 endIndex    = startIndex + job->rightEntryCount;
+
+    const Pair*  rightEntries       = job->rightEntries;
+    const byte*  rightMarkedEntries = job->rightMarkedEntries;
+    const uint32 shift              = job->partitionShift;
+
+    uint64* offsets = job->counts;
+    uint32* indices = job->indices;
+
+    for( uint64 i = startIndex; i < endIndex; i++ )
+    {
+        if constexpr ( HasRightTableMarkingBuffer )
+        {
+            if( !rightMarkedEntries[i] )
+                continue;
+        }
+
+        const Pair& entry = rightEntries[i];
+
+        indices[offsets[entry.left  >> shift]++] = entry.left;
+        indices[offsets[entry.right >> shift]++] = entry.right;
+    }
+}
+
+//-----------------------------------------------------------
+void MarkPartitionsThread( PartitionMarkJob* job )
+{
+    const uint32* indices       = job->indices;
+    byte*         markingBuffer = job->leftMarkingBuffer;
+    uint32*       markedCounts  = job->leftMarkedCounts;
+    const uint32  shift         = job->partitionShift;
+
+    const uint64  end = job->indexEnd;
+
+    if( markedCounts )
+    {
+        // Our partitions are cache-resident, so counting first-time marks is cheap
+        for( uint64 i = job->indexStart; i < end; i++ )
+        {
+            const uint32 idx = indices[i];
+            
+            markedCounts[idx >> shift] += markingBuffer[idx] ^ 1;
+            markingBuffer[idx] = 1;
+        }
+    }
+    else
+    {
+        for( uint64 i = job->indexStart; i < end; i++ )
+            markingBuffer[indices[i]] = 1;
+    }
+}
+
 //-----------------------------------------------------------
 void ClearMarkedEntriesThread( ClearMarkingBufferJob* job )
 {
@@ -287,7 +511,8 @@ void DbgReadWritePhase2MarkedEntries( MemPlotContext& cx, bool write )
 
     for( uint i = 1; i < 6; i++ )
     {
-        cx.usedEntries[i] = markingBuffer + (i-1) * sizePerTable;
+        cx.usedEntries[i]     = markingBuffer + (i-1) * sizePerTable;
+        cx.usedEntryCounts[i] = nullptr;
 
         if( write )
         {
@@ -23,6 +23,10 @@ private:
     template<bool HasRightTableMarkingBuffer>
     void MarkTable( const Pair* rightTable, uint64 rightEntryCount, const byte* rMarkedEntries, byte* lMarkingBuffer );
 
+    template<bool HasRightTableMarkingBuffer>
+    void MarkTablePartitioned( const Pair* rightTable, uint64 rightEntryCount, const byte* rMarkedEntries, 
+                               byte* lMarkingBuffer, uint64 leftEntryCount, uint32* lMarkedCounts );
+
 private:
     MemPlotContext& _context;
 };
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include "algorithm/RadixSort.h"
 #include "LPGen.h"
 #include "ParkWriter.h"
+#include "LPBucketSort.h"
+#include "threading/TaskGraph.h"
 #include <cmath>
 
 #include "DbgHelper.h"
@@ -45,15 +47,16 @@ void MemPhase3::Run()
         Pair*        rTable       = rTables[i+1];
         const uint64 rTableCount  = cx.entryCount[i+1];
         const byte*  rUsedEntries = i < (uint)TableId::Table6 ? (byte*)cx.usedEntries[i+1] : nullptr;
+        const uint32* rUsedCounts = i < (uint)TableId::Table6 ? cx.usedEntryCounts[i+1] : nullptr;
 
         Log::Line( "  Compressing tables %u and %u...", i+1, i+2 );
         auto tableTimer = TimerBegin();
         
         uint64 newCount;
         if( i == (uint)TableId::Table6 )
-            newCount = ProcessTable<true> ( lTable, lpBuffer, rTable, rTableCount, rUsedEntries, (TableId)i );
+            newCount = ProcessTable<true> ( lTable, lpBuffer, rTable, rTableCount, rUsedEntries, rUsedCounts, (TableId)i );
         else
-            newCount = ProcessTable<false>( lTable, lpBuffer, rTable, rTableCount, rUsedEntries, (TableId)i ); 
+            newCount = ProcessTable<false>( lTable, lpBuffer, rTable, rTableCount, rUsedEntries, rUsedCounts, (TableId)i ); 
 
         double tElapsed = TimerEnd( tableTimer );
         Log::Line( "  Finished compressing tables %u and %u in %.2lf seconds", i+1, i+2, tElapsed );
@@ -62,10 +65,207 @@ void MemPhase3::Run()
     }
 }
 
+//-----------------------------------------------------------
+bool MemPhase3::UsePartitionedLookup( const double cost[2][7], const TableId tableId ) const
+{
+#if P3_PARTITIONED_LOOKUP_MODE == 1
+    return true;
+#elif P3_PARTITIONED_LOOKUP_MODE == 2
+    // Go direct on the first plot and partitioned on the second one.
+    // After that, pick whichever ended up being fastest for this table.
+    const double directCost      = cost[0][(int)tableId];
+    const double partitionedCost = cost[1][(int)tableId];
+
+    if( directCost == 0 )
+        return false;
+
+    if( partitionedCost == 0 )
+        return true;
+
+    return partitionedCost < directCost;
+#else
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------
+static void RecordLookupCost( double cost[2][7], const bool partitioned, const TableId tableId, 
+                              const double elapsed, const char* name )
+{
+    cost[partitioned ? 1 : 0][(int)tableId] = elapsed;
+
+#if P3_PARTITIONED_LOOKUP_MODE == 2
+    const double directCost      = cost[0][(int)tableId];
+    const double partitionedCost = cost[1][(int)tableId];
+
+    if( directCost > 0 && partitionedCost > 0 )
+    {
+        Log::Line( "  %s: direct %.2lfs, partitioned %.2lfs. Used %s.", 
+            name, directCost, partitionedCost, partitioned ? "partitioned" : "direct" );
+    }
+#endif
+}
+
+// Splits a table of the given length into at most P3_LOOKUP_REGION_COUNT regions
+//-----------------------------------------------------------
+static uint32 GetLookupRegionShift( const uint64 length )
+{
+    uint32 regionShift = 0;
+    while( length > 0 && ( ( length - 1 ) >> regionShift ) >= P3_LOOKUP_REGION_COUNT )
+        regionShift++;
+
+    return regionShift;
+}
+
+// Returns the largest partitioned lookup block size that fits in the given scratch space,
+// or 0 if it can't fit a useful block.
+//-----------------------------------------------------------
+static uint64 GetLookupBlockSize( const size_t scratchSize, const uint threadCount )
+{
+    const uint64 blockSize = std::min( P3_LOOKUP_MAX_BLOCK_SIZE, (uint64)( scratchSize / threadCount / P3_LOOKUP_SCRATCH_PER_ENTRY ) );
+    return blockSize >= P3_LOOKUP_MIN_BLOCK_SIZE ? blockSize : 0;
+}
+
+//-----------------------------------------------------------
+static void SubmitParkChunk( void* data, const byte* parks, size_t size )
+{
+    reinterpret_cast<DiskPlotWriter*>( data )->SubmitTableChunk( size );
+}
+
+struct CountF7Job
+{
+    const uint32* f7;
+    uint64        length;
+    uint64        count;        // Out: Entries of the value 0xFFFFFFFF
+};
+
+//-----------------------------------------------------------
+static void CountF7Thread( CountF7Job* job )
+{
+    const uint32* f7  = job->f7;
+    const uint64  end = job->length;
+
+    uint64 count = 0;
+    for( uint64 i = 0; i < end; i++ )
+        count += f7[i] == 0xFFFFFFFF;
+
+    job->count = count;
+}
+
+//-----------------------------------------------------------
+uint64 MemPhase3::GetTrimmedTable7Count( MemPlotContext& cx )
+{
+    const uint64 f7Count     = cx.entryCount[(uint)TableId::Table7];
+    const uint   threadCount = cx.threadCount;
+    const uint64 perThread   = f7Count / threadCount;
+
+    CountF7Job jobs[MAX_THREADS];
+
+    for( uint i = 0; i < threadCount; i++ )
+    {
+        auto& job  = jobs[i];
+        job.f7     = cx.t7YBuffer + i * perThread;
+        job.length = perThread;
+        job.count  = 0;
+    }
+
+    jobs[threadCount-1].length += f7Count - perThread * threadCount;
+
+    cx.threadPool->RunJob( CountF7Thread, jobs, threadCount );
+
+    uint64 t7Count = f7Count;
+    for( uint i = 0; i < threadCount; i++ )
+        t7Count -= jobs[i].count;
+
+    return t7Count;
+}
+
+// State for the steps that follow the line point sort
+struct P3SortedTasks
+{
+    MemPlotContext* cx;
+    TableId         tableId;
+    uint64          length;         // Entries left after pruning
+    uint64          lookupLength;   // Entries in the lookup table (before pruning)
+    uint64          parkLength;     // Entries to park
+    uint64*         lpBuffer;
+    uint32*         map;
+    uint32*         lookup;
+    byte*           scratch;        // For the partitioned scatter
+    size_t          scratchSize;
+    bool            partitioned;    // Partition the scatter, if the scratch space allows it
+    byte*           parkBuffer;
+    size_t          parksSize;      // Set by WriteParksTask
+};
+
+//-----------------------------------------------------------
+static void WriteLookupTableTask( ThreadPool& pool, P3SortedTasks* tasks )
+{
+    const uint   threadCount      = pool.ThreadCount();
+    const uint64 length           = tasks->length;
+    const uint64 entriesPerThread = length / threadCount;
+
+    const uint64 blockSize   = GetLookupBlockSize( tasks->scratchSize, threadCount );
+    const uint32 regionShift = GetLookupRegionShift( tasks->lookupLength );
+    const bool   partitioned = tasks->partitioned && blockSize;
+
+    LPJob jobs[MAX_THREADS];
+
+    for( uint i = 0; i < threadCount; i++ )
+    {
+        auto& job = jobs[i];
+
+        job.offset      = i * entriesPerThread;
+        job.length      = entriesPerThread;
+        job.map         = tasks->map;
+        job.lTable      = tasks->lookup;
+        job.partitioned = partitioned;
+        job.regionShift = regionShift;
+        job.blockSize   = blockSize;
+        job.scratch     = tasks->scratch + i * blockSize * P3_LOOKUP_SCRATCH_PER_ENTRY;
+    }
+
+    jobs[threadCount-1].length += length - entriesPerThread * threadCount;
+
+    auto timer = TimerBegin();
+    pool.RunJob( WriteLookupTableThread, jobs, threadCount );
+    RecordLookupCost( tasks->cx->lookupScatterCost, partitioned, tasks->tableId, TimerEnd( timer ), "Lookup table scatter" );
+}
+
+//-----------------------------------------------------------
+static void SortF7Task( ThreadPool& pool, P3SortedTasks* tasks )
+{
+    MemPlotContext& cx = *tasks->cx;
+
+    uint32* t7SortTmp       = (uint32*)cx.yBuffer0; // Don't need yBuffer0 at this point, safe to use
+    uint32* lEntriesSortTmp = (uint32*)cx.yBuffer1;
+
+    // We need to sort on f7 now, with lEntries with
+    // contain now the index into table 6's LinePoints
+    RadixSort256::SortWithKey<MAX_THREADS>( pool,
+        cx.t7YBuffer,  t7SortTmp,
+        tasks->lookup, lEntriesSortTmp,
+        tasks->length );
+}
+
+//-----------------------------------------------------------
+static void WriteParksTask( ThreadPool& pool, P3SortedTasks* tasks )
+{
+    const uint table = (uint)tasks->tableId;
+
+    tasks->parksSize = WriteParks<MAX_THREADS>( pool, tasks->parkLength, tasks->lpBuffer, tasks->parkBuffer, tasks->tableId );
+
+    // Send over the park for writing in the plot file in the background,
+    // at its offset in the file, while the rest of the graph is still running
+    if( !tasks->cx->plotWriter->WriteTableAt( table, tasks->parkBuffer, tasks->parksSize ) )
+        Fatal( "Failed to write table %d to disk.", (int)table+1 );
+}
+
 //-----------------------------------------------------------
 template<bool IsTable6>
 uint64 MemPhase3::ProcessTable( uint32* lEntries, uint64* lpBuffer, Pair* rTable,
-                                const uint64 rTableCount, const byte* markedEntries, TableId tableId )
+                                const uint64 rTableCount, const byte* markedEntries, 
+                                const uint32* markedCounts, TableId tableId )
 {
     auto& cx = _context;
 
@@ -85,6 +285,17 @@ uint64 MemPhase3::ProcessTable( uint32* lEntries, uint64* lpBuffer, Pair* rTable
 
     uint32* map = (uint32*)cx.metaBuffer1;
 
+    // The rest of meta1 is not used until the line points are sorted,
+    // so it serves as scratch for the partitioned gather.
+    // (meta1 is the same size as meta0, which holds maxPairs pairs.)
+    const size_t metaBuffer1Size = cx.maxPairs * sizeof( Pair );
+
+    byte*        gatherScratch   = (byte*)( map + rTableCount );
+    const uint64 gatherBlockSize = GetLookupBlockSize( metaBuffer1Size - rTableCount * sizeof( uint32 ), threadCount );
+    const uint32 gatherShift     = GetLookupRegionShift( cx.entryCount[(int)tableId] );
+
+    const bool   partitionedGather = gatherBlockSize && UsePartitionedLookup( cx.lpGatherCost, tableId );
+
     std::atomic<uint> threadSignal = 0;
     std::atomic<uint> releaseLock  = 0;
     
@@ -104,12 +315,49 @@ uint64 MemPhase3::ProcessTable( uint32* lEntries, uint64* lpBuffer, Pair* rTable
 
         job.markedEntries = markedEntries;
         job.map           = map;
+        job.prunedKnown   = false;
+
+        job.partitioned   = partitionedGather;
+        job.regionShift   = gatherShift;
+        job.blockSize     = gatherBlockSize;
+        job.scratch       = gatherScratch + i * gatherBlockSize * P3_LOOKUP_SCRATCH_PER_ENTRY;
     }
 
     jobs[threadCount-1].length += trailingEntries;
 
+    // If Phase 2 counted the marked entries per range, split the table on those ranges
+    // so that each thread knows where its pruned entries go without counting them first.
+    if( markedCounts && !IsTable6 )
+    {
+        const uint64 rangeSize  = 1ull << P2_MARK_RANGE_BITS;
+        const uint64 rangeCount = CDiv( rTableCount, (int)rangeSize );
+
+        uint64 range        = 0;
+        uint64 prunedOffset = 0;
+
+        for( uint i = 0; i < threadCount; i++ )
+        {
+            auto& job = jobs[i];
+
+            const uint64 rangeEnd = rangeCount * (i+1) / threadCount;
+
+            job.offset       = std::min( range * rangeSize, rTableCount );
+            job.length       = std::min( rangeEnd * rangeSize, rTableCount ) - job.offset;
+            job.prunedKnown  = true;
+            job.prunedOffset = prunedOffset;
+
+            for( ; range < rangeEnd; range++ )
+                prunedOffset += markedCounts[range];
+
+            job.prunedLength = prunedOffset - job.prunedOffset;
+        }
+    }
+
     constexpr bool PruneTable = !IsTable6;
+
+    auto gatherTimer = TimerBegin();
     cx.threadPool->RunJob( ProcessTableThread<PruneTable>, jobs, threadCount );
+    RecordLookupCost( cx.lpGatherCost, partitionedGather, tableId, TimerEnd( gatherTimer ), "Line point gather" );
 
 
     // Get the new total length after the prune
@@ -128,55 +376,114 @@ uint64 MemPhase3::ProcessTable( uint32* lEntries, uint64* lpBuffer, Pair* rTable
     }
 
 
-    // Sort LinePoints, along with the map
-    RadixSort256::SortWithKey<MAX_THREADS>( *cx.threadPool,
-        lpBuffer, (uint64*)rTable,
-        map,      map + newLength,  // This is meta1, so there's plenty of space to hold both buffers
-        newLength );
-    
-
-    // Write lookup table (map it based on sort key)
-    // After this step lEntries will contain the new index map into the LP's
-    cx.threadPool->RunJob( WriteLookupTableThread, jobs, threadCount );
+    // Write park for table (re-use rTable for it)
+    // #NOTE: For table 6: rTable is meta0 here.
+    byte* parkBuffer = _context.plotWriter->AlignPointerToBlockSize<byte>( (void*)rTable );
 
+    // Table 6's parks only hold the entries left once f7 is trimmed below,
+    // so they are written after the trim, as they are without the bucketed sort.
+    constexpr bool WriteParksWhileSorting = P3_BUCKETED_LP_SORT && !IsTable6;
 
-    if constexpr ( IsTable6 )
+    if constexpr ( WriteParksWhileSorting )
     {
-        uint32* t7SortTmp       = (uint32*)cx.yBuffer0; // Don't need yBuffer0 at this point, safe to use
-        uint32* lEntriesSortTmp = (uint32*)cx.yBuffer1;
-
-        // We need to sort on f7 now, with lEntries with
-        // contain now the index into table 6's LinePoints
+        // Sort LinePoints, along with the map, writing the parks as the line points are sorted.
+        // The parks are streamed to disk as they are written.
+        if( !cx.plotWriter->BeginTable( parkBuffer ) )
+            Fatal( "Failed to write table %d to disk.", (int)tableId+1 );
+
+        const size_t sizeTableParks = SortLinePointsAndWriteParks( *cx.threadPool, newLength,
+            lpBuffer, (uint64*)rTable,
+            map,      map + newLength,  // This is meta1, so there's plenty of space to hold both buffers
+            parkBuffer, tableId,
+            map + newLength * 2,
+            SubmitParkChunk, cx.plotWriter );
+
+        if( !cx.plotWriter->EndTable( sizeTableParks ) )
+            Fatal( "Failed to write table %d to disk.", (int)tableId+1 );
+    }
+    else
+    {
+        // Sort LinePoints, along with the map
         RadixSort256::SortWithKey<MAX_THREADS>( *cx.threadPool,
-            cx.t7YBuffer, t7SortTmp,
-            lEntries,     lEntriesSortTmp,
+            lpBuffer, (uint64*)rTable,
+            map,      map + newLength,  // This is meta1, so there's plenty of space to hold both buffers
             newLength );
-
-        // #NOTE: Because the C2 table size is inferred by substracting table pointers
-        //        in chiapos, we need to make sure we don't have any f7 entries with the
-        //        value of 0xFFFFFFFF. See WriteC12Parallel in Phase4 for more details.
-        while( newLength && cx.t7YBuffer[newLength-1] == 0xFFFFFFFF )
-            --newLength;
-
-        cx.entryCount[(uint)TableId::Table7] = newLength;
     }
+    
+
+    // Table 6 only parks the entries left once the f7 entries of value 0xFFFFFFFF are trimmed.
+    // #NOTE: Because the C2 table size is inferred by substracting table pointers
+    //        in chiapos, we need to make sure we don't have any f7 entries with the
+    //        value of 0xFFFFFFFF. See WriteC12Parallel in Phase4 for more details.
+    //        They're counted before the f7 sort, so that the parks don't have to wait for it.
+    const uint64 parkLength = IsTable6 ? GetTrimmedTable7Count( cx ) : newLength;
 
     #if DBG_WRITE_LINE_POINTS
     {
         char filePath[512];
         snprintf( filePath, sizeof( filePath ), "%slp.t%d.tmp", DBG_TABLES_PATH, (int)tableId+1 );
-        DbgWriteTableToFile( *cx.threadPool, filePath, newLength, lpBuffer, true );
+        DbgWriteTableToFile( *cx.threadPool, filePath, parkLength, lpBuffer, true );
     }
     #endif
 
-    // Write park for table (re-use rTable for it)
-    // #NOTE: For table 6: rTable is meta0 here.
-    byte*  parkBuffer     = _context.plotWriter->AlignPointerToBlockSize<byte>( (void*)rTable );
-    size_t sizeTableParks = WriteParks<MAX_THREADS>( *cx.threadPool, newLength, lpBuffer, parkBuffer, tableId );
-    
-    // Send over the park for writing in the plot file in the background
-    if( !cx.plotWriter->WriteTable( parkBuffer, sizeTableParks ) )
-        Fatal( "Failed to write table %d to disk.", (int)tableId+1 );
+    // Run the steps that follow the sort as a graph, so that the parks,
+    // if they were not written while sorting, are written alongside
+    // the lookup table and table 6's f7 sort, which depend on each other.
+    P3SortedTasks tasks;
+    tasks.cx           = &cx;
+    tasks.tableId      = tableId;
+    tasks.length       = newLength;
+    tasks.lookupLength = rTableCount;
+    tasks.parkLength   = parkLength;
+    tasks.lpBuffer     = lpBuffer;
+    tasks.map          = map;
+    tasks.lookup       = lEntries;
+    tasks.scratch      = (byte*)( map + newLength );    // The rest of meta1 is free again after the sort
+    tasks.scratchSize  = metaBuffer1Size - newLength * sizeof( uint32 );
+    tasks.partitioned  = UsePartitionedLookup( cx.lookupScatterCost, tableId );
+    tasks.parkBuffer   = parkBuffer;
+    tasks.parksSize    = 0;
+
+    TaskGraph graph( *cx.threadPool );
+
+    // Write lookup table (map it based on sort key)
+    // After this step lEntries will contain the new index map into the LP's.
+    const uint lookupTask = graph.AddTask( "Write lookup table", WriteLookupTableTask, &tasks );
+    graph.Reads ( lookupTask, map          , newLength   * sizeof( uint32 ) );
+    graph.Writes( lookupTask, lEntries     , rTableCount * sizeof( uint32 ) );
+    graph.Writes( lookupTask, tasks.scratch, tasks.scratchSize );
+
+    if constexpr ( IsTable6 )
+    {
+        const size_t f7Size = newLength * sizeof( uint32 );
+
+        const uint sortTask = graph.AddTask( "Sort f7", SortF7Task, &tasks );
+        graph.Writes( sortTask, cx.t7YBuffer, f7Size );
+        graph.Writes( sortTask, lEntries    , f7Size );
+        graph.Writes( sortTask, cx.yBuffer0 , f7Size );
+        graph.Writes( sortTask, cx.yBuffer1 , f7Size );
+    }
+
+    if constexpr ( !WriteParksWhileSorting )
+    {
+        const size_t parksSize = CDiv( parkLength, kEntriesPerPark ) * CalculateParkSize( tableId );
+
+        // Parks are compressed, so give them a larger share of the threads
+        const uint parksTask = graph.AddTask( "Write parks", WriteParksTask, &tasks, 2 );
+        graph.Writes( parksTask, lpBuffer  , parkLength * sizeof( uint64 ) );
+        graph.Writes( parksTask, parkBuffer, parksSize );
+    }
+
+    graph.Run();
+
+    if constexpr ( IsTable6 )
+    {
+        while( newLength && cx.t7YBuffer[newLength-1] == 0xFFFFFFFF )
+            --newLength;
+
+        ASSERT( newLength == parkLength );
+        cx.entryCount[(uint)TableId::Table7] = newLength;
+    }
 
     if constexpr ( IsTable6 )
     {
@@ -211,12 +518,22 @@ void ProcessTableThread( LPJob* job )
 
     if constexpr ( PruneTable )
     {
+    #if P3_FUSED_PRUNE_LP
+        // Prune straight to line points
+        PruneToLinePointThread( job );
+    #else
         PruneAndMapThread( job );
         job->WaitForThreads();
-    }
 
-    // Convert to LinePoint
-    ConverToLinePointThread( job );
+        // Convert to LinePoint
+        ConverToLinePointThread( job );
+    #endif
+    }
+    else
+    {
+        // Convert to LinePoint
+        ConverToLinePointThread( job );
+    }
 
 
     // If it's the last table pair, perform a few things differently.
@@ -239,20 +556,28 @@ void ProcessTableThread( LPJob* job )
     }
 }
 
+// Determines how many entries are left in our range after pruning
+// and where they go in the pruned table. Sets them as our job's new length and offset.
+// Returns our original offset.
 //-----------------------------------------------------------
-void PruneAndMapThread( LPJob* job )
+uint64 GetPrunedRange( LPJob* job )
 {
     const byte*  markedEntries = job->markedEntries;
 
-    uint64       length        = job->length;
-
     const uint64 srcOffset     = job->offset; 
-    const uint64 end           = srcOffset + length;
+    const uint64 end           = srcOffset + job->length;
 
-    Pair* pairs = job->rTable;
+    uint64 dstOffset = 0;
 
-    // Scan entries
+    if( job->prunedKnown )
+    {
+        // Phase 2 already counted our entries
+        dstOffset   = job->prunedOffset;
+        job->length = job->prunedLength;
+    }
+    else
     {
+        // Scan entries
         uint64 newLength = 0;
         
         for( uint64 i = srcOffset; i < end; i++ )
@@ -261,30 +586,43 @@ void PruneAndMapThread( LPJob* job )
                 newLength ++;
         }
 
-        length      = newLength;
         job->length = newLength;
-    }
-
-    // Wait for other entries so that can determine
-    // the new position to copy to.
-    job->WaitForThreads();
 
-    ///
-    /// Prune to new buffer
-    ///
-     
-    // Get our new offset
-    uint64 dstOffset = 0;
+        // Wait for other entries so that can determine
+        // the new position to copy to.
+        job->WaitForThreads();
 
-    const uint  threadId = job->_threadId;
-    const auto* jobs     = job->jobs;
+        // Get our new offset
+        const uint  threadId = job->_threadId;
+        const auto* jobs     = job->jobs;
 
-    for( uint i = 0; i < threadId; i++ )
-        dstOffset += jobs[i].length;
+        for( uint i = 0; i < threadId; i++ )
+            dstOffset += jobs[i].length;
+    }
 
     // Store new offset
     job->offset = dstOffset;
 
+    return srcOffset;
+}
+
+//-----------------------------------------------------------
+void PruneAndMapThread( LPJob* job )
+{
+    const byte*  markedEntries = job->markedEntries;
+
+    const uint64 srcLength     = job->length;
+    const uint64 srcOffset     = GetPrunedRange( job );
+    const uint64 end           = srcOffset + srcLength;
+
+    const uint64 dstOffset     = job->offset;
+
+    Pair* pairs = job->rTable;
+
+    ///
+    /// Prune to new buffer
+    ///
+
     // Copy our valid entries to the new buffer
     uint32* map      = job->map + dstOffset;
     Pair*   newPairs = (Pair*)(job->lpBuffer + dstOffset);
@@ -302,7 +640,76 @@ void PruneAndMapThread( LPJob* job )
         dstI++; 
     }
 
-    ASSERT( dstI == length );
+    ASSERT( dstI == job->length );
+}
+
+// Same as PruneAndMapThread followed by ConverToLinePointThread,
+// but the surviving pairs are converted as they are read, so the pruned
+// pairs are never written out and read back.
+//-----------------------------------------------------------
+void PruneToLinePointThread( LPJob* job )
+{
+    const byte*  markedEntries = job->markedEntries;
+
+    const uint64 srcLength     = job->length;
+    const uint64 srcOffset     = GetPrunedRange( job );
+    const uint64 end           = srcOffset + srcLength;
+
+    const Pair*   pairs  = job->rTable;
+    const uint32* lTable = job->lTable;
+
+    uint32* map = job->map      + job->offset;
+    uint64* lps = job->lpBuffer + job->offset;
+
+    uint64 dstI = 0;
+
+    if( job->partitioned )
+    {
+        // Prune the pairs in place of their line points,
+        // and convert them one block at a time.
+        const uint32 regionShift = job->regionShift;
+        const uint64 blockSize   = job->blockSize;
+        uint64       blockStart  = 0;
+
+        for( uint64 i = srcOffset; i < end; i++ )
+        {
+            if( !markedEntries[i] )
+                continue;
+
+            ((Pair*)lps)[dstI] = pairs[i];
+            map[dstI] = (uint32)i;
+
+            if( ++dstI - blockStart == blockSize )
+            {
+                ConvertBlockToLinePoints( lps + blockStart, blockSize, lTable, regionShift, blockSize, job->scratch );
+                blockStart = dstI;
+            }
+        }
+
+        ConvertBlockToLinePoints( lps + blockStart, dstI - blockStart, lTable, regionShift, blockSize, job->scratch );
+
+        ASSERT( dstI == job->length );
+        return;
+    }
+
+    for( uint64 i = srcOffset; i < end; i++ )
+    {
+        if( !markedEntries[i] )
+            continue;
+
+        const Pair& rEntry = pairs[i];
+
+        const uint64 x = lTable[rEntry.left ];
+        const uint64 y = lTable[rEntry.right];
+        ASSERT( x || y );
+
+        lps[dstI] = SquareToLinePoint( x, y );
+        map[dstI] = (uint32)i;    // Map the entry back to its original location
+
+        dstI++;
+    }
+
+    ASSERT( dstI == job->length );
 }
 
 //-----------------------------------------------------------
@@ -313,6 +720,12 @@ void ConverToLinePointThread( LPJob* job )
     Pair*         rTable = (Pair*)(job->lpBuffer + job->offset);
     const uint32* lTable = job->lTable;
 
+    if( job->partitioned )
+    {
+        ConvertBlockToLinePoints( (uint64*)rTable, length, lTable, job->regionShift, job->blockSize, job->scratch );
+        return;
+    }
+
     for( uint64 i = 0; i < length; i++ )
     {
         const Pair* rEntry = &rTable[i];
@@ -337,8 +750,109 @@ void WriteLookupTableThread( LPJob* job )
     const uint32* map    = job->map;
     uint32*       lookup = job->lTable;
 
-    for( uint64 i = offset; i < end; i++ )
-        lookup[map[i]] = (uint32)i;
+    if( !job->partitioned )
+    {
+        for( uint64 i = offset; i < end; i++ )
+            lookup[map[i]] = (uint32)i;
+
+        return;
+    }
+
+    // Scatter a block of entries at a time. The block's entries are first partitioned
+    // by the lookup table region they are written to, so that the writes walk
+    // the lookup table one region at a time.
+    const uint32 regionShift = job->regionShift;
+    const uint64 blockSize   = job->blockSize;
+
+    uint32* blockIndices = (uint32*)job->scratch;
+    uint32* blockValues  = blockIndices + blockSize;
+
+    uint32 counts[P3_LOOKUP_REGION_COUNT];
+
+    for( uint64 blockStart = offset; blockStart < end; blockStart += blockSize )
+    {
+        const uint64 blockEnd = std::min( blockStart + blockSize, end );
+
+        memset( counts, 0, sizeof( counts ) );
+
+        for( uint64 i = blockStart; i < blockEnd; i++ )
+            counts[map[i] >> regionShift]++;
+
+        uint32 sum = 0;
+        for( uint32 r = 0; r < P3_LOOKUP_REGION_COUNT; r++ )
+        {
+            const uint32 count = counts[r];
+            counts[r] = sum;
+            sum += count;
+        }
+
+        for( uint64 i = blockStart; i < blockEnd; i++ )
+        {
+            const uint32 idx = counts[map[i] >> regionShift]++;
+
+            blockIndices[idx] = map[i];
+            blockValues [idx] = (uint32)i;
+        }
+
+        // Scatter in region order
+        const uint64 blockLength = blockEnd - blockStart;
+
+        for( uint64 i = 0; i < blockLength; i++ )
+            lookup[blockIndices[i]] = blockValues[i];
+    }
+}
+
+// Converts pairs, stored in place of their line points, one block at a time.
+// The block's pairs are first partitioned by the left table region of their left entry
+// (their right entry is at most a couple of kBC groups away), so that the lTable reads walk
+// the table one region at a time. The line points are written back to the pairs' locations.
+//-----------------------------------------------------------
+void ConvertBlockToLinePoints( uint64* lps, const uint64 length, const uint32* lTable, 
+                               const uint32 regionShift, const uint64 blockSize, byte* scratch )
+{
+    Pair*   blockPairs = (Pair*)scratch;
+    uint32* blockDst   = (uint32*)( blockPairs + blockSize );
+
+    uint32 counts[P3_LOOKUP_REGION_COUNT];
+
+    for( uint64 blockStart = 0; blockStart < length; blockStart += blockSize )
+    {
+        const uint64 blockLength = std::min( blockSize, length - blockStart );
+        uint64*      blockLps    = lps + blockStart;
+        const Pair*  pairs       = (const Pair*)blockLps;
+
+        // Partition the pairs by region
+        memset( counts, 0, sizeof( counts ) );
+
+        for( uint64 i = 0; i < blockLength; i++ )
+            counts[pairs[i].left >> regionShift]++;
+
+        uint32 sum = 0;
+        for( uint32 r = 0; r < P3_LOOKUP_REGION_COUNT; r++ )
+        {
+            const uint32 count = counts[r];
+            counts[r] = sum;
+            sum += count;
+        }
+
+        for( uint64 i = 0; i < blockLength; i++ )
+        {
+            const uint32 idx = counts[pairs[i].left >> regionShift]++;
+
+            blockPairs[idx] = pairs[i];
+            blockDst  [idx] = (uint32)i;
+        }
+
+        // Gather in region order
+        for( uint64 i = 0; i < blockLength; i++ )
+        {
+            const uint64 x = lTable[blockPairs[i].left ];
+            const uint64 y = lTable[blockPairs[i].right];
+            ASSERT( x || y );
+
+            blockLps[blockDst[i]] = SquareToLinePoint( x, y );
+        }
+    }
 }
 
 
@@ -14,7 +14,13 @@ private:
     template<bool IsTable6>
     uint64 ProcessTable( uint32* lEntries, uint64* lpBuffer,
                          Pair* rTable, const uint64 rTableCount, 
-                         const byte* markedEntries, TableId tableId );
+                         const byte* markedEntries, const uint32* markedCounts, TableId tableId );
+
+    bool UsePartitionedLookup( const double cost[2][7], TableId tableId ) const;
+
+    // Entries left in table 7 once its f7 entries of value 0xFFFFFFFF are dropped.
+    // f7 does not need to be sorted yet.
+    static uint64 GetTrimmedTable7Count( MemPlotContext& cx );
 
 private:
     MemPlotContext& _context;
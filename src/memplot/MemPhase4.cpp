@@ -1,6 +1,7 @@
 #include "MemPhase4.h"
 #include "CTables.h"
 #include "util/Log.h"
+#include "threading/TaskGraph.h"
 
 //-----------------------------------------------------------
 MemPhase4::MemPhase4( MemPlotContext& context )
@@ -18,105 +19,149 @@ void MemPhase4::Run()
     cx.p4WriteBuffer = ((byte*)cx.metaBuffer0) + 32ull GB;
     cx.p4WriteBufferWriter = cx.p4WriteBuffer;
 
-    WriteP7();
-    WriteC1();
-    WriteC2();
-    WriteC3();
+    WriteTables();
 }
 
+#if !P4_FUSED_TABLES
+// Tables to write as separate steps of a task graph
+struct P4Tables
+{
+    uint64          entryCount;
+    uint32*         f7Entries;
+    const uint32*   indices;
+    byte*           p7Buffer;
+    uint32*         c1Buffer;
+    uint32*         c2Buffer;
+    byte*           c3Buffer;
+    size_t          sizes[4];       // P7, C1, C2, C3
+    DiskPlotWriter* writer;         // If set, each table is queued as soon as it's written
+};
+
+// Queues a table for writing at its offset in the plot, while the other tables are still being written
 //-----------------------------------------------------------
-void MemPhase4::WriteP7()
+static void SubmitTable( P4Tables* t, uint index, const void* buffer )
 {
-    // Write P7 (Table 7 park), which are indices into
-    // the previous table's LinePoints (which are parked as well).
+    static const char* names[] = { "P7", "C1", "C2", "C3" };
 
-    MemPlotContext& cx = _context;
+    // P7, C1, C2 and C3 follow table 6 in the file
+    const uint table = (uint)TableId::Table7 + index;
 
-    const uint32* lTable     = cx.t1XBuffer;          // L table is passed around in the t1XBuffer
-    const uint64  entryCount = cx.entryCount[(int)TableId::Table7];
-    byte*         p7Buffer   = cx.plotWriter->AlignPointerToBlockSize<byte>( cx.p4WriteBufferWriter ); // This buffer is big enough to hold the whole park
-    
-    Log::Line( "  Writing P7." );
-    auto timer = TimerBegin();
+    if( t->writer && !t->writer->WriteTableAt( table, buffer, t->sizes[index] ) )
+        Fatal( "Failed to write %s to disk.", names[index] );
+}
 
-    const size_t sizeWritten = WriteP7Parallel<MAX_THREADS>( *cx.threadPool, entryCount, lTable, p7Buffer );
-    
-    cx.p4WriteBufferWriter = ((byte*)p7Buffer) + sizeWritten;
-    
-    if( !cx.plotWriter->WriteTable( p7Buffer, sizeWritten ) )
-        Fatal( "Failed to write P7 to disk." );
+//-----------------------------------------------------------
+static void WriteP7Task( ThreadPool& pool, P4Tables* t )
+{
+    // P7 (Table 7 park), which are indices into
+    // the previous table's LinePoints (which are parked as well).
+    WriteP7Parallel<MAX_THREADS>( pool, t->entryCount, t->indices, t->p7Buffer );
+    SubmitTable( t, 0, t->p7Buffer );
+}
 
-    double elapsed = TimerEnd( timer );
-    Log::Line( "  Finished writing P7 in %.2lf seconds.", elapsed );
+//-----------------------------------------------------------
+static void WriteC1Task( ThreadPool& pool, P4Tables* t )
+{
+    WriteC12Parallel<MAX_THREADS, kCheckpoint1Interval>( pool, t->entryCount, t->f7Entries, t->c1Buffer );
+    SubmitTable( t, 1, t->c1Buffer );
+}
+
+//-----------------------------------------------------------
+static void WriteC2Task( ThreadPool& pool, P4Tables* t )
+{
+    WriteC12Parallel<MAX_THREADS, kCheckpoint1Interval*kCheckpoint2Interval>( pool, t->entryCount, t->f7Entries, t->c2Buffer );
+    SubmitTable( t, 2, t->c2Buffer );
+}
+
+//-----------------------------------------------------------
+static void WriteC3Task( ThreadPool& pool, P4Tables* t )
+{
+    WriteC3Parallel<MAX_THREADS>( pool, t->entryCount, t->f7Entries, t->c3Buffer );
+    SubmitTable( t, 3, t->c3Buffer );
 }
+#endif
 
 //-----------------------------------------------------------
-void MemPhase4::WriteC1()
+void MemPhase4::WriteTables()
 {
     MemPlotContext& cx = _context;
- 
-    const uint64 entryCount  = cx.entryCount[(int)TableId::Table7];
-    uint32*      writeBuffer = cx.plotWriter->AlignPointerToBlockSize<uint32>( cx.p4WriteBufferWriter );
 
-    Log::Line( "  Writing C1 table." );
+    const uint32* lTable     = cx.t1XBuffer;          // L table is passed around in the t1XBuffer
+    const uint64  entryCount = cx.entryCount[(int)TableId::Table7];
+
+    // Lay out all the tables in the write buffer, as if they were written one after another
+    const size_t p7Size = GetP7TableSize( entryCount );
+    const size_t c1Size = GetC12TableSize<kCheckpoint1Interval>( entryCount );
+    const size_t c2Size = GetC12TableSize<kCheckpoint1Interval*kCheckpoint2Interval>( entryCount );
+    const size_t c3Size = GetC3TableSize( entryCount );
+
+    byte*   p7Buffer = cx.plotWriter->AlignPointerToBlockSize<byte>  ( cx.p4WriteBufferWriter );
+    uint32* c1Buffer = cx.plotWriter->AlignPointerToBlockSize<uint32>( p7Buffer + p7Size );
+    uint32* c2Buffer = cx.plotWriter->AlignPointerToBlockSize<uint32>( (byte*)c1Buffer + c1Size );
+    byte*   c3Buffer = cx.plotWriter->AlignPointerToBlockSize<byte>  ( (byte*)c2Buffer + c2Size );
+
+    Log::Line( "  Writing P7, C1, C2 and C3 tables." );
     auto timer = TimerBegin();
 
-    const size_t sizeWritten = WriteC12Parallel<MAX_THREADS, kCheckpoint1Interval>( 
-        *cx.threadPool, entryCount, cx.t7YBuffer, writeBuffer );
+#if P4_FUSED_TABLES
+    WriteP4TablesParallel<MAX_THREADS>( *cx.threadPool, entryCount, cx.t7YBuffer, lTable,
+                                        p7Buffer, c1Buffer, c2Buffer, c3Buffer );
+#else
+    // P7 only depends on the indices, so it runs alongside the C tables.
+    // C3 overwrites the f7 entries with its deltas, so it must wait for C1 and C2.
+    // With a known layout, each table is written at its offset as soon as it's ready,
+    // otherwise they're written in file order once they're all done.
+    DiskPlotWriter* writer = cx.plotWriter->IsLayoutKnown() ? cx.plotWriter : nullptr;
 
-    cx.p4WriteBufferWriter = ((byte*)writeBuffer) + sizeWritten;
+    P4Tables tables = { entryCount, cx.t7YBuffer, lTable, p7Buffer, c1Buffer, c2Buffer, c3Buffer,
+                        { p7Size, c1Size, c2Size, c3Size }, writer };
 
-    if( !cx.plotWriter->WriteTable( writeBuffer, sizeWritten ) )
-        Fatal( "Failed to write C1 to disk." );
+    TaskGraph graph( *cx.threadPool );
 
-    double elapsed = TimerEnd( timer );
-    Log::Line( "  Finished writing C1 table in %.2lf seconds.", elapsed );
-}
+    const size_t f7Size = entryCount * sizeof( uint32 );
 
-//-----------------------------------------------------------
-void MemPhase4::WriteC2()
-{
-    MemPlotContext& cx = _context;
- 
-    const uint64 entryCount  = cx.entryCount[(int)TableId::Table7];
-    uint32*      writeBuffer = cx.plotWriter->AlignPointerToBlockSize<uint32>( cx.p4WriteBufferWriter );
+    const uint p7Task = graph.AddTask( "P7", WriteP7Task, &tables );
+    graph.Reads ( p7Task, lTable  , entryCount * sizeof( uint32 ) );
+    graph.Writes( p7Task, p7Buffer, p7Size );
 
-    Log::Line( "  Writing C2 table." );
-    auto timer = TimerBegin();
+    const uint c1Task = graph.AddTask( "C1", WriteC1Task, &tables );
+    graph.Reads ( c1Task, cx.t7YBuffer, f7Size );
+    graph.Writes( c1Task, c1Buffer    , c1Size );
 
-    const size_t sizeWritten = WriteC12Parallel<MAX_THREADS, kCheckpoint1Interval*kCheckpoint2Interval>( 
-        *cx.threadPool, entryCount, cx.t7YBuffer, writeBuffer );
+    const uint c2Task = graph.AddTask( "C2", WriteC2Task, &tables );
+    graph.Reads ( c2Task, cx.t7YBuffer, f7Size );
+    graph.Writes( c2Task, c2Buffer    , c2Size );
 
-    cx.p4WriteBufferWriter = ((byte*)writeBuffer) + sizeWritten;
+    const uint c3Task = graph.AddTask( "C3", WriteC3Task, &tables );
+    graph.Writes( c3Task, cx.t7YBuffer, f7Size );
+    graph.Writes( c3Task, c3Buffer    , c3Size );
 
-    if( !cx.plotWriter->WriteTable( writeBuffer, sizeWritten ) )
-        Fatal( "Failed to write C2 to disk." );
+    graph.Run();
 
-    double elapsed = TimerEnd( timer );
-    Log::Line( "  Finished writing C2 table in %.2lf seconds.", elapsed );
-}
+    Log::Line( "  P7: %.2lfs, C1: %.2lfs, C2: %.2lfs, C3: %.2lfs.",
+        graph.TaskElapsed( p7Task ), graph.TaskElapsed( c1Task ),
+        graph.TaskElapsed( c2Task ), graph.TaskElapsed( c3Task ) );
+#endif
 
-//-----------------------------------------------------------
-void MemPhase4::WriteC3()
-{
-    MemPlotContext& cx = _context;
- 
-    const uint64 entryCount  = cx.entryCount[(int)TableId::Table7];
-    byte*        writeBuffer = cx.plotWriter->AlignPointerToBlockSize<byte>( cx.p4WriteBufferWriter );
+    cx.p4WriteBufferWriter = c3Buffer + c3Size;
 
-    Log::Line( "  Writing C3 table." );
-    auto timer = TimerBegin();
+#if !P4_FUSED_TABLES
+    if( !writer )
+#endif
+    {
+        if( !cx.plotWriter->WriteTable( p7Buffer, p7Size ) )
+            Fatal( "Failed to write P7 to disk." );
 
-    const size_t sizeWritten = WriteC3Parallel<MAX_THREADS>( 
-         *cx.threadPool, entryCount, cx.t7YBuffer, writeBuffer );
+        if( !cx.plotWriter->WriteTable( c1Buffer, c1Size ) )
+            Fatal( "Failed to write C1 to disk." );
 
-    cx.p4WriteBufferWriter = ((byte*)writeBuffer) + sizeWritten;
+        if( !cx.plotWriter->WriteTable( c2Buffer, c2Size ) )
+            Fatal( "Failed to write C2 to disk." );
 
-    if( !cx.plotWriter->WriteTable( writeBuffer, sizeWritten ) )
-        Fatal( "Failed to write C3 to disk." );
+        if( !cx.plotWriter->WriteTable( c3Buffer, c3Size ) )
+            Fatal( "Failed to write C3 to disk." );
+    }
 
     double elapsed = TimerEnd( timer );
-    Log::Line( "  Finished writing C3 table in %.2lf seconds.", elapsed );
+    Log::Line( "  Finished writing P7, C1, C2 and C3 tables in %.2lf seconds.", elapsed );
 }
-
-
@@ -1,6 +1,8 @@
 #pragma once
 #include "PlotContext.h"
 #include "CTables.h"
+#include "util/BitWriter.h"
+#include "ParkEncoder.h"
 
 class MemPhase4
 {
@@ -11,10 +13,9 @@ public:
 
     void Run();
 
-    void WriteP7();
-    void WriteC1();
-    void WriteC2();
-    void WriteC3();
+    // Writes P7, C1, C2 and C3. In a single pass if P4_FUSED_TABLES is set,
+    // otherwise as separate steps, with P7 running alongside the C tables.
+    void WriteTables();
 
 private:
     MemPlotContext& _context;
@@ -45,6 +46,19 @@ struct C3Job
     byte*   writeBuffer;
 };
 
+struct P4TablesJob
+{
+    uint64        length;           // Total number of f7 entries
+    uint64        intervalStart;    // Range of C1 intervals to write
+    uint64        intervalEnd;
+    uint32*       f7Entries;
+    const uint32* indices;
+    byte*         p7Buffer;
+    uint32*       c1Buffer;
+    uint32*       c2Buffer;
+    byte*         c3Buffer;
+};
+
 // P7
 template<uint MAX_JOBS>
 size_t WriteP7Parallel( ThreadPool& pool, const uint64 length, 
@@ -70,6 +84,23 @@ size_t WriteC3Parallel( ThreadPool& pool, const uint64 length, uint32* f7Entries
 
 void WriteC3Parks( const uint64 parkCount, uint32* f7Entries, byte* writeBuffer );
 void WriteC3Park( const uint64 length, uint32* f7Entries, byte* parkBuffer );
+void WriteC3ParkPair( uint32* f7Entries, byte* parkBuffer );
+const byte* PrepareC3Deltas( const uint64 length, uint32* f7Entries );
+void FinishC3Park( const uint64 length, uint32* f7Entries, const byte* compressed, const size_t compressedSize, byte* parkBuffer );
+
+// All tables in a single pass
+size_t GetP7TableSize( const uint64 length );
+
+template<uint CInterval>
+size_t GetC12TableSize( const uint64 length );
+
+size_t GetC3TableSize( const uint64 length );
+
+template<uint MAX_JOBS>
+void WriteP4TablesParallel( ThreadPool& pool, const uint64 length, uint32* f7Entries, const uint32* indices,
+                            byte* p7Buffer, uint32* c1Buffer, uint32* c2Buffer, byte* c3Buffer );
+
+void WriteP4TablesThread( P4TablesJob* job );
 
 
 ///
@@ -162,57 +193,14 @@ inline void WriteP7Parks( const uint64 parkCount, const uint32* indices, byte* p
 //-----------------------------------------------------------
 inline void WriteP7Entries( const uint64 length, const uint32* indices, byte* parkBuffer )
 {
-    uint64* fieldWriter = (uint64*)parkBuffer;
-    
     // chiapos requires this to have an extra bit for some odd reason.
     // Otherwise we could have copied the buffer as-is.
     const uint32 bitsPerEntry = _K + 1;
 
-    uint64 field = 0;
-    uint32 bits  = 0;
-
-    // Like when serializing stubs in the LinePoint parks,
-    // we always store it all the way to the MSbits 
-    // (shift all the way to the left)
-    for( uint64 i = 0; i < length; i++ )
-    {
-        const uint64 index    = indices[i];
-        const uint   freeBits = 64 - bits;
-
-        // Filled a field?
-        if( freeBits <= bitsPerEntry )
-        {
-            // Update the next field bits to what the stub bits that were not written into the current field
-            bits = bitsPerEntry - freeBits;
-            
-            // Write what we can (which may be nothing) into the free bits of the current field
-            field |= index >> bits;
-
-            // Store field
-            *fieldWriter++ = Swap64( field );
-
-            // Write the remaining bits to the next field
-            // if( bits )
-            //     field = f7 << ( 64 - bits );
-            // else
-            //     field = 0;
-
-            // Non-branching mask-based method
-            const uint remainder = 64 - bits;
-            uint64 mask = ( ( 1ull << bits ) - 1 ) << (remainder & 63);
-            field = ( index << remainder ) & mask;
-        }
-        else
-        {
-            // The entry completely fits into the current field with room to spare
-            field |= index << ( freeBits - bitsPerEntry );
-            bits += bitsPerEntry;
-        }
-    }
+    const size_t sizeWritten = PackBitsBE<bitsPerEntry>( parkBuffer, indices, length );
 
-    // Write any trailing fields
-    if( bits > 0 )
-        *fieldWriter++ = Swap64( field );
+    // chiapos serializes whole 64-bit fields, so zero-out the rest of the last one
+    memset( parkBuffer + sizeWritten, 0, RoundUpToNextBoundary( sizeWritten, 8 ) - sizeWritten );
 }
 
 
@@ -390,13 +378,17 @@ inline void WriteC3Parks( const uint64 parkCount, uint32* f7Entries, byte* write
 {
     const size_t c3Size = CalculateC3Size();
 
-    for( uint64 i = 0; i < parkCount; i++ )
+    uint64 i = 0;
+    for( ; i + 1 < parkCount; i += 2 )
     {
-        WriteC3Park( kCheckpoint1Interval-1, f7Entries, writeBuffer );
+        WriteC3ParkPair( f7Entries, writeBuffer );
 
-        f7Entries   += kCheckpoint1Interval;
-        writeBuffer += c3Size;
+        f7Entries   += kCheckpoint1Interval * 2;
+        writeBuffer += c3Size * 2;
     }
+
+    if( i < parkCount )
+        WriteC3Park( kCheckpoint1Interval-1, f7Entries, writeBuffer );
 }
 
 //-----------------------------------------------------------
@@ -404,6 +396,49 @@ inline void WriteC3Park( const uint64 length, uint32* f7Entries, byte* parkBuffe
 {
     const size_t c3Size = CalculateC3Size();
 
+    const byte* deltas = PrepareC3Deltas( length, f7Entries );
+
+    // Serialize them into the C3 park buffer
+    byte*  compressed = parkBuffer + 2;
+    size_t compressedSize;
+
+    FSECompressParks<1>( &compressed, c3Size, &deltas, length, (const FSE_CTable*)CTable_C3, &compressedSize );
+
+    FinishC3Park( length, f7Entries, compressed, compressedSize, parkBuffer );
+}
+
+// Write 2 consecutive full C3 parks, compressing their deltas together
+//-----------------------------------------------------------
+inline void WriteC3ParkPair( uint32* f7Entries, byte* parkBuffer )
+{
+    constexpr uint64 length = kCheckpoint1Interval - 1;
+    constexpr size_t c3Size = CalculateC3Size();
+
+    uint32* parkF7Entries[2] = { f7Entries , f7Entries  + kCheckpoint1Interval };
+    byte*   parkBuffers  [2] = { parkBuffer, parkBuffer + c3Size };
+
+    const byte* deltas[2] = {
+        PrepareC3Deltas( length, parkF7Entries[0] ),
+        PrepareC3Deltas( length, parkF7Entries[1] )
+    };
+
+    // The encoder may store past the end of the park (just as FSE_compress_usingCTable),
+    // so the first park is encoded on the side, to keep the second park intact
+    byte firstParkCompressed[c3Size];
+
+    byte*  compressed    [2] = { firstParkCompressed, parkBuffers[1] + 2 };
+    size_t compressedSize[2];
+
+    FSECompressParks<2>( compressed, c3Size, deltas, length, (const FSE_CTable*)CTable_C3, compressedSize );
+
+    FinishC3Park( length, parkF7Entries[0], compressed[0], compressedSize[0], parkBuffers[0] );
+    FinishC3Park( length, parkF7Entries[1], compressed[1], compressedSize[1], parkBuffers[1] );
+}
+
+// Converts the f7 entries of a park to deltas, written over f7Entries.
+//-----------------------------------------------------------
+inline const byte* PrepareC3Deltas( const uint64 length, uint32* f7Entries )
+{
     // Re-use f7Entries as the delta buffer. 
     // We won't use f7 entries after this, so we can re-write it.
     byte* deltaWriter = (byte*)f7Entries;
@@ -425,20 +460,158 @@ inline void WriteC3Park( const uint64 length, uint32* f7Entries, byte* parkBuffe
 
     ASSERT( (uint64)(deltaWriter - (byte*)f7Entries) == length );
 
-    // Serialize them into the C3 park buffer
-    const size_t compressedSize = FSE_compress_usingCTable(
-        parkBuffer+2, c3Size, (byte*)f7Entries, 
-        length, (const FSE_CTable*)CTable_C3
-    );
+    return (const byte*)f7Entries;
+}
+
+//-----------------------------------------------------------
+inline void FinishC3Park( const uint64 length, uint32* f7Entries, const byte* compressed, const size_t compressedSize, byte* parkBuffer )
+{
+    const size_t c3Size = CalculateC3Size();
+
     ASSERT( (compressedSize+2) < c3Size );
+
+    // The compressed deltas may have been encoded elsewhere
+    if( compressed != parkBuffer + 2 )
+        memcpy( parkBuffer + 2, compressed, compressedSize );
     
     // Store size in the first 2 bytes
     *((uint16*)parkBuffer) = Swap16( (uint16)compressedSize );
 
     // Zero-out remainder (not necessarry, though...)
+    byte* deltaWriter = (byte*)f7Entries + length;
+
     const size_t remainder = c3Size - (compressedSize + 2);
     if( remainder )
         memset( deltaWriter + compressedSize + 2, 0, remainder );
 }
 
 
+
+
+///
+/// P7, C1, C2 & C3 in a single pass
+///
+
+//-----------------------------------------------------------
+inline size_t GetP7TableSize( const uint64 length )
+{
+    const size_t parkSize = CDiv( (_K + 1) * kEntriesPerPark, 8 );
+    return CDiv( length, kEntriesPerPark ) * parkSize;
+}
+
+// Includes the trailing entry (see WriteC12Parallel)
+//-----------------------------------------------------------
+template<uint CInterval>
+inline size_t GetC12TableSize( const uint64 length )
+{
+    return ( CDiv( length, (int)CInterval ) + 1 ) * sizeof( uint32 );
+}
+
+//-----------------------------------------------------------
+inline size_t GetC3TableSize( const uint64 length )
+{
+    return GetC3ParkCount( length ) * CalculateC3Size();
+}
+
+// Produces the same tables as WriteP7Parallel, WriteC12Parallel (for C1 and C2) and WriteC3Parallel,
+// but each thread writes all the tables for its range of C1 intervals in one pass over the f7 entries
+// and the P7 indices. Each interval's C1 and C2 entries are read before its C3 park overwrites it with deltas.
+//-----------------------------------------------------------
+template<uint MAX_JOBS>
+inline void WriteP4TablesParallel( ThreadPool& pool, const uint64 length, uint32* f7Entries, const uint32* indices,
+                                   byte* p7Buffer, uint32* c1Buffer, uint32* c2Buffer, byte* c3Buffer )
+{
+    const uint32 threadCount   = std::min( pool.ThreadCount(), MAX_JOBS );
+    const uint64 intervalCount = CDiv( length, kCheckpoint1Interval );
+
+    P4TablesJob jobs[MAX_JOBS];
+
+    for( uint32 i = 0; i < threadCount; i++ )
+    {
+        auto& job = jobs[i];
+
+        job.length        = length;
+        job.intervalStart = intervalCount * i     / threadCount;
+        job.intervalEnd   = intervalCount * (i+1) / threadCount;
+        job.f7Entries     = f7Entries;
+        job.indices       = indices;
+        job.p7Buffer      = p7Buffer;
+        job.c1Buffer      = c1Buffer;
+        job.c2Buffer      = c2Buffer;
+        job.c3Buffer      = c3Buffer;
+    }
+
+    pool.RunJob( WriteP4TablesThread, jobs, threadCount );
+
+    // Trailing C1 and C2 entries (see WriteC12Parallel)
+    c1Buffer[intervalCount] = 0;
+    c2Buffer[CDiv( intervalCount, kCheckpoint2Interval )] = 0xFFFFFFFF;
+}
+
+//-----------------------------------------------------------
+inline void WriteP4TablesThread( P4TablesJob* job )
+{
+    const uint64 length        = job->length;
+    const uint64 intervalEnd   = job->intervalEnd;
+    const uint64 fullIntervals = length / kCheckpoint1Interval;
+
+    uint32*       f7Entries = job->f7Entries;
+    const uint32* indices   = job->indices;
+    uint32*       c1Buffer  = job->c1Buffer;
+    uint32*       c2Buffer  = job->c2Buffer;
+
+    const size_t p7ParkSize = CDiv( (_K + 1) * kEntriesPerPark, 8 );
+    const size_t c3Size     = CalculateC3Size();
+
+    // We write the P7 parks that start within our intervals
+    uint64       p7Park    = CDiv( job->intervalStart * kCheckpoint1Interval, kEntriesPerPark );
+    const uint64 p7ParkEnd = CDiv( std::min( intervalEnd * kCheckpoint1Interval, length ), kEntriesPerPark );
+
+    for( uint64 interval = job->intervalStart; interval < intervalEnd; )
+    {
+        // Write full intervals in pairs, so that their C3 parks are compressed together
+        const uint64 count = ( interval + 1 < intervalEnd && interval + 1 < fullIntervals ) ? 2 : 1;
+
+        for( uint64 i = interval; i < interval + count; i++ )
+        {
+            const uint32 f7 = Swap32( f7Entries[i * kCheckpoint1Interval] );
+
+            c1Buffer[i] = f7;
+
+            if( i % kCheckpoint2Interval == 0 )
+                c2Buffer[i / kCheckpoint2Interval] = f7;
+        }
+
+        uint32* intervalF7 = f7Entries     + interval * kCheckpoint1Interval;
+        byte*   c3Park     = job->c3Buffer + interval * c3Size;
+
+        if( count == 2 )
+            WriteC3ParkPair( intervalF7, c3Park );
+        else if( interval < fullIntervals )
+            WriteC3Park( kCheckpoint1Interval-1, intervalF7, c3Park );
+        else
+        {
+            // The first entry is stored in C1, so we need at least 1 delta to write the last park
+            const uint64 trailingEntries = length - interval * kCheckpoint1Interval;
+
+            if( trailingEntries > 1 )
+                WriteC3Park( trailingEntries-1, intervalF7, c3Park );
+        }
+
+        interval += count;
+
+        // Keep P7 going along with the intervals
+        const uint64 parkEnd = std::min( p7ParkEnd, CDiv( std::min( interval * kCheckpoint1Interval, length ), kEntriesPerPark ) );
+
+        for( ; p7Park < parkEnd; p7Park++ )
+        {
+            const uint64 entryCount = std::min( (uint64)kEntriesPerPark, length - p7Park * kEntriesPerPark );
+            byte*        parkBuffer = job->p7Buffer + p7Park * p7ParkSize;
+
+            if( entryCount < kEntriesPerPark )
+                memset( parkBuffer, 0, p7ParkSize );
+
+            WriteP7Entries( entryCount, indices + p7Park * kEntriesPerPark, parkBuffer );
+        }
+    }
+}
@@ -9,6 +9,9 @@
 #include "MemPhase3.h"
 #include "MemPhase4.h"
 
+#include <vector>
+#include <algorithm>
+#include <tuple>
 
 //----------------------------------------------------------
 MemPlotter::MemPlotter( const MemPlotConfig& cfg )
@@ -31,9 +34,60 @@ MemPlotter::MemPlotter( const MemPlotConfig& cfg )
     }
 
     _context.threadCount = cfg.threadCount;
+
+    // Prepare the output directories. Their writers are created when first used.
+    _destinationCount = std::max( cfg.outDirCount, 1u );
+    _destinations     = new PlotDestination[_destinationCount];
+
+    for( uint i = 0; i < _destinationCount; i++ )
+    {
+        _destinations[i].type      = PlotSinkType::File;
+        _destinations[i].writer    = nullptr;
+        _destinations[i].plotCount = 0;
+    }
+
+    for( uint i = 0; i < cfg.outDirCount; i++ )
+        _destinations[i].type = ParseDestination( cfg.outDirs[i], _destinations[i].dir );
+
+    _checksumThreads = cfg.checksumThreads;
+    _writeStatsPath  = cfg.writeStatsPath;
+
+    _context.onPlotFinished     = cfg.onPlotFinished;
+    _context.onPlotFinishedData = cfg.onPlotFinishedData;
+
+    if( cfg.stagingSize )
+    {
+        _staging = new PlotStagingBuffer();
+
+        if( _staging->Init( cfg.stagingSize, cfg.stagingDir ) )
+            Log::Line( "Allocated %.2lf GiB staging buffer for pending plot writes.", (double)_staging->Size() / (1ull GB) );
+        else
+        {
+            Log::Line( "Warning: Staging is disabled." );
+            delete _staging;
+            _staging = nullptr;
+        }
+    }
     
     // Create a thread pool
-    _context.threadPool = new ThreadPool( cfg.threadCount, ThreadPool::Mode::Fixed, cfg.noCPUAffinity );
+    _threadPool         = new ThreadPool( cfg.threadCount, ThreadPool::Mode::Fixed, cfg.noCPUAffinity );
+    _context.threadPool = _threadPool;
+
+    if( cfg.pressureCeiling )
+    {
+        PressureConfig pressureCfg;
+        pressureCfg.ceiling    = cfg.pressureCeiling;
+        pressureCfg.minThreads = cfg.pressureMinThreads;
+
+        _context.governor = new PressureGovernor( *_context.threadPool );
+
+        if( !_context.governor->Start( pressureCfg ) )
+        {
+            Log::Line( "Warning: The system doesn't report its pressure. Co-location mode is disabled." );
+            delete _context.governor;
+            _context.governor = nullptr;
+        }
+    }
 
     // Allocate buffers
     {
@@ -113,7 +167,42 @@ MemPlotter::MemPlotter( const MemPlotConfig& cfg )
 
 //----------------------------------------------------------
 MemPlotter::~MemPlotter()
-{}
+{
+    auto& cx = _context;
+
+    // The last plot must be written before its writer goes away
+    Flush();
+
+    for( uint i = 0; i < _destinationCount; i++ )
+    {
+        if( _destinations[i].writer )
+            delete _destinations[i].writer;
+    }
+
+    delete[] _destinations;
+
+    if( _staging )
+        delete _staging;
+
+    // The governor hands the threads back to the pool
+    if( cx.governor )
+        delete cx.governor;
+
+    delete _threadPool;
+
+    SafeFree( cx.t1XBuffer   );
+    SafeFree( cx.t2LRBuffer  );
+    SafeFree( cx.t3LRBuffer  );
+    SafeFree( cx.t4LRBuffer  );
+    SafeFree( cx.t5LRBuffer  );
+    SafeFree( cx.t6LRBuffer  );
+    SafeFree( cx.t7YBuffer   );
+    SafeFree( cx.t7LRBuffer  );
+    SafeFree( cx.yBuffer0    );
+    SafeFree( cx.yBuffer1    );
+    SafeFree( cx.metaBuffer0 );
+    SafeFree( cx.metaBuffer1 );
+}
 
 //----------------------------------------------------------
 bool MemPlotter::Run( const PlotRequest& request )
@@ -125,28 +214,10 @@ bool MemPlotter::Run( const PlotRequest& request )
     cx.plotMemo     = request.memo;
     cx.plotMemoSize = request.memoSize;
     
-    // Open the plot file for writing before we actually start plotting
-    const int PLOT_FILE_RETRIES = 16;
-    FileStream* plotfile = new FileStream();
-    ASSERT( plotfile );
+    PlotResult result;
+    ZeroMem( &result );
+    result.userData = request.userData;
 
-    for( int i = 0; i < PLOT_FILE_RETRIES; i++ )
-    {
-        if( !plotfile->Open( request.outPath, FileMode::Create, FileAccess::Write, FileFlags::NoBuffering | FileFlags::LargeFile ) )
-        {
-            if( i+1 >= PLOT_FILE_RETRIES )
-            {
-                Log::Error( "Error: Failed to open plot output file at %s for writing after %d tries.", request.outPath, PLOT_FILE_RETRIES );
-                delete plotfile;
-                return false;
-            }
-
-            continue;
-        }
-
-        break;
-    }
-    
     // Start plotting
     auto plotTimer = TimerBegin();
 
@@ -156,53 +227,103 @@ bool MemPlotter::Run( const PlotRequest& request )
     {
         auto timeStart = plotTimer;
         Log::Line( "Running Phase 1" );
+        UpdateGovernor();
 
         MemPhase1 phase1( cx );
         phase1.Run();
 
         double elapsed = TimerEnd( timeStart );
         Log::Line( "Finished Phase 1 in %.2lf seconds.", elapsed );
+        result.phaseSeconds[0] = elapsed;
     }
 
     {
         MemPhase2 phase2( cx );
         auto timeStart = TimerBegin();
         Log::Line( "Running Phase 2" );
+        UpdateGovernor();
 
         phase2.Run();
 
         double elapsed = TimerEnd( timeStart );
         Log::Line( "Finished Phase 2 in %.2lf seconds.", elapsed );
+        result.phaseSeconds[1] = elapsed;
     }
 
-    // Start writing the plot file
-    if( !_context.plotWriter )
-        _context.plotWriter = new DiskPlotWriter();
-    
-    cx.plotWriter->BeginPlot( request.outPath, *plotfile, request.plotId, request.memo, request.memoSize );
+    // Start writing the plot file.
+    // The previous plot has finished writing by now, as phase 1 needs its buffers.
+    {
+        PlotSink* plotfile = new PlotSink();
+        ASSERT( plotfile );
+
+        std::string plotPath;
+        PlotDestination* dst = OpenPlotFile( request.plotFileName, request.outDir, *plotfile, plotPath );
+
+        if( !dst )
+        {
+            delete plotfile;
+            return false;
+        }
+
+        if( !dst->writer )
+        {
+            dst->writer = new DiskPlotWriter();
+            dst->writer->SetStagingBuffer( _staging );
+
+            if( _checksumThreads )
+                dst->writer->EnableChecksum( _checksumThreads );
+
+            dst->writer->SetStatsPath( _writeStatsPath );
+        }
+
+        dst->plotCount++;
+        cx.plotWriter = dst->writer;
+
+        Log::Line( "Writing plot to %s", plotPath.c_str() );
+
+        // With the tables' sizes known, the writer lays out the file and writes the header first
+        size_t  tableSizes[10];
+        size_t* layout = nullptr;
+
+        #if PLOT_WRITER_PRECOMPUTED_LAYOUT
+            if( GetTableSizes( tableSizes ) )
+                layout = tableSizes;
+        #endif
+
+        cx.plotWriter->BeginPlot( plotPath.c_str(), *plotfile, request.plotId, request.memo, request.memoSize, layout );
+    }
 
     {
         auto timeStart = TimerBegin();
         Log::Line( "Running Phase 3" );
+        UpdateGovernor();
 
         MemPhase3 phase3( cx );
         phase3.Run();
 
         double elapsed = TimerEnd( timeStart );
         Log::Line( "Finished Phase 3 in %.2lf seconds.", elapsed );
+        result.phaseSeconds[2] = elapsed;
     }
 
     {
         auto timeStart = TimerBegin();
         Log::Line( "Running Phase 4" );
+        UpdateGovernor();
 
         MemPhase4 phase4( cx );
         phase4.Run();
 
         double elapsed = TimerEnd( timeStart );
         Log::Line( "Finished Phase 4 in %.2lf seconds.", elapsed );
+        result.phaseSeconds[3] = elapsed;
     }
 
+    // Reported once the plot has been written.
+    // (The previous plot was reported in Phase 1, before its buffers were reused.)
+    result.plotSeconds = TimerEnd( plotTimer );
+    cx.plotResult      = result;
+
     // Wait flush writer, if this is the final plot
     if( request.IsFinalPlot )
     {
@@ -224,6 +345,64 @@ bool MemPlotter::Run( const PlotRequest& request )
     return true;
 }
 
+#if PLOT_WRITER_PRECOMPUTED_LAYOUT
+//-----------------------------------------------------------
+bool MemPlotter::GetTableSizes( size_t tableSizes[10] )
+{
+    auto& cx = _context;
+
+    // Tables 1-5 keep the entries of the next table that Phase 2 marked as used.
+    // Table 6 keeps table 7's entries, but for the ones Phase 3 drops (see below).
+    uint64 entryCounts[6];
+
+    for( uint i = (uint)TableId::Table1; i < (uint)TableId::Table6; i++ )
+    {
+        const uint32* usedCounts = cx.usedEntryCounts[i+1];
+
+        if( !usedCounts )
+            return false;
+
+        const uint64 rangeCount = CDiv( cx.entryCount[i+1], 1 << P2_MARK_RANGE_BITS );
+
+        entryCounts[i] = 0;
+        for( uint64 range = 0; range < rangeCount; range++ )
+            entryCounts[i] += usedCounts[range];
+    }
+
+    // Phase 3 drops the f7 entries of value 0xFFFFFFFF (see MemPhase3::ProcessTable)
+    const uint64 t7Count = MemPhase3::GetTrimmedTable7Count( cx );
+
+    // Table 6 is parked with the entries that are left in table 7
+    entryCounts[(uint)TableId::Table6] = t7Count;
+
+    for( uint i = (uint)TableId::Table1; i <= (uint)TableId::Table6; i++ )
+        tableSizes[i] = CDiv( entryCounts[i], kEntriesPerPark ) * CalculateParkSize( (TableId)i );
+
+    tableSizes[6] = GetP7TableSize( t7Count );
+    tableSizes[7] = GetC12TableSize<kCheckpoint1Interval>( t7Count );
+    tableSizes[8] = GetC12TableSize<kCheckpoint1Interval*kCheckpoint2Interval>( t7Count );
+    tableSizes[9] = GetC3TableSize( t7Count );
+
+    return true;
+}
+
+#endif
+
+//-----------------------------------------------------------
+void MemPlotter::Flush()
+{
+    // Set while a plot is being written
+    if( _context.p4WriteBuffer )
+        WaitPlotWriter();
+}
+
+//-----------------------------------------------------------
+void MemPlotter::UpdateGovernor()
+{
+    if( _context.governor )
+        _context.governor->Update( _context.threadPool, _context.threadCount );
+}
+
 //-----------------------------------------------------------
 void MemPlotter::WaitPlotWriter()
 {
@@ -238,6 +417,7 @@ void MemPlotter::WaitPlotWriter()
                 _context.plotWriter->GetError() );
 
         // Rename plot file to final plot file name (remove .tmp suffix)
+        // The receiver of a streamed plot renames it itself.
         const char*  tmpName       = _context.plotWriter->FilePath().c_str();
         const size_t tmpNameLength = strlen( tmpName );
 
@@ -246,7 +426,7 @@ void MemPlotter::WaitPlotWriter()
         memcpy( plotName, tmpName, tmpNameLength - 4 );
         plotName[tmpNameLength-4] = 0;
 
-        int r = rename( tmpName, plotName );
+        int r = _context.plotWriter->IsStreaming() ? 0 : rename( tmpName, plotName );
         
         if( r )
         {
@@ -257,8 +437,6 @@ void MemPlotter::WaitPlotWriter()
         Log::Line( "" );
         Log::Line( "Plot %s finished writing to disk:", r ? tmpName : plotName );
 
-        delete[] plotName;
-
         // Print final pointer offsets
         const uint64* tablePointers = _context.plotWriter->GetTablePointers();
         for( uint i = 0; i < 7; i++ )
@@ -273,12 +451,182 @@ void MemPlotter::WaitPlotWriter()
             Log::Line( "  C%u table pointer : %16lu ( 0x%016lx )", i+1-7, ptr, ptr);
         }
         Log::Line( "" );
+
+        _context.plotWriter->ReportWriteStats();
+        Log::Line( "" );
+
+        if( _context.onPlotFinished )
+        {
+            _context.plotResult.plotPath   = r ? tmpName : plotName;
+            _context.plotResult.plotSize   = _context.plotWriter->PlotSize();
+            _context.plotResult.writeStats = &_context.plotWriter->WriteStats();
+            _context.onPlotFinished( _context.plotResult, _context.onPlotFinishedData );
+        }
+
+        delete[] plotName;
+
+        _context.p4WriteBuffer = nullptr;
     // }
 }
 
+//-----------------------------------------------------------
+PlotSinkType MemPlotter::ParseDestination( const char* outDir, std::string& dir )
+{
+    const PlotSinkType type = PlotSink::TargetType( outDir );
+    dir = outDir;
+
+    if( type == PlotSinkType::Socket )
+        dir.erase( 0, sizeof( "tcp://" ) - 1 );
+
+    // Add a trailing slash, if we need one.
+    if( type == PlotSinkType::File && !dir.empty() && dir.back() != '/' )
+        dir += '/';
+
+    return type;
+}
+
+//-----------------------------------------------------------
+MemPlotter::PlotDestination* MemPlotter::OpenPlotFile( const char* plotFileName, const char* outDir, PlotSink& file, std::string& outPath )
+{
+    // We need room for a whole plot. Use the size of the last plot written if we have one,
+    // with some slack as plot sizes vary slightly, otherwise an upper estimate.
+    size_t plotSize = 0;
+    for( uint i = 0; i < _destinationCount; i++ )
+    {
+        DiskPlotWriter* writer = _destinations[i].writer;
+
+        if( writer && writer->HasFinishedWriting() )
+            plotSize = std::max( plotSize, writer->PlotSize() );
+    }
+
+    plotSize = plotSize ? plotSize + plotSize / 64 : DiskPlotWriter::EstimatePlotSize( 0, SysHost::GetPageSize() );
+
+    // Try the directories from most to least suitable:
+    // Directories with room for the plot come first, with the ones with the fewest
+    // plots routed to them first, so plots are spread across disks.
+    // If none have enough room, the ones with the most space available come first.
+    // #NOTE: Routing is by plot count only, not by whether a directory is still writing a plot.
+    //        Phase 1 waits for the previous plot's writer to release our buffers, so at most
+    //        the tables it staged can still be pending, and the count already moves the next
+    //        plot off the directory the last one went to, as long as another one has room.
+    const uint count = _destinationCount;
+
+    std::vector<size_t> space( count );
+    std::vector<uint>   order( count );
+
+    for( uint i = 0; i < count; i++ )
+    {
+        // Assume that plot receivers have room
+        space[i] = _destinations[i].type == PlotSinkType::File ?
+                    SysHost::GetAvailableDiskSpace( _destinations[i].dir.c_str() ) : SIZE_MAX;
+        order[i] = i;
+    }
+
+    auto rank = [&]( uint i ) {
+        const PlotDestination& dst = _destinations[i];
+        
+        const bool fits = space[i] >= plotSize;
+        
+        return std::make_tuple( !fits, dst.plotCount, ~space[i], i );
+    };
+
+    std::sort( order.begin(), order.end(), [&]( uint a, uint b ) { return rank( a ) < rank( b ); } );
+
+    // Only try the requested directory, if there is one
+    uint tryCount = count;
+
+    if( outDir )
+    {
+        std::string  dir;
+        PlotSinkType type = ParseDestination( outDir, dir );
+
+        uint i = 0;
+        while( i < count && !( _destinations[i].type == type && _destinations[i].dir == dir ) )
+            i++;
+
+        if( i == count )
+        {
+            Log::Error( "Error: %s is not one of the plotter's output directories.", outDir );
+            return nullptr;
+        }
+
+        order[0] = i;
+        tryCount = 1;
+    }
+
+    if( space[order[0]] < plotSize )
+        Log::Line( "Warning: No output directory is known to have room for the plot. Using the one with the most space available." );
+
+    const int PLOT_FILE_RETRIES = 16;
+
+    // Streams are given the final plot name, as the receiver writes to its own temporary file
+    std::string plotName = plotFileName;
+    if( plotName.size() > 4 && plotName.compare( plotName.size() - 4, 4, ".tmp" ) == 0 )
+        plotName.resize( plotName.size() - 4 );
+
+    for( uint i = 0; i < tryCount; i++ )
+    {
+        PlotDestination& dst = _destinations[order[i]];
+
+        switch( dst.type )
+        {
+            case PlotSinkType::File:
+                outPath = dst.dir + plotFileName;
+
+                for( int j = 0; j < PLOT_FILE_RETRIES; j++ )
+                {
+                    if( file.OpenFile( outPath.c_str(), FileFlags::NoBuffering | FileFlags::LargeFile ) )
+                        return &dst;
+                }
+            break;
+
+            case PlotSinkType::Pipe:
+                outPath = std::string( "stdout/" ) + plotFileName;
+
+                if( file.OpenPipe( fileno( stdout ), plotName.c_str() ) )
+                    return &dst;
+
+                file.Close();
+            break;
+
+            case PlotSinkType::Socket:
+                outPath = "tcp://" + dst.dir + "/" + plotFileName;
+
+                // Give the receiver a moment if it's not up
+                for( int j = 0; j < PLOT_FILE_RETRIES; j++ )
+                {
+                    if( file.Connect( dst.dir.c_str(), plotName.c_str() ) )
+                        return &dst;
+
+                    file.Close();
+                    Thread::Sleep( 1000 );
+                }
+            break;
+        }
+
+        Log::Error( "Error: Failed to open plot output %s for writing with error: %d.", outPath.c_str(), file.GetError() );
+    }
+
+    return nullptr;
+}
+
 ///
 /// Internal methods
 ///
+//-----------------------------------------------------------
+void MemPlotter::SafeFree( void* ptr )
+{
+    if( !ptr )
+        return;
+
+    // Free the leading guard page as well
+    #if DEBUG || BOUNDS_PROTECTION
+        ptr = (byte*)ptr - SysHost::GetPageSize();
+    #endif
+
+    SysHost::VirtualFree( ptr );
+}
+
 //-----------------------------------------------------------
 template<typename T>
 T* MemPlotter::SafeAlloc( size_t size, bool warmStart, const NumaInfo* numa )
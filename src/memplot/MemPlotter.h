@@ -5,10 +5,23 @@ struct NumaInfo;
 
 struct MemPlotConfig
 {
-    uint threadCount;
-    bool warmStart;
-    bool noNUMA;
-    bool noCPUAffinity;
+    uint               threadCount;
+    bool               warmStart;
+    bool               noNUMA;
+    bool               noCPUAffinity;
+    const char* const* outDirs;         // Directories to write plots to. Each plot goes to one of them.
+                                        //  "-" streams plots to stdout, and tcp://host:port to a plot receiver.
+    uint               outDirCount;
+    size_t             stagingSize;     // If not 0, the previous plot's pending tables are copied to a staging
+    const char*        stagingDir;      //  buffer of this size when the next plot needs their buffers.
+                                        //  The buffer is in RAM, or in a temporary file in stagingDir if set.
+    uint               checksumThreads; // If not 0, each plot is hashed with BLAKE3 while it's written, using this many
+                                        //  threads per output directory, and the hash is written to a manifest next to it.
+    const char*        writeStatsPath;  // If set, how each plot was written is appended to this file as a line of JSON.
+    uint               pressureCeiling; // If not 0, the percentage of time the system's tasks may be stalled on memory
+    uint               pressureMinThreads;  //  or CPU, which plotting is slowed down to stay under. See PressureGovernor.
+    PlotFinishedCallback onPlotFinished;    // If set, called on the plotting thread once each plot has been written
+    void*              onPlotFinishedData;
 };
 
 // This plotter performs the whole plotting process in-memory.
@@ -21,15 +34,53 @@ public:
 
     bool Run( const PlotRequest& request );
 
+    // Waits for the last plot to finish writing, if it hasn't yet.
+    // Run() does this itself for the final plot.
+    void Flush();
+
 private:
 
     template<typename T>
     T* SafeAlloc( size_t size, bool warmStart, const NumaInfo* numa );
 
+    static void SafeFree( void* ptr );
+
     // Check if the background plot writer finished
     void WaitPlotWriter();
 
+#if PLOT_WRITER_PRECOMPUTED_LAYOUT
+    // Size of each table in the plot, in file order, once Phase 2 has marked the used entries.
+    // Returns false if the marked entries were not counted.
+    bool GetTableSizes( size_t tableSizes[10] );
+#endif
+
+    // Lets the pressure governor change the thread count between phases
+    void UpdateGovernor();
+
+    // An output directory or stream, with its own writer thread
+    struct PlotDestination
+    {
+        PlotSinkType    type;
+        std::string     dir;            // Has a trailing slash, unless it is the current directory.
+                                        //  For streams, it's the target, without the tcp:// prefix.
+        DiskPlotWriter* writer;
+        uint            plotCount;      // Plots routed to this directory
+    };
+
+    // Opens the plot file or stream in outDir, if given, or else in the destination best suited for the next plot
+    PlotDestination* OpenPlotFile( const char* plotFileName, const char* outDir, PlotSink& file, std::string& outPath );
+
+    // Gets the type of an output directory and how we refer to it
+    static PlotSinkType ParseDestination( const char* outDir, std::string& dir );
+
 private:
 
     MemPlotContext _context;
+    ThreadPool*    _threadPool = nullptr;   // Owns the threads. The context's pool may be a partition of it.
+
+    PlotDestination*   _destinations     = nullptr;
+    uint               _destinationCount = 0;
+    PlotStagingBuffer* _staging          = nullptr;  // Shared by all destinations, as only one plot is pending at a time
+    uint               _checksumThreads  = 0;
+    const char*        _writeStatsPath   = nullptr;
 };
\ No newline at end of file
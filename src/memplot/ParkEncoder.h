@@ -0,0 +1,155 @@
+#pragma once
+// Needed for the CTable layout
+#define FSE_STATIC_LINKING_ONLY 1
+#include "fse/fse.h"
+
+///
+/// FSE encoder for the fixed-table park deltas (LinePoint parks and C3 parks).
+///
+/// Produces the exact output of FSE_compress_usingCTable, including returning 0 when
+/// the stream does not fit in dstSize, but encodes StreamCount independent inputs
+/// of the same size in lockstep. Each FSE stream has two states that depend on each other
+/// from one symbol to the next, so encoding a single park is bound by the state table lookups.
+/// Interleaving parks gives the CPU independent states to work on.
+///
+/// The table parameters are read once per call, and the symbol loop is unrolled
+/// to 4 symbols per flush, which the 64-bit bit container allows for FSE_MAX_TABLELOG.
+///
+template<uint StreamCount>
+inline void FSECompressParks( byte* const dst[StreamCount], const size_t dstSize,
+                              const byte* const src[StreamCount], const size_t srcSize,
+                              const FSE_CTable* ct, size_t outSizes[StreamCount] )
+{
+    static_assert( FSE_MAX_TABLELOG * 4 + 7 < 64, "Bit container can't hold 4 symbols." );
+
+    if( srcSize <= 2 || dstSize <= sizeof( uint64 ) )
+    {
+        for( uint s = 0; s < StreamCount; s++ )
+            outSizes[s] = 0;
+        return;
+    }
+
+    const uint16* ctU16      = (const uint16*)ct;
+    const uint    tableLog   = ctU16[0];
+    const uint16* stateTable = ctU16 + 2;
+    const FSE_symbolCompressionTransform* symbolTT = (const FSE_symbolCompressionTransform*)
+        ( (const uint32*)ct + 1 + ( tableLog ? ( 1u << ( tableLog - 1 ) ) : 1 ) );
+
+    uint64 container[StreamCount];
+    uint   bitPos   [StreamCount];
+    byte*  writer   [StreamCount];
+    byte*  end      [StreamCount];
+    int64  state1   [StreamCount];
+    int64  state2   [StreamCount];
+
+    for( uint s = 0; s < StreamCount; s++ )
+    {
+        container[s] = 0;
+        bitPos   [s] = 0;
+        writer   [s] = dst[s];
+        end      [s] = dst[s] + dstSize - sizeof( uint64 );
+    }
+
+    // FSE_initCState2
+    const auto initState = [=]( int64& state, const uint symbol ) {
+        const FSE_symbolCompressionTransform tt = symbolTT[symbol];
+
+        const uint32 nbBitsOut = ( tt.deltaNbBits + ( 1 << 15 ) ) >> 16;
+        const uint32 value     = ( nbBitsOut << 16 ) - tt.deltaNbBits;
+
+        state = stateTable[( value >> nbBitsOut ) + tt.deltaFindState];
+    };
+
+    // FSE_encodeSymbol
+    const auto encode = [=]( uint64& bits, uint& pos, int64& state, const uint symbol ) {
+        const FSE_symbolCompressionTransform tt = symbolTT[symbol];
+
+        const uint nbBitsOut = (uint)( ( state + tt.deltaNbBits ) >> 16 );
+
+        bits  |= ( (uint64)state & ( ( 1ull << nbBitsOut ) - 1 ) ) << pos;
+        pos   += nbBitsOut;
+        state  = stateTable[( state >> nbBitsOut ) + tt.deltaFindState];
+    };
+
+    // BIT_flushBits
+    const auto flush = [=]( uint64& bits, uint& pos, byte*& ptr, const byte* endPtr ) {
+        const uint nbBytes = pos >> 3;
+
+        memcpy( ptr, &bits, sizeof( uint64 ) );     // Little-endian, as MEM_writeLEST
+        ptr += nbBytes;
+        ptr  = ptr > endPtr ? (byte*)endPtr : ptr;
+
+        pos  &= 7;
+        bits >>= nbBytes * 8;
+    };
+
+    // Symbols are encoded from the end
+    size_t ip = srcSize;
+
+    if( srcSize & 1 )
+    {
+        for( uint s = 0; s < StreamCount; s++ )
+        {
+            initState( state1[s], src[s][ip-1] );
+            initState( state2[s], src[s][ip-2] );
+            encode( container[s], bitPos[s], state1[s], src[s][ip-3] );
+            flush( container[s], bitPos[s], writer[s], end[s] );
+        }
+        ip -= 3;
+    }
+    else
+    {
+        for( uint s = 0; s < StreamCount; s++ )
+        {
+            initState( state2[s], src[s][ip-1] );
+            initState( state1[s], src[s][ip-2] );
+        }
+        ip -= 2;
+    }
+
+    // Join to a multiple of 4
+    if( ( srcSize - 2 ) & 2 )
+    {
+        for( uint s = 0; s < StreamCount; s++ )
+        {
+            encode( container[s], bitPos[s], state2[s], src[s][ip-1] );
+            encode( container[s], bitPos[s], state1[s], src[s][ip-2] );
+            flush( container[s], bitPos[s], writer[s], end[s] );
+        }
+        ip -= 2;
+    }
+
+    while( ip > 0 )
+    {
+        for( uint s = 0; s < StreamCount; s++ )
+        {
+            const byte* symbols = src[s] + ip - 4;
+
+            encode( container[s], bitPos[s], state2[s], symbols[3] );
+            encode( container[s], bitPos[s], state1[s], symbols[2] );
+            encode( container[s], bitPos[s], state2[s], symbols[1] );
+            encode( container[s], bitPos[s], state1[s], symbols[0] );
+            flush( container[s], bitPos[s], writer[s], end[s] );
+        }
+        ip -= 4;
+    }
+
+    for( uint s = 0; s < StreamCount; s++ )
+    {
+        // FSE_flushCState
+        container[s] |= ( (uint64)state2[s] & ( ( 1ull << tableLog ) - 1 ) ) << bitPos[s];
+        bitPos[s]    += tableLog;
+        flush( container[s], bitPos[s], writer[s], end[s] );
+
+        container[s] |= ( (uint64)state1[s] & ( ( 1ull << tableLog ) - 1 ) ) << bitPos[s];
+        bitPos[s]    += tableLog;
+        flush( container[s], bitPos[s], writer[s], end[s] );
+
+        // BIT_closeCStream: End mark
+        container[s] |= 1ull << bitPos[s];
+        bitPos[s]    += 1;
+        flush( container[s], bitPos[s], writer[s], end[s] );
+
+        outSizes[s] = writer[s] >= end[s] ? 0 : (size_t)( writer[s] - dst[s] ) + ( bitPos[s] > 0 );
+    }
+}
@@ -2,6 +2,8 @@
 #include "memplot/CTables.h"
 #include "ChiaConsts.h"
 #include "threading/ThreadPool.h"
+#include "util/BitWriter.h"
+#include "ParkEncoder.h"
 
 struct WriteParkJob
 {
@@ -21,6 +23,14 @@ size_t WriteParks( ThreadPool& pool, const uint64 length, uint64* linePoints, by
 // Returns the offset to the next park buffer
 void WritePark( const size_t parkSize, const uint64 count, uint64* linePoints, byte* parkBuffer, TableId tableId );
 
+// Write 2 consecutive full parks
+void WriteParkPair( const size_t parkSize, uint64* linePoints, byte* parkBuffer, TableId tableId );
+
+byte* PrepareParkDeltas( const uint64 count, uint64* linePoints, byte* parkBuffer );
+
+void FinishPark( const size_t parkSize, const uint64 count, const byte* smallDeltas,
+                 const byte* compressedDeltas, size_t deltasSize, byte* parkBuffer, TableId tableId );
+
 void WriteParkThread( WriteParkJob* job );
 
 //-----------------------------------------------------------
@@ -78,8 +88,53 @@ inline size_t WriteParks( ThreadPool& pool, const uint64 length, uint64* linePoi
     return sizeWritten;
 }
 
+// Offset of the compressed deltas size field in a LinePoint park,
+// after the first LinePoint and the stubs
+constexpr size_t ParkDeltaSizeOffset = sizeof( uint64 ) + CDiv( (kEntriesPerPark - 1) * (_K - kStubMinusBits), 8 );
+
 //-----------------------------------------------------------
 inline void WritePark( const size_t parkSize, const uint64 count, uint64* linePoints, byte* parkBuffer, TableId tableId )
+{
+    const byte* smallDeltas = PrepareParkDeltas( count, linePoints, parkBuffer );
+
+    byte*  compressedDeltas = parkBuffer + ParkDeltaSizeOffset + 2;
+    size_t deltasSize;
+
+    FSECompressParks<1>( &compressedDeltas, (count-1) * 8, &smallDeltas, count-1, CTables[(int)tableId], &deltasSize );
+
+    FinishPark( parkSize, count, smallDeltas, compressedDeltas, deltasSize, parkBuffer, tableId );
+}
+
+// Write 2 full parks, compressing their deltas together
+//-----------------------------------------------------------
+inline void WriteParkPair( const size_t parkSize, uint64* linePoints, byte* parkBuffer, TableId tableId )
+{
+    constexpr uint64 deltaCount = kEntriesPerPark - 1;
+
+    byte* parkBuffers[2] = { parkBuffer, parkBuffer + parkSize };
+
+    const byte* smallDeltas[2] = {
+        PrepareParkDeltas( kEntriesPerPark, linePoints                  , parkBuffers[0] ),
+        PrepareParkDeltas( kEntriesPerPark, linePoints + kEntriesPerPark, parkBuffers[1] )
+    };
+
+    // The encoder may store a few bytes past the compressed deltas, 
+    // so the first park's are encoded on the side, to keep the second park's stubs intact
+    byte firstParkDeltas[deltaCount * 8];
+
+    byte*  compressedDeltas[2] = { firstParkDeltas, parkBuffers[1] + ParkDeltaSizeOffset + 2 };
+    size_t deltasSizes     [2];
+
+    FSECompressParks<2>( compressedDeltas, deltaCount * 8, smallDeltas, deltaCount, CTables[(int)tableId], deltasSizes );
+
+    FinishPark( parkSize, kEntriesPerPark, smallDeltas[0], compressedDeltas[0], deltasSizes[0], parkBuffers[0], tableId );
+    FinishPark( parkSize, kEntriesPerPark, smallDeltas[1], compressedDeltas[1], deltasSizes[1], parkBuffers[1], tableId );
+}
+
+// Writes the first LinePoint and the stubs of a park.
+// Returns the small deltas to compress, which are written over linePoints.
+//-----------------------------------------------------------
+inline byte* PrepareParkDeltas( const uint64 count, uint64* linePoints, byte* parkBuffer )
 {
     ASSERT( count <= kEntriesPerPark );
 
@@ -104,65 +159,13 @@ inline void WritePark( const size_t parkSize, const uint64 count, uint64* linePo
     const size_t stubSectionBytes = CDiv( (kEntriesPerPark - 1) * stubBitSize, 8 );
 
     byte* deltaBytesWriter = ((byte*)writer) + stubSectionBytes;
+    ASSERT( deltaBytesWriter == parkBuffer + ParkDeltaSizeOffset );
 
     // Write stubs
     {
-        const uint64 stubMask = ((1ULL << stubBitSize) - 1);
-
-        uint64 field = 0;   // Current field to write
-        uint   bits  = 0;   // Bits occupying the current field (always shifted to the leftmost bits)
-
-        for( uint64 i = 1; i < count; i++ )
-        {
-            const uint64 lpDelta = linePoints[i];
-            const uint64 stub    = lpDelta & stubMask;
-
-            // Serialize into bits, one uint64 field at a time
-            // Always store it all the way to the MSbits
-            const uint freeBits = 64 - bits;
-            if( freeBits <= stubBitSize )
-            {
-                // Update the next field bits to what the stub bits that were not written into the current field
-                bits = stubBitSize - freeBits;
-
-                // Write what we can (which may be nothing) into the free bits of the current field
-                field |= stub >> bits;
-
-                // Store field
-                *writer++ = Swap64( field );
-
-                // Write the remaining stub bits (which may be none) into the next field
-                // if( bits )
-                //     field = stub << ( 64 - bits );
-                // else
-                //     field = 0;
-
-                // #NOTE: I benchmarked both branching and non-branching
-                //        versions and they pretty much run the same in arm CPUs.
-                //        Perhaps we should go with the branching method with no undefined behavior.
-
-                // Add a mask to avoid branching here.
-                // If the bits is 0, we will shift by 64 bits, which
-                // is undefined behavior. Therefore, we mask it so that in the
-                // case that bits is 0, we will mask it out to 0.
-                const uint remainder = 64 - bits;
-                uint64 mask = ( ( 1ull << bits ) - 1 ) << (remainder & 63);
-                field = ( stub << remainder ) & mask;
-            }
-            else
-            {
-                // The stub completely fits into the current field with room to spare
-                field |= stub << (freeBits - stubBitSize);
-                bits += stubBitSize;
-            }
-        }
-
-        // Write any trailing fields
-        if( bits > 0 )
-            *writer++ = Swap64( field );
+        const size_t stubUsedBytes = PackBitsBE<stubBitSize>( (byte*)writer, linePoints + 1, count - 1 );
 
         // Zero-out any remaining unused bytes
-        const size_t stubUsedBytes  = CDiv( (count - 1) * stubBitSize, 8 );
         const size_t remainderBytes = stubSectionBytes - stubUsedBytes;
         
         memset( deltaBytesWriter - remainderBytes, 0, remainderBytes );
@@ -200,17 +203,22 @@ inline void WritePark( const size_t parkSize, const uint64 count, uint64* linePo
         ASSERT( averageDeltaBits <= kMaxAverageDeltaTable1 );
     #endif
 
+    return smallDeltas;
+}
+
+// Writes the compressed deltas (or the raw deltas if they could not be compressed)
+// and zeroes-out the rest of the park
+//-----------------------------------------------------------
+inline void FinishPark( const size_t parkSize, const uint64 count, const byte* smallDeltas,
+                        const byte* compressedDeltas, size_t deltasSize, byte* parkBuffer, TableId tableId )
+{
+    byte* deltaBytesWriter = parkBuffer + ParkDeltaSizeOffset;
+
     // Write small deltas
     {
         uint16* deltaSizeWriter = (uint16*)deltaBytesWriter;
         deltaBytesWriter += 2;
 
-        const FSE_CTable* ct = CTables[(int)tableId];
-
-        size_t deltasSize = FSE_compress_usingCTable( 
-                                deltaBytesWriter, (count-1) * 8,
-                                smallDeltas, count-1, ct );
-
         if( !deltasSize )
         {
             // Deltas were NOT compressed, we have to copy them raw
@@ -220,8 +228,11 @@ inline void WritePark( const size_t parkSize, const uint64 count, uint64* linePo
         }
         else
         {
-            // Deltas were compressed
+            // Deltas were compressed, they may have been encoded elsewhere
             *deltaSizeWriter = (uint16)deltasSize;
+
+            if( compressedDeltas != deltaBytesWriter )
+                memcpy( deltaBytesWriter, compressedDeltas, deltasSize );
         }
 
         deltaBytesWriter += deltasSize;
@@ -248,12 +259,16 @@ inline void WriteParkThread( WriteParkJob* job )
     uint64* linePoints = job->linePoints;
     byte*   parkBuffer = job->parkBuffer;
 
-    for( uint64 i = 0; i < parkCount; i++ )
+    uint64 i = 0;
+    for( ; i + 1 < parkCount; i += 2 )
     {
-        WritePark( parkSize, kEntriesPerPark, linePoints, parkBuffer, tableId );
+        WriteParkPair( parkSize, linePoints, parkBuffer, tableId );
         
-        linePoints += kEntriesPerPark;
-        parkBuffer += parkSize;
+        linePoints += kEntriesPerPark * 2;
+        parkBuffer += parkSize * 2;
     }
+
+    if( i < parkCount )
+        WritePark( parkSize, kEntriesPerPark, linePoints, parkBuffer, tableId );
 }
 
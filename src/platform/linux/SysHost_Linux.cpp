@@ -5,6 +5,7 @@
 #include <sys/random.h>
 #include <execinfo.h>
 #include <signal.h>
+#include <sys/statvfs.h>
 #include <atomic>
 #include <numa.h>
 #include <numaif.h>
@@ -35,6 +36,16 @@ size_t SysHost::GetAvailableSystemMemory()
     return (size_t)get_avphys_pages() * pageSize;
 }
 
+//-----------------------------------------------------------
+size_t SysHost::GetAvailableDiskSpace( const char* path )
+{
+    struct statvfs fs;
+    if( statvfs( path && *path ? path : ".", &fs ) != 0 )
+        return 0;
+
+    return (size_t)fs.f_bavail * (size_t)fs.f_frsize;
+}
+
 //-----------------------------------------------------------
  uint SysHost::GetLogicalCPUCount()
  {
@@ -2,6 +2,8 @@
 #include "Platform.h"
 #include "Util.h"
 
+#include <sys/statvfs.h>
+
 #if _DEBUG
     #include "util/Log.h"
 #endif
@@ -47,6 +49,16 @@ size_t SysHost::GetAvailableSystemMemory()
              vmstat->inactive_count ) * pageSize;
 }
 
+//-----------------------------------------------------------
+size_t SysHost::GetAvailableDiskSpace( const char* path )
+{
+    struct statvfs fs;
+    if( statvfs( path && *path ? path : ".", &fs ) != 0 )
+        return 0;
+
+    return (size_t)fs.f_bavail * (size_t)fs.f_frsize;
+}
+
 //-----------------------------------------------------------
 void* SysHost::VirtualAlloc( size_t size, bool initialize )
 {
@@ -6,6 +6,128 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#if PLATFORM_IS_LINUX
+    #include <sys/syscall.h>
+    #include <sys/mman.h>
+    #include <sys/uio.h>
+    #include <linux/io_uring.h>
+
+    #if defined( __NR_io_uring_setup ) && defined( __NR_io_uring_enter ) && defined( __NR_io_uring_register )
+        #define BB_IO_URING 1
+    #endif
+#endif
+
+#if BB_IO_URING
+///
+/// io_uring used for async writes. We use the raw syscalls, so we don't depend on liburing.
+///
+struct AsyncWriteRequest
+{
+    const byte* buffer;
+    size_t      size;
+    uint64      offset;
+    iovec       iov;
+};
+
+struct AsyncWriteQueue
+{
+    static constexpr uint   MAX_DEPTH            = 64;
+    static constexpr uint   MAX_REGISTERED       = 64;
+    static constexpr size_t REGISTERED_IOV_SIZE  = 1ull << 30;   // The kernel limits registered buffers to 1GiB
+
+    int           ringFd;
+    uint          depth;
+    uint          pending;          // Requests in flight
+    uint          toSubmit;         // Requests queued in the SQ, but not yet submitted
+
+    // Submission ring
+    byte*         sqRing;
+    size_t        sqRingSize;
+    uint32*       sqHead;
+    uint32*       sqTail;
+    uint32        sqMask;
+    uint32*       sqArray;
+    io_uring_sqe* sqes;
+    size_t        sqesSize;
+
+    // Completion ring (same mapping as the submission ring, with IORING_FEAT_SINGLE_MMAP)
+    byte*         cqRing;
+    size_t        cqRingSize;
+    uint32*       cqHead;
+    uint32*       cqTail;
+    uint32        cqMask;
+    io_uring_cqe* cqes;
+
+    AsyncWriteRequest requests    [MAX_DEPTH];
+    uint              freeRequests[MAX_DEPTH];
+    uint              freeCount;
+
+    const byte*       registeredBuffer;
+    size_t            registeredSize;
+};
+
+//-----------------------------------------------------------
+inline static int IOUringSetup( uint entries, io_uring_params* params )
+{
+    return (int)syscall( __NR_io_uring_setup, entries, params );
+}
+
+//-----------------------------------------------------------
+inline static int IOUringEnter( int ringFd, uint toSubmit, uint minComplete, uint flags )
+{
+    return (int)syscall( __NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0 );
+}
+
+//-----------------------------------------------------------
+inline static int IOUringRegister( int ringFd, uint opcode, const void* arg, uint argCount )
+{
+    return (int)syscall( __NR_io_uring_register, ringFd, opcode, arg, argCount );
+}
+
+//-----------------------------------------------------------
+static void DestroyAsyncWriteQueue( AsyncWriteQueue* queue )
+{
+    if( queue->sqes )
+        munmap( queue->sqes, queue->sqesSize );
+
+    if( queue->cqRing && queue->cqRing != queue->sqRing )
+        munmap( queue->cqRing, queue->cqRingSize );
+
+    if( queue->sqRing )
+        munmap( queue->sqRing, queue->sqRingSize );
+
+    close( queue->ringFd );
+    delete queue;
+}
+#endif
+
+// Writes all of buffer at offset, returns 0 or errno
+//-----------------------------------------------------------
+static int WriteAt( int fd, const byte* buffer, size_t size, uint64 offset )
+{
+    while( size )
+    {
+        const ssize_t written = pwrite( fd, buffer, size, (off_t)offset );
+
+        if( written < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+
+            return errno;
+        }
+
+        if( written == 0 )
+            return EIO;
+
+        buffer += written;
+        offset += (uint64)written;
+        size   -= (size_t)written;
+    }
+
+    return 0;
+}
+
 //----------------------------------------------------------
 bool FileStream::Open( const char* path, FileMode mode, FileAccess access, FileFlags flags )
 {
@@ -33,8 +155,9 @@ bool FileStream::Open( const char* path, FileStream& file, FileMode mode, FileAc
                mode == FileMode::Append ? O_APPEND : 0;
 
     #if PLATFORM_IS_LINUX
+        // Not O_SYNC: Writers call DataSync() once they're done instead of syncing every write
         if( IsFlagSet( flags, FileFlags::NoBuffering ) )
-            fdFlags |= O_DIRECT | O_SYNC;
+            fdFlags |= O_DIRECT;
 
         if( IsFlagSet( flags, FileFlags::LargeFile )  )
             fdFlags |= O_LARGEFILE;
@@ -98,6 +221,15 @@ void FileStream::Close()
     if( _fd <= 0 )
         return;
 
+    #if BB_IO_URING
+        if( _asyncQueue )
+        {
+            WaitForAsyncWrites();
+            DestroyAsyncWriteQueue( _asyncQueue );
+            _asyncQueue = nullptr;
+        }
+    #endif
+
     #if _DEBUG
     int r =
     #endif
@@ -173,7 +305,9 @@ ssize_t FileStream::Write( const void* buffer, size_t size )
 bool FileStream::Reserve( ssize_t size )
 {
     #if PLATFORM_IS_LINUX
-        int r = posix_fallocate( _fd, 0, (off_t)size );
+        // Not posix_fallocate, as it falls back to writing the whole file
+        // if the file system does not support fallocate.
+        int r = fallocate( _fd, 0, 0, (off_t)size );
         if( r != 0 )
         {
             _error = errno;
@@ -230,6 +364,427 @@ bool FileStream::Flush()
     return true;
 }
 
+//-----------------------------------------------------------
+bool FileStream::DataSync()
+{
+    if( !IsOpen() )
+        return false;
+
+    #if PLATFORM_IS_LINUX
+        int r = fdatasync( _fd );
+    #else
+        int r = fsync( _fd );
+    #endif
+
+    if( r )
+    {
+        _error = errno;
+        return false;
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------
+bool FileStream::Truncate( int64 size )
+{
+    if( !IsOpen() )
+        return false;
+
+    int r = ftruncate( _fd, (off_t)size );
+
+    if( r )
+    {
+        _error = errno;
+        return false;
+    }
+
+    return true;
+}
+
+#if PLATFORM_IS_LINUX
+//-----------------------------------------------------------
+bool FileStream::InitAsyncWrites( uint queueDepth )
+{
+    if( !IsOpen() )
+        return false;
+
+#if BB_IO_URING
+    if( _asyncQueue )
+        return true;
+
+    queueDepth = std::max( 1u, std::min( queueDepth, AsyncWriteQueue::MAX_DEPTH ) );
+
+    io_uring_params params;
+    memset( &params, 0, sizeof( params ) );
+
+    const int ringFd = IOUringSetup( queueDepth, &params );
+    if( ringFd < 0 )
+        return false;
+
+    AsyncWriteQueue* queue = new AsyncWriteQueue();
+    memset( queue, 0, sizeof( AsyncWriteQueue ) );
+
+    queue->ringFd     = ringFd;
+    queue->depth      = queueDepth;
+    queue->sqRingSize = params.sq_off.array + params.sq_entries * sizeof( uint32 );
+    queue->cqRingSize = params.cq_off.cqes  + params.cq_entries * sizeof( io_uring_cqe );
+    queue->sqesSize   = params.sq_entries * sizeof( io_uring_sqe );
+
+    const bool singleMap = ( params.features & IORING_FEAT_SINGLE_MMAP ) != 0;
+    if( singleMap )
+        queue->sqRingSize = queue->cqRingSize = std::max( queue->sqRingSize, queue->cqRingSize );
+
+    void* sqRing = mmap( nullptr, queue->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING );
+    if( sqRing == MAP_FAILED )
+    {
+        DestroyAsyncWriteQueue( queue );
+        return false;
+    }
+    queue->sqRing = (byte*)sqRing;
+
+    if( singleMap )
+        queue->cqRing = queue->sqRing;
+    else
+    {
+        void* cqRing = mmap( nullptr, queue->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING );
+        if( cqRing == MAP_FAILED )
+        {
+            DestroyAsyncWriteQueue( queue );
+            return false;
+        }
+        queue->cqRing = (byte*)cqRing;
+    }
+
+    void* sqes = mmap( nullptr, queue->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES );
+    if( sqes == MAP_FAILED )
+    {
+        DestroyAsyncWriteQueue( queue );
+        return false;
+    }
+    queue->sqes = (io_uring_sqe*)sqes;
+
+    queue->sqHead  = (uint32*)( queue->sqRing + params.sq_off.head );
+    queue->sqTail  = (uint32*)( queue->sqRing + params.sq_off.tail );
+    queue->sqMask  = *(uint32*)( queue->sqRing + params.sq_off.ring_mask );
+    queue->sqArray = (uint32*)( queue->sqRing + params.sq_off.array );
+
+    queue->cqHead  = (uint32*)( queue->cqRing + params.cq_off.head );
+    queue->cqTail  = (uint32*)( queue->cqRing + params.cq_off.tail );
+    queue->cqMask  = *(uint32*)( queue->cqRing + params.cq_off.ring_mask );
+    queue->cqes    = (io_uring_cqe*)( queue->cqRing + params.cq_off.cqes );
+
+    for( uint i = 0; i < queueDepth; i++ )
+        queue->freeRequests[i] = queueDepth - 1 - i;
+
+    queue->freeCount = queueDepth;
+
+    _asyncQueue = queue;
+    return true;
+#else
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------
+bool FileStream::RegisterAsyncBuffer( const void* buffer, size_t size )
+{
+#if BB_IO_URING
+    AsyncWriteQueue* queue = _asyncQueue;
+    if( !queue )
+        return false;
+
+    ASSERT( queue->pending == 0 && queue->toSubmit == 0 );
+    if( queue->pending || queue->toSubmit )
+        return false;
+
+    if( queue->registeredBuffer )
+    {
+        IOUringRegister( queue->ringFd, IORING_UNREGISTER_BUFFERS, nullptr, 0 );
+        queue->registeredBuffer = nullptr;
+        queue->registeredSize   = 0;
+    }
+
+    if( !buffer || !size )
+        return false;
+
+    const uint count = (uint)CDiv( size, (int)AsyncWriteQueue::REGISTERED_IOV_SIZE );
+    if( count > AsyncWriteQueue::MAX_REGISTERED )
+        return false;
+
+    iovec iovs[AsyncWriteQueue::MAX_REGISTERED];
+
+    for( uint i = 0; i < count; i++ )
+    {
+        const size_t offset = i * AsyncWriteQueue::REGISTERED_IOV_SIZE;
+
+        iovs[i].iov_base = (byte*)buffer + offset;
+        iovs[i].iov_len  = std::min( size - offset, AsyncWriteQueue::REGISTERED_IOV_SIZE );
+    }
+
+    // Fails if the pages can't be locked, in which case we simply write without registered buffers
+    if( IOUringRegister( queue->ringFd, IORING_REGISTER_BUFFERS, iovs, count ) < 0 )
+        return false;
+
+    queue->registeredBuffer = (const byte*)buffer;
+    queue->registeredSize   = size;
+
+    return true;
+#else
+    return false;
+#endif
+}
+#endif // PLATFORM_IS_LINUX
+
+#if BB_IO_URING
+// Reaps the completed requests. Write errors are returned in error.
+//-----------------------------------------------------------
+static void ReapAsyncWrites( AsyncWriteQueue& queue, int fd, int& error )
+{
+    uint32 head = *queue.cqHead;
+    const uint32 tail = __atomic_load_n( queue.cqTail, __ATOMIC_ACQUIRE );
+
+    for( ; head != tail; head++ )
+    {
+        const io_uring_cqe&      cqe = queue.cqes[head & queue.cqMask];
+        const uint               id  = (uint)cqe.user_data;
+        const AsyncWriteRequest& req = queue.requests[id];
+
+        if( cqe.res < 0 )
+        {
+            if( !error )
+                error = -cqe.res;
+        }
+        else if( (size_t)cqe.res < req.size )
+        {
+            // Short write, finish it synchronously
+            const int r = WriteAt( fd, req.buffer + cqe.res, req.size - (size_t)cqe.res, req.offset + (uint64)cqe.res );
+            if( r && !error )
+                error = r;
+        }
+
+        queue.freeRequests[queue.freeCount++] = id;
+        queue.pending--;
+    }
+
+    __atomic_store_n( queue.cqHead, head, __ATOMIC_RELEASE );
+}
+
+// Submits the queued requests, waits for minComplete requests to complete, then reaps the completed ones.
+// Write errors are returned in error. Returns false only if io_uring_enter failed.
+//-----------------------------------------------------------
+inline static bool SubmitAndReap( AsyncWriteQueue& queue, int fd, uint minComplete, int& error )
+{
+    const uint maxRetries = 1000;   // For when the kernel is out of resources and we have nothing in flight
+    uint       retries    = 0;
+
+    while( queue.toSubmit || minComplete )
+    {
+        const int r = IOUringEnter( queue.ringFd, queue.toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0 );
+
+        if( r >= 0 )
+        {
+            queue.toSubmit -= std::min( (uint)r, queue.toSubmit );
+            break;
+        }
+
+        if( errno == EINTR )
+            continue;
+
+        // Out of resources to submit more, wait for completions to free them up,
+        // or try again shortly if there's none to wait for
+        if( errno == EAGAIN || errno == EBUSY )
+        {
+            if( queue.pending > queue.toSubmit )
+            {
+                IOUringEnter( queue.ringFd, 0, 1, IORING_ENTER_GETEVENTS );
+                break;
+            }
+
+            if( ++retries < maxRetries )
+            {
+                usleep( 1000 );
+                continue;
+            }
+        }
+
+        if( !error )
+            error = errno;
+
+        return false;
+    }
+
+    ReapAsyncWrites( queue, fd, error );
+    return true;
+}
+
+// Called once io_uring_enter has failed: Takes back the requests the kernel has not consumed,
+// and waits for the ones in flight to complete, so that their buffers are no longer in use.
+//-----------------------------------------------------------
+static void DrainAsyncWrites( AsyncWriteQueue& queue, int fd, int& error )
+{
+    const uint32 sqHead   = __atomic_load_n( queue.sqHead, __ATOMIC_ACQUIRE );
+          uint32 sqTail   = *queue.sqTail;
+    const uint   unqueued = (uint)( sqTail - sqHead );
+
+    for( uint i = 0; i < unqueued; i++ )
+    {
+        sqTail--;
+        const io_uring_sqe& sqe = queue.sqes[queue.sqArray[sqTail & queue.sqMask]];
+        queue.freeRequests[queue.freeCount++] = (uint)sqe.user_data;
+    }
+
+    __atomic_store_n( queue.sqTail, sqTail, __ATOMIC_RELEASE );
+
+    queue.pending -= unqueued;
+    queue.toSubmit = 0;
+
+    // The kernel posts completions to the ring by itself, so we can poll it if we can't wait on it
+    while( queue.pending )
+    {
+        const int r = IOUringEnter( queue.ringFd, 0, 1, IORING_ENTER_GETEVENTS );
+        if( r < 0 && errno != EINTR )
+            usleep( 1000 );
+
+        ReapAsyncWrites( queue, fd, error );
+    }
+}
+#endif
+
+//-----------------------------------------------------------
+bool FileStream::WriteAsync( const void* buffer, size_t size, uint64 offset )
+{
+    ASSERT( buffer );
+
+    if( !IsOpen() || !IsFlagSet( _access, FileAccess::Write ) )
+        return false;
+
+    if( _error )
+        return false;
+
+#if BB_IO_URING
+    AsyncWriteQueue* queue = _asyncQueue;
+
+    if( queue )
+    {
+        const byte* writer = (const byte*)buffer;
+
+        while( size )
+        {
+            // Wait for a request to free up
+            while( queue->freeCount == 0 )
+            {
+                if( !SubmitAndReap( *queue, _fd, 1, _error ) )
+                {
+                    DrainAsyncWrites( *queue, _fd, _error );
+                    return false;
+                }
+            }
+
+            if( _error )
+                return false;
+
+            const size_t chunkSize = std::min( size, AsyncWriteChunkSize );
+            const uint   id        = queue->freeRequests[--queue->freeCount];
+
+            AsyncWriteRequest& req = queue->requests[id];
+            req.buffer = writer;
+            req.size   = chunkSize;
+            req.offset = offset;
+
+            // Use the registered buffer if the whole chunk falls into one of its iovecs
+            int bufIndex = -1;
+            if( writer >= queue->registeredBuffer && writer + chunkSize <= queue->registeredBuffer + queue->registeredSize )
+            {
+                const size_t regOffset = (size_t)( writer - queue->registeredBuffer );
+                const size_t iovIdx    = regOffset / AsyncWriteQueue::REGISTERED_IOV_SIZE;
+
+                if( regOffset + chunkSize <= ( iovIdx + 1 ) * AsyncWriteQueue::REGISTERED_IOV_SIZE )
+                    bufIndex = (int)iovIdx;
+            }
+
+            const uint32  tail = *queue->sqTail;
+            const uint32  idx  = tail & queue->sqMask;
+            io_uring_sqe& sqe  = queue->sqes[idx];
+
+            memset( &sqe, 0, sizeof( sqe ) );
+            sqe.fd        = _fd;
+            sqe.off       = offset;
+            sqe.user_data = id;
+
+            if( bufIndex >= 0 )
+            {
+                sqe.opcode    = IORING_OP_WRITE_FIXED;
+                sqe.addr      = (uint64)(uintptr_t)writer;
+                sqe.len       = (uint32)chunkSize;
+                sqe.buf_index = (uint16)bufIndex;
+            }
+            else
+            {
+                // Writev rather than write, as it's supported since io_uring was introduced
+                req.iov.iov_base = (void*)writer;
+                req.iov.iov_len  = chunkSize;
+
+                sqe.opcode    = IORING_OP_WRITEV;
+                sqe.addr      = (uint64)(uintptr_t)&req.iov;
+                sqe.len       = 1;
+            }
+
+            queue->sqArray[idx] = idx;
+            __atomic_store_n( queue->sqTail, tail + 1, __ATOMIC_RELEASE );
+
+            queue->toSubmit++;
+            queue->pending++;
+
+            writer += chunkSize;
+            offset += chunkSize;
+            size   -= chunkSize;
+        }
+
+        if( !SubmitAndReap( *queue, _fd, 0, _error ) )
+            DrainAsyncWrites( *queue, _fd, _error );
+
+        return _error == 0;
+    }
+#endif
+
+    const int r = WriteAt( _fd, (const byte*)buffer, size, offset );
+    if( r )
+    {
+        _error = r;
+        return false;
+    }
+
+    return true;
+}
+
+//-----------------------------------------------------------
+bool FileStream::WaitForAsyncWrites()
+{
+#if BB_IO_URING
+    AsyncWriteQueue* queue = _asyncQueue;
+
+    if( queue )
+    {
+        // Wait on all the requests even if there's an error, so that their buffers are released
+        int error = 0;
+        while( queue->pending )
+        {
+            if( !SubmitAndReap( *queue, _fd, 1, error ) )
+            {
+                DrainAsyncWrites( *queue, _fd, error );
+                break;
+            }
+        }
+
+        if( error && !_error )
+            _error = error;
+    }
+#endif
+
+    return _error == 0;
+}
+
 //-----------------------------------------------------------
 bool FileStream::IsOpen() const
 {
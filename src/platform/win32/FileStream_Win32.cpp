@@ -254,6 +254,70 @@ bool FileStream::Flush()
     return (bool)r;
 }
 
+//-----------------------------------------------------------
+bool FileStream::DataSync()
+{
+    return Flush();
+}
+
+//-----------------------------------------------------------
+bool FileStream::Truncate( int64 size )
+{
+    if( !IsOpen() || !HasValidFD() )
+        return false;
+
+    const size_t writePosition = _writePosition;
+    const size_t readPosition  = _readPosition;
+
+    if( !Seek( size, SeekOrigin::Begin ) )
+        return false;
+
+    const BOOL r = SetEndOfFile( _fd );
+    if( !r )
+        _error = GetLastError();
+
+    // Restore the file position
+    Seek( (int64)writePosition, SeekOrigin::Begin );
+    _readPosition = readPosition;
+
+    return (bool)r;
+}
+
+//-----------------------------------------------------------
+bool FileStream::WriteAsync( const void* buffer, size_t size, uint64 offset )
+{
+    ASSERT( buffer );
+
+    if( _error )
+        return false;
+
+    // No async I/O yet, so write synchronously
+    const size_t writePosition = _writePosition;
+
+    if( !Seek( (int64)offset, SeekOrigin::Begin ) )
+        return false;
+
+    const byte* writer = (const byte*)buffer;
+
+    while( size )
+    {
+        const ssize_t written = Write( writer, size );
+        if( written < 1 )
+            return false;
+
+        writer += written;
+        size   -= (size_t)written;
+    }
+
+    return Seek( (int64)writePosition, SeekOrigin::Begin );
+}
+
+//-----------------------------------------------------------
+bool FileStream::WaitForAsyncWrites()
+{
+    return _error == 0;
+}
+
 //-----------------------------------------------------------
 bool FileStream::IsOpen() const
 {
@@ -94,6 +94,17 @@ size_t SysHost::GetAvailableSystemMemory()
     return statex.ullAvailPhys;
 }
 
+//-----------------------------------------------------------
+size_t SysHost::GetAvailableDiskSpace( const char* path )
+{
+    ULARGE_INTEGER available;
+
+    if( !GetDiskFreeSpaceExA( path && *path ? path : NULL, &available, NULL, NULL ) )
+        return 0;
+
+    return (size_t)available.QuadPart;
+}
+
 //-----------------------------------------------------------
 uint SysHost::GetLogicalCPUCount()
 {
@@ -0,0 +1,92 @@
+#include "Util.h"
+#include "util/Log.h"
+#include "util/BitWriter.h"
+#include "ChiaConsts.h"
+#include "SysHost.h"
+#include <random>
+
+template<uint BitCount>
+void BenchmarkPacker( const char* name, const uint64* values, const uint64 length, const uint64 entriesPerPark, byte* buffer );
+
+template<uint BitCount>
+bool ValidatePacker( const uint64* values, const uint64 maxCount );
+
+//-----------------------------------------------------------
+void TestBitWriter( int argc, const char* argv[] )
+{
+    const uint64 length = 1ull << 26;
+
+    uint64* values = (uint64*)SysHost::VirtualAlloc( length * sizeof( uint64 ) );
+    byte*   buffer = (byte*)SysHost::VirtualAlloc( length * sizeof( uint64 ) + 64 );
+    ASSERT( values && buffer );
+
+    std::mt19937_64 rng( 1 );
+    for( uint64 i = 0; i < length; i++ )
+        values[i] = rng();
+
+    // Validate against the value-at-a-time packer, for all the counts up to a couple of parks
+    if( !ValidatePacker<_K - kStubMinusBits>( values, kEntriesPerPark * 2 ) ||
+        !ValidatePacker<_K + 1>( values, kEntriesPerPark * 2 ) )
+        Fatal( "Bit packer validation failed." );
+
+    Log::Line( "Bit packers validated." );
+
+    // Stubs of LinePoint parks and P7 entries
+    BenchmarkPacker<_K - kStubMinusBits>( "Park stubs", values, length, kEntriesPerPark - 1, buffer );
+    BenchmarkPacker<_K + 1>             ( "P7 entries", values, length, kEntriesPerPark    , buffer );
+
+    SysHost::VirtualFree( values );
+    SysHost::VirtualFree( buffer );
+}
+
+//-----------------------------------------------------------
+template<uint BitCount>
+void BenchmarkPacker( const char* name, const uint64* values, const uint64 length, const uint64 entriesPerPark, byte* buffer )
+{
+    const size_t parkSize = CDiv( entriesPerPark * BitCount, 8 );
+    const uint64 parks    = length / entriesPerPark;
+
+    for( uint pass = 0; pass < 3; pass++ )
+    {
+        auto timer = TimerBegin();
+        for( uint64 i = 0; i < parks; i++ )
+            PackBitsScalarBE<BitCount>( buffer + i * parkSize, values + i * entriesPerPark, entriesPerPark );
+        const double scalarElapsed = TimerEnd( timer );
+
+        timer = TimerBegin();
+        for( uint64 i = 0; i < parks; i++ )
+            PackBitsBE<BitCount>( buffer + i * parkSize, values + i * entriesPerPark, entriesPerPark );
+        const double groupElapsed = TimerEnd( timer );
+
+        Log::Line( "%s (%u bits): One at a time: %.3lf seconds. Grouped: %.3lf seconds.",
+            name, BitCount, scalarElapsed, groupElapsed );
+    }
+}
+
+//-----------------------------------------------------------
+template<uint BitCount>
+bool ValidatePacker( const uint64* values, const uint64 maxCount )
+{
+    const size_t bufferSize = CDiv( maxCount * BitCount, 8 ) + 16;
+
+    byte* expected = (byte*)malloc( bufferSize );
+    byte* packed   = (byte*)malloc( bufferSize );
+
+    bool valid = true;
+
+    for( uint64 count = 0; count <= maxCount && valid; count++ )
+    {
+        memset( expected, 0xCD, bufferSize );
+        memset( packed  , 0xCD, bufferSize );
+
+        const size_t size = PackBitsScalarBE<BitCount>( expected, values, count );
+        valid = PackBitsBE<BitCount>( packed, values, count ) == size &&
+                size == CDiv( count * BitCount, 8 )                   &&
+                memcmp( expected, packed, bufferSize ) == 0;
+    }
+
+    free( expected );
+    free( packed   );
+
+    return valid;
+}
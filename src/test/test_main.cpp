@@ -1,12 +1,18 @@
 
 void TestNuma( int argc, const char* argv[] );
 void TestNumaSort( int argc, const char* argv[] );
+void TestBitWriter( int argc, const char* argv[] );
+void TestPlotStream( int argc, const char* argv[] );
+void TestParkEncoder( int argc, const char* argv[] );
 
 //-----------------------------------------------------------
 int main( int argc, const char* argv[] )
 {
     // TestNuma( argc-1, argv+1 );
     TestNumaSort( argc-1, argv+1 );
+    // TestBitWriter( argc-1, argv+1 );
+    // TestPlotStream( argc-1, argv+1 );
+    // TestParkEncoder( argc-1, argv+1 );
 
     return 0;
 }
\ No newline at end of file
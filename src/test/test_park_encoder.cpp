@@ -0,0 +1,116 @@
+#include "Util.h"
+#include "util/Log.h"
+#include "ChiaConsts.h"
+#include "memplot/CTables.h"
+#include "memplot/ParkEncoder.h"
+#include <random>
+#include <cmath>
+
+template<uint StreamCount>
+bool ValidateParkEncoder( const FSE_CTable* ct, const uint64 maxLength, const double meanDelta, const uint64 deltaShift, std::mt19937_64& rng );
+
+//-----------------------------------------------------------
+void TestParkEncoder( int argc, const char* argv[] )
+{
+    std::mt19937_64 rng( 1 );
+
+    // LinePoints in a park are ~2^(k-1) apart, which is what makes their small deltas (stub bits shifted out)
+    const double lpMeanDelta  = (double)( 1ull << ( _K - 1 ) );
+    const uint64 lpDeltaShift = _K - kStubMinusBits;
+
+    for( uint table = 0; table < 6; table++ )
+    {
+        if( !ValidateParkEncoder<1>( CTables[table], kEntriesPerPark - 1, lpMeanDelta, lpDeltaShift, rng ) ||
+            !ValidateParkEncoder<2>( CTables[table], kEntriesPerPark - 1, lpMeanDelta, lpDeltaShift, rng ) )
+            Fatal( "Park encoder validation failed for table %u.", table + 1 );
+    }
+
+    // f7 values are ~1 apart
+    if( !ValidateParkEncoder<1>( (const FSE_CTable*)CTable_C3, kCheckpoint1Interval - 1, 1.0, 0, rng ) ||
+        !ValidateParkEncoder<2>( (const FSE_CTable*)CTable_C3, kCheckpoint1Interval - 1, 1.0, 0, rng ) )
+        Fatal( "Park encoder validation failed for C3 parks." );
+
+    Log::Line( "Park encoder validated." );
+}
+
+// Encode random deltas with FSECompressParks and compare them with FSE_compress_usingCTable.
+// Full and partial parks are encoded, with room for the whole stream and with too little room.
+//-----------------------------------------------------------
+template<uint StreamCount>
+bool ValidateParkEncoder( const FSE_CTable* ct, const uint64 maxLength, const double meanDelta, const uint64 deltaShift, std::mt19937_64& rng )
+{
+    const size_t bufferSize = maxLength * 8;
+    const uint   rounds     = 256;
+
+    byte* deltas  [StreamCount];
+    byte* expected[StreamCount];
+    byte* encoded [StreamCount];
+
+    for( uint s = 0; s < StreamCount; s++ )
+    {
+        deltas  [s] = (byte*)malloc( maxLength  );
+        expected[s] = (byte*)malloc( bufferSize );
+        encoded [s] = (byte*)malloc( bufferSize );
+    }
+
+    std::uniform_real_distribution<double> uniform( 0.0, 1.0 );
+
+    bool valid = true;
+
+    for( uint round = 0; round < rounds && valid; round++ )
+    {
+        // Full parks, then every length up to a few symbols, then random lengths
+        uint64 length = maxLength;
+        if( round > 0 && round < 8 )
+            length = round;
+        else if( round >= 8 )
+            length = 1 + rng() % maxLength;
+
+        // Enough room for the stream, except for some rounds which test overflowing the destination
+        size_t dstSize = bufferSize;
+        if( round % 4 == 3 )
+            dstSize = 1 + rng() % ( length / 2 + 16 );
+
+        for( uint s = 0; s < StreamCount; s++ )
+        {
+            for( uint64 i = 0; i < length; i++ )
+            {
+                const uint64 delta = (uint64)( -std::log( 1.0 - uniform( rng ) ) * meanDelta ) >> deltaShift;
+                deltas[s][i] = (byte)std::min( delta, (uint64)255 );
+            }
+        }
+
+        size_t expectedSizes[StreamCount];
+        size_t encodedSizes [StreamCount];
+
+        for( uint s = 0; s < StreamCount; s++ )
+        {
+            memset( expected[s], 0xCD, bufferSize );
+            memset( encoded [s], 0xCD, bufferSize );
+
+            expectedSizes[s] = FSE_compress_usingCTable( expected[s], dstSize, deltas[s], length, ct );
+        }
+
+        FSECompressParks<StreamCount>( encoded, dstSize, deltas, length, ct, encodedSizes );
+
+        for( uint s = 0; s < StreamCount && valid; s++ )
+        {
+            valid = !FSE_isError( expectedSizes[s] )         &&
+                    encodedSizes[s] == expectedSizes[s]      &&
+                    memcmp( encoded[s], expected[s], expectedSizes[s] ) == 0;
+
+            if( !valid )
+                Log::Error( "Mismatch on stream %u of %u with %llu deltas and a %llu byte destination: %llu bytes instead of %llu.",
+                    s, StreamCount, length, (uint64)dstSize, (uint64)encodedSizes[s], (uint64)expectedSizes[s] );
+        }
+    }
+
+    for( uint s = 0; s < StreamCount; s++ )
+    {
+        free( deltas  [s] );
+        free( expected[s] );
+        free( encoded [s] );
+    }
+
+    return valid;
+}
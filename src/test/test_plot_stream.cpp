@@ -0,0 +1,221 @@
+#include "io/PlotSink.h"
+#include "threading/Thread.h"
+#include "SysHost.h"
+#include "Util.h"
+#include "util/Log.h"
+#include <string>
+#include <random>
+#include <chrono>
+#include <thread>
+#include "b3/blake3.h"
+
+#if PLATFORM_IS_UNIX
+    #include <unistd.h>
+#endif
+
+struct ReceiverJob
+{
+    const char* source;
+    const char* directory;
+    bool        result;
+};
+
+static void OpenStdinPipe( int fds[2] );
+static void ReceiverThread( void* data );
+static bool StreamFile( PlotSink& sink, const byte* data, size_t size, ssize_t reserveSize );
+static bool HashFile( const char* path, byte hash[BLAKE3_OUT_LEN] );
+
+//-----------------------------------------------------------
+/// Streams a small file through a plot sink, to a receiver over a pipe and over
+/// a localhost TCP connection, and checks that the received file has the same BLAKE3 hash.
+/// Usage: [directory] [port]
+//-----------------------------------------------------------
+void TestPlotStream( int argc, const char* argv[] )
+{
+#if PLATFORM_IS_UNIX
+    std::string dir  = argc > 0 ? argv[0] : ".";
+    const char* port = argc > 1 ? argv[1] : "8744";
+
+    if( dir.back() != '/' )
+        dir += '/';
+
+    // Not a multiple of the stream block size, so the last write is partial
+    const size_t size = ( 8ull << 20 ) + 1234;
+
+    byte* data = (byte*)SysHost::VirtualAlloc( size );
+    ASSERT( data );
+
+    std::mt19937_64 rng( 46 );
+    for( size_t i = 0; i < size; i++ )
+        data[i] = (byte)rng();
+
+    byte hash[BLAKE3_OUT_LEN];
+    {
+        blake3_hasher hasher;
+        blake3_hasher_init( &hasher );
+        blake3_hasher_update( &hasher, data, size );
+        blake3_hasher_finalize( &hasher, hash, sizeof( hash ) );
+    }
+
+    const std::string pipeName   = "test-plot-stream-pipe.plot";
+    const std::string socketName = "test-plot-stream-tcp.plot";
+
+    // Pipe: The receiver reads stdin until we close the pipe
+    {
+        int fds[2];
+        OpenStdinPipe( fds );
+
+        ReceiverJob job = { "-", dir.c_str(), false };
+        Thread receiver;
+        receiver.Run( ReceiverThread, &job );
+
+        PlotSink sink;
+        if( !sink.OpenPipe( fds[1], pipeName.c_str() ) || !StreamFile( sink, data, size, (ssize_t)size ) )
+            Fatal( "Failed to stream to pipe with error: %d.", sink.GetError() );
+
+        sink.Close();
+        close( fds[1] );
+        receiver.WaitForExit();
+
+        byte received[BLAKE3_OUT_LEN];
+        const bool ok = job.result && HashFile( ( dir + pipeName ).c_str(), received ) &&
+                        memcmp( hash, received, sizeof( hash ) ) == 0;
+
+        Log::Line( "Pipe stream: %s", ok ? "OK" : "FAILED" );
+        remove( ( dir + pipeName ).c_str() );
+    }
+
+    // Pipe: The receiver must reject a plot larger than any k can produce
+    {
+        int fds[2];
+        OpenStdinPipe( fds );
+
+        ReceiverJob job = { "-", dir.c_str(), true };
+        Thread receiver;
+        receiver.Run( ReceiverThread, &job );
+
+        PlotSink sink;
+        if( sink.OpenPipe( fds[1], pipeName.c_str() ) )
+            StreamFile( sink, data, size, (ssize_t)( 1ull << 62 ) );
+
+        sink.Close();
+        close( fds[1] );
+        receiver.WaitForExit();
+
+        Log::Line( "Oversized reserve rejected: %s", !job.result ? "OK" : "FAILED" );
+        remove( ( dir + pipeName + ".tmp" ).c_str() );
+    }
+
+    // TCP: The receiver serves until the process exits. The sink waits for it to acknowledge the plot.
+    {
+        // Kept alive for the receiver
+        static std::string receiverDir;
+        static ReceiverJob job;
+
+        receiverDir = dir;
+        job         = { port, receiverDir.c_str(), false };
+
+        Thread* receiver = new Thread();
+        receiver->Run( ReceiverThread, &job );
+
+        const std::string address = std::string( "127.0.0.1:" ) + port;
+
+        PlotSink sink;
+
+        // Give the receiver time to listen
+        bool connected = false;
+        for( uint i = 0; i < 50 && !connected; i++ )
+        {
+            connected = sink.Connect( address.c_str(), socketName.c_str() );
+            if( !connected )
+                std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
+        }
+
+        if( !connected || !StreamFile( sink, data, size, (ssize_t)size ) )
+            Fatal( "Failed to stream to %s with error: %d.", address.c_str(), sink.GetError() );
+
+        sink.Close();
+
+        byte received[BLAKE3_OUT_LEN];
+        const bool ok = HashFile( ( dir + socketName ).c_str(), received ) &&
+                        memcmp( hash, received, sizeof( hash ) ) == 0;
+
+        Log::Line( "TCP stream: %s", ok ? "OK" : "FAILED" );
+        remove( ( dir + socketName ).c_str() );
+    }
+
+    SysHost::VirtualFree( data );
+#else
+    Log::Line( "Plot streams are not supported on this platform." );
+#endif
+}
+
+//-----------------------------------------------------------
+void OpenStdinPipe( int fds[2] )
+{
+    if( pipe( fds ) != 0 )
+        Fatal( "Failed to create pipe." );
+
+    // stdin is closed after a previous receiver, so it may have been given the read end already
+    if( fds[0] != STDIN_FILENO )
+    {
+        if( dup2( fds[0], STDIN_FILENO ) < 0 )
+            Fatal( "Failed to redirect stdin." );
+
+        close( fds[0] );
+    }
+}
+
+//-----------------------------------------------------------
+void ReceiverThread( void* data )
+{
+    ReceiverJob& job = *(ReceiverJob*)data;
+    job.result = PlotStreamReceiver::Run( job.source, job.directory );
+
+    // So that the sink doesn't block on a full pipe, if the receiver stopped early
+    if( strcmp( job.source, "-" ) == 0 )
+        close( STDIN_FILENO );
+}
+
+//-----------------------------------------------------------
+bool StreamFile( PlotSink& sink, const byte* data, size_t size, ssize_t reserveSize )
+{
+    if( !sink.Reserve( reserveSize ) )
+        return false;
+
+    // Like a plot: Everything but the first block, then the first block last
+    const size_t headerSize = PlotSink::StreamBlockSize;
+    const size_t chunkSize  = 1ull << 20;
+
+    for( size_t offset = headerSize; offset < size; offset += chunkSize )
+    {
+        if( !sink.WriteAsync( data + offset, std::min( chunkSize, size - offset ), offset ) )
+            return false;
+    }
+
+    return sink.WriteAsync( data, headerSize, 0 ) &&
+           sink.WaitForAsyncWrites() &&
+           sink.Finish( size );
+}
+
+//-----------------------------------------------------------
+bool HashFile( const char* path, byte hash[BLAKE3_OUT_LEN] )
+{
+    FILE* f = fopen( path, "rb" );
+    if( !f )
+        return false;
+
+    blake3_hasher hasher;
+    blake3_hasher_init( &hasher );
+
+    byte   buffer[64 * 1024];
+    size_t read;
+
+    while( ( read = fread( buffer, 1, sizeof( buffer ), f ) ) > 0 )
+        blake3_hasher_update( &hasher, buffer, read );
+
+    fclose( f );
+
+    blake3_hasher_finalize( &hasher, hash, BLAKE3_OUT_LEN );
+    return true;
+}
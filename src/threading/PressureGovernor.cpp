@@ -0,0 +1,180 @@
+#include "PressureGovernor.h"
+#include "ThreadPool.h"
+#include "Util.h"
+#include "util/Log.h"
+
+#include <algorithm>
+
+static const char MemoryPressurePath[] = "/proc/pressure/memory";
+static const char CpuPressurePath   [] = "/proc/pressure/cpu";
+
+//-----------------------------------------------------------
+PressureGovernor::PressureGovernor( ThreadPool& pool )
+    : _pool( pool )
+{}
+
+//-----------------------------------------------------------
+PressureGovernor::~PressureGovernor()
+{
+    if( _running )
+    {
+        _stopSignal.store( true, std::memory_order_release );
+        _monitorThread.WaitForExit();
+    }
+
+    _pool.SetDutyCycle( ThreadPool::FullDutyCycle );
+
+    if( _partition )
+        delete _partition;
+}
+
+//-----------------------------------------------------------
+bool PressureGovernor::Start( const PressureConfig& cfg )
+{
+    ASSERT( !_running );
+
+    uint64 stallTotal;
+    if( !ReadStallTotal( MemoryPressurePath, stallTotal ) || !ReadStallTotal( CpuPressurePath, stallTotal ) )
+        return false;
+
+    _cfg            = cfg;
+    _cfg.minThreads = std::min( std::max( cfg.minThreads, 1u ), _pool.ThreadCount() );
+
+    _activeThreads.store( _pool.ThreadCount(), std::memory_order_relaxed );
+    _targetThreads.store( _pool.ThreadCount(), std::memory_order_relaxed );
+
+    _running = true;
+    _monitorThread.Run( MonitorMain, this );
+
+    return true;
+}
+
+//-----------------------------------------------------------
+void PressureGovernor::Update( ThreadPool*& pool, uint32& threadCount )
+{
+    if( !_running )
+        return;
+
+    const uint activeThreads = _activeThreads.load( std::memory_order_relaxed );
+    const uint targetThreads = _targetThreads.load( std::memory_order_relaxed );
+
+    if( targetThreads == activeThreads )
+        return;
+
+    // No jobs are running, so the partition can be replaced
+    if( _partition )
+    {
+        delete _partition;
+        _partition = nullptr;
+    }
+
+    if( targetThreads < _pool.ThreadCount() )
+        _partition = new ThreadPool( _pool, 0, targetThreads );
+
+    pool        = _partition ? _partition : &_pool;
+    threadCount = targetThreads;
+
+    _activeThreads.store( targetThreads, std::memory_order_relaxed );
+
+    Log::Line( " System pressure at %.1lf%%: Running on %u threads, %.0lf%% of the time.",
+        _pressure.load( std::memory_order_relaxed ) / 10.0, targetThreads,
+        _pool.DutyCycle() * 100.0 / ThreadPool::FullDutyCycle );
+}
+
+//-----------------------------------------------------------
+void PressureGovernor::MonitorMain( void* data )
+{
+    ASSERT( data );
+    reinterpret_cast<PressureGovernor*>( data )->MonitorThread();
+}
+
+//-----------------------------------------------------------
+void PressureGovernor::MonitorThread()
+{
+    const uint   maxThreads = _pool.ThreadCount();
+    const double ceiling    = (double)_cfg.ceiling;
+
+    uint64 lastMemoryStall = 0;
+    uint64 lastCpuStall    = 0;
+    ReadStallTotal( MemoryPressurePath, lastMemoryStall );
+    ReadStallTotal( CpuPressurePath   , lastCpuStall    );
+
+    auto   sampleTimer = TimerBegin();
+    double pressure    = 0;
+    bool   firstSample = true;
+
+    while( !_stopSignal.load( std::memory_order_acquire ) )
+    {
+        Thread::Sleep( SampleInterval );
+
+        uint64 memoryStall, cpuStall;
+        if( !ReadStallTotal( MemoryPressurePath, memoryStall ) || !ReadStallTotal( CpuPressurePath, cpuStall ) )
+            continue;
+
+        const auto   now     = TimerBegin();
+        const double elapsed = (double)std::chrono::duration_cast<std::chrono::microseconds>( now - sampleTimer ).count();
+        sampleTimer = now;
+
+        if( elapsed <= 0 )
+            continue;
+
+        // Percentage of the interval during which some tasks were stalled
+        const uint64 stall  = std::max( memoryStall - lastMemoryStall, cpuStall - lastCpuStall );
+        const double sample = std::min( (double)stall * 100.0 / elapsed, 100.0 );
+
+        lastMemoryStall = memoryStall;
+        lastCpuStall    = cpuStall;
+
+        // Smooth out spikes, without lagging behind by more than a couple of samples
+        pressure    = firstSample ? sample : ( pressure + sample ) * 0.5;
+        firstSample = false;
+
+        _pressure.store( (uint)( pressure * 10.0 ), std::memory_order_relaxed );
+
+        uint       dutyCycle     = _pool.DutyCycle();
+        uint       targetThreads = _targetThreads.load( std::memory_order_relaxed );
+        const bool applied       = targetThreads == _activeThreads.load( std::memory_order_relaxed );
+
+        if( pressure > ceiling )
+        {
+            // Back off right away by pacing the jobs, then run on fewer threads from the next update.
+            // Don't take threads away again before the last change was applied.
+            dutyCycle = std::max( dutyCycle * 3 / 4, MinDutyCycle );
+
+            if( applied )
+                targetThreads = std::max( targetThreads * 3 / 4, _cfg.minThreads );
+        }
+        else if( pressure < ceiling * 0.75 )
+        {
+            // Give back the pacing first, as it's the quickest to take away again
+            if( dutyCycle < ThreadPool::FullDutyCycle )
+                dutyCycle = std::min( dutyCycle + ThreadPool::FullDutyCycle / 10, ThreadPool::FullDutyCycle );
+            else if( applied && targetThreads < maxThreads )
+                targetThreads = std::min( targetThreads + std::max( maxThreads / 16, 1u ), maxThreads );
+        }
+
+        _pool.SetDutyCycle( dutyCycle );
+        _targetThreads.store( targetThreads, std::memory_order_relaxed );
+    }
+}
+
+//-----------------------------------------------------------
+bool PressureGovernor::ReadStallTotal( const char* path, uint64& stallTotal )
+{
+    // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    // full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    FILE* f = fopen( path, "r" );
+    if( !f )
+        return false;
+
+    unsigned long long total = 0;
+    const int matched = fscanf( f, "some avg10=%*f avg60=%*f avg300=%*f total=%llu", &total );
+
+    fclose( f );
+
+    if( matched != 1 )
+        return false;
+
+    stallTotal = (uint64)total;
+    return true;
+}
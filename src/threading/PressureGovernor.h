@@ -0,0 +1,58 @@
+#pragma once
+#include "Thread.h"
+#include <atomic>
+
+class ThreadPool;
+
+struct PressureConfig
+{
+    uint   ceiling;         // Max percentage of time that tasks on the system may be stalled on memory or CPU
+    uint   minThreads;      // Never run on fewer threads than this
+};
+
+///
+/// Shares the machine with latency-sensitive processes, such as harvesters,
+/// by keeping the system's pressure under a ceiling while plotting as fast as it allows.
+///
+/// A monitor thread samples Linux's pressure stall information (/proc/pressure/memory and cpu),
+/// and paces the pool's jobs as soon as the pressure goes over the ceiling. It also picks how many
+/// threads should run jobs, which the plotter switches to by calling Update() at points where no
+/// job state depends on the thread count, such as the start of a table.
+/// Threads and pacing are given back one step at a time while the pressure is well under the ceiling.
+///
+class PressureGovernor
+{
+public:
+    PressureGovernor( ThreadPool& pool );
+    ~PressureGovernor();
+
+    // Returns false if the system doesn't report its pressure
+    bool Start( const PressureConfig& cfg );
+
+    // Switches pool to run on as many of the threads as the monitor picked.
+    // pool and threadCount are the plotter's, and are only changed if the thread count has changed.
+    void Update( ThreadPool*& pool, uint32& threadCount );
+
+private:
+    static void MonitorMain( void* data );
+    void MonitorThread();
+
+    // Reads the total time in microseconds that some tasks were stalled, from a pressure file
+    static bool ReadStallTotal( const char* path, uint64& stallTotal );
+
+    static constexpr long   SampleInterval = 1000;    // Milliseconds between samples
+    static constexpr uint   MinDutyCycle   = 100;     // Of ThreadPool::FullDutyCycle
+
+private:
+    ThreadPool&       _pool;                    // The root pool, with all the threads
+    ThreadPool*       _partition     = nullptr; // Runs jobs on the first _activeThreads threads of the pool
+    PressureConfig    _cfg           = {};
+
+    std::atomic<uint> _activeThreads = 0;       // Set by the plotting thread
+    std::atomic<uint> _targetThreads = 0;       // Picked by the monitor thread
+    std::atomic<uint> _pressure      = 0;       // Last pressure sampled, in tenths of a percent
+
+    Thread            _monitorThread;
+    bool              _running       = false;
+    std::atomic<bool> _stopSignal    = false;
+};
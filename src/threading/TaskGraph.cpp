@@ -0,0 +1,211 @@
+#include "TaskGraph.h"
+#include "Util.h"
+#include "util/Log.h"
+
+//-----------------------------------------------------------
+TaskGraph::TaskGraph( ThreadPool& pool )
+    : _pool( pool )
+{}
+
+//-----------------------------------------------------------
+uint TaskGraph::AddTask( const char* name, TaskFunc func, void* data, uint weight )
+{
+    ASSERT( func );
+
+    if( _taskCount >= MAX_TASKS )
+        Fatal( "Too many tasks in task graph." );
+
+    const uint id = _taskCount++;
+
+    Task& task = _tasks[id];
+    task.name         = name;
+    task.func         = func;
+    task.data         = data;
+    task.weight       = std::max( weight, 1u );
+    task.bufferCount  = 0;
+    task.elapsed      = 0;
+
+    return id;
+}
+
+//-----------------------------------------------------------
+void TaskGraph::Reads( uint task, const void* buffer, size_t size )
+{
+    AddBuffer( task, buffer, size, false );
+}
+
+//-----------------------------------------------------------
+void TaskGraph::Writes( uint task, const void* buffer, size_t size )
+{
+    AddBuffer( task, buffer, size, true );
+}
+
+//-----------------------------------------------------------
+void TaskGraph::AddBuffer( uint task, const void* buffer, size_t size, bool write )
+{
+    ASSERT( task < _taskCount );
+    ASSERT( buffer );
+    ASSERT( size );
+
+    Task& t = _tasks[task];
+
+    if( t.bufferCount >= MAX_BUFFERS )
+        Fatal( "Too many buffers for task '%s'.", t.name );
+
+    const byte* start = (const byte*)buffer;
+    t.buffers[t.bufferCount++] = { start, start + size, write };
+}
+
+//-----------------------------------------------------------
+bool TaskGraph::Conflicts( const Task& a, const Task& b ) const
+{
+    for( uint i = 0; i < a.bufferCount; i++ )
+    {
+        for( uint j = 0; j < b.bufferCount; j++ )
+        {
+            const Buffer& ba = a.buffers[i];
+            const Buffer& bb = b.buffers[j];
+
+            // The ranges overlap, and one of them is written
+            if( ba.start < bb.end && bb.start < ba.end && ( ba.write || bb.write ) )
+                return true;
+        }
+    }
+
+    return false;
+}
+
+//-----------------------------------------------------------
+void TaskGraph::Run()
+{
+    const uint threadCount = _pool.ThreadCount();
+
+    // Each task depends on the earlier tasks it conflicts with.
+    // Tasks that are connected through their dependencies share a subgraph,
+    // named after one of its tasks.
+    uint subgraph[MAX_TASKS];
+
+    for( uint i = 0; i < _taskCount; i++ )
+    {
+        const Task& task = _tasks[i];
+        subgraph[i] = i;
+
+        for( uint j = 0; j < i; j++ )
+        {
+            if( !Conflicts( task, _tasks[j] ) )
+                continue;
+
+            // Merge our subgraph with j's
+            const uint from = subgraph[i];
+            const uint to   = subgraph[j];
+
+            for( uint k = 0; k <= i; k++ )
+            {
+                if( subgraph[k] == from )
+                    subgraph[k] = to;
+            }
+        }
+    }
+
+    // One group per subgraph. If there's more subgraphs than threads, groups share them.
+    TaskGroup groups[MAX_TASKS] = {};
+    uint      groupCount  = 0;
+    uint      totalWeight = 0;
+
+    for( uint i = 0; i < _taskCount; i++ )
+    {
+        if( subgraph[i] != i )
+            continue;
+
+        const uint groupIdx = groupCount < threadCount ? groupCount++ : i % threadCount;
+
+        TaskGroup& group = groups[groupIdx];
+        group.graph = this;
+
+        for( uint j = 0; j < _taskCount; j++ )
+        {
+            if( subgraph[j] == i )
+            {
+                group.tasks  |= 1ull << j;
+                group.weight += _tasks[j].weight;
+                totalWeight  += _tasks[j].weight;
+            }
+        }
+    }
+
+    if( groupCount == 1 )
+    {
+        // Runs on the whole pool
+        groups[0].pool = &_pool;
+        RunGroup( groups[0] );
+    }
+    else if( groupCount > 1 )
+    {
+        // Split the threads by weight, with at least one thread per group
+        Thread* threads[MAX_TASKS];
+
+        uint threadOffset    = 0;
+        uint weightRemaining = totalWeight;
+
+        for( uint i = 0; i < groupCount; i++ )
+        {
+            TaskGroup& group = groups[i];
+
+            const uint threadsRemaining = threadCount - threadOffset;
+            const uint groupsRemaining  = groupCount - i;
+
+            uint groupThreads = (uint)( (uint64)threadsRemaining * group.weight / weightRemaining );
+            groupThreads = std::max( groupThreads, 1u );
+            groupThreads = std::min( groupThreads, threadsRemaining - ( groupsRemaining - 1 ) );
+
+            group.pool = new ThreadPool( _pool, threadOffset, groupThreads );
+
+            threadOffset    += groupThreads;
+            weightRemaining -= group.weight;
+        }
+
+        // The first group runs on this thread, the others on their own driver threads
+        for( uint i = 1; i < groupCount; i++ )
+        {
+            threads[i] = new Thread();
+            threads[i]->Run( GroupThreadRunner, &groups[i] );
+        }
+
+        RunGroup( groups[0] );
+
+        for( uint i = 1; i < groupCount; i++ )
+        {
+            threads[i]->WaitForExit();
+            delete threads[i];
+        }
+
+        for( uint i = 0; i < groupCount; i++ )
+            delete groups[i].pool;
+    }
+
+    _taskCount = 0;
+}
+
+//-----------------------------------------------------------
+void TaskGraph::RunGroup( TaskGroup& group )
+{
+    // Dependencies always point to earlier tasks, so running in order satisfies them
+    for( uint i = 0; i < _taskCount; i++ )
+    {
+        if( ( group.tasks & ( 1ull << i ) ) == 0 )
+            continue;
+
+        Task& task = _tasks[i];
+
+        auto timer = TimerBegin();
+        task.func( *group.pool, task.data );
+        task.elapsed = TimerEnd( timer );
+    }
+}
+
+//-----------------------------------------------------------
+void TaskGraph::GroupThreadRunner( void* param )
+{
+    TaskGroup& group = *(TaskGroup*)param;
+    group.graph->RunGroup( group );
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include "ThreadPool.h"
+
+///
+/// Runs a set of steps on a thread pool, where each step declares the buffer ranges it reads and writes.
+/// A step depends on every step added before it that it conflicts with:
+/// One of them writes to a range that overlaps a range the other one reads or writes.
+///
+/// Steps that are connected through their dependencies form a subgraph, whose steps run
+/// one after another in the order they were added. Independent subgraphs run concurrently,
+/// each on its own partition of the pool's threads, sized by the total weight of its steps.
+/// Steps must therefore size their jobs by the thread count of the pool they are given.
+///
+/// The pool must be in Fixed mode, and must not be used by anything else while the graph runs.
+///
+class TaskGraph
+{
+public:
+    typedef void (*TaskFunc)( ThreadPool& pool, void* data );
+
+    static constexpr uint MAX_TASKS   = 16;
+    static constexpr uint MAX_BUFFERS = 8;     // Per task
+
+    TaskGraph( ThreadPool& pool );
+
+    // Returns the index of the new task.
+    // The task is given a pool which runs its jobs on its share of the threads.
+    uint AddTask( const char* name, TaskFunc func, void* data, uint weight = 1 );
+
+    template<typename T>
+    inline uint AddTask( const char* name, void (*func)( ThreadPool& pool, T* data ), T* data, uint weight = 1 );
+
+    // Declares that the task accesses size bytes starting at buffer
+    void Reads ( uint task, const void* buffer, size_t size );
+    void Writes( uint task, const void* buffer, size_t size );
+
+    // Runs all the tasks, and resets the graph
+    void Run();
+
+    // Time in seconds that a task took on the last run
+    inline double TaskElapsed( uint task ) const { return _tasks[task].elapsed; }
+
+private:
+    struct Buffer
+    {
+        const byte* start;
+        const byte* end;
+        bool        write;
+    };
+
+    struct Task
+    {
+        const char* name;
+        TaskFunc    func;
+        void*       data;
+        uint        weight;
+        uint        bufferCount;
+        Buffer      buffers[MAX_BUFFERS];
+        double      elapsed;
+    };
+
+    // Tasks run one after another on a partition of the threads
+    struct TaskGroup
+    {
+        TaskGraph*  graph;
+        ThreadPool* pool;
+        uint64      tasks;              // Bit mask of the tasks to run
+        uint        weight;
+    };
+
+    void AddBuffer( uint task, const void* buffer, size_t size, bool write );
+    bool Conflicts( const Task& a, const Task& b ) const;
+
+    void RunGroup( TaskGroup& group );
+    static void GroupThreadRunner( void* param );
+
+private:
+    ThreadPool& _pool;
+    uint        _taskCount = 0;
+    Task        _tasks[MAX_TASKS];
+};
+
+//-----------------------------------------------------------
+template<typename T>
+inline uint TaskGraph::AddTask( const char* name, void (*func)( ThreadPool& pool, T* data ), T* data, uint weight )
+{
+    return AddTask( name, (TaskFunc)func, (void*)data, weight );
+}
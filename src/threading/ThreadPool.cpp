@@ -3,12 +3,17 @@
 #include "util/Log.h"
 #include "SysHost.h"
 
+#include <algorithm>
+#include <thread>
+
 
 //-----------------------------------------------------------
 ThreadPool::ThreadPool( uint threadCount, Mode mode, bool disableAffinity )
     : _threadCount( threadCount )
     , _mode           ( mode )
     , _disableAffinity( disableAffinity )
+    , _ownsThreads    ( true )
+    , _root           ( this )
     , _jobSignal      ( 0 )
     , _poolSignal     ( 0 )
 {
@@ -32,9 +37,32 @@ ThreadPool::ThreadPool( uint threadCount, Mode mode, bool disableAffinity )
     }
 }
 
+//-----------------------------------------------------------
+ThreadPool::ThreadPool( ThreadPool& parent, uint threadOffset, uint threadCount )
+    : _threadCount    ( threadCount )
+    , _mode           ( Mode::Fixed )
+    , _disableAffinity( parent._disableAffinity )
+    , _ownsThreads    ( false )
+    , _root           ( parent._root )
+    , _threads        ( nullptr )
+    , _threadData     ( parent._threadData + threadOffset )
+    , _jobSignal      ( 0 )
+    , _poolSignal     ( 0 )
+{
+    if( parent._mode != Mode::Fixed )
+        Fatal( "Only fixed mode thread pools can be partitioned." );
+
+    if( threadCount < 1 || threadOffset + threadCount > parent._threadCount )
+        Fatal( "Invalid thread pool partition." );
+}
+
 //-----------------------------------------------------------
 ThreadPool::~ThreadPool()
 {
+    // The threads belong to the parent pool
+    if( !_ownsThreads )
+        return;
+
     // Signal
     _exitSignal.store( true, std::memory_order_release );
 
@@ -49,10 +77,9 @@ ThreadPool::~ThreadPool()
             _jobSignal.Release();
     }
 
-    // #TODO: Wait for all threads to finish
-    
-    // #TODO: Signal thread for exit.
-    // #TODO: Wait for all threads to exit
+    // Wait for all threads to exit, as they still use their data
+    for( uint i = 0; i < _threadCount; i++ )
+        _threads[i].WaitForExit();
 
     delete[] _threads;
     delete[] _threadData;
@@ -68,12 +95,28 @@ void ThreadPool::RunJob( JobFunc func, void* data, uint count, size_t dataSize )
     ASSERT( data     );
     ASSERT( dataSize );
 
+    const uint dutyCycle = DutyCycle();
+    auto       timer     = TimerBegin();
+
     // #TODO: Should lock here to prevent re-entrancy and wait
     //        until current jobs are finished, but that is not the intended usage.
     if( _mode == Mode::Fixed )
         DispatchFixed( func, (byte*)data, count, dataSize );
     else
         DispatchGreedy( func, (byte*)data, count, dataSize );
+
+    // Leave the threads idle for the rest of the duty cycle
+    if( dutyCycle < FullDutyCycle )
+    {
+        const auto elapsed = std::chrono::steady_clock::now() - timer;
+        std::this_thread::sleep_for( elapsed * ( FullDutyCycle - dutyCycle ) / std::max( dutyCycle, 1u ) );
+    }
+}
+
+//-----------------------------------------------------------
+void ThreadPool::SetDutyCycle( uint dutyCycle )
+{
+    _root->_dutyCycle.store( std::min( dutyCycle, FullDutyCycle ), std::memory_order_relaxed );
 }
 
 //-----------------------------------------------------------
@@ -89,7 +132,15 @@ void ThreadPool::DispatchFixed( JobFunc func, byte* data, uint count, size_t dat
         count = _threadCount;
 
     for( uint i = 0; i < count; i++ )
-        _threadData[i].jobSignal.Release();
+    {
+        ThreadData& d = _threadData[i];
+
+        d.jobFunc    = func;
+        d.jobData    = data + dataSize * i;
+        d.poolSignal = &_poolSignal;
+
+        d.jobSignal.Release();
+    }
 
     // Wait until all running jobs finish
     uint releaseCount = 0;
@@ -147,10 +198,7 @@ void ThreadPool::FixedThreadRunner( void* tParam )
     if( !pool._disableAffinity )
         SysHost::SetCurrentThreadAffinityCpuId( d.cpuId );
 
-    const uint index = (uint)d.index;
-
     std::atomic<bool>& exitSignal = pool._exitSignal;
-    Semaphore&         poolSignal = pool._poolSignal;
     Semaphore&         jobSignal  = d.jobSignal;
 
     for( ;; )
@@ -165,11 +213,11 @@ void ThreadPool::FixedThreadRunner( void* tParam )
         if( exitSignal.load( std::memory_order_acquire ) )
             return;
         
-        // Run job
-        pool._jobFunc( pool._jobData + pool._jobDataSize * index );
+        // Run job (dispatched by us or by a partition of us)
+        d.jobFunc( d.jobData );
 
         // Finished job
-        poolSignal.Release();
+        d.poolSignal->Release();
     }
 }
 
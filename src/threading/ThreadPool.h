@@ -21,6 +21,12 @@ public:
     };
 
     ThreadPool( uint threadCount, Mode mode = Mode::Fixed, bool disableAffinity = false );
+
+    // Creates a pool that runs its jobs on threadCount of parent's threads, starting at threadOffset.
+    // The parent must be in Fixed mode. Pools which share a parent may run jobs concurrently,
+    // as long as they don't share any threads, but not while the parent itself is running a job.
+    ThreadPool( ThreadPool& parent, uint threadOffset, uint threadCount );
+
     ~ThreadPool();
 
     void RunJob( JobFunc func, void* data, uint count, size_t dataSize );
@@ -29,6 +35,15 @@ public:
     inline void RunJob( void (*TJobFunc)( T* ), T* data, uint count );
 
     inline uint ThreadCount() { return _threadCount; }
+
+    // Paces jobs so that threads run them only dutyCycle/FullDutyCycle of the time:
+    // After each job, the pool sleeps in proportion to how long the job took.
+    // Applies to the pool and its partitions, and may be changed from any thread.
+    void SetDutyCycle( uint dutyCycle );
+    inline uint DutyCycle() { return _root->_dutyCycle.load( std::memory_order_relaxed ); }
+
+    static constexpr uint FullDutyCycle = 1000;
+
 private:
 
     void DispatchFixed( JobFunc func, byte* data, uint count, size_t dataSize );
@@ -43,12 +58,21 @@ private:
         int         index;
         uint        cpuId;     // CPU Id affinity
         Semaphore   jobSignal; // Used for fixed mode
+
+        // Job to run in fixed mode, and where to signal that it finished.
+        // (Set by the pool dispatching it, which may be a partition of the pool.)
+        JobFunc     jobFunc;
+        byte*       jobData;
+        Semaphore*  poolSignal;
     };
 
 private:
     uint              _threadCount;         // Reserved number of thread running jobs
     Mode              _mode;
     bool              _disableAffinity;
+    bool              _ownsThreads;         // False if we run on a partition of another pool's threads
+    ThreadPool*       _root;                // The pool that owns the threads
+    std::atomic<uint> _dutyCycle = FullDutyCycle;   // Only used on the root
     Thread*           _threads;
     ThreadData*       _threadData;
     Semaphore         _jobSignal;           // Used to signal threads that there's a new job
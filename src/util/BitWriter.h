@@ -0,0 +1,151 @@
+#pragma once
+#include "Util.h"
+
+///
+/// Packs fixed-width values MSB-first into a big-endian bit stream.
+/// This is the layout chiapos uses for the LinePoint park stubs and the P7 parks:
+/// A sequence of big-endian 64-bit fields, filled starting at their most significant bits.
+///
+/// Rather than completing one 64-bit field at a time, which needs a branch per value,
+/// every value is followed by an unaligned 8-byte store of the pending bits and
+/// the writer is advanced by the whole bytes completed.
+///
+struct BitWriterBE
+{
+    byte*  writer;
+    uint64 field;   // Pending bits, stored all the way to the MSbits
+    uint   bits;    // Number of pending bits. Always < 8 between writes.
+
+    //-----------------------------------------------------------
+    inline BitWriterBE( byte* buffer )
+        : writer( buffer )
+        , field ( 0 )
+        , bits  ( 0 )
+    {}
+
+    // Writes up to 56 bits. value must not have any bits set above bitCount.
+    // Up to 8 bytes are written at the current write position.
+    //-----------------------------------------------------------
+    inline void Write( const uint64 value, const uint bitCount )
+    {
+        ASSERT( bitCount <= 56 );
+        ASSERT( ( value >> bitCount ) == 0 );
+
+        field |= value << ( 64 - bitCount - bits );
+        bits  += bitCount;
+
+        const uint64 bigEndian = Swap64( field );
+        memcpy( writer, &bigEndian, sizeof( uint64 ) );
+
+        const uint bytes = bits >> 3;
+        writer += bytes;
+        field <<= bytes * 8;
+        bits   &= 7;
+    }
+};
+
+///
+/// Packs count values of BitCount bits each into dst, as a big-endian bit stream, one value at a time.
+/// Values are masked to BitCount bits.
+/// Exactly CDiv( count * BitCount, 8 ) bytes are written, which is returned.
+/// The unused bits of the last byte are zeroed.
+///
+template<uint BitCount, typename T>
+inline size_t PackBitsScalarBE( byte* dst, const T* values, const uint64 count )
+{
+    static_assert( BitCount > 0 && BitCount <= 56, "Unsupported bit count." );
+
+    constexpr uint64 Mask = ( 1ull << BitCount ) - 1;
+
+    const size_t size = (size_t)CDiv( count * BitCount, 8 );
+
+    // Each write stores 8 bytes starting at the byte holding value i's first bit, (i * BitCount) / 8.
+    // Values which could store past the end are written to a local buffer first.
+    const uint64 directCount = size > 7 ? std::min( count, (uint64)CDiv( ( size - 7 ) * 8, (int)BitCount ) ) : 0;
+
+    BitWriterBE writer( dst );
+
+    uint64 i = 0;
+    for( ; i < directCount; i++ )
+        writer.Write( (uint64)values[i] & Mask, BitCount );
+
+    if( i < count )
+    {
+        // Less than 8 bytes are left to write (see directCount), plus the 8-byte store overhang
+        byte  tail[16];
+        byte* tailStart = writer.writer;
+
+        writer.writer = tail;
+
+        for( ; i < count; i++ )
+            writer.Write( (uint64)values[i] & Mask, BitCount );
+
+        memcpy( tailStart, tail, size - (size_t)( tailStart - dst ) );
+    }
+
+    return size;
+}
+
+///
+/// Packs 8 values, which fill exactly BitCount bytes.
+/// The bit position of every value is known at compile time, so the values are
+/// combined into 64-bit words with constant shifts and no dependency between them.
+/// Writes CDiv( BitCount, 8 ) * 8 bytes: Up to 7 bytes past the group are overwritten.
+///
+template<uint BitCount, typename T>
+inline void PackBitsGroupBE( byte* dst, const T* values )
+{
+    constexpr uint64 Mask       = ( 1ull << BitCount ) - 1;
+    constexpr uint   GroupWords = CDiv( BitCount, 8 );
+
+    uint64 words[GroupWords+1] = { 0 };
+
+    for( uint i = 0; i < 8; i++ )
+    {
+        const uint64 value  = (uint64)values[i] & Mask;
+        const uint   bitPos = i * BitCount;
+        const uint   word   = bitPos / 64;
+        const uint   pos    = bitPos - word * 64;
+
+        if( pos + BitCount <= 64 )
+            words[word] |= value << ( 64 - pos - BitCount );
+        else
+        {
+            words[word]   |= value >> ( pos + BitCount - 64 );
+            words[word+1] |= value << ( 128 - pos - BitCount );
+        }
+    }
+
+    for( uint i = 0; i < GroupWords; i++ )
+    {
+        const uint64 bigEndian = Swap64( words[i] );
+        memcpy( dst + i * sizeof( uint64 ), &bigEndian, sizeof( uint64 ) );
+    }
+}
+
+///
+/// Packs count values of BitCount bits each into dst, as a big-endian bit stream.
+/// Values are masked to BitCount bits.
+/// Exactly CDiv( count * BitCount, 8 ) bytes are written, which is returned.
+/// The unused bits of the last byte are zeroed.
+///
+template<uint BitCount, typename T>
+inline size_t PackBitsBE( byte* dst, const T* values, const uint64 count )
+{
+    static_assert( BitCount > 0 && BitCount <= 56, "Unsupported bit count." );
+
+    constexpr size_t GroupOverhang = CDiv( BitCount, 8 ) * 8 - BitCount;
+
+    const size_t size = (size_t)CDiv( count * BitCount, 8 );
+
+    // Pack whole groups while their stores stay within dst
+    const uint64 groupCount = size >= GroupOverhang ? std::min( count / 8, (uint64)( size - GroupOverhang ) / BitCount ) : 0;
+
+    for( uint64 i = 0; i < groupCount; i++ )
+        PackBitsGroupBE<BitCount>( dst + i * BitCount, values + i * 8 );
+
+    // Groups end on a byte boundary, so the rest is a stream of its own
+    PackBitsScalarBE<BitCount>( dst + groupCount * BitCount, values + groupCount * 8, count - groupCount * 8 );
+
+    return size;
+}
@@ -0,0 +1,238 @@
+#include "Blake3Tree.h"
+#include "Config.h"
+#include "threading/ThreadPool.h"
+#include "Util.h"
+
+#include <algorithm>
+
+extern "C" {
+    #include "b3/blake3_impl.h"
+}
+
+static_assert( Blake3Tree::ChunkSize == BLAKE3_CHUNK_LEN, "Invalid BLAKE3 chunk size." );
+static_assert( Blake3Tree::HashSize  == BLAKE3_OUT_LEN  , "Invalid BLAKE3 hash size."  );
+
+static void StoreCV( const uint32_t words[8], byte cv[BLAKE3_OUT_LEN] );
+static void ParentCV( const byte left[BLAKE3_OUT_LEN], const byte right[BLAKE3_OUT_LEN], uint8_t flags, byte cv[BLAKE3_OUT_LEN] );
+
+//-----------------------------------------------------------
+void Blake3Tree::Reset()
+{
+    _subtrees.clear();
+}
+
+//-----------------------------------------------------------
+void Blake3Tree::AddRegion( ThreadPool& pool, const void* data, size_t size, uint64 offset )
+{
+    ASSERT( data );
+    ASSERT( offset % ChunkSize == 0 );
+
+    if( size == 0 )
+        return;
+
+    // Split the region into the largest subtrees that are aligned to their size,
+    // so that they're all nodes of the file's tree, whatever the file's size.
+    const size_t firstSubtree = _subtrees.size();
+
+    const byte* bytes     = (const byte*)data;
+    uint64      chunk     = offset / ChunkSize;
+    size_t      remaining = size;
+
+    while( remaining )
+    {
+        uint64 chunkCount = std::min( (uint64)( remaining / ChunkSize ), MaxSubtree );
+
+        // A partial chunk can only be at the end of the file, and it's a subtree by itself
+        if( chunkCount == 0 )
+            chunkCount = 1;
+        else
+            chunkCount = round_down_to_power_of_2( chunkCount );
+
+        while( chunk & ( chunkCount - 1 ) )
+            chunkCount >>= 1;
+
+        const size_t subtreeSize = std::min( remaining, (size_t)( chunkCount * ChunkSize ) );
+
+        Subtree subtree;
+        subtree.chunk      = chunk;
+        subtree.chunkCount = chunkCount;
+        subtree.data       = bytes;
+        subtree.size       = subtreeSize;
+        _subtrees.push_back( subtree );
+
+        chunk     += chunkCount;
+        bytes     += subtreeSize;
+        remaining -= subtreeSize;
+    }
+
+    // Hash the new subtrees, a contiguous run of them per thread
+    const size_t subtreeCount = _subtrees.size() - firstSubtree;
+    const uint   threadCount  = (uint)std::min( (size_t)pool.ThreadCount(), subtreeCount );
+
+    HashJob jobs[MAX_THREADS];
+
+    const size_t subtreesPerThread = subtreeCount / threadCount;
+
+    for( uint i = 0; i < threadCount; i++ )
+    {
+        HashJob& job = jobs[i];
+        job.subtrees = _subtrees.data() + firstSubtree + subtreesPerThread * i;
+        job.count    = i == threadCount-1 ? subtreeCount - subtreesPerThread * i : subtreesPerThread;
+    }
+
+    pool.RunJob( HashJobThread, jobs, threadCount );
+}
+
+//-----------------------------------------------------------
+bool Blake3Tree::Finalize( uint64 fileSize, byte hash[HashSize] )
+{
+    const uint64 chunkCount = CDiv( fileSize, (int)ChunkSize );
+
+    // A single chunk is hashed as the root, which we don't do, as plots are much larger
+    if( chunkCount < 2 )
+        return false;
+
+    std::sort( _subtrees.begin(), _subtrees.end(), []( const Subtree& a, const Subtree& b ) {
+        return a.chunk < b.chunk;
+    });
+
+    size_t next = 0;
+
+    return MergeSubtrees( 0, chunkCount, next, true, hash ) && next == _subtrees.size();
+}
+
+//-----------------------------------------------------------
+bool Blake3Tree::MergeSubtrees( uint64 chunk, uint64 chunkCount, size_t& next, bool root, byte cv[HashSize] )
+{
+    if( next >= _subtrees.size() )
+        return false;
+
+    const Subtree& subtree = _subtrees[next];
+
+    if( subtree.chunk != chunk || subtree.chunkCount > chunkCount )
+        return false;
+
+    if( subtree.chunkCount == chunkCount )
+    {
+        // The root must be finalized with its own flag, so it can't be a hashed subtree
+        if( root )
+            return false;
+
+        memcpy( cv, subtree.cv, HashSize );
+        next++;
+        return true;
+    }
+
+    // The left side of a node is the largest power of 2 of chunks that leaves at least one for the right
+    const uint64 leftCount = round_down_to_power_of_2( chunkCount - 1 );
+
+    byte left [HashSize];
+    byte right[HashSize];
+
+    if( !MergeSubtrees( chunk, leftCount, next, false, left ) ||
+        !MergeSubtrees( chunk + leftCount, chunkCount - leftCount, next, false, right ) )
+        return false;
+
+    ParentCV( left, right, root ? ROOT : 0, cv );
+    return true;
+}
+
+//-----------------------------------------------------------
+void Blake3Tree::HashJobThread( HashJob* job )
+{
+    for( size_t i = 0; i < job->count; i++ )
+        HashSubtree( job->subtrees[i] );
+}
+
+//-----------------------------------------------------------
+void Blake3Tree::HashSubtree( Subtree& subtree )
+{
+    // Partial chunk, compressed block by block
+    if( subtree.size < ChunkSize )
+    {
+        uint32_t words[8];
+        memcpy( words, IV, sizeof( words ) );
+
+        const size_t blockCount = std::max( CDiv( subtree.size, BLAKE3_BLOCK_LEN ), (size_t)1 );
+
+        for( size_t i = 0; i < blockCount; i++ )
+        {
+            const size_t offset   = i * BLAKE3_BLOCK_LEN;
+            const size_t blockLen = std::min( subtree.size - offset, (size_t)BLAKE3_BLOCK_LEN );
+
+            byte block[BLAKE3_BLOCK_LEN] = { 0 };
+            memcpy( block, subtree.data + offset, blockLen );
+
+            uint8_t flags = 0;
+            if( i == 0 )
+                flags |= CHUNK_START;
+            if( i == blockCount-1 )
+                flags |= CHUNK_END;
+
+            blake3_compress_in_place( words, block, (uint8_t)blockLen, subtree.chunk, flags );
+        }
+
+        StoreCV( words, subtree.cv );
+        return;
+    }
+
+    // Whole chunks: Hash them all, then hash pairs of chaining values until there's one left
+    const uint8_t* inputs  [MaxSubtree] = {};
+    byte           cvs     [MaxSubtree * BLAKE3_OUT_LEN];
+    byte           parents [MaxSubtree / 2 * BLAKE3_OUT_LEN];
+
+    size_t count = (size_t)subtree.chunkCount;
+    ASSERT( count <= MaxSubtree && subtree.size == count * ChunkSize );
+
+    // Partial chunks were handled above, so there's always at least one whole chunk
+    if( count < 1 )
+        return;
+
+    for( size_t i = 0; i < count; i++ )
+        inputs[i] = subtree.data + i * ChunkSize;
+
+    blake3_hash_many( inputs, count, BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN, IV, subtree.chunk,
+                      true, 0, CHUNK_START, CHUNK_END, cvs );
+
+    byte* src = cvs;
+    byte* dst = parents;
+
+    while( count > 1 )
+    {
+        count /= 2;
+
+        for( size_t i = 0; i < count; i++ )
+            inputs[i] = src + i * BLAKE3_BLOCK_LEN;
+
+        blake3_hash_many( inputs, count, 1, IV, 0, false, PARENT, 0, 0, dst );
+        std::swap( src, dst );
+    }
+
+    memcpy( subtree.cv, src, BLAKE3_OUT_LEN );
+}
+
+//-----------------------------------------------------------
+void StoreCV( const uint32_t words[8], byte cv[BLAKE3_OUT_LEN] )
+{
+    for( uint i = 0; i < 8; i++ )
+    {
+        cv[i*4+0] = (byte)( words[i] >> 0  );
+        cv[i*4+1] = (byte)( words[i] >> 8  );
+        cv[i*4+2] = (byte)( words[i] >> 16 );
+        cv[i*4+3] = (byte)( words[i] >> 24 );
+    }
+}
+
+//-----------------------------------------------------------
+void ParentCV( const byte left[BLAKE3_OUT_LEN], const byte right[BLAKE3_OUT_LEN], uint8_t flags, byte cv[BLAKE3_OUT_LEN] )
+{
+    byte block[BLAKE3_BLOCK_LEN];
+    memcpy( block, left, BLAKE3_OUT_LEN );
+    memcpy( block + BLAKE3_OUT_LEN, right, BLAKE3_OUT_LEN );
+
+    uint32_t words[8];
+    memcpy( words, IV, sizeof( words ) );
+
+    blake3_compress_in_place( words, block, BLAKE3_BLOCK_LEN, 0, PARENT | flags );
+    StoreCV( words, cv );
+}
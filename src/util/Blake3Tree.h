@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+
+class ThreadPool;
+
+///
+/// Computes the BLAKE3 hash of a file from regions of it given in any order,
+/// such as a plot whose header is written last.
+/// Each region is split into subtrees of the BLAKE3 tree, which are hashed in parallel.
+/// The hash is the same as hashing the whole file in order with blake3_hasher.
+///
+class Blake3Tree
+{
+public:
+    static constexpr size_t ChunkSize    = 1024;            // BLAKE3_CHUNK_LEN
+    static constexpr uint64 MaxSubtree   = 1024;            // Max chunks hashed by a single job
+    static constexpr size_t HashSize     = 32;
+
+    // Forgets all regions added so far
+    void Reset();
+
+    // Hashes the file region [offset, offset+size), whose contents are in data.
+    // offset must be a multiple of ChunkSize, and so must size, unless the region ends the file.
+    // Regions must not overlap.
+    void AddRegion( ThreadPool& pool, const void* data, size_t size, uint64 offset );
+
+    // Computes the hash of the whole file, once every byte of it has been added.
+    // Returns false if the regions added don't cover the file exactly.
+    bool Finalize( uint64 fileSize, byte hash[HashSize] );
+
+private:
+    struct Subtree
+    {
+        uint64      chunk;          // Index of the first chunk
+        uint64      chunkCount;     // Power of 2, and chunk is a multiple of it
+        const byte* data;           // Only valid while the region is being hashed
+        size_t      size;
+        byte        cv[HashSize];   // Chaining value
+    };
+
+    struct HashJob
+    {
+        Subtree* subtrees;
+        size_t   count;
+    };
+
+    static void HashJobThread( HashJob* job );
+    static void HashSubtree( Subtree& subtree );
+
+    bool MergeSubtrees( uint64 chunk, uint64 chunkCount, size_t& next, bool root, byte cv[HashSize] );
+
+private:
+    std::vector<Subtree> _subtrees;
+};
@@ -18,6 +18,13 @@ inline FILE* Log::GetOutStream()
     return _outStream;
 }
 
+//-----------------------------------------------------------
+void Log::SetOutStream( FILE* stream )
+{
+    ASSERT( stream );
+    _outStream = stream;
+}
+
 //-----------------------------------------------------------
 inline FILE* Log::GetErrStream()
 {
@@ -18,6 +18,9 @@ public:
     static void WriteError( const char* msg, va_list args );
 
     inline static void SetVerbose( bool enabled ) { _verbose = enabled; }
+
+    // Where Line() and Write() go to, stdout by default
+    static void SetOutStream( FILE* stream );
     
     static void Verbose( const char* msg, ...  );
     static void VerboseWrite( const char* msg, ...  );